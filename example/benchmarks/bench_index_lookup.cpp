@@ -0,0 +1,60 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The search for quads of an unsolvable field against many indexes, like the
+// ~150 index files of the 4100 and 5200 series (several healpix tiles per
+// quad scale range), most of which don't match the scale of a given quad.
+//
+// Usage: bench_index_lookup [nb scale ranges (12)] [nb indexes per range (12)]
+//                           [max nb of quads to try (500000)] [nb stars (300)]
+
+#include <iostream>
+#include "synthetic.h"
+
+
+int main(int argc, char** argv)
+{
+    int nscales = (argc > 1) ? atoi(argv[1]) : 12;
+    int ntiles = (argc > 2) ? atoi(argv[2]) : 12;
+    int maxquads = (argc > 3) ? atoi(argv[3]) : 500000;
+    int nstars = (argc > 4) ? atoi(argv[4]) : 300;
+
+    std::vector<Star> sky = makeSky(30000);
+
+    // Scale ranges a factor of 2^(1/4) wide, from INDEX_SCALES[0] up
+    const double ratio = pow(2.0, 0.25);
+
+    std::vector<index_t*> indexes;
+    for (int i = 0; i < nscales; ++i)
+    {
+        double low = INDEX_SCALES[0] * pow(ratio, i);
+        for (int j = 0; j < ntiles; ++j)
+        {
+            int id = 100 * i + j;
+            indexes.push_back(buildIndex(sky, 6000, low, low * ratio, id, 2000));
+        }
+    }
+
+    tan_t wcs;
+    starxy_t* field = makeField(sky, nstars, 1, &wcs, false);
+
+    solver_t* solver = newSolver(indexes);
+    solver->maxquads = maxquads;
+    solver_set_field(solver, field);
+
+    double start = now();
+    solver_run(solver);
+    double elapsed = now() - start;
+
+    std::cout << indexes.size() << " indexes, " << solver->numtries << " quads tried in "
+              << elapsed << " s (" << (1e6 * elapsed / solver->numtries) << " us per quad), "
+              << solver->nummatches << " matches" << std::endl;
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Builds kd-trees of random points serially and with KD_BUILD_PARALLEL (one
+// thread per hardware thread), and checks that both trees are identical.
+//
+// Usage: bench_kdtree_build [max nb points (1000000)]
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include "synthetic.h"
+
+
+bool same(const void* a, const void* b, size_t size)
+{
+    if (!a || !b)
+        return (a == b);
+    return (memcmp(a, b, size) == 0);
+}
+
+//-----------------------------------------------------------------------------
+
+bool identical(const kdtree_t* a, const kdtree_t* b)
+{
+    // (kdtree_sizeof_bb() is the size of the low or the high corners)
+    return (a->nnodes == b->nnodes) &&
+           same(a->data.any, b->data.any, kdtree_sizeof_data(a)) &&
+           same(a->perm, b->perm, kdtree_sizeof_perm(a)) &&
+           same(a->lr, b->lr, kdtree_sizeof_lr(a)) &&
+           same(a->bb.any, b->bb.any, 2 * kdtree_sizeof_bb(a)) &&
+           same(a->split.any, b->split.any, kdtree_sizeof_split(a)) &&
+           same(a->splitdim, b->splitdim, kdtree_sizeof_splitdim(a));
+}
+
+
+int main(int argc, char** argv)
+{
+    int maxpoints = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+    struct { const char* name; int treetype; unsigned int options; } types[] = {
+        { "double, bbox", KDTT_DOUBLE, KD_BUILD_BBOX },
+        { "double, split", KDTT_DOUBLE, KD_BUILD_SPLIT },
+        { "u32, split+dim", KDTT_DUU, KD_BUILD_SPLIT | KD_BUILD_SPLITDIM },
+        { "u16, bbox", KDTT_DSS, KD_BUILD_BBOX | KD_BUILD_SPLITDIM },
+    };
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::thread::hardware_concurrency() << " hardware threads "
+              << "(ms, serial -> parallel):" << std::endl;
+
+    bool ok = true;
+
+    for (int npoints = 10000; npoints <= maxpoints; npoints *= 10)
+    {
+        for (int D = 2; D <= 4; ++D)
+        {
+            std::mt19937 rng(npoints + D);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+            std::vector<double> points(npoints * D);
+            for (double& v : points)
+                v = uniform(rng);
+
+            std::vector<double> low(D, 0.0), high(D, 1.0);
+
+            std::cout << "    N=" << npoints << ", D=" << D << ":";
+
+            for (const auto& type : types)
+            {
+                kdtree_t* trees[2];
+                double elapsed[2];
+
+                // (kdtree_build() moves the points around)
+                std::vector<double> data[2] = { points, points };
+
+                for (int parallel = 0; parallel < 2; ++parallel)
+                {
+                    double start = now();
+                    trees[parallel] = kdtree_build_2(
+                        NULL, data[parallel].data(), npoints, D, 10, type.treetype,
+                        type.options | (parallel ? KD_BUILD_PARALLEL : 0), low.data(), high.data()
+                    );
+                    elapsed[parallel] = now() - start;
+                }
+
+                bool same = identical(trees[0], trees[1]);
+                ok = ok && same;
+
+                std::cout << "  " << type.name << " " << (1000.0 * elapsed[0]) << " -> "
+                          << (1000.0 * elapsed[1]) << (same ? "" : " DIFFERENT");
+
+                kdtree_free(trees[0]);
+                kdtree_free(trees[1]);
+            }
+
+            std::cout << std::endl;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
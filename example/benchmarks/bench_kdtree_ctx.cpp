@@ -0,0 +1,151 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Range searches in kd-trees of random points, with and without a query
+// context (kdtree_query_ctx_t): time and allocations per query, for each
+// tree type, with bounding boxes and with splits, one query at a time and
+// in batches.
+//
+// Usage: bench_kdtree_ctx [nb points (200000)] [nb dimensions (3)]
+//                         [nb queries (50000)] [batch size (64)]
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include "synthetic.h"
+
+
+// The best of 5 runs of "search" over all the queries: returns the time per
+// query (in ns), and the allocations and results per query.
+double measure(const std::function<size_t(int)>& search, int nqueries, int step,
+               double* allocs, double* nres)
+{
+    double best = HUGE_VAL;
+    for (int run = 0; run < 5; ++run)
+    {
+        size_t n = 0;
+        int64_t nallocs = allocations();
+        double start = now();
+
+        for (int i = 0; i < nqueries; i += step)
+            n += search(i);
+
+        best = std::min(best, now() - start);
+        *allocs = double(allocations() - nallocs) / nqueries;
+        *nres = double(n) / nqueries;
+    }
+
+    return 1e9 * best / nqueries;
+}
+
+
+int main(int argc, char** argv)
+{
+    int npoints = (argc > 1) ? atoi(argv[1]) : 200000;
+    int D = (argc > 2) ? atoi(argv[2]) : 3;
+    int nqueries = (argc > 3) ? atoi(argv[3]) : 50000;
+    int batchsize = (argc > 4) ? atoi(argv[4]) : 64;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    std::vector<double> points(npoints * D);
+    for (double& v : points)
+        v = uniform(rng);
+
+    std::vector<double> queries(nqueries * D);
+    for (double& v : queries)
+        v = uniform(rng);
+
+    // About 10 points in each query ball
+    double volume = 10.0 / npoints;
+    double r = (D == 2) ? sqrt(volume / M_PI) : pow(volume * 3.0 / (4.0 * M_PI), 1.0 / 3.0);
+    if (D > 3)
+        r = pow(volume, 1.0 / D) / 2.0;
+    double r2 = r * r;
+
+    std::vector<double> low(D, 0.0), high(D, 1.0);
+
+    struct { const char* name; int treetype; } types[] = {
+        { "double", KDTT_DOUBLE },
+        { "u32", KDTT_DUU },
+        { "u16", KDTT_DSS },
+    };
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << npoints << " points in " << D << "-D, " << nqueries
+              << " queries (ns, allocations per query):" << std::endl;
+
+    for (const auto& type : types)
+    {
+        for (int split = 0; split < 2; ++split)
+        {
+            // (kdtree_build() moves the points around)
+            std::vector<double> data = points;
+            kdtree_t* kd = kdtree_build_2(NULL, data.data(), npoints, D, 16, type.treetype,
+                                          split ? KD_BUILD_SPLIT : KD_BUILD_BBOX,
+                                          low.data(), high.data());
+
+            int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+                          (split ? KD_OPTIONS_USE_SPLIT : 0);
+
+            kdtree_qres_t* res = nullptr;
+            kdtree_query_ctx_t* ctx = kdtree_query_ctx_new();
+            std::vector<int> starts(batchsize + 1);
+
+            auto fresh = [&](int i) {
+                kdtree_qres_t* r = kdtree_rangesearch_options(kd, &queries[i * D], r2, options);
+                size_t n = r->nres;
+                kdtree_free_query(r);
+                return n;
+            };
+
+            auto reuse = [&](int i) {
+                res = kdtree_rangesearch_options_reuse(kd, res, &queries[i * D], r2, options);
+                return (size_t) res->nres;
+            };
+
+            auto withctx = [&](int i) {
+                return (size_t) kdtree_rangesearch_ctx(kd, ctx, &queries[i * D], r2, options)->nres;
+            };
+
+            auto batch = [&](int i) {
+                int n = std::min(batchsize, nqueries - i);
+                res = kdtree_rangesearch_batch(kd, res, &queries[i * D], n, r2, options,
+                                               starts.data());
+                return (size_t) res->nres;
+            };
+
+            auto batchctx = [&](int i) {
+                int n = std::min(batchsize, nqueries - i);
+                return (size_t) kdtree_rangesearch_batch_ctx(kd, ctx, &queries[i * D], n, r2,
+                                                             options, starts.data())->nres;
+            };
+
+            struct { const char* name; std::function<size_t(int)> search; int step; } modes[] = {
+                { "new results", fresh, 1 },
+                { "reused", reuse, 1 },
+                { "context", withctx, 1 },
+                { "batch", batch, batchsize },
+                { "batch+context", batchctx, batchsize },
+            };
+
+            std::cout << "    " << std::setw(6) << type.name << (split ? ", split:" : ", bbox: ");
+            for (const auto& mode : modes)
+            {
+                double allocs, nres;
+                double ns = measure(mode.search, nqueries, mode.step, &allocs, &nres);
+                std::cout << "  " << mode.name << " " << ns << " (" << std::setprecision(2)
+                          << allocs << ")" << std::setprecision(0);
+            }
+            std::cout << std::endl;
+
+            kdtree_free_query(res);
+            kdtree_query_ctx_free(ctx);
+            kdtree_free(kd);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Searches in kd-trees of random points, with the queries compiled for the
+// dimension of the tree (kdint_*_D.c, installed by kdtree_update_funcs()) and
+// with the generic ones: time per query for range searches (bounding boxes and
+// splits) and nearest neighbours, for each tree type of the index files, and
+// a check that the results are identical.
+//
+// The generic queries are taken from a tree of the same type in 5-D, for
+// which there is no specialized version.
+//
+// Usage: bench_kdtree_dims [nb points (1000000)] [nb queries (50000)]
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include "synthetic.h"
+
+
+// The best of 5 runs of "search" over all the queries, in ns per query
+double measure(const std::function<void(int)>& search, int nqueries)
+{
+    double best = HUGE_VAL;
+    for (int run = 0; run < 5; ++run)
+    {
+        double start = now();
+        for (int i = 0; i < nqueries; ++i)
+            search(i);
+        best = std::min(best, now() - start);
+    }
+
+    return 1e9 * best / nqueries;
+}
+
+//-----------------------------------------------------------------------------
+
+// Replaces the queries of "kd" by those of "from"
+void setQueries(kdtree_t* kd, const kdtree_funcs& from)
+{
+    kd->fun.nearest_neighbour_internal = from.nearest_neighbour_internal;
+    kd->fun.rangesearch = from.rangesearch;
+    kd->fun.rangesearch_batch = from.rangesearch_batch;
+    kd->fun.rangesearch_ctx = from.rangesearch_ctx;
+    kd->fun.rangesearch_batch_ctx = from.rangesearch_batch_ctx;
+}
+
+
+int main(int argc, char** argv)
+{
+    int npoints = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int nqueries = (argc > 2) ? atoi(argv[2]) : 50000;
+
+    struct { const char* name; int treetype; int mindim; } types[] = {
+        { "double", KDTT_DOUBLE, 2 },
+        { "u32", KDTT_DUU, 3 },
+        { "u16", KDTT_DSS, 3 },
+    };
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << npoints << " points, " << nqueries
+              << " queries (ns per query, generic -> specialized):" << std::endl;
+
+    bool ok = true;
+
+    for (int D = 2; D <= 4; ++D)
+    {
+        std::mt19937 rng(42 + D);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        std::vector<double> points(npoints * D);
+        for (double& v : points)
+            v = uniform(rng);
+
+        std::vector<double> queries(nqueries * D);
+        for (double& v : queries)
+            v = uniform(rng);
+
+        // About 10 points in each query ball
+        double volume = 10.0 / npoints;
+        double r = (D == 2) ? sqrt(volume / M_PI) :
+                   (D == 3) ? pow(volume * 3.0 / (4.0 * M_PI), 1.0 / 3.0) :
+                              pow(volume * 2.0 / (M_PI * M_PI), 0.25);
+        double r2 = r * r;
+
+        std::vector<double> low(D, 0.0), high(D, 1.0);
+        std::vector<double> low5(5, 0.0), high5(5, 1.0);
+
+        for (const auto& type : types)
+        {
+            if (D < type.mindim)
+                continue;
+
+            // A tree without specialized queries, to borrow its generic ones
+            std::vector<double> data5(100 * 5, 0.5);
+            kdtree_t* kd5 = kdtree_build_2(NULL, data5.data(), 100, 5, 16, type.treetype,
+                                           KD_BUILD_BBOX, low5.data(), high5.data());
+
+            std::cout << "    " << std::setw(6) << type.name << ", D=" << D << ":";
+
+            for (int split = 0; split < 2; ++split)
+            {
+                // (kdtree_build() moves the points around)
+                std::vector<double> data = points;
+                kdtree_t* kd = kdtree_build_2(NULL, data.data(), npoints, D, 16, type.treetype,
+                                              split ? KD_BUILD_SPLIT : KD_BUILD_BBOX,
+                                              low.data(), high.data());
+
+                int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+                              (split ? KD_OPTIONS_USE_SPLIT : 0);
+
+                kdtree_query_ctx_t* ctx = kdtree_query_ctx_new();
+                kdtree_funcs specialized = kd->fun;
+
+                std::vector<uint32_t> inds[2];
+                std::vector<double> d2s[2];
+                double range[2], nn[2];
+
+                for (int spec = 0; spec < 2; ++spec)
+                {
+                    setQueries(kd, spec ? specialized : kd5->fun);
+
+                    range[spec] = measure([&](int i) {
+                        kdtree_rangesearch_ctx(kd, ctx, &queries[i * D], r2, options);
+                    }, nqueries);
+
+                    nn[spec] = measure([&](int i) {
+                        double d2;
+                        kdtree_nearest_neighbour(kd, &queries[i * D], &d2);
+                    }, nqueries);
+
+                    for (int i = 0; i < nqueries; ++i)
+                    {
+                        kdtree_qres_t* res = kdtree_rangesearch_ctx(kd, ctx, &queries[i * D],
+                                                                    r2, options);
+                        inds[spec].insert(inds[spec].end(), res->inds, res->inds + res->nres);
+                        d2s[spec].insert(d2s[spec].end(), res->sdists, res->sdists + res->nres);
+
+                        double d2;
+                        inds[spec].push_back(kdtree_nearest_neighbour(kd, &queries[i * D], &d2));
+                        d2s[spec].push_back(d2);
+                    }
+                }
+
+                bool same = (inds[0] == inds[1]) && (d2s[0] == d2s[1]);
+                ok = ok && same;
+
+                std::cout << (split ? "  split: " : "  bbox: ") << "range " << range[0] << " -> "
+                          << range[1] << std::setprecision(2) << " (" << (range[0] / range[1])
+                          << "x), nn " << std::setprecision(0) << nn[0] << " -> " << nn[1]
+                          << std::setprecision(2) << " (" << (nn[0] / nn[1]) << "x)"
+                          << std::setprecision(0) << (same ? "" : " DIFFERENT");
+
+                kdtree_query_ctx_free(ctx);
+                kdtree_free(kd);
+            }
+
+            std::cout << std::endl;
+
+            kdtree_free(kd5);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
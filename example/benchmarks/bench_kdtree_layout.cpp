@@ -0,0 +1,537 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The layout of the kd-trees of the index files, which are searched as mapped
+// from the file (like fits_read_chunk() does), against two layouts built at load
+// time in the memory of the process:
+//
+//  - copy:    the same arrays, each copied to memory aligned on a cache line
+//             (and, where available, on huge pages);
+//  - blocked: the nodes in blocks of a few levels of the tree (breadth-first
+//             within a block, the blocks one after the other), with the
+//             bounding box and the children or points of a node in one
+//             cache-line record; the points are copied as they are.
+//
+// The tree is a 3-D star tree of points on the unit sphere (leaves of 8 points,
+// bounding boxes, doubles), written to a temporary file and mapped back.
+// Reports the memory of each layout, the time of range searches (about 10
+// points each) and nearest neighbour searches with warm pages, and the time to
+// load the tree and run some searches with a cold page cache, with the part of
+// the mapped tree they read.  The results of all the layouts must be the same.
+//
+// Usage: bench_kdtree_layout [nb points (1000000)] [nb queries (200000)]
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <deque>
+#include "synthetic.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+const int D = 3;
+const char* FILENAME = "bench_kdtree_layout.tmp";
+const size_t FITS_BLOCK = 2880;
+
+
+// An array of the tree, in the file, and its mapping
+struct Chunk
+{
+    void** array;   // in the tree
+    size_t size;
+    size_t offset;  // in the file
+    void* map;
+    size_t mapsize;
+};
+
+
+// The arrays of the tree that are in the index files
+std::vector<Chunk> chunks(kdtree_t* kd)
+{
+    std::vector<Chunk> result;
+    void** arrays[] = { (void**) &kd->lr, (void**) &kd->perm, &kd->bb.any, &kd->split.any,
+                        (void**) &kd->splitdim, &kd->data.any };
+    // (kdtree_sizeof_bb() is the size of the low or the high corners)
+    size_t sizes[] = {
+        kdtree_sizeof_lr(kd), kdtree_sizeof_perm(kd), 2 * kdtree_sizeof_bb(kd),
+        kdtree_sizeof_split(kd), kdtree_sizeof_splitdim(kd), kdtree_sizeof_data(kd)
+    };
+
+    size_t offset = FITS_BLOCK;
+    for (int i = 0; i < 6; ++i)
+    {
+        if (!*arrays[i])
+            continue;
+        result.push_back({ arrays[i], sizes[i], offset, nullptr, 0 });
+        offset += (sizes[i] + 2 * FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+    }
+    return result;
+}
+
+
+// Maps the arrays from the file, as fits_read_chunk() does
+void mapTree(int fd, std::vector<Chunk>& arrays)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    for (Chunk& chunk : arrays)
+    {
+        size_t offset = chunk.offset % pageSize;
+        chunk.mapsize = chunk.size + offset;
+        chunk.map = mmap(NULL, chunk.mapsize, PROT_READ, MAP_PRIVATE, fd, chunk.offset - offset);
+        *chunk.array = (char*) chunk.map + offset;
+    }
+}
+
+
+void unmapTree(std::vector<Chunk>& arrays)
+{
+    for (Chunk& chunk : arrays)
+        munmap(chunk.map, chunk.mapsize);
+}
+
+
+// Resident bytes of the mappings
+size_t residentSize(const std::vector<Chunk>& arrays)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t n = 0;
+    for (const Chunk& chunk : arrays)
+    {
+        size_t npages = (chunk.mapsize + pageSize - 1) / pageSize;
+        std::vector<unsigned char> vec(npages);
+        mincore(chunk.map, chunk.mapsize, vec.data());
+        for (unsigned char v : vec)
+            n += (v & 1) ? pageSize : 0;
+    }
+    return n;
+}
+
+
+void dropPageCache(int fd)
+{
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+
+// Copies the arrays to the memory of the process; returns the memory
+void* copyTree(const std::vector<Chunk>& arrays, bool hugePages, size_t* size)
+{
+    const size_t alignment = hugePages ? (2 << 20) : 64;
+
+    *size = 0;
+    for (const Chunk& chunk : arrays)
+        *size += (chunk.size + 63) / 64 * 64;
+    *size = (*size + alignment - 1) / alignment * alignment;
+
+    char* memory = (char*) aligned_alloc(alignment, *size);
+#if defined(MADV_HUGEPAGE)
+    if (hugePages)
+        madvise(memory, *size, MADV_HUGEPAGE);
+#endif
+
+    char* p = memory;
+    for (const Chunk& chunk : arrays)
+    {
+        memcpy(p, *chunk.array, chunk.size);
+        *chunk.array = p;
+        p += (chunk.size + 63) / 64 * 64;
+    }
+    return memory;
+}
+
+
+// A node of the blocked layout: one cache line
+struct alignas(64) Node
+{
+    double lo[D];
+    double hi[D];
+    // interior node: the positions of the children; leaf: its points, [a, b)
+    int32_t a, b;
+    int32_t leaf;
+};
+
+
+struct Blocked
+{
+    std::vector<Node> nodes;
+    const double* data;
+    const u32* perm;
+};
+
+
+Blocked buildBlocked(const kdtree_t* kd, int levels)
+{
+    std::vector<int> order;
+    std::vector<int> pos(kd->nnodes);
+    std::deque<int> roots = { 0 };
+
+    while (!roots.empty())
+    {
+        std::vector<int> level = { roots.front() };
+        roots.pop_front();
+
+        for (int l = 0; (l < levels) && !level.empty(); ++l)
+        {
+            std::vector<int> next;
+            for (int n : level)
+            {
+                pos[n] = (int) order.size();
+                order.push_back(n);
+                if (KD_IS_LEAF(kd, n))
+                    continue;
+
+                for (int child : { KD_CHILD_LEFT(n), KD_CHILD_RIGHT(n) })
+                {
+                    if (l < levels - 1)
+                        next.push_back(child);
+                    else
+                        roots.push_back(child);
+                }
+            }
+            level.swap(next);
+        }
+    }
+
+    Blocked blocked;
+    blocked.nodes.resize(kd->nnodes);
+    blocked.data = kd->data.d;
+    blocked.perm = kd->perm;
+
+    for (int p = 0; p < kd->nnodes; ++p)
+    {
+        int n = order[p];
+        Node& node = blocked.nodes[p];
+        kdtree_get_bboxes(kd, n, node.lo, node.hi);
+        node.leaf = KD_IS_LEAF(kd, n);
+        if (node.leaf)
+        {
+            node.a = kdtree_leaf_left(kd, n);
+            node.b = kdtree_leaf_right(kd, n) + 1;
+        }
+        else
+        {
+            node.a = pos[KD_CHILD_LEFT(n)];
+            node.b = pos[KD_CHILD_RIGHT(n)];
+        }
+    }
+
+    return blocked;
+}
+
+
+inline double mindist2(const Node& node, const double* pt)
+{
+    double d2 = 0.0;
+    for (int d = 0; d < D; ++d)
+    {
+        double delta = std::max(0.0, std::max(node.lo[d] - pt[d], pt[d] - node.hi[d]));
+        d2 += delta * delta;
+    }
+    return d2;
+}
+
+
+inline double dist2(const double* p, const double* pt)
+{
+    double d2 = 0.0;
+    for (int d = 0; d < D; ++d)
+        d2 += (p[d] - pt[d]) * (p[d] - pt[d]);
+    return d2;
+}
+
+
+// Range search in the blocked layout: the results are in "inds" and "d2s"
+int rangesearchBlocked(const Blocked& blocked, const double* pt, double maxd2,
+                       u32* inds, double* d2s)
+{
+    int stack[128];
+    int nstack = 0;
+    int nres = 0;
+
+    stack[nstack++] = 0;
+    while (nstack)
+    {
+        const Node& node = blocked.nodes[stack[--nstack]];
+        if (mindist2(node, pt) > maxd2)
+            continue;
+
+        if (!node.leaf)
+        {
+            stack[nstack++] = node.b;
+            stack[nstack++] = node.a;
+            continue;
+        }
+
+        for (int i = node.a; i < node.b; ++i)
+        {
+            double d2 = dist2(blocked.data + i * D, pt);
+            if (d2 > maxd2)
+                continue;
+            inds[nres] = blocked.perm[i];
+            d2s[nres] = d2;
+            ++nres;
+        }
+    }
+
+    return nres;
+}
+
+
+// Nearest neighbour in the blocked layout: returns its index in the tree
+int nearestBlocked(const Blocked& blocked, const double* pt)
+{
+    int stack[128];
+    double mind2s[128];
+    int nstack = 0;
+    double best = HUGE_VAL;
+    int ibest = -1;
+
+    stack[nstack] = 0;
+    mind2s[nstack++] = mindist2(blocked.nodes[0], pt);
+    while (nstack)
+    {
+        --nstack;
+        if (mind2s[nstack] >= best)
+            continue;
+
+        const Node& node = blocked.nodes[stack[nstack]];
+        if (node.leaf)
+        {
+            for (int i = node.a; i < node.b; ++i)
+            {
+                double d2 = dist2(blocked.data + i * D, pt);
+                if (d2 < best)
+                {
+                    best = d2;
+                    ibest = i;
+                }
+            }
+            continue;
+        }
+
+        // (the nearest child last, to be searched first)
+        double da = mindist2(blocked.nodes[node.a], pt);
+        double db = mindist2(blocked.nodes[node.b], pt);
+        int first = (da <= db) ? node.a : node.b;
+        int second = (da <= db) ? node.b : node.a;
+        stack[nstack] = second;
+        mind2s[nstack++] = std::max(da, db);
+        stack[nstack] = first;
+        mind2s[nstack++] = std::min(da, db);
+    }
+
+    return ibest;
+}
+
+
+// The best of 3 runs of "search" over the queries, in ns per query; "check"
+// gets the sum of what "search" returns over the last run
+template<typename F>
+double measure(F search, int nqueries, double* check)
+{
+    double best = HUGE_VAL;
+    for (int r = 0; r < 3; ++r)
+    {
+        double sum = 0.0;
+        double start = now();
+        for (int i = 0; i < nqueries; ++i)
+            sum += search(i);
+        best = std::min(best, now() - start);
+        *check = sum;
+    }
+    return 1e9 * best / nqueries;
+}
+
+
+int main(int argc, char** argv)
+{
+    int npoints = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int nqueries = (argc > 2) ? atoi(argv[2]) : 200000;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    auto onSphere = [&](double* xyz) {
+        for (int d = 0; d < D; ++d)
+            xyz[d] = normal(rng);
+        double norm = sqrt(xyz[0] * xyz[0] + xyz[1] * xyz[1] + xyz[2] * xyz[2]);
+        for (int d = 0; d < D; ++d)
+            xyz[d] /= norm;
+    };
+
+    std::vector<double> points(npoints * D);
+    for (int i = 0; i < npoints; ++i)
+        onSphere(&points[i * D]);
+
+    std::vector<double> queries(nqueries * D);
+    for (int i = 0; i < nqueries; ++i)
+        onSphere(&queries[i * D]);
+
+    // About 10 points in each query ball (on the sphere, of area 4 pi)
+    double r2 = 4.0 * 10.0 / npoints;
+
+    kdtree_t* kd = kdtree_build(NULL, points.data(), npoints, D, 8, KDTT_DOUBLE,
+                                KD_BUILD_BBOX);
+
+    // The file, with the arrays at the start of FITS blocks
+    std::vector<Chunk> arrays = chunks(kd);
+    {
+        std::ofstream file(FILENAME, std::ios::binary);
+        for (const Chunk& chunk : arrays)
+        {
+            file.seekp(chunk.offset);
+            file.write((const char*) *chunk.array, chunk.size);
+        }
+        file.seekp(arrays.back().offset + arrays.back().size);
+        file.write("", 1);
+    }
+
+    int fd = open(FILENAME, O_RDONLY);
+
+    kdtree_t tree = *kd;
+    std::vector<Chunk> treeArrays = chunks(&tree);
+
+    kdtree_query_ctx_t* ctx = kdtree_query_ctx_new();
+    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS;
+
+    auto range = [&](int i) {
+        return (double) kdtree_rangesearch_ctx(&tree, ctx, &queries[i * D], r2, options)->nres;
+    };
+
+    auto nearest = [&](int i) {
+        return (double) kdtree_nearest_neighbour(&tree, &queries[i * D], NULL);
+    };
+
+    size_t filesize = 0;
+    for (const Chunk& chunk : arrays)
+        filesize += chunk.size;
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << npoints << " points, " << kd->nnodes << " nodes, " << nqueries
+              << " queries, " << filesize / 1048576.0 << " MB of arrays" << std::endl;
+
+    // Warm page cache
+    std::cout << "Warm (MB in memory, ns per range search, ns per nearest neighbour):"
+              << std::endl;
+
+    double checkRange, checkNearest, check;
+    bool ok = true;
+
+    mapTree(fd, treeArrays);
+    double nsRange = measure(range, nqueries, &checkRange);
+    double nsNearest = measure(nearest, nqueries, &checkNearest);
+    std::cout << "    mapped:          " << residentSize(treeArrays) / 1048576.0 << " MB (of "
+              << filesize / 1048576.0 << ")  " << nsRange << "  " << nsNearest << std::endl;
+
+    for (int hugePages = 0; hugePages < 2; ++hugePages)
+    {
+        size_t size;
+        void* memory = copyTree(treeArrays, hugePages, &size);
+        double ns = measure(range, nqueries, &check);
+        ok = ok && (check == checkRange);
+        double ns2 = measure(nearest, nqueries, &check);
+        ok = ok && (check == checkNearest);
+        std::cout << (hugePages ? "    copy, huge pages:" : "    copy:            ")
+                  << size / 1048576.0 << " MB  " << ns << " (" << std::setprecision(2)
+                  << nsRange / ns << "x)  " << ns2 << " (" << nsNearest / ns2 << "x)"
+                  << std::setprecision(1) << std::endl;
+        free(memory);
+        for (Chunk& chunk : treeArrays)
+            *chunk.array = (char*) chunk.map + chunk.offset % sysconf(_SC_PAGESIZE);
+    }
+
+    std::vector<u32> inds(npoints);
+    std::vector<double> d2s(npoints);
+
+    for (int levels : { 2, 4, 6, 8, 12 })
+    {
+        Blocked blocked = buildBlocked(&tree, levels);
+
+        // (the points and the permutation, copied as they are)
+        std::vector<double> data(tree.data.d, tree.data.d + npoints * D);
+        std::vector<u32> perm(tree.perm, tree.perm + npoints);
+        blocked.data = data.data();
+        blocked.perm = perm.data();
+
+        auto rangeBlocked = [&](int i) {
+            return (double) rangesearchBlocked(blocked, &queries[i * D], r2, inds.data(),
+                                               d2s.data());
+        };
+
+        auto nearestBlocked_ = [&](int i) {
+            return (double) nearestBlocked(blocked, &queries[i * D]);
+        };
+
+        double ns = measure(rangeBlocked, nqueries, &check);
+        ok = ok && (check == checkRange);
+        double ns2 = measure(nearestBlocked_, nqueries, &check);
+        ok = ok && (check == checkNearest);
+
+        size_t size = blocked.nodes.size() * sizeof(Node) + data.size() * sizeof(double) +
+                      perm.size() * sizeof(u32);
+        std::cout << "    blocked, " << std::setw(2) << levels << " levels: "
+                  << size / 1048576.0 << " MB  " << ns << " (" << std::setprecision(2)
+                  << nsRange / ns << "x)  " << ns2 << " (" << nsNearest / ns2 << "x)"
+                  << std::setprecision(1) << std::endl;
+    }
+
+    unmapTree(treeArrays);
+
+    // Cold page cache: map (and copy) the tree, then search
+    std::cout << "Cold (ms to load and search, mapped -> copy; MB of the mapping paged in):"
+              << std::endl;
+
+    for (int n : { nqueries / 100, nqueries / 10, nqueries })
+    {
+        double times[2];
+        double cached = 0.0;
+        size_t touched = 0;
+
+        for (int copy = 0; copy < 2; ++copy)
+        {
+            dropPageCache(fd);
+
+            double start = now();
+            mapTree(fd, treeArrays);
+            if (copy == 0)
+                cached = std::max(cached, (double) residentSize(treeArrays) / filesize);
+
+            size_t size;
+            void* memory = copy ? copyTree(treeArrays, false, &size) : nullptr;
+            for (int i = 0; i < n; ++i)
+                range(i);
+            times[copy] = now() - start;
+            if (copy == 0)
+                touched = residentSize(treeArrays);
+
+            free(memory);
+            unmapTree(treeArrays);
+        }
+
+        std::cout << "    " << std::setw(6) << n << " searches:  " << 1e3 * times[0] << " -> "
+                  << 1e3 * times[1] << " (" << std::setprecision(2) << times[0] / times[1]
+                  << "x)" << std::setprecision(1) << "  " << touched / 1048576.0 << " MB";
+        if (cached > 0.01)
+            std::cout << "  (" << 100.0 * cached << "% of the file was still cached)";
+        std::cout << std::endl;
+    }
+
+    close(fd);
+    unlink(FILENAME);
+
+    kdtree_query_ctx_free(ctx);
+    kdtree_free(kd);
+
+    if (!ok)
+    {
+        std::cout << "The layouts gave different results!" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Range searches in kd-trees of random points, with the SIMD kernels that
+// scan the points of the leaves (kd->fun.leaf_scan) and with the generic
+// loops: time per query, and a check that the results are identical.
+//
+// Usage: bench_kdtree_leaf_scan [nb points (1000000)] [nb queries (300000)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+
+// Runs all the queries, and returns the best time of 3 runs, in ns per query.
+// The results of the last run are appended to "inds" and "d2s".
+double run(const kdtree_t* kd, kdtree_query_ctx_t* ctx, const std::vector<double>& queries,
+           double r2, int options, std::vector<uint32_t>& inds, std::vector<double>& d2s)
+{
+    int D = kd->ndim;
+    int nqueries = (int) queries.size() / D;
+    double best = HUGE_VAL;
+
+    for (int r = 0; r < 3; ++r)
+    {
+        double start = now();
+        for (int i = 0; i < nqueries; ++i)
+            kdtree_rangesearch_ctx(kd, ctx, &queries[i * D], r2, options);
+        best = std::min(best, now() - start);
+    }
+
+    for (int i = 0; i < nqueries; ++i)
+    {
+        kdtree_qres_t* res = kdtree_rangesearch_ctx(kd, ctx, &queries[i * D], r2, options);
+        inds.insert(inds.end(), res->inds, res->inds + res->nres);
+        d2s.insert(d2s.end(), res->sdists, res->sdists + res->nres);
+    }
+
+    return 1e9 * best / nqueries;
+}
+
+
+int main(int argc, char** argv)
+{
+    int npoints = (argc > 1) ? atoi(argv[1]) : 1000000;
+    int nqueries = (argc > 2) ? atoi(argv[2]) : 300000;
+
+    struct { const char* name; int treetype; } types[] = {
+        { "double", KDTT_DOUBLE },
+        { "u32", KDTT_DUU },
+        { "u16", KDTT_DSS },
+    };
+
+    // The configurations of the trees of the index files: star trees (3-D)
+    // and code trees (4-D), searched with splits or bounding boxes
+    struct { int D; int nleaf; bool split; } configs[] = {
+        { 3, 8, true },
+        { 3, 32, false },
+        { 4, 8, true },
+        { 4, 32, false },
+    };
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << npoints << " points, " << nqueries
+              << " queries (ns per query, generic loops -> kernel):" << std::endl;
+
+    bool ok = true;
+
+    for (const auto& config : configs)
+    {
+        int D = config.D;
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        std::vector<double> points(npoints * D);
+        for (double& v : points)
+            v = uniform(rng);
+
+        std::vector<double> queries(nqueries * D);
+        for (double& v : queries)
+            v = uniform(rng);
+
+        // About 10 points in each query ball
+        double volume = 10.0 / npoints;
+        double r = (D == 3) ? pow(volume * 3.0 / (4.0 * M_PI), 1.0 / 3.0)
+                            : pow(volume * 2.0 / (M_PI * M_PI), 0.25);
+        double r2 = r * r;
+
+        std::vector<double> low(D, 0.0), high(D, 1.0);
+
+        std::cout << "    D=" << D << ", leaf " << config.nleaf
+                  << (config.split ? ", split:" : ", bbox: ");
+
+        for (const auto& type : types)
+        {
+            // (kdtree_build() moves the points around)
+            std::vector<double> data = points;
+            kdtree_t* kd = kdtree_build_2(NULL, data.data(), npoints, D, config.nleaf,
+                                          type.treetype,
+                                          config.split ? KD_BUILD_SPLIT : KD_BUILD_BBOX,
+                                          low.data(), high.data());
+
+            int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+                          (config.split ? KD_OPTIONS_USE_SPLIT : 0);
+
+            kdtree_query_ctx_t* ctx = kdtree_query_ctx_new();
+
+            std::cout << "  " << type.name << " ";
+
+            if (kd->fun.leaf_scan)
+            {
+                std::vector<uint32_t> inds[2];
+                std::vector<double> d2s[2];
+
+                double ns[2];
+                ns[1] = run(kd, ctx, queries, r2, options, inds[1], d2s[1]);
+
+                auto leaf_scan = kd->fun.leaf_scan;
+                kd->fun.leaf_scan = nullptr;
+                ns[0] = run(kd, ctx, queries, r2, options, inds[0], d2s[0]);
+                kd->fun.leaf_scan = leaf_scan;
+
+                bool same = (inds[0] == inds[1]) && (d2s[0] == d2s[1]);
+                ok = ok && same;
+
+                std::cout << ns[0] << " -> " << ns[1] << std::setprecision(2) << " ("
+                          << (ns[0] / ns[1]) << "x" << (same ? "" : ", DIFFERENT") << ")"
+                          << std::setprecision(0);
+            }
+            else
+            {
+                std::cout << "no kernel";
+            }
+
+            kdtree_query_ctx_free(ctx);
+            kdtree_free(kd);
+        }
+
+        std::cout << std::endl;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The logarithms of verification: times log_batch() against a loop of log()
+// over arrays of several sizes, and verify_star_lists() (which uses it) on
+// random lists of reference and test stars, next to the time of the 2 x NT
+// logarithms it used to compute with log() (the peak of the foreground
+// Gaussian and the distractor likelihood of each test star) and the time they
+// take with log_batch().  See check_log_batch for the accuracy.
+//
+// Usage: bench_log_batch [nb values per size (4000000)] [nb verifications (2000)]
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include "synthetic.h"
+
+
+// The best of 5 runs of "function" (called "n" times), in ns per call
+double measure(const std::function<void()>& function, int n)
+{
+    double best = HUGE_VAL;
+    for (int run = 0; run < 5; ++run)
+    {
+        double start = now();
+        for (int i = 0; i < n; ++i)
+            function();
+        best = std::min(best, now() - start);
+    }
+
+    return 1e9 * best / n;
+}
+
+//-----------------------------------------------------------------------------
+
+// Times log() and log_batch() over "x", in ns per value
+void timeLogs(const std::vector<double>& x, double* scalar, double* batch)
+{
+    int N = (int) x.size();
+    int nrepeats = std::max(1, 4000000 / N);
+    std::vector<double> logx(N);
+    volatile double sink = 0.0;
+
+    *scalar = measure([&]() {
+        for (int i = 0; i < N; ++i)
+            logx[i] = log(x[i]);
+        sink = sink + logx[N - 1];
+    }, nrepeats) / N;
+
+    *batch = measure([&]() {
+        log_batch(x.data(), N, logx.data());
+        sink = sink + logx[N - 1];
+    }, nrepeats) / N;
+}
+
+
+int main(int argc, char** argv)
+{
+    int nvalues = (argc > 1) ? atoi(argv[1]) : 4000000;
+    int nverifications = (argc > 2) ? atoi(argv[2]) : 2000;
+
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> values(1e-6, 1e3);
+
+    std::cout << std::fixed << std::setprecision(2);
+
+    // log_batch() against log()
+    std::cout << "ns per logarithm, log() -> log_batch():" << std::endl;
+
+    for (int N : { 4, 16, 32, 256, 4096, nvalues })
+    {
+        std::vector<double> x(N);
+        for (double& v : x)
+            v = values(rng);
+
+        double scalar, batch;
+        timeLogs(x, &scalar, &batch);
+
+        std::cout << "    " << std::setw(7) << N << " values: " << scalar << " -> " << batch
+                  << " (" << (scalar / batch) << "x)" << std::endl;
+    }
+
+
+    // verify_star_lists()
+    std::cout << "us per verify_star_lists(), and its 2 x NT logarithms with log() -> "
+              << "log_batch():" << std::endl;
+
+    std::uniform_real_distribution<double> position(0.0, 1000.0);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 1.0);
+
+    struct { int NR; int NT; } sizes[] = {
+        { 50, 100 },
+        { 200, 300 },
+        { 500, 1000 },
+        { 2000, 3000 },
+    };
+
+    for (const auto& size : sizes)
+    {
+        std::vector<double> refxy(2 * size.NR);
+        for (double& v : refxy)
+            v = position(rng);
+
+        // 60% of the test stars match a reference star, the others are
+        // distractors
+        std::vector<double> testxy(2 * size.NT), sigma2s(size.NT);
+        for (int i = 0; i < size.NT; ++i)
+        {
+            double sigma = 1.0 + 3.0 * uniform(rng);
+            sigma2s[i] = sigma * sigma;
+            if (uniform(rng) < 0.6)
+            {
+                int r = (int) (uniform(rng) * size.NR) % size.NR;
+                testxy[2 * i] = refxy[2 * r] + sigma * noise(rng);
+                testxy[2 * i + 1] = refxy[2 * r + 1] + sigma * noise(rng);
+            }
+            else
+            {
+                testxy[2 * i] = position(rng);
+                testxy[2 * i + 1] = position(rng);
+            }
+        }
+
+        // (verify_star_lists() takes the reference stars as non-const)
+        std::vector<double> refs = refxy;
+        double logodds = 0.0;
+        double verify = measure([&]() {
+            int besti;
+            logodds = verify_star_lists(refs.data(), size.NR, testxy.data(), sigma2s.data(),
+                                        size.NT, 1e6, 0.25, -HUGE_VAL, HUGE_VAL, &besti,
+                                        nullptr, nullptr, nullptr, nullptr);
+        }, nverifications) / 1000.0;
+
+        // The values of these logarithms don't matter for their time
+        std::vector<double> x(2 * size.NT);
+        for (int i = 0; i < size.NT; ++i)
+        {
+            x[2 * i] = 0.75 / (2.0 * M_PI * sigma2s[i] * size.NR);
+            x[2 * i + 1] = 0.25 + 0.75 * i / (double) size.NR;
+        }
+
+        double scalar, batch;
+        timeLogs(x, &scalar, &batch);
+
+        std::cout << "    NR=" << std::setw(4) << size.NR << ", NT=" << std::setw(4) << size.NT
+                  << ": " << verify << " us (log-odds " << logodds << "), logarithms "
+                  << (scalar * x.size() / 1000.0) << " -> " << (batch * x.size() / 1000.0)
+                  << " us" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The pre-check of the matches before their verification ("precheck_nref"):
+// solves synthetic fields without it, keeping up to "nb matches" of the matches
+// the solver accepts in each field, then puts each of them (with the TAN WCS of
+// its quad, as the solver had it before verifying it) through verify_precheck(),
+// for each "precheck_nref", and runs the full verify_hit() on those the
+// pre-check rejects.  Those the full verification keeps are false rejects: a
+// solution lost to the pre-check.  (A match the solver doesn't accept can't be
+// one.)  Also reports the verifications, the pre-check rejections and the
+// solved fields of the solves with each "precheck_nref".
+//
+// Usage: bench_precheck [nb fields (20)] [nb stars per field (300)]
+//                       [nb matches per field (10)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+extern "C" {
+    #include <astrometry/verify.h>
+    #include <astrometry/fit-wcs.h>
+}
+
+
+// The values of "precheck_nref" (0: no pre-check)
+const int NREFS[] = { 0, 5, 10, 20, 40 };
+const int NB_NREFS = sizeof(NREFS) / sizeof(NREFS[0]);
+
+
+struct AcceptedMatches
+{
+    std::vector<MatchObj> matches;
+    size_t max;
+};
+
+
+struct Totals
+{
+    int solved = 0;
+    int64_t verified = 0;
+    int64_t rejected = 0;
+    double time = 0.0;
+    int prerejected = 0;        // accepted matches the pre-check rejects
+    int falseRejects = 0;       // ... and that the full verification keeps
+};
+
+//-----------------------------------------------------------------------------
+
+// Keeps the accepted matches (without their arrays), until there's enough
+anbool keepMatch(MatchObj* mo, void* userdata)
+{
+    AcceptedMatches* accepted = (AcceptedMatches*) userdata;
+
+    MatchObj match = *mo;
+    match.sip = NULL;
+    match.theta = NULL;
+    match.matchodds = NULL;
+    match.refxyz = NULL;
+    match.refxy = NULL;
+    match.refstarid = NULL;
+    match.testperm = NULL;
+    accepted->matches.push_back(match);
+
+    return (accepted->matches.size() >= accepted->max) ? TRUE : FALSE;
+}
+
+//-----------------------------------------------------------------------------
+
+// Puts back the TAN WCS of the quad of an accepted match (the tweak replaced
+// it), as the solver computed it before verifying the match
+bool quadWCS(const solver_t* solver, MatchObj* mo)
+{
+    double scale;
+    if (fit_tan_wcs(mo->quadxyz, mo->quadpix, mo->dimquads, &mo->wcstan, &scale))
+        return false;
+
+    mo->wcstan.imagew = solver->field_maxx;
+    mo->wcstan.imageh = solver->field_maxy;
+    mo->scale = scale * 3600.0;
+
+    double xyz[3];
+    tan_pixelxy2xyzarr(&mo->wcstan, 0.5 * (solver->field_minx + solver->field_maxx),
+                       0.5 * (solver->field_miny + solver->field_maxy), mo->center);
+    tan_pixelxy2xyzarr(&mo->wcstan, solver->field_minx, solver->field_miny, xyz);
+    mo->radius = sqrt(distsq(mo->center, xyz, 3));
+    mo->radius_deg = dist2deg(mo->radius);
+    return true;
+}
+
+
+int main(int argc, char** argv)
+{
+    int nfields = (argc > 1) ? atoi(argv[1]) : 20;
+    int nstars = (argc > 2) ? atoi(argv[2]) : 300;
+    int nmatches = (argc > 3) ? atoi(argv[3]) : 10;
+
+    std::vector<Star> sky = makeSky(30000);
+    std::vector<index_t*> indexes = buildIndexes(sky, 4);
+
+    Totals totals[NB_NREFS];
+    int naccepted = 0;
+
+    for (int i = 0; i < nfields; ++i)
+    {
+        // The accepted matches, without pre-check
+        tan_t wcs;
+        starxy_t* field = makeField(sky, nstars, i + 1, &wcs);
+
+        AcceptedMatches accepted;
+        accepted.max = nmatches;
+
+        solver_t* solver = newSolver(indexes);
+        solver->record_match_callback = keepMatch;
+        solver->userdata = &accepted;
+        solver_set_field(solver, field);
+        solver_run(solver);
+
+        naccepted += accepted.matches.size();
+
+        double logaccept = std::min(solver->logratio_tokeep, solver->logratio_totune);
+
+        for (int n = 1; n < NB_NREFS; ++n)
+        {
+            for (const MatchObj& match : accepted.matches)
+            {
+                MatchObj mo = match;
+                if (!quadWCS(solver, &mo))
+                    continue;
+
+                index_t* index = mo.index;
+                double pix2 = square(solver->verify_pix) + square(index->index_jitter / mo.scale);
+
+                double logodds = verify_precheck(index->starkd, &mo, solver->vf, NULL, NREFS[n],
+                                                 solver->precheck_nfield, pix2,
+                                                 solver->distractor_ratio, solver->field_maxx,
+                                                 solver->field_maxy);
+                if (logodds >= solver->logratio_precheck)
+                    continue;
+
+                ++totals[n].prerejected;
+
+                verify_hit(index->starkd, index->cutnside, &mo, NULL, solver->vf, NULL, pix2,
+                           solver->distractor_ratio, solver->field_maxx, solver->field_maxy,
+                           solver->logratio_bail_threshold, logaccept,
+                           solver->logratio_stoplooking, solver->distance_from_quad_bonus,
+                           FALSE);
+
+                if (mo.logodds >= logaccept)
+                    ++totals[n].falseRejects;
+
+                verify_free_matchobj(&mo);
+            }
+        }
+
+        solver_clear_indexes(solver);
+        solver_free(solver);
+
+        // The solves with each "precheck_nref"
+        for (int n = 0; n < NB_NREFS; ++n)
+        {
+            field = makeField(sky, nstars, i + 1, &wcs);
+
+            solver = newSolver(indexes);
+            solver->precheck_nref = NREFS[n];
+            solver_set_field(solver, field);
+
+            double start = now();
+            solver_run(solver);
+            totals[n].time += now() - start;
+
+            if (solver_did_solve(solver))
+                ++totals[n].solved;
+            totals[n].verified += solver->num_verified;
+            totals[n].rejected += solver->num_precheck_rejected;
+
+            solver_clear_indexes(solver);
+            solver_free(solver);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << nfields << " fields of " << nstars << " stars, " << naccepted
+              << " accepted matches (up to " << nmatches << " per field):" << std::endl;
+
+    for (int n = 0; n < NB_NREFS; ++n)
+    {
+        std::cout << "    precheck_nref " << std::setw(2) << NREFS[n] << ": " << totals[n].solved
+                  << " solved, " << totals[n].verified << " verifications, "
+                  << totals[n].rejected << " rejected by the pre-check, "
+                  << (1000.0 * totals[n].time / nfields) << " ms per solve";
+        if (n > 0)
+        {
+            std::cout << "; " << totals[n].prerejected << " accepted matches rejected, "
+                      << totals[n].falseRejects << " false rejects";
+        }
+        std::cout << std::endl;
+    }
+
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
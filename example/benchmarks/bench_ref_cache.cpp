@@ -0,0 +1,128 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The cache of the reference stars of verification: verifies the solution of a
+// synthetic field many times, with its center moved by up to 30 pixels (as
+// other quads of the same field would), without and with the cache, and
+// reports the time per verification, the cache hits and the log-odds (which
+// must be the same).  And the same for the blind search that finds it.
+//
+// Usage: bench_ref_cache [nb stars per index (6000)] [nb verifications (2000)]
+
+#include <iostream>
+#include "synthetic.h"
+
+
+int main(int argc, char** argv)
+{
+    int nindexstars = (argc > 1) ? atoi(argv[1]) : 6000;
+    int nverifications = (argc > 2) ? atoi(argv[2]) : 2000;
+
+    std::vector<Star> sky = makeSky(std::max(30000, nindexstars));
+
+    std::vector<index_t*> indexes;
+    for (int i = 0; i < 4; ++i)
+    {
+        indexes.push_back(
+            buildIndex(sky, nindexstars, INDEX_SCALES[i], INDEX_SCALES[i + 1], 100 + i, 20000)
+        );
+    }
+
+    tan_t wcs;
+    starxy_t* field = makeField(sky, 300, 1, &wcs);
+
+    // The blind search, without and with the cache
+    solver_t* solver = nullptr;
+    for (int cached = 0; cached < 2; ++cached)
+    {
+        if (solver)
+        {
+            solver_clear_indexes(solver);
+            solver_free(solver);
+            field = makeField(sky, 300, 1, &wcs);
+        }
+
+        solver = newSolver(indexes);
+        solver->do_tweak = FALSE;
+        solver_set_field(solver, field);
+        solver_preprocess_field(solver);
+        solver->vf->no_ref_cache = !cached;
+
+        double start = now();
+        solver_run(solver);
+        double elapsed = now() - start;
+
+        if (!solver_did_solve(solver))
+        {
+            std::cerr << "The field wasn't solved" << std::endl;
+            return 1;
+        }
+
+        std::cout << "Blind search " << (cached ? "with the cache:    " : "without the cache: ")
+                  << elapsed << " s, " << solver->num_verified << " verifications, "
+                  << solver->num_ref_cache_hits << " cache hits, "
+                  << solver->num_ref_cache_misses << " misses" << std::endl;
+    }
+
+    MatchObj* best = &solver->best_match;
+    index_t* index = solver->best_index;
+
+    std::cout << "Verifications of the solution (" << best->nindex << " index stars in the field):"
+              << std::endl;
+
+    for (int cached = 0; cached < 2; ++cached)
+    {
+        verify_scratch_t* vs = verify_scratch_new();
+        solver->vf->no_ref_cache = !cached;
+
+        std::mt19937 rng(777);
+        std::uniform_real_distribution<double> jitter(-30.0, 30.0);
+
+        double logodds = 0.0;
+        double start = now();
+
+        for (int i = 0; i < nverifications; ++i)
+        {
+            MatchObj mo = *best;
+            mo.theta = NULL;
+            mo.matchodds = NULL;
+            mo.refxyz = NULL;
+            mo.refxy = NULL;
+            mo.refstarid = NULL;
+            mo.testperm = NULL;
+
+            mo.wcstan.crpix[0] += jitter(rng);
+            mo.wcstan.crpix[1] += jitter(rng);
+            tan_pixelxy2xyzarr(&mo.wcstan, IMAGE_SIZE / 2, IMAGE_SIZE / 2, mo.center);
+
+            verify_hit(index->starkd, index->cutnside, &mo, NULL, solver->vf, vs,
+                       square(solver->verify_pix), solver->distractor_ratio,
+                       solver->field_maxx, solver->field_maxy,
+                       solver->logratio_bail_threshold, solver->logratio_tokeep,
+                       solver->logratio_stoplooking, TRUE, FALSE);
+
+            logodds += mo.logodds;
+            verify_free_matchobj(&mo);
+        }
+
+        double elapsed = now() - start;
+
+        int64_t hits, misses;
+        verify_scratch_get_ref_cache_stats(vs, &hits, &misses);
+
+        std::cout << "    " << (cached ? "with the cache:    " : "without the cache: ")
+                  << (1e6 * elapsed / nverifications) << " us per verification, "
+                  << hits << "/" << (hits + misses) << " hits, sum of the log-odds "
+                  << logodds << std::endl;
+
+        verify_scratch_free(vs);
+    }
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The selection of the indexes to search for each AB pair of a field, alone:
+// the scan of the quad size ranges of all the indexes at each visit of the pair,
+// against one lookup of its interval of quad sizes (scale_intervals_find(), when
+// the pair is created) and a walk of the list of indexes of that interval at each
+// visit.  A pair is visited once with its star B as the new field object, then
+// once for each star C or D in its circle.  The indexes are like the ~150 index
+// files of the 4100 and 5200 series (several healpix tiles per quad scale range).
+//
+// Usage: bench_scale_intervals [nb scale ranges (12)] [nb indexes per range (12)]
+//                              [nb stars (300)] [min pixel scale (4.5)]
+//                              [max pixel scale (5.5)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+extern "C" {
+    #include <astrometry/solver/scale-intervals.h>
+}
+
+
+int main(int argc, char** argv)
+{
+    int nscales = (argc > 1) ? atoi(argv[1]) : 12;
+    int ntiles = (argc > 2) ? atoi(argv[2]) : 12;
+    int nstars = (argc > 3) ? atoi(argv[3]) : 300;
+    double funits_lower = (argc > 4) ? atof(argv[4]) : 4.5;
+    double funits_upper = (argc > 5) ? atof(argv[5]) : 5.5;
+
+    // The quad size ranges of the indexes, in pixels^2, as the solver computes
+    // them: scale ranges a factor of 2^(1/4) wide, from INDEX_SCALES[0] up
+    const double ratio = pow(2.0, 0.25);
+
+    solver_t* solver = solver_new();
+    solver->funits_lower = funits_lower;
+    solver->funits_upper = funits_upper;
+
+    int nindexes = nscales * ntiles;
+    std::vector<double> minAB2s(nindexes);
+    std::vector<double> maxAB2s(nindexes);
+    double minminAB2 = HUGE_VAL;
+    double maxmaxAB2 = -HUGE_VAL;
+
+    for (int i = 0; i < nindexes; ++i)
+    {
+        index_t index;
+        memset(&index, 0, sizeof(index_t));
+        index.index_scale_lower = INDEX_SCALES[0] * pow(ratio, i / ntiles);
+        index.index_scale_upper = index.index_scale_lower * ratio;
+
+        double minAB = 0.0, maxAB = 0.0;
+        solver_compute_quad_range(solver, &index, &minAB, &maxAB);
+        minAB2s[i] = minAB * minAB;
+        maxAB2s[i] = maxAB * maxAB;
+        minminAB2 = std::min(minminAB2, minAB2s[i]);
+        maxmaxAB2 = std::max(maxmaxAB2, maxAB2s[i]);
+    }
+
+    solver_free(solver);
+
+    // The field stars, and the AB pairs of acceptable scale in the order of the
+    // search, with the number of times each one is visited
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(0.0, IMAGE_SIZE);
+
+    std::vector<double> xy(2 * nstars);
+    for (double& v : xy)
+        v = uniform(rng);
+
+    std::vector<double> scales;
+    std::vector<int> visits;
+
+    for (int b = 0; b < nstars; ++b)
+    {
+        for (int a = 0; a < b; ++a)
+        {
+            double dx = xy[2 * b] - xy[2 * a];
+            double dy = xy[2 * b + 1] - xy[2 * a + 1];
+            double scale = dx * dx + dy * dy;
+            if ((scale < minminAB2) || (scale > maxmaxAB2))
+                continue;
+
+            // (stars C and D in the circle of diameter AB)
+            double mx = 0.5 * (xy[2 * a] + xy[2 * b]);
+            double my = 0.5 * (xy[2 * a + 1] + xy[2 * b + 1]);
+            int n = 1;
+            for (int c = 0; c < nstars; ++c)
+            {
+                double cx = xy[2 * c] - mx;
+                double cy = xy[2 * c + 1] - my;
+                if ((c != a) && (c != b) && (4.0 * (cx * cx + cy * cy) <= scale))
+                    ++n;
+            }
+
+            scales.push_back(scale);
+            visits.push_back(n);
+        }
+    }
+
+    // The visits, in the order of the search: by new field object, which is
+    // approximated by spreading the visits of each pair over the rest of the search
+    std::vector<int> order;
+    for (size_t p = 0; p < scales.size(); ++p)
+        order.insert(order.end(), visits[p], (int) p);
+    std::shuffle(order.begin(), order.end(), rng);
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << nindexes << " indexes, " << scales.size() << " AB pairs, "
+              << order.size() << " visits" << std::endl;
+
+    // Scan of all the indexes at each visit
+    int64_t sum1 = 0;
+    int64_t nsearched = 0;
+
+    double start = now();
+    for (int p : order)
+    {
+        double scale = scales[p];
+        for (int i = 0; i < nindexes; ++i)
+        {
+            if ((scale < minAB2s[i]) || (scale > maxAB2s[i]))
+                continue;
+            sum1 += i;
+            ++nsearched;
+        }
+    }
+    double scanTime = now() - start;
+
+    // Lookup of the interval of each pair, then walk of its list at each visit
+    scale_intervals_t iv;
+    memset(&iv, 0, sizeof(scale_intervals_t));
+
+    start = now();
+    scale_intervals_build(&iv, minAB2s.data(), maxAB2s.data(), nindexes);
+    double buildTime = now() - start;
+
+    std::vector<int> intervals(scales.size());
+
+    start = now();
+    for (size_t p = 0; p < scales.size(); ++p)
+        intervals[p] = scale_intervals_find(&iv, scales[p]);
+    double findTime = now() - start;
+
+    int64_t sum2 = 0;
+
+    start = now();
+    for (int p : order)
+    {
+        int j = intervals[p];
+        for (int k = iv.start[j]; k < iv.start[j + 1]; ++k)
+            sum2 += iv.indexes[k];
+    }
+    double walkTime = now() - start;
+
+    scale_intervals_free(&iv);
+
+    double lookupTime = buildTime + findTime + walkTime;
+
+    std::cout << (double) nsearched / order.size() << " indexes searched per visit" << std::endl;
+    std::cout << "scan:   " << 1e3 * scanTime << " ms ("
+              << 1e9 * scanTime / order.size() << " ns per visit)" << std::endl;
+    std::cout << "lookup: " << 1e3 * lookupTime << " ms ("
+              << 1e9 * lookupTime / order.size() << " ns per visit; build "
+              << 1e3 * buildTime << " ms, find " << 1e3 * findTime << " ms, walk "
+              << 1e3 * walkTime << " ms), "
+              << scanTime / lookupTime << "x" << std::endl;
+
+    if (sum1 != sum2)
+    {
+        std::cout << "The scan and the lookup found different indexes!" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Peak memory and allocations of the search for quads of one solve.
+//
+// Usage: bench_solve_memory [nb stars (1000)] [max nb of quads to try (0: no limit)]
+//                           [unsolvable (0)]
+//
+// With an unsolvable field (of random stars), the search goes on until it has
+// tried the given number of quads, through as many stars as that takes.
+
+#include <iostream>
+#include "synthetic.h"
+
+
+int main(int argc, char** argv)
+{
+    int nstars = (argc > 1) ? atoi(argv[1]) : 1000;
+    int maxquads = (argc > 2) ? atoi(argv[2]) : 0;
+    bool solvable = (argc > 3) ? (atoi(argv[3]) == 0) : true;
+
+    std::vector<Star> sky = makeSky(30000);
+    std::vector<index_t*> indexes = buildIndexes(sky, 4);
+
+    tan_t wcs;
+    starxy_t* field = makeField(sky, nstars, 1, &wcs, solvable);
+
+    solver_t* solver = newSolver(indexes);
+    solver->maxquads = maxquads;
+    solver_set_field(solver, field);
+
+    double rss = peakRSS();
+    int64_t nallocs = allocations();
+    double start = now();
+
+    solver_run(solver);
+
+    double elapsed = now() - start;
+    nallocs = allocations() - nallocs;
+
+    std::cout << field->N << " stars, " << (solver_did_solve(solver) ? "solved" : "not solved")
+              << " after " << solver->numtries << " quads and " << (solver->last_examined_object + 1)
+              << " stars, in " << elapsed << " s" << std::endl;
+    std::cout << "    peak RSS: " << rss << " MB before the solve, " << peakRSS()
+              << " MB after" << std::endl;
+    std::cout << "    allocations during the solve: " << nallocs << std::endl;
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Solves synthetic fields back to back, either with one solver prepared for
+// each new field by solver_reset() (which keeps the memory set up for the
+// previous ones), or with a new solver for each field, and reports the time
+// and allocations per solve.
+//
+// Usage: bench_solve_session [nb fields (20)] [nb stars per field (300)]
+//                            [nb threads (0: solver_run(), else solver_run_parallel())]
+//                            [tweak (1)]
+//
+// The tweak of the solution (fit of a SIP WCS) makes most of the allocations
+// of a solve: without it, only those of the search remain.
+
+#include <iostream>
+#include <string>
+#include "synthetic.h"
+
+
+struct Totals
+{
+    double time = 0.0;
+    int64_t allocations = 0;
+    int solved = 0;
+};
+
+
+int main(int argc, char** argv)
+{
+    int nfields = (argc > 1) ? atoi(argv[1]) : 20;
+    int nstars = (argc > 2) ? atoi(argv[2]) : 300;
+    int nthreads = (argc > 3) ? atoi(argv[3]) : 0;
+    bool tweak = (argc > 4) ? (atoi(argv[4]) != 0) : true;
+
+    std::vector<Star> sky = makeSky(30000);
+    std::vector<index_t*> indexes = buildIndexes(sky, 4);
+
+    // Alternate the two ways, field by field, so that both see the same
+    // state of the machine
+    Totals reused, fresh;
+    solver_t* solver = nullptr;
+
+    for (int i = 0; i < nfields; ++i)
+    {
+        for (int reuse = 0; reuse < 2; ++reuse)
+        {
+            tan_t wcs;
+            starxy_t* field = makeField(sky, nstars, i + 1, &wcs);
+            Totals& totals = reuse ? reused : fresh;
+
+            int64_t nallocs = allocations();
+            double start = now();
+
+            solver_t* s;
+            if (reuse && solver)
+            {
+                s = solver;
+                solver_reset(s, field);
+            }
+            else
+            {
+                s = newSolver(indexes);
+                s->do_tweak = tweak;
+                solver_set_field(s, field);
+            }
+
+            if (nthreads > 0)
+                solver_run_parallel(s, nthreads);
+            else
+                solver_run(s);
+            if (solver_did_solve(s))
+                ++totals.solved;
+
+            if (reuse)
+            {
+                solver = s;
+            }
+            else
+            {
+                solver_clear_indexes(s);
+                solver_free(s);
+            }
+
+            totals.time += now() - start;
+            totals.allocations += allocations() - nallocs;
+        }
+    }
+
+    std::cout << nfields << " fields of " << nstars << " stars, "
+              << (nthreads > 0 ? std::to_string(nthreads) + " threads" : "solver_run()")
+              << (tweak ? ", with tweak:" : ", no tweak:") << std::endl;
+    std::cout << "    new solver per field:  " << fresh.solved << " solved, "
+              << (1000.0 * fresh.time / nfields) << " ms and "
+              << (fresh.allocations / nfields) << " allocations per solve" << std::endl;
+    std::cout << "    solver_reset():        " << reused.solved << " solved, "
+              << (1000.0 * reused.time / nfields) << " ms and "
+              << (reused.allocations / nfields) << " allocations per solve" << std::endl;
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The allocations of verification: verifies matches of a synthetic field many
+// times with verify_hit(), with a scratch space kept from one call to the next
+// (as the solver does) and without one, with and without de-duplication of the
+// field stars, and reports the allocations and the time per verification once
+// warmed up.  The matches are either the solution, moved by up to 3 pixels
+// (accepted), or moved by 100 to 200 pixels (rejected, as most are).
+//
+// Usage: bench_verify_memory [nb verifications (2000)] [nb stars (300)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+
+// Verifications not counted, while the scratch space grows
+const int WARMUP = 20;
+
+
+struct Result
+{
+    double allocations = 0.0;
+    double time = 0.0;
+    int accepted = 0;
+};
+
+
+Result verifyMany(solver_t* solver, const MatchObj* match, index_t* index, bool keepScratch,
+                  bool rejected, int nverifications)
+{
+    verify_scratch_t* vs = keepScratch ? verify_scratch_new() : nullptr;
+
+    std::mt19937 rng(777);
+    std::uniform_real_distribution<double> jitter(-3.0, 3.0);
+    std::uniform_real_distribution<double> shift(100.0, 200.0);
+    std::uniform_int_distribution<int> sign(0, 1);
+
+    Result result;
+    int64_t nallocs = 0;
+    double start = 0.0;
+
+    for (int i = 0; i < WARMUP + nverifications; ++i)
+    {
+        if (i == WARMUP)
+        {
+            nallocs = allocations();
+            start = now();
+        }
+
+        MatchObj mo = *match;
+        mo.theta = NULL;
+        mo.matchodds = NULL;
+        mo.refxyz = NULL;
+        mo.refxy = NULL;
+        mo.refstarid = NULL;
+        mo.testperm = NULL;
+
+        for (int d = 0; d < 2; ++d)
+            mo.wcstan.crpix[d] += rejected ? (sign(rng) ? 1 : -1) * shift(rng) : jitter(rng);
+        tan_pixelxy2xyzarr(&mo.wcstan, IMAGE_SIZE / 2, IMAGE_SIZE / 2, mo.center);
+
+        verify_hit(index->starkd, index->cutnside, &mo, NULL, solver->vf, vs,
+                   square(solver->verify_pix), solver->distractor_ratio,
+                   solver->field_maxx, solver->field_maxy,
+                   solver->logratio_bail_threshold, solver->logratio_tokeep,
+                   solver->logratio_stoplooking, TRUE, FALSE);
+
+        if ((i >= WARMUP) && (mo.logodds >= solver->logratio_tokeep))
+            ++result.accepted;
+
+        verify_free_matchobj(&mo);
+    }
+
+    result.time = 1e6 * (now() - start) / nverifications;
+    result.allocations = double(allocations() - nallocs) / nverifications;
+
+    verify_scratch_free(vs);
+    return result;
+}
+
+
+int main(int argc, char** argv)
+{
+    int nverifications = (argc > 1) ? atoi(argv[1]) : 2000;
+    int nstars = (argc > 2) ? atoi(argv[2]) : 300;
+
+    std::vector<Star> sky = makeSky(30000);
+    std::vector<index_t*> indexes = buildIndexes(sky, 4);
+
+    tan_t wcs;
+    starxy_t* field = makeField(sky, nstars, 1, &wcs);
+
+    solver_t* solver = newSolver(indexes);
+    solver->do_tweak = FALSE;
+    solver_set_field(solver, field);
+    solver_run(solver);
+
+    if (!solver_did_solve(solver))
+    {
+        std::cerr << "The field wasn't solved" << std::endl;
+        return 1;
+    }
+
+    MatchObj* best = &solver->best_match;
+    index_t* index = solver->best_index;
+
+    std::cout << std::fixed;
+    std::cout << nverifications << " verifications of matches in a field of " << nstars
+              << " stars (allocations and us per verification):" << std::endl;
+
+    for (int rejected = 1; rejected >= 0; --rejected)
+    {
+        for (int dedup = 0; dedup < 2; ++dedup)
+        {
+            solver->vf->do_dedup = dedup;
+
+            std::cout << "    " << (rejected ? "rejected" : "accepted")
+                      << (dedup ? ", de-duplicated:    " : ", no de-duplication:");
+
+            for (int keep = 0; keep < 2; ++keep)
+            {
+                Result result = verifyMany(solver, best, index, keep, rejected, nverifications);
+                std::cout << (keep ? "  scratch kept " : "  no scratch ") << std::setprecision(2)
+                          << result.allocations << " (" << std::setprecision(0) << result.time
+                          << " us)";
+                if (keep)
+                    std::cout << ", " << result.accepted << " accepted";
+            }
+
+            std::cout << std::endl;
+        }
+    }
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The search of the nearest reference star of each field star in verification,
+// with a grid over the reference stars (VERIFY_NN_GRID, the default) and with a
+// kd-tree of them (VERIFY_NN_KDTREE): the blind search of a synthetic field,
+// then many verifications of its solution, moved by up to 3 pixels (accepted)
+// or by 100 to 200 pixels (rejected), with each method.  Reports the times, and
+// the log-odds (which must be the same).
+//
+// Usage: bench_verify_nn [nb stars per index (6000)] [nb verifications (2000)]
+//                        [nb stars (300)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+
+const char* METHOD_NAMES[] = { "grid:   ", "kd-tree:" };
+
+
+int main(int argc, char** argv)
+{
+    int nindexstars = (argc > 1) ? atoi(argv[1]) : 6000;
+    int nverifications = (argc > 2) ? atoi(argv[2]) : 2000;
+    int nstars = (argc > 3) ? atoi(argv[3]) : 300;
+
+    std::vector<Star> sky = makeSky(std::max(30000, nindexstars));
+
+    std::vector<index_t*> indexes;
+    for (int i = 0; i < 4; ++i)
+    {
+        indexes.push_back(
+            buildIndex(sky, nindexstars, INDEX_SCALES[i], INDEX_SCALES[i + 1], 100 + i, 20000)
+        );
+    }
+
+    std::cout << std::fixed;
+
+    // The blind search, with each method
+    solver_t* solver = nullptr;
+    for (int method = VERIFY_NN_GRID; method <= VERIFY_NN_KDTREE; ++method)
+    {
+        if (solver)
+        {
+            solver_clear_indexes(solver);
+            solver_free(solver);
+        }
+
+        tan_t wcs;
+        starxy_t* field = makeField(sky, nstars, 1, &wcs);
+
+        solver = newSolver(indexes);
+        solver->do_tweak = FALSE;
+        solver_set_field(solver, field);
+        solver_preprocess_field(solver);
+        solver->vf->nn_method = method;
+
+        double start = now();
+        solver_run(solver);
+        double elapsed = now() - start;
+
+        if (!solver_did_solve(solver))
+        {
+            std::cerr << "The field wasn't solved" << std::endl;
+            return 1;
+        }
+
+        std::cout << "Blind search, " << METHOD_NAMES[method] << " " << std::setprecision(3)
+                  << elapsed << " s, " << solver->num_verified << " verifications, log-odds "
+                  << std::setprecision(4) << solver->best_match.logodds << std::endl;
+    }
+
+    MatchObj* best = &solver->best_match;
+    index_t* index = solver->best_index;
+
+    std::cout << nverifications << " verifications of the solution (" << best->nindex
+              << " index stars in the field, " << nstars << " field stars):" << std::endl;
+
+    for (int rejected = 0; rejected < 2; ++rejected)
+    {
+        for (int method = VERIFY_NN_GRID; method <= VERIFY_NN_KDTREE; ++method)
+        {
+            verify_scratch_t* vs = verify_scratch_new();
+            solver->vf->nn_method = method;
+
+            std::mt19937 rng(777);
+            std::uniform_real_distribution<double> jitter(-3.0, 3.0);
+            std::uniform_real_distribution<double> shift(100.0, 200.0);
+            std::uniform_int_distribution<int> sign(0, 1);
+
+            double logodds = 0.0;
+            double start = now();
+
+            for (int i = 0; i < nverifications; ++i)
+            {
+                MatchObj mo = *best;
+                mo.theta = NULL;
+                mo.matchodds = NULL;
+                mo.refxyz = NULL;
+                mo.refxy = NULL;
+                mo.refstarid = NULL;
+                mo.testperm = NULL;
+
+                for (int d = 0; d < 2; ++d)
+                    mo.wcstan.crpix[d] += rejected ? (sign(rng) ? 1 : -1) * shift(rng) : jitter(rng);
+                tan_pixelxy2xyzarr(&mo.wcstan, IMAGE_SIZE / 2, IMAGE_SIZE / 2, mo.center);
+
+                verify_hit(index->starkd, index->cutnside, &mo, NULL, solver->vf, vs,
+                           square(solver->verify_pix), solver->distractor_ratio,
+                           solver->field_maxx, solver->field_maxy,
+                           solver->logratio_bail_threshold, solver->logratio_tokeep,
+                           solver->logratio_stoplooking, TRUE, FALSE);
+
+                logodds += mo.logodds;
+                verify_free_matchobj(&mo);
+            }
+
+            double elapsed = now() - start;
+
+            std::cout << "    " << (rejected ? "rejected, " : "accepted, ") << METHOD_NAMES[method]
+                      << " " << std::setprecision(1) << (1e6 * elapsed / nverifications)
+                      << " us per verification, sum of the log-odds " << std::setprecision(4)
+                      << logodds << std::endl;
+
+            verify_scratch_free(vs);
+        }
+    }
+
+    solver_clear_indexes(solver);
+    solver_free(solver);
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// The Hough-style voting before verification ("vote_min", "vote_max_cells"):
+// solves synthetic fields, and fields of false stars only, with each setting,
+// and reports the verifications, the field objects searched, the time and the
+// outcome: the fields solved, and those solved at their true position (within
+// 10 pixels).  The search of the fields of false stars stops after "max quads"
+// field quads (those of the synthetic fields take up to a few 100000).
+//
+// Usage: bench_vote [nb fields (20)] [nb stars per field (300)]
+//                   [nb fields of false stars (2)] [max quads (1000000)]
+
+#include <iostream>
+#include <iomanip>
+#include "synthetic.h"
+
+
+struct Setting
+{
+    const char* name;
+    int vote_min;
+    int vote_max_cells;
+};
+
+const Setting SETTINGS[] = {
+    { "no voting:                     ", 0, 0 },
+    { "vote_min 2:                    ", 2, 0 },
+    { "vote_min 3:                    ", 3, 0 },
+    { "vote_min 2, vote_max_cells 1:  ", 2, 1 },
+    { "vote_min 2, vote_max_cells 4:  ", 2, 4 },
+};
+const int NB_SETTINGS = sizeof(SETTINGS) / sizeof(SETTINGS[0]);
+
+
+struct Totals
+{
+    int solved = 0;
+    int right = 0;
+    int64_t verified = 0;
+    int64_t objects = 0;
+    double time = 0.0;
+};
+
+
+int main(int argc, char** argv)
+{
+    int nfields = (argc > 1) ? atoi(argv[1]) : 20;
+    int nstars = (argc > 2) ? atoi(argv[2]) : 300;
+    int nfalse = (argc > 3) ? atoi(argv[3]) : 2;
+    int maxquads = (argc > 4) ? atoi(argv[4]) : 1000000;
+
+    std::vector<Star> sky = makeSky(30000);
+    std::vector<index_t*> indexes = buildIndexes(sky, 4);
+
+    // Alternate the settings, field by field, so that all see the same state
+    // of the machine
+    Totals totals[NB_SETTINGS];
+    Totals falseTotals[NB_SETTINGS];
+
+    for (int i = 0; i < nfields + nfalse; ++i)
+    {
+        bool solvable = (i < nfields);
+
+        for (int s = 0; s < NB_SETTINGS; ++s)
+        {
+            tan_t wcs;
+            starxy_t* field = makeField(sky, nstars, i + 1, &wcs, solvable);
+            Totals& t = solvable ? totals[s] : falseTotals[s];
+
+            solver_t* solver = newSolver(indexes);
+            solver->vote_min = SETTINGS[s].vote_min;
+            solver->vote_max_cells = SETTINGS[s].vote_max_cells;
+            if (!solvable)
+                solver->maxquads = maxquads;
+            solver_set_field(solver, field);
+
+            double start = now();
+            solver_run(solver);
+            t.time += now() - start;
+
+            if (solver_did_solve(solver))
+            {
+                ++t.solved;
+
+                double x, y;
+                if (tan_xyzarr2pixelxy(&wcs, solver->best_match.center, &x, &y) &&
+                    (hypot(x - 0.5 * IMAGE_SIZE, y - 0.5 * IMAGE_SIZE) < 10.0))
+                {
+                    ++t.right;
+                }
+            }
+
+            t.verified += solver->num_verified;
+            t.objects += solver->last_examined_object + 1;
+
+            solver_clear_indexes(solver);
+            solver_free(solver);
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << nfields << " fields of " << nstars << " stars:" << std::endl;
+    for (int s = 0; s < NB_SETTINGS; ++s)
+    {
+        std::cout << "    " << SETTINGS[s].name << totals[s].solved << " solved ("
+                  << totals[s].right << " at the right position), " << totals[s].verified
+                  << " verifications, " << totals[s].objects << " field objects, "
+                  << (1000.0 * totals[s].time / std::max(nfields, 1)) << " ms per field"
+                  << std::endl;
+    }
+
+    if (nfalse > 0)
+    {
+        std::cout << nfalse << " fields of " << nstars << " false stars:" << std::endl;
+        for (int s = 0; s < NB_SETTINGS; ++s)
+        {
+            std::cout << "    " << SETTINGS[s].name << falseTotals[s].solved << " solved, "
+                      << falseTotals[s].verified << " verifications, "
+                      << falseTotals[s].objects << " field objects, "
+                      << (1000.0 * falseTotals[s].time / nfalse) << " ms per field"
+                      << std::endl;
+        }
+    }
+
+    for (index_t* index : indexes)
+        freeIndex(index);
+
+    return 0;
+}
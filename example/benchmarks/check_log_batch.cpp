@@ -0,0 +1,324 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Checks log_batch() against log(), and the log-odds of verify_star_lists()
+// (which uses it) against those of the same verification done with log().
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+    #include <astrometry/mathutil.h>
+    #include <astrometry/verify.h>
+}
+
+
+/*********************************** HELPER FUNCTIONS ***********************************/
+
+// Distance between two doubles in units in the last place (0 if both are NaN).
+int64_t ulps(double a, double b)
+{
+    if (std::isnan(a) || std::isnan(b))
+        return (std::isnan(a) && std::isnan(b)) ? 0 : INT64_MAX;
+    if (a == b)
+        return 0;
+
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(double));
+    memcpy(&ib, &b, sizeof(double));
+    if (ia < 0)
+        ia = INT64_MIN - ia;
+    if (ib < 0)
+        ib = INT64_MIN - ib;
+    return (ia > ib) ? ia - ib : ib - ia;
+}
+
+//-----------------------------------------------------------------------------
+
+// Compares log_batch() of "x" with log(): returns the largest difference in
+// ulps, and counts the values that are exactly equal.
+int64_t compare(const std::vector<double>& x, size_t& nequal)
+{
+    std::vector<double> logx(x.size());
+    log_batch(x.data(), (int) x.size(), logx.data());
+
+    int64_t worst = 0;
+    nequal = 0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        int64_t d = ulps(logx[i], log(x[i]));
+        worst = std::max(worst, d);
+        if (d == 0)
+            ++nequal;
+    }
+
+    return worst;
+}
+
+//-----------------------------------------------------------------------------
+
+double logd_at(double distractor, int mu, int NR, double logbg)
+{
+    return log(distractor + (1.0 - distractor) * mu / (double) NR) + logbg;
+}
+
+//-----------------------------------------------------------------------------
+
+// The verification of verify_star_lists() (test stars in order, no bail-out
+// or stop-looking threshold) as it was done before log_batch(): one log() per
+// value, and the nearest reference star found by brute force.
+double reference_verify(const std::vector<double>& refxy, const std::vector<double>& testxy,
+                        const std::vector<double>& sigma2s, double effective_area,
+                        double distractors, int* p_besti)
+{
+    int NR = (int) refxy.size() / 2;
+    int NT = (int) testxy.size() / 2;
+
+    std::vector<int> rmatches(NR, -1);
+    std::vector<double> rprobs(NR);
+    std::vector<int> theta(NT);
+
+    double logbg = log(1.0 / effective_area);
+    double logodds = 0.0;
+    double bestlogodds = -HUGE_VAL;
+    int mu = 0;
+
+    *p_besti = -1;
+
+    for (int i = 0; i < NT; ++i)
+    {
+        double sig2 = sigma2s[i];
+        double logd = logd_at(distractors, mu, NR, logbg);
+        double logfg = -HUGE_VAL;
+
+        int refi = -1;
+        double bestd2 = sig2 * 25.0;
+        for (int r = 0; r < NR; ++r)
+        {
+            double dx = testxy[2*i] - refxy[2*r];
+            double dy = testxy[2*i+1] - refxy[2*r+1];
+            double d2 = dx*dx + dy*dy;
+            if (d2 <= bestd2)
+            {
+                bestd2 = d2;
+                refi = r;
+            }
+        }
+
+        if (refi != -1)
+        {
+            double loggmax = log((1.0 - distractors) / (2.0 * M_PI * sig2 * NR));
+            logfg = loggmax - bestd2 / (2.0 * sig2);
+        }
+
+        if (logfg < logd)
+        {
+            logfg = logd;
+            theta[i] = THETA_DISTRACTOR;
+        }
+        else if (rmatches[refi] != -1)
+        {
+            // Conflict: keep the old match, or switch to the new one?
+            double keepfg = logd;
+            double switchfg = logfg;
+            int oldj = rmatches[refi];
+            int muj = 0;
+            int j;
+
+            for (j = 0; j < oldj; ++j)
+            {
+                if (theta[j] >= 0)
+                    ++muj;
+            }
+
+            switchfg += logd_at(distractors, muj, NR, logbg) - rprobs[refi];
+            for (; j < i; ++j)
+            {
+                if (theta[j] < 0)
+                    switchfg += logd_at(distractors, muj, NR, logbg) -
+                                logd_at(distractors, muj + 1, NR, logbg);
+                else
+                    ++muj;
+            }
+
+            if (switchfg > keepfg)
+            {
+                theta[oldj] = THETA_CONFLICT;
+                theta[i] = refi;
+                rmatches[refi] = i;
+                rprobs[refi] = logfg;
+                logfg = switchfg;
+            }
+            else
+            {
+                logfg = keepfg;
+                theta[i] = THETA_CONFLICT;
+            }
+        }
+        else
+        {
+            rmatches[refi] = i;
+            rprobs[refi] = logfg;
+            theta[i] = refi;
+            ++mu;
+        }
+
+        logodds += logfg - logbg;
+        if (logodds > bestlogodds)
+        {
+            bestlogodds = logodds;
+            *p_besti = i;
+        }
+    }
+
+    return bestlogodds;
+}
+
+
+/************************************* MAIN FUNCTION ************************************/
+
+int main(int argc, char** argv)
+{
+    std::mt19937_64 rng(42);
+    bool ok = true;
+
+
+    // Normal values: over the whole range of exponents, and close to 1
+    std::cout << "log_batch() against log():" << std::endl;
+
+    std::uniform_int_distribution<uint64_t> anybits(0x0010000000000000ULL, 0x7fefffffffffffffULL);
+    std::uniform_real_distribution<double> nearone(0.5, 2.0);
+
+    std::vector<double> x(4000000);
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        if (i % 2)
+        {
+            uint64_t bits = anybits(rng);
+            memcpy(&x[i], &bits, sizeof(double));
+        }
+        else
+        {
+            x[i] = nearone(rng);
+        }
+    }
+
+    size_t nequal;
+    int64_t worst = compare(x, nequal);
+    std::cout << "    " << x.size() << " normal values: at most " << worst << " ulp apart, "
+              << (100.0 * nequal / x.size()) << "% equal" << std::endl;
+    ok = ok && (worst <= 1);
+
+
+    // Edge values, which must give exactly what log() does
+    std::vector<double> edges = {
+        0.0, -0.0, -1.0, 1.0, 2.0, 0.5, M_SQRT2, M_SQRT1_2, std::nextafter(1.0, 0.0),
+        std::nextafter(1.0, 2.0), DBL_MIN, std::nextafter(DBL_MIN, 0.0), DBL_TRUE_MIN,
+        DBL_MAX, HUGE_VAL, -HUGE_VAL, NAN, -NAN, 1e-300, 1e300,
+    };
+    worst = compare(edges, nequal);
+    std::cout << "    " << edges.size() << " edge values: at most " << worst << " ulp apart, "
+              << nequal << " equal" << std::endl;
+    for (double e : edges)
+    {
+        double l;
+        log_batch(&e, 1, &l);
+        bool special = !(e >= DBL_MIN && e <= DBL_MAX);
+        if (special && (ulps(l, log(e)) != 0))
+        {
+            std::cout << "    log_batch(" << e << ") = " << l << ", log() = " << log(e) << std::endl;
+            ok = false;
+        }
+    }
+    ok = ok && (worst <= 1);
+
+
+    // Odd lengths and offsets, and in place: the same results as all at once
+    std::vector<double> all(x.begin(), x.begin() + 64);
+    all.insert(all.end(), edges.begin(), edges.end());
+    std::vector<double> expected(all.size());
+    log_batch(all.data(), (int) all.size(), expected.data());
+
+    int nbad = 0;
+    for (int offset = 0; offset < 8; ++offset)
+    {
+        for (int n = 0; offset + n <= (int) all.size(); ++n)
+        {
+            std::vector<double> y(all.begin() + offset, all.begin() + offset + n);
+            log_batch(y.data(), n, y.data());
+            for (int i = 0; i < n; ++i)
+            {
+                if (ulps(y[i], expected[offset + i]) != 0)
+                    ++nbad;
+            }
+        }
+    }
+    std::cout << "    lengths 0-" << all.size() << ", offsets 0-7, in place: " << nbad
+              << " different values" << std::endl;
+    ok = ok && (nbad == 0);
+
+
+    // The log-odds of verifications, before (log()) and after (log_batch())
+    std::cout << "Log-odds of verify_star_lists():" << std::endl;
+
+    std::uniform_real_distribution<double> position(0.0, 1000.0);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    double maxdiff = 0.0;
+    int nbesti = 0;
+    const int ntrials = 2000;
+    for (int trial = 0; trial < ntrials; ++trial)
+    {
+        int NR = 5 + trial % 60;
+        int NT = 5 + (trial * 7) % 200;
+
+        std::vector<double> refxy(2 * NR);
+        for (double& v : refxy)
+            v = position(rng);
+
+        // Test stars: matches (sometimes two of the same reference star, for
+        // conflicts) and distractors
+        std::vector<double> testxy(2 * NT), sigma2s(NT);
+        for (int i = 0; i < NT; ++i)
+        {
+            double sigma = 1.0 + 3.0 * uniform(rng);
+            sigma2s[i] = sigma * sigma;
+            if (uniform(rng) < 0.6)
+            {
+                int r = (int) (uniform(rng) * NR) % NR;
+                testxy[2*i] = refxy[2*r] + sigma * noise(rng);
+                testxy[2*i+1] = refxy[2*r+1] + sigma * noise(rng);
+            }
+            else
+            {
+                testxy[2*i] = position(rng);
+                testxy[2*i+1] = position(rng);
+            }
+        }
+
+        int besti_before, besti_after;
+        double before = reference_verify(refxy, testxy, sigma2s, 1e6, 0.25, &besti_before);
+        double after = verify_star_lists(refxy.data(), NR, testxy.data(), sigma2s.data(), NT,
+                                         1e6, 0.25, -HUGE_VAL, HUGE_VAL, &besti_after,
+                                         nullptr, nullptr, nullptr, nullptr);
+
+        maxdiff = std::max(maxdiff, fabs(after - before) / std::max(1.0, fabs(before)));
+        if (besti_before != besti_after)
+            ++nbesti;
+    }
+
+    std::cout << "    " << ntrials << " verifications: relative difference at most " << maxdiff
+              << ", " << nbesti << " with a different best star" << std::endl;
+    ok = ok && (maxdiff < 1e-12) && (nbesti == 0);
+
+
+    std::cout << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
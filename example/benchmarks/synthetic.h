@@ -0,0 +1,487 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+*/
+
+// Synthetic skies, index files and fields for the benchmarks, and helpers to
+// measure them: no index file is needed.
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+
+#if !defined(_WIN32)
+    #include <sys/resource.h>
+#endif
+
+extern "C" {
+    #include <astrometry/solver.h>
+    #include <astrometry/index.h>
+    #include <astrometry/starutil.h>
+    #include <astrometry/mathutil.h>
+    #include <astrometry/starxy.h>
+    #include <astrometry/sip.h>
+    #include <astrometry/kdtree.h>
+}
+
+
+/****************************** MEASUREMENTS ******************************/
+
+// Number of calls to malloc(), calloc() and realloc() so far, when the C
+// library allows to count them (glibc); -1 otherwise.
+#if defined(__GLIBC__)
+
+static int64_t nb_allocations = 0;
+
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t nmemb, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+
+    void* malloc(size_t size)
+    {
+        ++nb_allocations;
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t nmemb, size_t size)
+    {
+        ++nb_allocations;
+        return __libc_calloc(nmemb, size);
+    }
+
+    void* realloc(void* ptr, size_t size)
+    {
+        ++nb_allocations;
+        return __libc_realloc(ptr, size);
+    }
+}
+
+inline int64_t allocations()
+{
+    return nb_allocations;
+}
+
+#else
+
+inline int64_t allocations()
+{
+    return -1;
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Peak resident memory of the process so far, in MB (-1 on Windows).
+inline double peakRSS()
+{
+#if defined(_WIN32)
+    return -1.0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+// Current time, in seconds.
+inline double now()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+
+/****************************** SYNTHETIC DATA ******************************/
+
+// Sky area of the synthetic stars, and the field of view of the images
+const double SKY_RA = 150.0;
+const double SKY_DEC = 30.0;
+const double SKY_SIZE = 5.0;            // degrees
+const int IMAGE_SIZE = 1024;            // pixels
+const double PIXEL_SCALE = 5.0;         // arcsec
+
+// Quad size ranges (arcsec) of the synthetic indexes
+const double INDEX_SCALES[] = { 240, 340, 480, 680, 960, 1360, 1920, 2720, 3840 };
+
+
+struct Star
+{
+    double xyz[3];
+    double mag;
+};
+
+//-----------------------------------------------------------------------------
+
+// Random stars over a SKY_SIZE x SKY_SIZE degrees area, brightest first.
+inline std::vector<Star> makeSky(int nstars, unsigned int seed = 42)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    std::vector<Star> stars(nstars);
+    for (Star& star : stars)
+    {
+        double ra = SKY_RA + (uniform(rng) - 0.5) * SKY_SIZE / cos(deg2rad(SKY_DEC));
+        double dec = SKY_DEC + (uniform(rng) - 0.5) * SKY_SIZE;
+        radecdeg2xyzarr(ra, dec, star.xyz);
+        star.mag = 8.0 + 10.0 * pow(uniform(rng), 0.3);
+    }
+
+    std::sort(stars.begin(), stars.end(),
+              [](const Star& a, const Star& b) { return a.mag < b.mag; });
+    return stars;
+}
+
+//-----------------------------------------------------------------------------
+
+// The code of the quad ABCD, as index files store it (false if the stars are
+// too far apart to compute it).
+inline bool computeCode(const double* A, const double* B, const double* C, const double* D,
+                        double* code)
+{
+    double mid[3], ax, ay, bx, by, cx, cy, dx, dy;
+    star_midpoint(mid, A, B);
+    if (!star_coords(A, mid, TRUE, &ax, &ay) || !star_coords(B, mid, TRUE, &bx, &by) ||
+        !star_coords(C, mid, TRUE, &cx, &cy) || !star_coords(D, mid, TRUE, &dx, &dy))
+    {
+        return false;
+    }
+
+    double abx = bx - ax;
+    double aby = by - ay;
+    double scale = abx * abx + aby * aby;
+    double costheta = (aby + abx) / scale;
+    double sintheta = (aby - abx) / scale;
+
+    cx -= ax;
+    cy -= ay;
+    dx -= ax;
+    dy -= ay;
+    code[0] = cx * costheta + cy * sintheta;
+    code[1] = -cx * sintheta + cy * costheta;
+    code[2] = dx * costheta + dy * sintheta;
+    code[3] = -dx * sintheta + dy * costheta;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// An index of the "nstars" brightest stars of the sky, with up to "nquads"
+// quads of size in [scaleLow, scaleHigh] arcsec.  The trees are of type
+// "treetype" (KDTT_DOUBLE or KDTT_DSS, as in the index files).
+inline index_t* buildIndex(const std::vector<Star>& sky, int nstars, double scaleLow,
+                           double scaleHigh, int id, int nquads, int treetype = KDTT_DOUBLE)
+{
+    nstars = std::min(nstars, (int) sky.size());
+
+    std::vector<double> xyz(3 * nstars);
+    for (int i = 0; i < nstars; ++i)
+        memcpy(&xyz[3 * i], sky[i].xyz, 3 * sizeof(double));
+
+    // The star tree (kdtree_build() moves the points around, so on a copy)
+    double* treexyz = (double*) malloc(3 * nstars * sizeof(double));
+    memcpy(treexyz, xyz.data(), 3 * nstars * sizeof(double));
+
+    kdtree_t* startree;
+    if (treetype == KDTT_DSS)
+    {
+        double low[3] = { -1, -1, -1 };
+        double high[3] = { 1, 1, 1 };
+        startree = kdtree_build_2(NULL, treexyz, nstars, 3, 8, KDTT_DSS, KD_BUILD_BBOX, low, high);
+    }
+    else
+    {
+        startree = kdtree_build(NULL, treexyz, nstars, 3, 8, KDTT_DOUBLE, KD_BUILD_BBOX);
+    }
+
+    startree_t* starkd = (startree_t*) calloc(1, sizeof(startree_t));
+    starkd->tree = startree;
+    starkd->sweep = (uint8_t*) malloc(nstars);
+    for (int i = 0; i < nstars; ++i)
+        starkd->sweep[i] = (uint8_t) (i * 250 / nstars);
+
+    // The quads: for each star A, a star B at the right distance, and the
+    // two brightest stars C and D in the circle of diameter AB
+    double low2 = arcsec2distsq(scaleLow);
+    double high2 = arcsec2distsq(scaleHigh);
+
+    uint32_t* quads = (uint32_t*) malloc(nquads * 4 * sizeof(uint32_t));
+    double* codes = (double*) malloc(nquads * 4 * sizeof(double));
+    int nq = 0;
+
+    for (int pass = 0; (pass < 8) && (nq < nquads); ++pass)
+    {
+        for (int a = 0; (a < nstars) && (nq < nquads); ++a)
+        {
+            kdtree_qres_t* res = kdtree_rangesearch_options(
+                startree, &xyz[3 * a], high2, KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS
+            );
+
+            int candidates[64];
+            int nc = 0;
+            for (unsigned int j = 0; (j < res->nres) && (nc < 64); ++j)
+            {
+                if ((res->inds[j] > a) && (res->sdists[j] >= low2))
+                    candidates[nc++] = res->inds[j];
+            }
+            kdtree_free_query(res);
+
+            if (nc == 0)
+                continue;
+
+            int b = candidates[(pass * 7 + a) % nc];
+
+            double mid[3];
+            star_midpoint(mid, &xyz[3 * a], &xyz[3 * b]);
+            res = kdtree_rangesearch_options(
+                startree, mid, distsq(&xyz[3 * a], mid, 3), KD_OPTIONS_SMALL_RADIUS
+            );
+
+            int brightest[2] = { -1, -1 };
+            for (unsigned int j = 0; j < res->nres; ++j)
+            {
+                int k = res->inds[j];
+                if ((k == a) || (k == b))
+                    continue;
+
+                if ((brightest[0] == -1) || (k < brightest[0]))
+                {
+                    brightest[1] = brightest[0];
+                    brightest[0] = k;
+                }
+                else if ((brightest[1] == -1) || (k < brightest[1]))
+                {
+                    brightest[1] = k;
+                }
+            }
+            kdtree_free_query(res);
+
+            if (brightest[1] == -1)
+                continue;
+
+            int stars[4] = { a, b, brightest[0], brightest[1] };
+            double code[4];
+            if (!computeCode(&xyz[3 * stars[0]], &xyz[3 * stars[1]], &xyz[3 * stars[2]],
+                             &xyz[3 * stars[3]], code))
+            {
+                continue;
+            }
+
+            // Same symmetry-breaking as the index files
+            if (code[0] + code[2] > 1.0)
+            {
+                std::swap(stars[0], stars[1]);
+                for (int j = 0; j < 4; ++j)
+                    code[j] = 1.0 - code[j];
+            }
+
+            if (code[0] > code[2])
+            {
+                std::swap(stars[2], stars[3]);
+                std::swap(code[0], code[2]);
+                std::swap(code[1], code[3]);
+            }
+
+            for (int j = 0; j < 4; ++j)
+            {
+                quads[nq * 4 + j] = stars[j];
+                codes[nq * 4 + j] = code[j];
+            }
+            ++nq;
+        }
+    }
+
+    kdtree_t* codetree;
+    if (treetype == KDTT_DSS)
+    {
+        double low[4] = { -0.5, -0.5, -0.5, -0.5 };
+        double high[4] = { 1.5, 1.5, 1.5, 1.5 };
+        codetree = kdtree_build_2(NULL, codes, nq, 4, 8, KDTT_DSS, KD_BUILD_BBOX, low, high);
+    }
+    else
+    {
+        codetree = kdtree_build(NULL, codes, nq, 4, 8, KDTT_DOUBLE, KD_BUILD_BBOX | KD_BUILD_SPLIT);
+    }
+
+    codetree_t* codekd = (codetree_t*) calloc(1, sizeof(codetree_t));
+    codekd->tree = codetree;
+
+    quadfile_t* quadfile = (quadfile_t*) calloc(1, sizeof(quadfile_t));
+    quadfile->numquads = nq;
+    quadfile->numstars = nstars;
+    quadfile->dimquads = 4;
+    quadfile->index_scale_lower = arcsec2rad(scaleLow);
+    quadfile->index_scale_upper = arcsec2rad(scaleHigh);
+    quadfile->indexid = id;
+    quadfile->quadarray = quads;
+
+    index_t* index = (index_t*) calloc(1, sizeof(index_t));
+    index->codekd = codekd;
+    index->quads = quadfile;
+    index->starkd = starkd;
+    index->indexname = strdup(("synthetic-" + std::to_string(id)).c_str());
+    index->indexid = id;
+    index->healpix = -1;
+    index->hpnside = 1;
+    index->index_jitter = 1.0;
+    index->cutnside = 64;
+    index->circle = TRUE;
+    index->cx_less_than_dx = TRUE;
+    index->meanx_less_than_half = TRUE;
+    index->index_scale_lower = scaleLow;
+    index->index_scale_upper = scaleHigh;
+    index->dimquads = 4;
+    index->nquads = nq;
+    index->nstars = nstars;
+
+    return index;
+}
+
+//-----------------------------------------------------------------------------
+
+inline void freeIndex(index_t* index)
+{
+    kdtree_free(index->codekd->tree);
+    free(index->codekd);
+    kdtree_free(index->starkd->tree);
+    free(index->starkd->sweep);
+    free(index->starkd);
+    free(index->quads->quadarray);
+    free(index->quads);
+    free(index->indexname);
+    free(index);
+}
+
+//-----------------------------------------------------------------------------
+
+// The indexes of the INDEX_SCALES ranges [0, nb) over the sky.
+inline std::vector<index_t*> buildIndexes(const std::vector<Star>& sky, int nb,
+                                          int treetype = KDTT_DOUBLE)
+{
+    std::vector<index_t*> indexes;
+    for (int i = 0; i < nb; ++i)
+    {
+        indexes.push_back(
+            buildIndex(sky, 6000, INDEX_SCALES[i], INDEX_SCALES[i + 1], 100 + i, 20000, treetype)
+        );
+    }
+    return indexes;
+}
+
+//-----------------------------------------------------------------------------
+
+// A field of "nstars" stars, brightest first, of an IMAGE_SIZE x IMAGE_SIZE
+// pixels image of the sky (at a random position and orientation, in "wcs"):
+// 85% of the stars of the sky there, with 0.3 pixel of noise, and 10% of
+// false stars.  If "solvable" is false, all the stars are false.
+inline starxy_t* makeField(const std::vector<Star>& sky, int nstars, unsigned int seed,
+                           tan_t* wcs, bool solvable = true)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 0.3);
+
+    memset(wcs, 0, sizeof(tan_t));
+    wcs->crval[0] = SKY_RA + uniform(rng) - 0.5;
+    wcs->crval[1] = SKY_DEC + uniform(rng) - 0.5;
+    wcs->crpix[0] = IMAGE_SIZE / 2;
+    wcs->crpix[1] = IMAGE_SIZE / 2;
+
+    double scale = PIXEL_SCALE / 3600.0;
+    double theta = uniform(rng) * 2.0 * M_PI;
+    wcs->cd[0][0] = -scale * cos(theta);
+    wcs->cd[0][1] = scale * sin(theta);
+    wcs->cd[1][0] = scale * sin(theta);
+    wcs->cd[1][1] = scale * cos(theta);
+    wcs->imagew = IMAGE_SIZE;
+    wcs->imageh = IMAGE_SIZE;
+
+    starxy_t* field = starxy_new(nstars, FALSE, FALSE);
+    int n = 0;
+
+    if (!solvable)
+    {
+        for (; n < nstars; ++n)
+        {
+            field->x[n] = uniform(rng) * IMAGE_SIZE;
+            field->y[n] = uniform(rng) * IMAGE_SIZE;
+        }
+    }
+
+    for (size_t i = 0; (i < sky.size()) && (n < nstars); ++i)
+    {
+        double x, y;
+        if (!tan_xyzarr2pixelxy(wcs, sky[i].xyz, &x, &y))
+            continue;
+
+        if ((x < 0) || (y < 0) || (x >= IMAGE_SIZE) || (y >= IMAGE_SIZE))
+            continue;
+
+        // Missing star
+        if (uniform(rng) < 0.15)
+            continue;
+
+        field->x[n] = x + noise(rng);
+        field->y[n] = y + noise(rng);
+        ++n;
+
+        // False star
+        if ((uniform(rng) < 0.1) && (n < nstars))
+        {
+            field->x[n] = uniform(rng) * IMAGE_SIZE;
+            field->y[n] = uniform(rng) * IMAGE_SIZE;
+            ++n;
+        }
+    }
+
+    field->N = n;
+    return field;
+}
+
+//-----------------------------------------------------------------------------
+
+inline anbool acceptMatch(MatchObj* mo, void* userdata)
+{
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+
+// A solver for the synthetic fields, with the parameters of the example.
+inline solver_t* newSolver(const std::vector<index_t*>& indexes)
+{
+    solver_t* solver = solver_new();
+
+    solver->field_maxx = IMAGE_SIZE;
+    solver->field_maxy = IMAGE_SIZE;
+    solver->funits_lower = 1.0;
+    solver->funits_upper = 20.0;
+    solver->logratio_toprint = log(1e6);
+    solver->logratio_tokeep = log(1e9);
+    solver->logratio_totune = log(1e6);
+    solver->record_match_callback = acceptMatch;
+    solver->do_tweak = TRUE;
+    solver->tweak_aborder = 2;
+    solver->tweak_abporder = 2;
+    solver->quadsize_min = 0.1 * IMAGE_SIZE;
+
+    for (index_t* index : indexes)
+        solver_add_index(solver, index);
+
+    return solver;
+}
@@ -0,0 +1,99 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+#ifndef AN_THREAD_H
+#define AN_THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Minimal, portable threading primitives (Linux, MacOSX and Windows),
+ implemented on top of the C++ standard library.
+ */
+
+struct an_mutex_t;
+typedef struct an_mutex_t an_mutex_t;
+
+an_mutex_t* an_mutex_new(void);
+void an_mutex_free(an_mutex_t* m);
+void an_mutex_lock(an_mutex_t* m);
+void an_mutex_unlock(an_mutex_t* m);
+
+/*
+ A condition variable, used with an an_mutex_t: an_cond_wait() must be
+ called with the mutex locked, and returns with it locked again.
+ */
+struct an_cond_t;
+typedef struct an_cond_t an_cond_t;
+
+an_cond_t* an_cond_new(void);
+void an_cond_free(an_cond_t* c);
+void an_cond_wait(an_cond_t* c, an_mutex_t* m);
+void an_cond_signal(an_cond_t* c);
+void an_cond_broadcast(an_cond_t* c);
+
+/*
+ A thread that runs "func(arg)"; an_thread_join() waits for it to
+ finish and frees it.
+ */
+struct an_thread_t;
+typedef struct an_thread_t an_thread_t;
+
+an_thread_t* an_thread_start(void (*func)(void* arg), void* arg);
+void an_thread_join(an_thread_t* t);
+
+/*
+ Returns the number of hardware threads available, or 1 if it can't
+ be determined.
+ */
+int an_thread_hardware_concurrency(void);
+
+/*
+ Relaxed atomic loads and stores of a flag (an anbool) or an int that
+ other threads may be reading or writing without holding a lock: they
+ only guarantee that the value isn't torn, not any ordering with the
+ other memory accesses.
+ */
+unsigned char an_atomic_load_flag(const unsigned char* flag);
+void an_atomic_store_flag(unsigned char* flag, unsigned char value);
+int an_atomic_load_int(const int* value);
+void an_atomic_store_int(int* dest, int value);
+
+/*
+ A pool of worker threads that executes batches of independent tasks.
+
+ an_pool_run() calls "func(arg, task, thread)" once for each "task" in
+ [0, ntasks), spread over the threads of the pool, and returns once all
+ of them are finished; it thus acts as a barrier.  The calling thread
+ takes part in the work, as thread number 0; "thread" is always in
+ [0, an_pool_nthreads()), and no two tasks run concurrently with the
+ same "thread" value, so it can be used to index per-thread scratch
+ space.
+
+ Each thread starts with its own contiguous block of tasks, which it
+ runs in increasing order; a thread that runs out of tasks steals the
+ second half of the remaining block of another thread.  Tasks may thus
+ complete in any order.
+ */
+struct an_pool_t;
+typedef struct an_pool_t an_pool_t;
+
+typedef void (*an_pool_func_t)(void* arg, int task, int thread);
+
+/*
+ Creates a pool of "nthreads" threads (including the calling one); if
+ "nthreads" <= 0, uses an_thread_hardware_concurrency().
+ */
+an_pool_t* an_pool_new(int nthreads);
+void an_pool_free(an_pool_t* pool);
+int an_pool_nthreads(const an_pool_t* pool);
+void an_pool_run(an_pool_t* pool, int ntasks, an_pool_func_t func, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -59,6 +59,10 @@ enum kd_build_options {
     KD_BUILD_LINEAR_LR     = 0x10,
     // DEBUG
     KD_BUILD_FORCE_SORT    = 0x20,
+    /* Build with as many threads as the hardware has (the tree is the
+     same as without).  Only for trees large enough to be worth it, and
+     not for int trees without KD_BUILD_SPLITDIM, which need sorting. */
+    KD_BUILD_PARALLEL      = 0x40,
     
 };
 
@@ -139,6 +143,9 @@ typedef struct kdtree kdtree_t;
 struct kdtree_qres;
 typedef struct kdtree_qres kdtree_qres_t;
 
+struct kdtree_query_ctx;
+typedef struct kdtree_query_ctx kdtree_query_ctx_t;
+
 struct kdtree_funcs {
     void* (*get_data)(const kdtree_t* kd, int i);
     void  (*copy_data_double)(const kdtree_t* kd, int start, int N, double* dest);
@@ -150,6 +157,16 @@ struct kdtree_funcs {
 
     void  (*nearest_neighbour_internal)(const kdtree_t* kd, const void* query, double* bestd2, int* pbest);
     kdtree_qres_t* (*rangesearch)(const kdtree_t* kd, kdtree_qres_t* res, const void* pt, double maxd2, int options);
+    kdtree_qres_t* (*rangesearch_batch)(const kdtree_t* kd, kdtree_qres_t* res, const void* pts, int N, double maxd2, int options, int* starts);
+    kdtree_qres_t* (*rangesearch_ctx)(const kdtree_t* kd, kdtree_query_ctx_t* ctx, const void* pt, double maxd2, int options);
+    kdtree_qres_t* (*rangesearch_batch_ctx)(const kdtree_t* kd, kdtree_query_ctx_t* ctx, const void* pts, int N, double maxd2, int options, int* starts);
+
+    // Scans the "n" points from "start" for those within squared
+    // distance "maxd2" of "query": puts their numbers and squared
+    // distances in "hits" and "d2s", in order, and returns how many
+    // there are.  The SIMD version for this type of tree (see
+    // kdtree_leaf.c), or NULL to use the generic loops.
+    int (*leaf_scan)(const kdtree_t* kd, int start, int n, const double* query, double maxd2, int* hits, double* d2s);
 
     void (*nodes_contained)(const kdtree_t* kd,
                             const void* querylow, const void* queryhi,
@@ -274,6 +291,34 @@ struct kdtree_qres {
     u32 *inds;    /* Indexes into original data set */
 };
 
+/*
+ The memory of range searches, kept from one search to the next so that
+ they don't allocate any once it has grown to the size they need: the
+ results, and the lists of batched searches.  (The query converted to
+ the tree type and the traversal stack are small enough to live on the
+ C stack.)
+
+ Searches only read the tree, so any number of threads can search the
+ same tree at once -- each with its own context.
+
+ Get one with kdtree_query_ctx_new() (or zero one), and free it with
+ kdtree_query_ctx_free().
+ */
+struct kdtree_query_ctx {
+    // The results of the last search.
+    kdtree_qres_t res;
+    // What the result arrays were last sized for: bytes per point, and
+    // the number of distances "res.sdists" has room for.
+    size_t pointsize;
+    int distcap;
+    // kdtree_rangesearch_batch_ctx(): the query number of each result,
+    // and the lists of queries going down the tree.
+    int* qids;
+    size_t qidcap;
+    int* lists;
+    size_t listcap;
+};
+
 // Returns the number of data points in this kdtree.
 int kdtree_n(const kdtree_t* kd);
 
@@ -348,6 +393,11 @@ void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm);
 /* Free results */
 void kdtree_free_query(kdtree_qres_t *res);
 
+kdtree_query_ctx_t* kdtree_query_ctx_new(void);
+
+// Frees the memory of the context, and the context.
+void kdtree_query_ctx_free(kdtree_query_ctx_t* ctx);
+
 /* Free a tree; does not free kd->data */
 void kdtree_free(kdtree_t *kd);
 
@@ -594,6 +644,40 @@ kdtree_qres_t* KDFUNC(kdtree_rangesearch_options)(const kdtree_t *kd, const void
  */
 kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)(const kdtree_t *kd, kdtree_qres_t* res, const void *pt, double maxd2, int options);
 
+/*
+ Range search for "N" query points at once, in a single traversal of
+ the tree: "pts" holds the N x D query points (N-major, of the same
+ type as for kdtree_rangesearch()).
+
+ The results for all the queries are stored in "res" (reused as in
+ kdtree_rangesearch_options_reuse(), or allocated if NULL), bucketed by
+ query: the results of query "i" are entries [starts[i], starts[i+1])
+ of the result arrays, so "starts" must have room for N+1 values.
+ Within a bucket, results are in the same order as from
+ kdtree_rangesearch_options() with KD_OPTIONS_SMALL_RADIUS (and without
+ KD_OPTIONS_SORT_DISTS).  (With splits on integer trees, the latter can
+ miss points for queries outside the bounding box of the tree, which
+ are found here.)
+
+ Of the "options", only KD_OPTIONS_COMPUTE_DISTS and
+ KD_OPTIONS_USE_SPLIT are honoured.
+
+ Returns NULL on error.
+ */
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_batch)(const kdtree_t *kd, kdtree_qres_t* res, const void *pts, int N, double maxd2, int options, int* starts);
+
+/*
+ Like kdtree_rangesearch_options_reuse() and kdtree_rangesearch_batch(),
+ but using (and growing) the memory of "ctx" instead of allocating any.
+ The results are in ctx->res, and stay there until the next search
+ with "ctx": don't free them.  KD_OPTIONS_NO_RESIZE_RESULTS is implied.
+
+ Returns NULL on error.
+ */
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_ctx)(const kdtree_t *kd, kdtree_query_ctx_t* ctx, const void *pt, double maxd2, int options);
+
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_batch_ctx)(const kdtree_t *kd, kdtree_query_ctx_t* ctx, const void *pts, int N, double maxd2, int options, int* starts);
+
 #if !defined(KD_DIM)
 #undef KD_DIM_GENERIC
 #endif
@@ -11,6 +11,10 @@
 #define GLUE3(base, x, y, z) base ## _ ## x ## y ## z
 #define KDMANGLE(func, e, d, t) GLUE3(func, e, d, t)
 
+// The versions of the queries compiled for "D" dimensions (KD_DIM).
+#define GLUE4(base, x, y, z, D) base ## _ ## x ## y ## z ## _ ## D
+#define KDMANGLE_DIM(func, e, d, t, D) GLUE4(func, e, d, t, D)
+
 #define KD_DECLARE(func, rtn, args) \
 rtn KDMANGLE(func, d, d, d)args; \
 rtn KDMANGLE(func, f, f, f)args; \
@@ -42,4 +46,14 @@ rtn KDMANGLE(func, d, s, s)args
 */
 int kdtree_compute_levels(int N, int Nleaf);
 
+typedef int (*kdtree_leaf_scan_t)(const kdtree_t* kd, int start, int n,
+                                  const double* query, double maxd2,
+                                  int* hits, double* d2s);
+
+/* The SIMD leaf scan (kdtree_funcs.leaf_scan) for trees of type
+   "treetype" in "D" dimensions, if there's one and the CPU can run it;
+   NULL otherwise.
+*/
+kdtree_leaf_scan_t kdtree_get_leaf_scan(int treetype, int D);
+
 #endif
@@ -46,6 +46,13 @@ double uniform_sample(double low, double high);
 
 double gaussian_sample(double mean, double stddev);
 
+/*
+ Sets logx[i] = log(x[i]) for i < N, with SIMD instructions if the CPU
+ has them (see log-batch.c).  Within 1 ulp of log(), but not always
+ equal to it.  "logx" may be "x".
+ */
+void log_batch(const double* x, int N, double* logx);
+
 // just drop partial blocks off the end.
 #define EDGE_TRUNCATE 0
 // just average the pixels in partial blocks.
@@ -149,6 +149,11 @@ anbool sip_xyzarr2pixelxy(const sip_t* sip, const double* xyz, double *px, doubl
 WarnUnusedResult
 anbool sip_xyz2pixelxy(const sip_t* sip, double x, double y, double z, double *px, double *py);
 
+// XYZ unit vectors to Pixels, for "N" points at once: see
+// tan_xyzarr2pixelxy_batch().
+int sip_xyzarr2pixelxy_batch(const sip_t* sip, const double* xyz, int N,
+                             double* px, double* py, anbool* inside);
+
 // Pixels to Intermediate World Coordinates in degrees.
 void sip_pixelxy2iwc(const sip_t* sip, double px, double py,
                      double *iwcx, double* iwcy);
@@ -197,6 +202,16 @@ anbool   tan_radec2pixelxy(const tan_t* wcs_tan, double ra, double dec, double *
 WarnUnusedResult
 anbool   tan_xyzarr2pixelxy(const tan_t* wcs_tan, const double* xyz, double *px, double *py);
 
+// xyz unit vectors to Pixels, for "N" points at once (with SIMD
+// instructions where the CPU has them): point i is xyz[3*i .. 3*i+2],
+// and its pixel coordinates go into px[i], py[i] (NaN if it's on the
+// opposite side of the sphere).  If "inside" is non-NULL, inside[i]
+// says whether the point is inside the image (see
+// tan_pixel_is_inside_image()).
+// Returns the number of points inside the image.
+int tan_xyzarr2pixelxy_batch(const tan_t* wcs_tan, const double* xyz, int N,
+                             double* px, double* py, anbool* inside);
+
 void tan_iwc2pixelxy(const tan_t* tan, double iwcx, double iwcy,
                      double *px, double* py);
 void tan_iwc2xyzarr(const tan_t* tan, double x, double y, double *xyz);
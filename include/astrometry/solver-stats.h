@@ -0,0 +1,193 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+#ifndef SOLVER_STATS_H
+#define SOLVER_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/index.h"
+
+/**
+ Where the time of the solver goes, and what it finds, broken down by
+ step and by index.
+
+ Attach one to a solver with solver_set_stats(); each solver_run() (or
+ solver_resume(), or their parallel versions) then adds to it, until
+ solver_stats_clear().  The timing reads the clocks around every step,
+ so it slows the solver down a little: leave it off when not needed.
+ */
+
+/**
+ The timed steps.  They nest: "resolve" includes "fit_tan", "verify" and
+ "tweak" (for the matches found during the search).
+ */
+enum {
+    // the whole search (CPU time of the process: all the threads).
+    SOLVER_TIMER_RUN,
+    // setting up the field quads: AB pairs and the stars in their box.
+    SOLVER_TIMER_SETUP,
+    // looking up the codes in the code trees.
+    SOLVER_TIMER_CODE_SEARCH,
+    // looking at the code matches: resolve_matches().
+    SOLVER_TIMER_RESOLVE,
+    // fitting a TAN WCS to the matched quads: fit_tan_wcs().
+    SOLVER_TIMER_FIT_TAN,
+    // verifying the matches: verify_hit().
+    SOLVER_TIMER_VERIFY,
+    // tuning up and tweaking the matches: solver_tweak2().
+    SOLVER_TIMER_TWEAK,
+    SOLVER_NTIMERS
+};
+
+// The timers that are also kept for each index.
+#define SOLVER_FIRST_INDEX_TIMER SOLVER_TIMER_CODE_SEARCH
+
+// Histogram of the number of matches per code looked up: bin 0 counts
+// the codes with no match, bin i > 0 those with [2^(i-1), 2^i) matches;
+// the last bin also counts all the larger numbers.
+#define SOLVER_STATS_HIT_BINS 16
+
+// Histogram of the log-odds of the verified matches: bin i counts
+// those in [LOW + i * STEP, LOW + (i+1) * STEP); the first and last bins
+// also count everything below and above.
+#define SOLVER_STATS_LOGODDS_BINS 50
+#define SOLVER_STATS_LOGODDS_LOW -250.0
+#define SOLVER_STATS_LOGODDS_STEP 25.0
+
+struct solver_timer {
+    // number of times the step ran.
+    int64_t count;
+    // wall-clock and CPU (of the thread that did it) time, in ns.
+    int64_t wall_ns;
+    int64_t cpu_ns;
+};
+typedef struct solver_timer solver_timer_t;
+
+struct solver_index_stats {
+    // Which index (the pointer is only used to tell them apart).
+    const index_t* index;
+    char* indexname;
+    int indexid;
+    int healpix;
+
+    // number of codes looked up, and matches found, in its code tree.
+    int64_t ncodes;
+    int64_t nhits;
+    // number of matches verified, and of those that were kept (log-odds
+    // above "logratio_tokeep").
+    int64_t nverified;
+    int64_t nkept;
+
+    // the timers from SOLVER_FIRST_INDEX_TIMER on.
+    solver_timer_t timers[SOLVER_NTIMERS];
+};
+typedef struct solver_index_stats solver_index_stats_t;
+
+struct solver_stats {
+    // number of runs, how many of them found a solution, and how many
+    // ran out of time.
+    int nruns;
+    int nsolved;
+    int ntimedout;
+
+    // what the solver_t counters (see solver.h) went up by during the
+    // runs.
+    int64_t numtries;
+    int64_t nummatches;
+    int64_t numscaleok;
+    int64_t num_cxdx_skipped;
+    int64_t num_meanx_skipped;
+    int64_t num_radec_skipped;
+    int64_t num_abscale_skipped;
+    int64_t num_verified;
+    int64_t num_hypothesis_hits;
+    int64_t num_ref_cache_hits;
+    int64_t num_ref_cache_misses;
+    int64_t num_precheck_rejected;
+
+    solver_timer_t timers[SOLVER_NTIMERS];
+
+    int64_t hits_hist[SOLVER_STATS_HIT_BINS];
+    int64_t logodds_hist[SOLVER_STATS_LOGODDS_BINS];
+
+    // the indexes, in the order they were first searched.
+    solver_index_stats_t* indexes;
+    int nindexes;
+    int indexcap;
+};
+typedef struct solver_stats solver_stats_t;
+
+// The clocks at the start of a timed step.
+struct solver_clock {
+    int64_t wall_ns;
+    int64_t cpu_ns;
+};
+typedef struct solver_clock solver_clock_t;
+
+solver_stats_t* solver_stats_new(void);
+
+void solver_stats_free(solver_stats_t* stats);
+
+/**
+ Sets everything back to zero, and forgets the indexes.
+ */
+void solver_stats_clear(solver_stats_t* stats);
+
+/**
+ Adds the stats in "src" to those in "dest".  Returns 0 on success.
+ */
+int solver_stats_add(solver_stats_t* dest, const solver_stats_t* src);
+
+/**
+ Returns the stats of the given index, adding them if they aren't
+ there yet; NULL on error.
+ */
+solver_index_stats_t* solver_stats_get_index(solver_stats_t* stats,
+                                             const index_t* index);
+
+/**
+ Returns the name of the given timer ("run", "setup", "code_search",
+ ...), or NULL if there is no such timer.
+ */
+const char* solver_stats_timer_name(int timer);
+
+/**
+ Writes the stats as a JSON object.  Returns 0 on success.
+ */
+int solver_stats_write_json(const solver_stats_t* stats, FILE* fid);
+
+/**
+ For the solver: reads the clocks at the start of a step.
+ */
+void solver_clock_start(solver_clock_t* clock);
+
+/**
+ For the solver: adds the time since solver_clock_start() to the given
+ timer (and to "timer2", if non-NULL).
+ */
+void solver_timer_add_since(solver_timer_t* timer, solver_timer_t* timer2,
+                            const solver_clock_t* clock);
+
+/**
+ For the solver: counts "nhits" matches for one code.
+ */
+static inline void solver_stats_add_hits(solver_stats_t* stats, int nhits) {
+    int bin = 0;
+    while (nhits && (bin < SOLVER_STATS_HIT_BINS - 1)) {
+        nhits >>= 1;
+        bin++;
+    }
+    stats->hits_hist[bin]++;
+}
+
+/**
+ For the solver: counts a verified match.
+ */
+void solver_stats_add_logodds(solver_stats_t* stats, double logodds);
+
+#endif
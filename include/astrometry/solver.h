@@ -7,6 +7,7 @@
 #define SOLVER_H
 
 #include <time.h>
+#include <stdint.h>
 
 #include "astrometry/starutil.h"
 #include "astrometry/starxy.h"
@@ -20,6 +21,7 @@
 #include "astrometry/verify.h"
 #include "astrometry/sip.h"
 #include "astrometry/an-bool.h"
+#include "astrometry/an-thread.h"
 
 enum {
     PARITY_NORMAL,
@@ -27,6 +29,19 @@ enum {
     PARITY_BOTH
 };
 
+/**
+ The stages of a search that are timed, see solver_set_stage_budget_ns().
+ */
+enum {
+    // building field quads and looking them up in the code trees.
+    SOLVER_STAGE_SEARCH,
+    // verifying the matches.
+    SOLVER_STAGE_VERIFY,
+    // tuning up and tweaking the matches.
+    SOLVER_STAGE_TWEAK,
+    SOLVER_NSTAGES
+};
+
 #define DEFAULT_CODE_TOL .01
 #define DEFAULT_PARITY PARITY_BOTH
 #define DEFAULT_TWEAK_ABORDER 3
@@ -34,8 +49,14 @@ enum {
 #define DEFAULT_DISTRACTOR_RATIO 0.25
 #define DEFAULT_VERIFY_PIX 1.0
 #define DEFAULT_BAIL_THRESHOLD 1e-100
+#define DEFAULT_VOTE_TOL 20.0
+#define DEFAULT_PRECHECK_NFIELD 20
+#define DEFAULT_PRECHECK_LOGODDS 0.0
+#define DEFAULT_VERIFY_QUEUE_SIZE 256
 
 struct verify_field_t;
+struct solver_stats;
+struct solver_index_stats;
 struct solver_t {
 
     // FIELDS REQUIRED FROM THE CALLER BEFORE CALLING SOLVER_RUN
@@ -123,6 +144,52 @@ struct solver_t {
     // maximum Bayes factor value).
     double logratio_stoplooking;
 
+    // Matches whose WCSes agree to within about this many pixels (at
+    // the edge of the field) with one already verified are not verified
+    // again (see solver/hypothesis-cache.h); 0 to verify them all.  (Not
+    // those whose verification or tune-up was cut short by the deadline
+    // or the stage budgets.)  About 1 pixel saves most of the repeated
+    // verifications of a blind solve, but the log-odds of a match depend
+    // on its own quad too (its stars aren't counted, and the positional
+    // variance grows with the distance from it), so a match skipped this
+    // way could have been accepted where the one verified wasn't: the
+    // solutions can differ from those found without it.  Default: 0.
+    double hypothesis_tol;
+
+    // Hough-style voting (see solver/vote-grid.h): if "vote_min" is
+    // non-zero, the matches aren't verified right away but vote for
+    // their WCS, quantized into cells of about "vote_tol" pixels at the
+    // edge of the field.  After each field object, the cells that have
+    // reached "vote_min" votes are verified, those with the most votes
+    // first, and at most "vote_max_cells" of them if non-zero (the
+    // others wait for the next field object).  Default: no voting;
+    // "vote_tol" DEFAULT_VOTE_TOL.
+    int vote_min;
+    double vote_tol;
+    int vote_max_cells;
+
+    // A cheap look at each match before its verification (see
+    // verify_precheck()): if "precheck_nref" is non-zero, its
+    // "precheck_nref" brightest reference stars are looked for among
+    // the "precheck_nfield" brightest field objects, and it isn't
+    // verified if that gives log-odds below "logratio_precheck".
+    // Default: no pre-check; "precheck_nfield" DEFAULT_PRECHECK_NFIELD,
+    // "logratio_precheck" DEFAULT_PRECHECK_LOGODDS.
+    int precheck_nref;
+    int precheck_nfield;
+    double logratio_precheck;
+
+    // With solver_run_parallel() (even with one search thread): if
+    // "verify_threads" is non-zero, the search threads don't verify the
+    // matches they find but queue them (see solver/match-queue.h), at
+    // most "verify_queue_size" at a time, for that many separate
+    // threads, which verify them (smallest code error first) while the
+    // search goes on.  Which match solves the field then depends on the
+    // timing of the threads.  Default: 0; "verify_queue_size"
+    // DEFAULT_VERIFY_QUEUE_SIZE.
+    int verify_threads;
+    int verify_queue_size;
+
     // Number of field quads to try or zero for no limit.
     int maxquads;
     // Number of quad matches to try or zero for no limit.
@@ -141,6 +208,14 @@ struct solver_t {
     // calling again.  The parameter is "userdata".
     time_t (*timer_callback)(void*);
 
+    // Time limits, in nanoseconds; see solver_set_deadline_ns() and
+    // solver_set_stage_budget_ns().  Zero for none.
+    int64_t deadline_ns;
+    int64_t stage_budget_ns[SOLVER_NSTAGES];
+
+    // Where the time goes, if non-NULL; see solver_set_stats().
+    struct solver_stats* stats;
+
     // FIELDS THAT AFFECT THE RUNNING SOLVER ON CALLBACK
     // =================================================
 
@@ -166,11 +241,30 @@ struct solver_t {
     int num_abscale_skipped;
     // The number of times we ran verification on a quad.
     int num_verified;
+    // The number of matches not verified because one with the same WCS
+    // had been (see "hypothesis_tol").
+    int num_hypothesis_hits;
+    // The number of times verification found the reference stars in its
+    // cache, and had to look them up in the star tree.
+    int num_ref_cache_hits;
+    int num_ref_cache_misses;
+    // The number of matches not verified because of the pre-check (see
+    // "precheck_nref").
+    int num_precheck_rejected;
+    // Time spent in each stage (added up over the threads), in nanoseconds.
+    int64_t stage_ns[SOLVER_NSTAGES];
+    // Did the search stop because it ran out of time?
+    anbool timed_out;
 
     // INTERNAL PARAMETERS; DO NOT MODIFY
     // ==================================
     // The index we're currently dealing with.
     index_t* index;
+    // Its entry in "stats" (if any).
+    struct solver_index_stats* index_stats;
+    // With an RA,Dec region: where the quads of the current index are
+    // on the sky (see solver/index-region.h), or NULL.
+    struct index_region* index_region;
 
     // The extreme limits of quad size, for all indexes, in pixels^2.
     double minminAB2;
@@ -200,6 +294,14 @@ struct solver_t {
     double starttime;
     double timeused;
 
+    // The stage being timed and since when (0 if not timing), and when
+    // to stop (the deadline, or the end of the budget of the stage).
+    int stage;
+    int64_t stage_start_ns;
+    int64_t stop_ns;
+    // Number of checks until we look at the clock again.
+    int clock_countdown;
+
     // Best match so far
     double   best_logodds;
     MatchObj best_match;
@@ -209,6 +311,25 @@ struct solver_t {
 
     // Cached data about this field, for verify_hit().
     verify_field_t* vf;
+    // Scratch space for verify_hit(), reused from match to match.
+    verify_scratch_t* vscratch;
+
+    // Scratch space for the code-tree searches, reused from quad to quad.
+    kdtree_query_ctx_t* codectx;
+    // Codes waiting to be searched for in the code tree (see solver.c).
+    struct solver_code_batch* codebatch;
+    // Memory kept from one solver_run() to the next (see solver.c).
+    struct solver_scratch* scratch;
+
+    // During solver_run_parallel(): the solver this is a worker copy of
+    // (NULL otherwise).  Matches are recorded into the parent.
+    struct solver_t* parent;
+    // During solver_run_parallel(): serializes the recording of matches
+    // (and the calls to "record_match_callback").
+    an_mutex_t* mutex;
+    // During solver_run_parallel(): the number of the task this worker
+    // copy is running (see solver.c), or -1.
+    int task;
 };
 typedef struct solver_t solver_t;
 
@@ -338,6 +459,19 @@ void solver_set_field(solver_t* s, starxy_t* field);
 
 starxy_t* solver_get_field(solver_t* solver);
 
+/**
+ Adds stars at the end of the field to solve (creating it if there is
+ none), for instance as they come out of source extraction.  They must
+ be fainter than those already in the field (the search goes through
+ the field in order).  The stars are copied.
+
+ After a solver_run() that didn't solve, call solver_resume() to search
+ the quads that include the new stars.
+
+ Returns 0 on success.
+ */
+int solver_append_stars(solver_t* s, const starxy_t* stars);
+
 void solver_reset_field_size(solver_t* s);
 
 /**
@@ -345,6 +479,12 @@ void solver_reset_field_size(solver_t* s);
  degrees) of the given "ra","dec" point (also in degrees).
 
  This is, each star comprising the quad must be within that circle.
+
+ The indexes that don't cover the circle (see index_is_within_range())
+ are not searched at all, and the quads of the others are filed by
+ position on the sky the first time they are searched with a circle,
+ so that most out-of-bounds matches are rejected without looking up
+ their stars.
  */
 void solver_set_radec(solver_t* s, double ra, double dec, double radius_deg);
 
@@ -364,6 +504,25 @@ void solver_set_field_bounds(solver_t* s, double xlo, double xhi, double ylo, do
  */
 void solver_cleanup_field(solver_t*);
 
+/**
+ Gets the solver ready to solve another field: same as
+ solver_cleanup_field() followed by solver_set_field(), except that
+ the best match of the previous field is freed.
+
+ The indexes and the parameters are kept, and so is the memory the
+ solver set up for the previous field (potential quads, quad size
+ ranges of the indexes, verification data, threads of
+ solver_run_parallel()...), which is recycled as long as it's large
+ enough; solving a sequence of fields with the same solver thus
+ allocates very little per field.  This memory is released by
+ solver_cleanup() / solver_free().
+
+ The field bounds are kept too: call solver_reset_field_size() if they
+ were computed from the previous field rather than set with
+ solver_set_field_bounds().
+ */
+void solver_reset(solver_t* s, starxy_t* field);
+
 /**
  get field w,h
  */
@@ -381,6 +540,70 @@ void solver_verify_sip_wcs(solver_t* solver, sip_t* sip); //, MatchObj* mo);
 
 void solver_run(solver_t* solver);
 
+/**
+ Same as solver_run(), but spreads the work over "nthreads" threads
+ (if <= 0, the number of hardware threads).
+
+ Each newly-examined field object ("newpoint") is processed in
+ parallel: each pair of stars A,B that can form quads with it is a
+ task, and tasks are spread over the threads by a work-stealing
+ scheduler, so that even a search in a single index uses all the
+ threads.  All the threads are done with a field object before the
+ next one is considered, so the brightness ordering of the search is
+ preserved.  The field and the potential quads are shared (read-only)
+ between the threads; each thread has its own scratch space and
+ counters, the latter being added to this solver's after each field
+ object.
+
+ The matches that the threads accept (those with log-odds above
+ "logratio_tokeep") are handed to "record_match_callback" once all the
+ threads are done with the field object, from the calling thread, in
+ the order of the tasks; with a single index, that is the order of
+ solver_run().  The first one accepted by the callback stops the
+ search, and ends up in "best_match": the same match as with
+ solver_run() if a single index can solve the field (unless
+ "hypothesis_tol" lets a thread skip a match verified by another one
+ first).  The tasks after the first one that has an accepted match
+ aren't started, or are stopped if there is no callback; those that
+ weren't run are run after all if the callback rejects the match.
+ "timer_callback" is only called from the calling thread too.  (With
+ "verify_threads", the matches are recorded by the verification
+ threads as soon as they are verified: see there.)
+
+ The indexes must not be shared with other threads while this runs.
+ */
+void solver_run_parallel(solver_t* solver, int nthreads);
+
+/**
+ Continues the search of the field where the previous solver_run() (or
+ solver_resume()) left it: at "last_examined_object" if that one
+ wasn't searched completely, after it otherwise.  The potential quads
+ of the field objects already searched are kept, so with stars added
+ by solver_append_stars(), only the quads that include new stars are
+ tried.  The counters keep counting.
+
+ The indexes and the parameters must not change in between (if the
+ quad size ranges did, the search starts over), and "quit_now" must be
+ cleared if the previous run was stopped with it.  Without a previous
+ search of this field (since solver_set_field()), this is the same as
+ solver_run().
+
+ So, to start solving before all the stars of an image are known:
+
+     solver_append_stars(solver, first_stars);
+     solver_run(solver);
+     while (!solver_did_solve(solver) && more stars) {
+         solver_append_stars(solver, more_stars);
+         solver_resume(solver);
+     }
+ */
+void solver_resume(solver_t* solver);
+
+/**
+ Same as solver_resume(), with the search of solver_run_parallel().
+ */
+void solver_resume_parallel(solver_t* solver, int nthreads);
+
 #define SOLVER_TWEAK2_AVAILABLE 1
 void solver_tweak2(solver_t* solver, MatchObj* mo, int order, sip_t* verifysip);
 
@@ -402,6 +625,49 @@ void solver_compute_quad_range(const solver_t* solver, const index_t* index, dou
  */
 void solver_reset_counters(solver_t* t);
 
+/**
+ Makes solver_run() (and the others) stop once the monotonic clock of
+ timenow_ns() (see tic.h) reaches "deadline_ns"; 0 to remove the
+ deadline.  For example, to give up after 50 ms:
+
+     solver_set_deadline_ns(solver, timenow_ns() + 50000000);
+
+ The clock is looked at every few quads tried, before each
+ verification and every few stars during verification, so the search
+ stops within a fraction of a millisecond of the deadline.  A
+ verification cut short is treated as if its log-odds had dropped
+ below the bail-out level.  "timed_out" is then set, as is "quit_now".
+ The best match found before the deadline stays in "best_match".
+ */
+void solver_set_deadline_ns(solver_t* solver, int64_t deadline_ns);
+
+/**
+ Limits the time spent in one stage of the search (SOLVER_STAGE_*) to
+ "budget_ns" nanoseconds; 0 for no limit.  The budgets apply to the
+ times in "stage_ns", which add up from one run to the next until
+ solver_reset_counters() (so they cover a field solved with
+ solver_resume(), too).
+
+ Once the budget of the search or of the verification is spent, the
+ search stops as with solver_set_deadline_ns() (except that a
+ verification under way is finished).  Once the budget of tweaking is
+ spent, the matches found are kept without being tuned up or tweaked.
+
+ With solver_run_parallel(), the times of all the threads add up: what
+ is left of a budget is shared between the threads at each field
+ object.
+ */
+void solver_set_stage_budget_ns(solver_t* solver, int stage, int64_t budget_ns);
+
+/**
+ Sets the stats object (see solver-stats.h) that the following runs add
+ their timings and counts to; NULL (the default) to stop.  The caller
+ keeps ownership of it.
+ */
+void solver_set_stats(solver_t* s, struct solver_stats* stats);
+
+struct solver_stats* solver_get_stats(const solver_t* s);
+
 /**
  Clears the "best_match_solves", "have_best_match", etc fields.
  */
@@ -0,0 +1,87 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef HYPOTHESIS_CACHE_H
+#define HYPOTHESIS_CACHE_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/matchobj.h"
+
+/**
+ The outcomes of the verifications of a field: the same pointing is
+ usually proposed by many quads, and once one of them has been
+ verified, the others needn't be.
+
+ A match is filed under its "hypothesis": its WCS (center, scale,
+ rotation and parity), quantized into cells of about "tol" pixels at
+ the edge of the field.  A match that falls into the same cell as one
+ already verified doesn't need to be verified if that one was verified
+ with the same index, or was accepted (the reference stars of another
+ index could give another result, but an accepted solution is one).
+ Matches a bit less than "tol" apart can fall into neighbouring
+ cells: then they're both verified.
+ */
+#define HYPOTHESIS_KEY_SIZE 6
+
+struct hypothesis {
+    int32_t key[HYPOTHESIS_KEY_SIZE];
+    int indexid;
+    int healpix;
+    double logodds;
+};
+typedef struct hypothesis hypothesis_t;
+
+struct hypothesis_cache {
+    // open-addressing hash table of "cap" (a power of two) entries, of
+    // which "n" are used (those with "used" set).
+    hypothesis_t* entries;
+    uint8_t* used;
+    int n;
+    int cap;
+};
+typedef struct hypothesis_cache hypothesis_cache_t;
+
+/**
+ Computes the key of the hypothesis of the given match (which must
+ have its "center", "scale", "wcstan" and "parity" set), for a field of
+ radius "field_radius" pixels.
+ */
+void hypothesis_key(int32_t* key, const MatchObj* mo, double tol,
+                    double field_radius);
+
+/**
+ Hashes a key.
+ */
+uint32_t hypothesis_key_hash(const int32_t* key);
+
+/**
+ Returns the verified hypothesis with this key that makes verifying a
+ match of the given index useless (see above), or NULL if there is
+ none.
+ */
+const hypothesis_t* hypothesis_cache_find(const hypothesis_cache_t* cache,
+                                          const int32_t* key,
+                                          int indexid, int healpix,
+                                          double logodds_accept);
+
+/**
+ Remembers the outcome of a verification.  Returns 0 on success.
+ */
+int hypothesis_cache_add(hypothesis_cache_t* cache, const int32_t* key,
+                         int indexid, int healpix, double logodds);
+
+/**
+ Forgets all the hypotheses (keeping the memory).
+ */
+void hypothesis_cache_clear(hypothesis_cache_t* cache);
+
+/**
+ Frees the memory of the cache (but not the struct).
+ */
+void hypothesis_cache_free(hypothesis_cache_t* cache);
+
+#endif
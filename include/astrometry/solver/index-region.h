@@ -0,0 +1,64 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef INDEX_REGION_H
+#define INDEX_REGION_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/index.h"
+
+/**
+ Where the quads of an index are on the sky, coarsely: used to reject,
+ without looking at their stars, the quads that can't be within the
+ RA,Dec region given to solver_set_radec().
+
+ Each quad is filed under the healpix containing the midpoint of its
+ stars A and B.  If all the stars of a quad are within a circle (of
+ radius < 90 degrees), so is that midpoint, so a quad whose healpix
+ doesn't touch the circle can't be in it.  (The converse isn't true:
+ the quads that pass still have to be checked star by star.)
+ */
+struct index_region {
+    const index_t* index;
+    int nside;
+    // healpix of each quad.
+    int* quadhp;
+    // 12 * nside^2 entries: 1 for the healpixes that touch the circle
+    // set by index_region_set_circle().
+    uint8_t* inrange;
+    // The circle "inrange" was computed for.
+    double centerxyz[3];
+    double r2;
+};
+typedef struct index_region index_region_t;
+
+/**
+ Files the quads of the given index (which must be loaded) into
+ healpixes of a size suited to the size of its quads.  This looks at
+ stars A and B of every quad.  Returns NULL on error.
+ */
+index_region_t* index_region_new(index_t* index);
+
+void index_region_free(index_region_t* region);
+
+/**
+ Sets the circle (center as a unit vector, and squared chord radius,
+ as in solver_t "centerxyz" and "r2") that index_region_may_contain()
+ tests against.  Does nothing if it's the same as the current one.
+ */
+void index_region_set_circle(index_region_t* region, const double* centerxyz,
+                             double r2);
+
+/**
+ Returns FALSE if quad "quadno" can't be entirely within the circle.
+ */
+static inline anbool index_region_may_contain(const index_region_t* region,
+                                              int quadno) {
+	return region->inrange[region->quadhp[quadno]] == 1;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef MATCH_QUEUE_H
+#define MATCH_QUEUE_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/an-thread.h"
+#include "astrometry/index.h"
+#include "astrometry/matchobj.h"
+
+/**
+ The matches waiting for verification, when the search threads hand
+ them over to separate verification threads (see "verify_threads" in
+ solver.h).  It's a bounded priority queue: the match with the smallest
+ code error comes out first (the first one pushed, on a tie), and a
+ search thread that finds the queue full waits for room.
+
+ It's guarded by a mutex: matches are rare compared to the quads tried,
+ so it's hardly ever contended.
+ */
+struct match_queue_entry {
+    MatchObj mo;
+    index_t* index;
+    // the field object whose search found it.
+    int fieldobj;
+    int64_t seq;
+};
+typedef struct match_queue_entry match_queue_entry_t;
+
+struct match_queue {
+    an_mutex_t* mutex;
+    // signalled when a match is pushed, or the queue is closed...
+    an_cond_t* notempty;
+    // ...and when one is popped, or the queue is cancelled.
+    an_cond_t* notfull;
+
+    // "cap" slots; "heap" is a binary heap of the numbers of the "n"
+    // used ones, and "freeslots" lists the others.
+    match_queue_entry_t* slots;
+    int* heap;
+    int* freeslots;
+    int n;
+    int cap;
+    int64_t npushed;
+
+    // No more pushes: match_queue_pop() returns what's left, then FALSE.
+    anbool closed;
+    // Everything dropped: pushes and pops fail right away.
+    anbool cancelled;
+    // The smallest "fieldobj" of the matches that were not verified
+    // because of the cancellation; INT_MAX if none.
+    int firstdropped;
+
+    // How many pushes had to wait for room, and the most matches
+    // queued at once.
+    int nwaits;
+    int maxn;
+};
+typedef struct match_queue match_queue_t;
+
+/**
+ Sets up an empty queue for at most "cap" matches (keeping the memory
+ if it's big enough).  Returns 0 on success.
+ */
+int match_queue_init(match_queue_t* q, int cap);
+
+/**
+ Adds a match of the given index, found while searching field object
+ "fieldobj"; waits while the queue is full.  Returns FALSE (and drops
+ the match) if the queue has been cancelled or closed.
+ */
+anbool match_queue_push(match_queue_t* q, const MatchObj* mo, index_t* index,
+                        int fieldobj);
+
+/**
+ Takes the match with the smallest code error; waits while the queue is
+ empty and still open.  Returns FALSE once it's closed and empty, or
+ cancelled.
+ */
+anbool match_queue_pop(match_queue_t* q, MatchObj* mo, index_t** index,
+                       int* fieldobj);
+
+/**
+ No more matches will be pushed: wakes up the threads waiting to pop.
+ */
+void match_queue_close(match_queue_t* q);
+
+/**
+ Drops all the queued matches and wakes up everyone, because the search
+ is over.  "fieldobj" is that of a match that the caller didn't finish
+ verifying (-1 if none): it counts in "firstdropped", like those of the
+ dropped matches.
+ */
+void match_queue_cancel(match_queue_t* q, int fieldobj);
+
+/**
+ Frees the memory of the queue (but not the struct).
+ */
+void match_queue_free(match_queue_t* q);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef POINT_GRID_H
+#define POINT_GRID_H
+
+/**
+ A uniform grid over a set of 2-D points, for nearest-neighbour and
+ range searches.  For the small sets of points of verification (the
+ reference stars in the image, in pixels), it is much cheaper to build
+ than a kd-tree: one counting sort.
+
+ The cells are sized so that there are about two points per cell, over
+ the bounding box of the points.  A query looks at all the cells that
+ overlap the search disc.
+
+ The memory is kept from one point_grid_build() to the next.
+ */
+struct point_grid {
+    int npoints;
+    // bounding box of the points, and number and inverse size of the
+    // cells along x and y.
+    double xlo, ylo;
+    int nx, ny;
+    double invcellw, invcellh;
+
+    // the points of cell c are xy[2*k], for k in
+    // [cellstart[c], cellstart[c+1]); "index" gives their number in
+    // the input.
+    int* cellstart;
+    double* xy;
+    int* index;
+    int cellcap;
+    int pointcap;
+};
+typedef struct point_grid point_grid_t;
+
+/**
+ Builds the grid over "N" points: point i is (xy[2*j], xy[2*j+1]),
+ where j = perm[i], or j = i if "perm" is NULL.  Returns 0 on success.
+ */
+int point_grid_build(point_grid_t* grid, const double* xy, const int* perm,
+                     int N);
+
+/**
+ Returns the number (i, above) of the point nearest to "pt", if it's
+ within squared distance "maxd2", and puts that squared distance in
+ "p_d2"; returns -1 if there's none.
+ */
+int point_grid_nearest_within(const point_grid_t* grid, const double* pt,
+                              double maxd2, double* p_d2);
+
+/**
+ Puts the numbers (i, above) of all the points within squared distance
+ "maxd2" of "pt" in "inds", which must have room for all the points, in
+ no particular order; returns how many there are.
+ */
+int point_grid_within(const point_grid_t* grid, const double* pt,
+                      double maxd2, int* inds);
+
+/**
+ Frees the memory of the grid (but not the struct).
+ */
+void point_grid_free(point_grid_t* grid);
+
+#endif
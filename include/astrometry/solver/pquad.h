@@ -6,23 +6,123 @@
 #ifndef PQUAD_H
 #define PQUAD_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include "astrometry/an-bool.h"
+
 /**
- This file is just required for testing purposes (of solver.c)
+ A "potential quad": what we know about the quads that can be built
+ with field stars A and B as the backbone.
  */
-
 struct potential_quad
 {
 	anbool scale_ok;
 	int fieldA, fieldB;
 	// distance-squared between A and B, in pixels^2.
 	double scale;
+	// which indexes can hold quads of this scale (an interval of quad
+	// sizes, see solver.c).
+	int interval;
 	double costheta, sintheta;
 	// (field pixel noise / quad scale in pixels)^2
 	double rel_field_noise2;
-	anbool* inbox;
+	// Bitset: which field stars (in [0, ninbox)) are eligible to be star
+	// C or D of a quad with this AB backbone.  Points into the store.
+	uint64_t* inbox;
 	int ninbox;
-	double* xy;
 };
 typedef struct potential_quad pquad;
 
+/**
+ Storage for the potential quads of all the AB pairs (A < B) of a
+ field of "numxy" stars.
+
+ Only the upper triangle of the AB matrix is kept, and everything
+ (including the "inbox" bitsets) is allocated once, up front, so no
+ allocation happens during the search.  The memory is kept from one
+ field to the next, and only grows.
+ */
+struct pquad_store
+{
+	int numxy;
+	// numxy*(numxy-1)/2 structs, indexed by pquad_index()
+	pquad* pquads;
+	// one bitset of "inbox_words" words per pquad
+	uint64_t* inbox;
+	int inbox_words;
+	// allocated sizes of "pquads" and "inbox", in elements.
+	size_t pquads_cap;
+	size_t inbox_cap;
+};
+typedef struct pquad_store pquad_store_t;
+
+/**
+ Sets up the store for a field of "numxy" stars.  Reuses the memory of
+ a previous call if it's large enough.  The pquads are not initialized:
+ each one must go through pquad_store_init_pair() before it's used.
+ Returns 0 on success.
+ */
+int pquad_store_init(pquad_store_t* store, int numxy);
+
+/**
+ Makes room in the store for a field that grew to "numxy" stars (more
+ than the store was set up for), keeping the pquads of the pairs of the
+ previous stars (the "inbox" pointers of those are updated; the rest
+ are not initialized).  Returns 0 on success.
+ */
+int pquad_store_grow(pquad_store_t* store, int numxy);
+
+void pquad_store_free(pquad_store_t* store);
+
+static inline size_t pquad_index(int fieldA, int fieldB) {
+	return (size_t)fieldB * (size_t)(fieldB - 1) / 2 + (size_t)fieldA;
+}
+
+/**
+ Returns the pquad for the pair of field stars A < B.
+ */
+static inline pquad* pquad_store_get(const pquad_store_t* store, int fieldA, int fieldB) {
+	return store->pquads + pquad_index(fieldA, fieldB);
+}
+
+/**
+ Returns the pquad for the pair of field stars A < B, with its stars
+ and its "inbox" bitset set up; the rest is up to the caller.
+ */
+static inline pquad* pquad_store_init_pair(const pquad_store_t* store, int fieldA, int fieldB) {
+	size_t i = pquad_index(fieldA, fieldB);
+	pquad* pq = store->pquads + i;
+	pq->fieldA = fieldA;
+	pq->fieldB = fieldB;
+	pq->inbox = store->inbox + i * store->inbox_words;
+	pq->ninbox = 0;
+	return pq;
+}
+
+static inline anbool pquad_inbox_get(const pquad* pq, int i) {
+	return (pq->inbox[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void pquad_inbox_set(pquad* pq, int i) {
+	pq->inbox[i >> 6] |= ((uint64_t)1 << (i & 63));
+}
+
+static inline void pquad_inbox_clear(pquad* pq, int i) {
+	pq->inbox[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+/**
+ Marks stars [0, n) as in the box, and sets "ninbox" to "n".  (The bits
+ above "n" are left undefined; pquad_inbox_set() them before use.)
+ */
+static inline void pquad_inbox_fill(pquad* pq, int n) {
+	int i;
+	for (i = 0; i < (n >> 6); i++)
+		pq->inbox[i] = ~(uint64_t)0;
+	if (n & 63)
+		pq->inbox[n >> 6] = (((uint64_t)1 << (n & 63)) - 1);
+	pq->ninbox = n;
+}
+
 #endif
@@ -0,0 +1,54 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef SCALE_INTERVALS_H
+#define SCALE_INTERVALS_H
+
+#include <stddef.h>
+
+/**
+ Which indexes can hold quads of which size: the range of quad sizes
+ is cut at the end points of the ranges of the indexes, so that each
+ AB pair can look up the list of indexes that can hold its quads once,
+ instead of trying them all every time it is searched.
+
+ With the sorted, distinct end points b_0 < ... < b_{m-1}, there are
+ 2m+1 intervals: interval 2k is the open interval (b_{k-1}, b_k) (with
+ b_{-1} = -inf and b_m = +inf), and interval 2k+1 is the point b_k.
+ The indexes that can hold quads of the sizes in interval j are
+ indexes[start[j] .. start[j+1]), in increasing order.
+
+ The memory is kept from one scale_intervals_build() to the next.
+ */
+struct scale_intervals {
+    double* breaks;
+    int nbreaks;
+    int* start;
+    int* indexes;
+    int breakscap;
+    int startcap;
+    size_t indexescap;
+};
+typedef struct scale_intervals scale_intervals_t;
+
+/**
+ Builds the intervals of the ranges [mins[i], maxs[i]] of "N" indexes;
+ the indexes with mins[i] > maxs[i] (an empty range) are in none of
+ them.  Returns 0 on success.
+ */
+int scale_intervals_build(scale_intervals_t* iv, const double* mins,
+                          const double* maxs, int N);
+
+/**
+ Returns the interval that the given quad size is in.
+ */
+int scale_intervals_find(const scale_intervals_t* iv, double scale);
+
+/**
+ Frees the memory of the intervals (but not the struct).
+ */
+void scale_intervals_free(scale_intervals_t* iv);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+# This file is part of the Astrometry.net suite.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+#ifndef VOTE_GRID_H
+#define VOTE_GRID_H
+
+#include <stdint.h>
+
+#include "astrometry/an-bool.h"
+#include "astrometry/index.h"
+#include "astrometry/matchobj.h"
+#include "astrometry/solver/hypothesis-cache.h"
+
+/**
+ Hough-style voting for the WCS of a field: instead of being verified
+ right away, each match votes for its hypothesis (see
+ hypothesis-cache.h) -- a cell of the sparse grid over the center,
+ scale, rotation and parity of the WCS.  The true WCS collects the
+ votes of many quads, the false matches are spread all over the grid,
+ so only the cells with enough votes need to be verified, each once.
+ */
+struct vote_cell {
+    int32_t key[HYPOTHESIS_KEY_SIZE];
+    int nvotes;
+    // has its match been handed out for verification?
+    anbool verified;
+    // the match with the smallest code error, and its index.
+    index_t* index;
+    MatchObj mo;
+};
+typedef struct vote_cell vote_cell_t;
+
+struct vote_ref {
+    int nvotes;
+    int cell;
+};
+typedef struct vote_ref vote_ref_t;
+
+struct vote_grid {
+    // the cells, in the order they got their first vote...
+    vote_cell_t* cells;
+    int ncells;
+    int cellcap;
+    // ...and an open-addressing hash table of their numbers ("tablecap"
+    // is a power of two; -1 marks the empty slots).
+    int* table;
+    int tablecap;
+    // the cells that have enough votes but haven't been verified.
+    vote_ref_t* pending;
+    int npending;
+    int pendingcap;
+    // the cells handed out by the last vote_grid_select().
+    int* selected;
+    int nselected;
+    int selectedcap;
+};
+typedef struct vote_grid vote_grid_t;
+
+/**
+ Adds the vote of a match of the given index to its cell (which becomes
+ pending when it reaches "minvotes" votes).  Returns 0 on success.
+ */
+int vote_grid_add(vote_grid_t* grid, const int32_t* key, const MatchObj* mo,
+                  index_t* index, int minvotes);
+
+/**
+ Hands out the pending cells for verification, those with the most
+ votes first, at most "maxcells" of them if non-zero (the others stay
+ pending): their numbers are in "selected".  They won't be handed out
+ again.  Returns how many there are.
+ */
+int vote_grid_select(vote_grid_t* grid, int maxcells);
+
+/**
+ Makes the cells with at least "minvotes" votes pending again, as if
+ they had never been verified.
+ */
+int vote_grid_unverify(vote_grid_t* grid, int minvotes);
+
+/**
+ Forgets all the votes (keeping the memory).
+ */
+void vote_grid_clear(vote_grid_t* grid);
+
+/**
+ Frees the memory of the grid (but not the struct).
+ */
+void vote_grid_free(vote_grid_t* grid);
+
+#endif
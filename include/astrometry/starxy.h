@@ -57,6 +57,11 @@ void starxy_set_xy_array(starxy_t* s, const double* xy);
 
 void starxy_sort_by_flux(starxy_t* f);
 
+// Appends the stars of "more" to "xy".  The "flux" and "background"
+// of "xy" (if it has them) are set to 0 for the stars of "more" that
+// don't have them.  Returns 0 on success.
+int starxy_append(starxy_t* xy, const starxy_t* more);
+
 void starxy_set(starxy_t* f, int i, double x, double y);
 
 int starxy_n(const starxy_t* f);
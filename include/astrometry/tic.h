@@ -7,6 +7,7 @@
 #define TIC_H
 
 #include <time.h>
+#include <stdint.h>
 
 #ifndef _WIN32
 #  include <sys/time.h>
@@ -18,4 +19,12 @@ int get_resource_stats(double* p_usertime, double* p_systime, long* p_maxrss);
 // You probably only want to look at differences in the values returned by this function.
 double timenow();
 
+// Returns the time of a monotonic clock (unaffected by changes of the
+// system time), in nanoseconds since an arbitrary (but positive) origin.
+// For measuring durations and setting deadlines.
+int64_t timenow_ns(void);
+
+// Returns the CPU time used so far by the calling thread, in nanoseconds.
+int64_t timenow_thread_cpu_ns(void);
+
 #endif
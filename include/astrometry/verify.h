@@ -6,6 +6,8 @@
 #ifndef VERIFY_H
 #define VERIFY_H
 
+#include <stdint.h>
+
 #include "astrometry/kdtree.h"
 #include "astrometry/matchobj.h"
 #include "astrometry/bl.h"
@@ -13,6 +15,16 @@
 #include "astrometry/sip.h"
 #include "astrometry/bl.h"
 #include "astrometry/starxy.h"
+#include "astrometry/solver/point-grid.h"
+
+// How verification finds the reference star nearest to each field star.
+enum {
+    // with a uniform grid over the reference stars (see
+    // solver/point-grid.h).
+    VERIFY_NN_GRID,
+    // with a kd-tree of the reference stars.
+    VERIFY_NN_KDTREE
+};
 
 struct verify_field_t {
     const starxy_t* field;
@@ -20,7 +32,12 @@ struct verify_field_t {
     double* xy;
     // this copy is permuted by the kdtree
     double* fieldcopy;
+    // number of stars "xy" and "fieldcopy" have room for
+    int capacity;
     kdtree_t* ftree;
+    // a grid over "xy" (the point numbers are the star numbers), for
+    // finding the neighbours of each star when de-duplicating.
+    point_grid_t grid;
 
     // should this field be spatially uniformized at the index's scale?
     anbool do_uniformize;
@@ -28,9 +45,51 @@ struct verify_field_t {
     anbool do_dedup;
     // apply radius-of-relevance filtering
     anbool do_ror;
+    // if non-zero: verify_hit() gives up (as if the log-odds had dropped
+    // below the bail-out level) once timenow_ns() reaches this.
+    int64_t deadline_ns;
+    // VERIFY_NN_GRID (the default) or VERIFY_NN_KDTREE.
+    int nn_method;
+    // don't reuse the reference stars found by earlier verifications
+    // (see verify_scratch_t).
+    anbool no_ref_cache;
 };
 typedef struct verify_field_t verify_field_t;
 
+/*
+ Memory that verify_hit() keeps from one call to the next, rather than
+ allocating it for each verification: the working arrays grow to the
+ largest verification seen and are then reused, so that in the steady
+ state verifying a match allocates nothing (the arrays of an accepted
+ match are handed over to its MatchObj, and replaced the next time).
+ Not thread-safe: each thread needs its own.
+
+ It also caches the reference stars around the last few patches of sky
+ verified more than once (for each star tree): the matches of a field
+ tend to land on the same patches, and then only the projection of the
+ stars into the image needs to be redone.  The cache holds pointers to
+ the star trees:
+ call verify_scratch_clear() before freeing them.
+ */
+struct verify_scratch_t;
+typedef struct verify_scratch_t verify_scratch_t;
+
+verify_scratch_t* verify_scratch_new(void);
+
+/*
+ Forgets the cached reference stars.
+ */
+void verify_scratch_clear(verify_scratch_t* vs);
+
+/*
+ Returns the number of reference star lookups that were found in the
+ cache, and of those that weren't, since verify_scratch_new().
+ */
+void verify_scratch_get_ref_cache_stats(const verify_scratch_t* vs,
+                                        int64_t* p_hits, int64_t* p_misses);
+
+void verify_scratch_free(verify_scratch_t* vs);
+
 
 /*
  This function must be called once for each field before verification
@@ -39,6 +98,15 @@ typedef struct verify_field_t verify_field_t;
  */
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy);
 
+/*
+ Same as verify_field_preprocess(), but recycles the memory of "vf", a
+ verify_field_t of a previous field that is no longer needed (if NULL,
+ a new one is allocated).  On failure, "vf" is freed and NULL is
+ returned.
+ */
+verify_field_t* verify_field_preprocess_reuse(verify_field_t* vf,
+                                              const starxy_t* fieldxy);
+
 /*
  This function must be called after all verification calls for a field
  are finished; we clean up the data structures we created in the
@@ -88,6 +156,8 @@ void verify_wcs(const startree_t* skdt,
  -logodds
  -corr_field
  -corr_index
+
+ "vs" is optional (see verify_scratch_new()).
  */
 void verify_hit(const startree_t* skdt,
                 int index_cutnside,
@@ -95,6 +165,7 @@ void verify_hit(const startree_t* skdt,
                 MatchObj* mo,
                 const sip_t* sip, // if non-NULL, verify this SIP WCS.
                 const verify_field_t* vf,
+                verify_scratch_t* vs,
                 double verify_pix2,
                 double distractors,
                 double fieldW,
@@ -105,6 +176,30 @@ void verify_hit(const startree_t* skdt,
                 anbool distance_from_quad_bonus,
                 anbool fake_match);
 
+/*
+ A cheap first look at a match, before verify_hit(): projects only the
+ "nref" brightest (lowest sweep number) reference stars in the image
+ through mo->wcstan, and looks for each of them among the "nfield"
+ brightest field stars (with vf->ftree).  Returns the log-odds of that
+ partial match, in the same model as verify_hit() (with the roles of the
+ field and reference stars swapped); LARGE_VAL if there's nothing to
+ check.
+
+ Uses mo->wcstan, center, radius, field[], star[] and dimquads.  "vs"
+ is optional (see verify_scratch_new()): with it, the reference stars
+ come from its cache when they're there (but aren't added to it).
+ */
+double verify_precheck(const startree_t* skdt,
+                       const MatchObj* mo,
+                       const verify_field_t* vf,
+                       verify_scratch_t* vs,
+                       int nref,
+                       int nfield,
+                       double verify_pix2,
+                       double distractors,
+                       double fieldW,
+                       double fieldH);
+
 // Distractor
 #define THETA_DISTRACTOR -1
 // Conflict
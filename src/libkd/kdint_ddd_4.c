@@ -0,0 +1,8 @@
+/*
+# This file is part of libkd.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+// The queries of kdint_ddd.c, compiled for 4-dimensional trees.
+#define KD_DIM 4
+#include "kdint_ddd.c"
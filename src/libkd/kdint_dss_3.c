@@ -0,0 +1,8 @@
+/*
+# This file is part of libkd.
+# Licensed under a 3-clause BSD style license - see LICENSE
+*/
+
+// The queries of kdint_dss.c, compiled for 3-dimensional trees.
+#define KD_DIM 3
+#include "kdint_dss.c"
@@ -41,8 +41,10 @@
 #include "kdtree_internal.c"
 #include "kdtree_internal_fits.c"
 
+#if !defined(KD_DIM)
 // FIXME
 double kd_round(double x) {
     return KD_ROUND(x);
 }
+#endif
 
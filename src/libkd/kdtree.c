@@ -74,8 +74,42 @@ int kdtree_has_old_bb(const kdtree_t* kd) {
 
 KD_DECLARE(kdtree_update_funcs, void, (kdtree_t*));
 
+// The queries compiled for the dimensions of the trees of the solver:
+// 2 (fields, in verification; double trees only), 3 (stars) and 4
+// (codes), for the tree types of index files; see kdint_*_D.c.
+void KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 2)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 3)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 4)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, u, u, 3)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, u, u, 4)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, s, s, 3)(kdtree_t*);
+void KDMANGLE_DIM(kdtree_update_funcs, d, s, s, 4)(kdtree_t*);
+
 void kdtree_update_funcs(kdtree_t* kd) {
     KD_DISPATCH(kdtree_update_funcs, kd->treetype,, (kd));
+
+    switch (kd->treetype) {
+    case KDTT_DOUBLE:
+        if (kd->ndim == 2)
+            KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 2)(kd);
+        else if (kd->ndim == 3)
+            KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 3)(kd);
+        else if (kd->ndim == 4)
+            KDMANGLE_DIM(kdtree_update_funcs, d, d, d, 4)(kd);
+        break;
+    case KDTT_DUU:
+        if (kd->ndim == 3)
+            KDMANGLE_DIM(kdtree_update_funcs, d, u, u, 3)(kd);
+        else if (kd->ndim == 4)
+            KDMANGLE_DIM(kdtree_update_funcs, d, u, u, 4)(kd);
+        break;
+    case KDTT_DSS:
+        if (kd->ndim == 3)
+            KDMANGLE_DIM(kdtree_update_funcs, d, s, s, 3)(kd);
+        else if (kd->ndim == 4)
+            KDMANGLE_DIM(kdtree_update_funcs, d, s, s, 4)(kd);
+        break;
+    }
 }
 
 static int get_tree_size(int treetype) {
@@ -305,12 +339,13 @@ void kdtree_inverse_permutation(const kdtree_t* tree, int* invperm) {
 
 const char* kdtree_build_options_to_string(int opts) {
     static char buf[256];
-    sprintf(buf, "%s%s%s%s%s",
+    sprintf(buf, "%s%s%s%s%s%s",
             (opts & KD_BUILD_BBOX) ? "BBOX ":"",
             (opts & KD_BUILD_SPLIT) ? "SPLIT ":"",
             (opts & KD_BUILD_SPLITDIM) ? "SPLITDIM ":"",
             (opts & KD_BUILD_NO_LR) ? "NOLR ":"",
-            (opts & KD_BUILD_LINEAR_LR) ? "LINEARLR ":"");
+            (opts & KD_BUILD_LINEAR_LR) ? "LINEARLR ":"",
+            (opts & KD_BUILD_PARALLEL) ? "PARALLEL ":"");
     return buf;
 }
 
@@ -549,6 +584,23 @@ void kdtree_free_query(kdtree_qres_t *kq) {
     FREE(kq);
 }
 
+kdtree_query_ctx_t* kdtree_query_ctx_new(void) {
+    kdtree_query_ctx_t* ctx = CALLOC(1, sizeof(kdtree_query_ctx_t));
+    if (!ctx)
+        SYSERROR("Failed to allocate kdtree query context");
+    return ctx;
+}
+
+void kdtree_query_ctx_free(kdtree_query_ctx_t* ctx) {
+    if (!ctx) return;
+    FREE(ctx->res.results.any);
+    FREE(ctx->res.sdists);
+    FREE(ctx->res.inds);
+    FREE(ctx->qids);
+    FREE(ctx->lists);
+    FREE(ctx);
+}
+
 void kdtree_free(kdtree_t *kd) {
     if (!kd) return;
     FREE(kd->name);
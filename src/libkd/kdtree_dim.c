@@ -50,4 +50,25 @@ kdtree_qres_t* KDFUNC(kdtree_rangesearch_options_reuse)
     return kd->fun.rangesearch(kd, res, pt, maxd2, options);
 }
 
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_batch)
+     (const kdtree_t *kd, kdtree_qres_t* res, const void *pts, int N,
+      double maxd2, int options, int* starts) {
+    assert(kd->fun.rangesearch_batch);
+    return kd->fun.rangesearch_batch(kd, res, pts, N, maxd2, options, starts);
+}
+
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_ctx)
+     (const kdtree_t *kd, kdtree_query_ctx_t* ctx, const void *pt,
+      double maxd2, int options) {
+    assert(kd->fun.rangesearch_ctx);
+    return kd->fun.rangesearch_ctx(kd, ctx, pt, maxd2, options);
+}
+
+kdtree_qres_t* KDFUNC(kdtree_rangesearch_batch_ctx)
+     (const kdtree_t *kd, kdtree_query_ctx_t* ctx, const void *pts, int N,
+      double maxd2, int options, int* starts) {
+    assert(kd->fun.rangesearch_batch_ctx);
+    return kd->fun.rangesearch_batch_ctx(kd, ctx, pts, N, maxd2, options, starts);
+}
+
 
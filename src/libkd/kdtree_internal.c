@@ -14,14 +14,29 @@
 #include "kdtree_mem.h"
 #include "keywords.h"
 #include "errors.h"
+#include "log.h"
 #include "mathutil.h"
+#include "an-thread.h"
 
 #define KDTREE_MAX_RESULTS 1000
 #define KDTREE_MAX_DIM 100
+// KD_BUILD_PARALLEL: nodes (and blocks of points) of fewer points than
+// this aren't split between threads...
+#define KD_PARALLEL_CUTOFF 16384
+// ... into more than this many tasks per thread...
+#define KD_PARALLEL_TASKS 4
+// ... and this many leaves have their bounding boxes computed per task.
+#define KD_PARALLEL_LEAVES 256
+// Points per call to kd->fun.leaf_scan().
+#define KDTREE_LEAF_BLOCK 64
 
 #define WARNING(x, ...) fprintf(stderr, x, ## __VA_ARGS__)
 
+#if defined(KD_DIM)
+#define MANGLE(x) KDMANGLE_DIM(x, ETYPE, DTYPE, TTYPE, KD_DIM)
+#else
 #define MANGLE(x) KDMANGLE(x, ETYPE, DTYPE, TTYPE)
+#endif
 
 /*
  The "external" type is the data type that the outside world works in.
@@ -392,6 +407,7 @@ static anbool bb_point_l1mindist_exceeds_ttype(ttype* lo, ttype* hi,
     return FALSE;
 }
 
+#if !defined(KD_DIM)
 static void compute_splitbits(kdtree_t* kd) {
     int D;
     int bits;
@@ -407,11 +423,12 @@ static void compute_splitbits(kdtree_t* kd) {
     kd->dimbits = bits;
     kd->splitmask = ~kd->dimmask;
 }
+#endif
 
 /* Sorts results by kq->sdists */
 static int kdtree_qsort_results(kdtree_qres_t *kq, int D) {
     int beg[KDTREE_MAX_RESULTS], end[KDTREE_MAX_RESULTS], i = 0, j, L, R;
-    static etype piv_vec[KDTREE_MAX_DIM];
+    etype piv_vec[KDTREE_MAX_DIM];
     unsigned int piv_perm;
     double piv;
 
@@ -494,8 +511,12 @@ anbool resize_results(kdtree_qres_t* res, int newsize, int D,
     if (do_points)
         res->results.any = REALLOC(res->results.any, (size_t)newsize * (size_t)D * sizeof(etype));
     res->inds = REALLOC(res->inds, newsize * sizeof(u32));
-    if (newsize && (!res->results.any || (do_dists && !res->sdists) || !res->inds))
+    if (newsize && (!res->results.any || (do_dists && !res->sdists) || !res->inds)) {
         SYSERROR("Failed to resize kdtree results arrays");
+        // (so that a reused result struct is resized from scratch)
+        res->capacity = 0;
+        return FALSE;
+    }
     res->capacity = newsize;
 
     if (FALSE) {
@@ -538,6 +559,29 @@ anbool add_result(const kdtree_t* kd, kdtree_qres_t* res, double sdist,
     return TRUE;
 }
 
+/*
+ Adds the points L to R that are within squared distance "maxd2" of
+ "query", found with kd->fun.leaf_scan().
+ */
+static anbool add_leaf_results(const kdtree_t* kd, kdtree_qres_t* res,
+                               const etype* query, int L, int R,
+                               double maxd2, int D,
+                               anbool do_dists, anbool do_points) {
+    int hits[KDTREE_LEAF_BLOCK];
+    double d2s[KDTREE_LEAF_BLOCK];
+    int i, j, n;
+    for (i=L; i<=R; i+=KDTREE_LEAF_BLOCK) {
+        // (leaf_scan is only set for trees whose etype is double)
+        n = kd->fun.leaf_scan(kd, i, MIN(KDTREE_LEAF_BLOCK, R+1-i),
+                              (const double*)query, maxd2, hits, d2s);
+        for (j=0; j<n; j++)
+            if (!add_result(kd, res, d2s[j], KD_PERM(kd, hits[j]),
+                            KD_DATA(kd, D, hits[j]), D, do_dists, do_points))
+                return FALSE;
+    }
+    return TRUE;
+}
+
 /*
  Can the query be represented as a ttype?
 
@@ -545,7 +589,7 @@ anbool add_result(const kdtree_t* kd, kdtree_qres_t* res, double sdist,
  */
 static anbool ttype_query(const kdtree_t* kd, const etype* query, ttype* tquery) {
     etype val;
-    int d, D=kd->ndim;
+    int d, D=DIMENSION(kd);
     for (d=0; d<D; d++) {
         val = POINT_ET(kd, d, query[d], );
         if (val < TTYPE_MIN || val > TTYPE_MAX)
@@ -555,6 +599,7 @@ static anbool ttype_query(const kdtree_t* kd, const etype* query, ttype* tquery)
     return TRUE;
 }
 
+#if !defined(KD_DIM)
 double MANGLE(kdtree_get_splitval)(const kdtree_t* kd, int nodeid) {
     Unused int dim;
     ttype split = *KD_SPLIT(kd, nodeid);
@@ -570,6 +615,7 @@ double MANGLE(kdtree_get_splitval)(const kdtree_t* kd, int nodeid) {
     }
     return POINT_TE(kd, dim, split);
 }
+#endif
 
 
 static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
@@ -581,7 +627,7 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
     anbool use_tquery = FALSE;
     anbool use_tmath = FALSE;
     anbool use_bigtmath = FALSE;
-    ttype* tquery = malloc(D * sizeof(ttype));
+    ttype tquery[KDTREE_MAX_DIM];
     double bestd2 = *p_bestd2;
     int ibest = *p_ibest;
     ttype tl2 = 0;
@@ -593,6 +639,7 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
 #else
     D = kd->ndim;
 #endif
+    assert(D <= KDTREE_MAX_DIM);
 
     if (TTYPE_INTEGER) {
         use_tquery = ttype_query(kd, query, tquery);
@@ -750,8 +797,6 @@ static void kdtree_nn_bb(const kdtree_t* kd, const etype* query,
     }
     *p_bestd2 = bestd2;
     *p_ibest = ibest;
-
-    free(tquery);
 }
 
 static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
@@ -761,7 +806,7 @@ static void kdtree_nn_int_split(const kdtree_t* kd, const etype* query,
     ttype mindists[100];
 
     int stackpos = 0;
-    int D = kd->ndim;
+    int D = DIMENSION(kd);
 
     ttype closest_so_far;
     bigttype closest2;
@@ -916,13 +961,12 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
 
     // Integers.
     if (TTYPE_INTEGER) {
-        ttype* tquery = malloc(D * sizeof(ttype));
+        ttype tquery[KDTREE_MAX_DIM];
+        assert(D <= KDTREE_MAX_DIM);
         if (ttype_query(kd, query, tquery)) {
             kdtree_nn_int_split(kd, query, tquery, p_bestd2, p_ibest);
-            free(tquery);
             return;
         }
-        free(tquery);
     }
 
     // We got splitting planes, and the splits are either doubles, or ints
@@ -1030,10 +1074,35 @@ void MANGLE(kdtree_nn)(const kdtree_t* kd, const void* vquery,
 }
 
 
-kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
-     (const kdtree_t* kd, kdtree_qres_t* res, const void* vquery,
+/*
+ Gets the result arrays of "ctx" ready for a search, with room for at
+ least KDTREE_MAX_RESULTS results.  They are only resized if the last
+ search left them too small, or sized for another type of tree or
+ dimension.
+ */
+static anbool prepare_results(kdtree_query_ctx_t* ctx, int D,
+                              anbool do_dists, anbool do_points) {
+    kdtree_qres_t* res = &(ctx->res);
+    size_t pointsize = (size_t)D * sizeof(etype);
+
+    res->nres = 0;
+    if (res->capacity && (ctx->pointsize == pointsize) &&
+        (!do_dists || (ctx->distcap == (int)res->capacity)))
+        return TRUE;
+    if (!resize_results(res, res->capacity ? res->capacity : KDTREE_MAX_RESULTS,
+                        D, do_dists, do_points))
+        return FALSE;
+    ctx->pointsize = pointsize;
+    if (do_dists)
+        ctx->distcap = res->capacity;
+    return TRUE;
+}
+
+kdtree_qres_t* MANGLE(kdtree_rangesearch_ctx)
+     (const kdtree_t* kd, kdtree_query_ctx_t* ctx, const void* vquery,
       double maxd2, int options)
 {
+    kdtree_qres_t* res;
     int nodestack[100];
     int stackpos = 0;
     int D = (kd ? kd->ndim : 0);
@@ -1060,20 +1129,19 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
     double dtl1=0.0, dtl2=0.0, dtlinf=0.0;
 
     const etype* query = vquery;
+    ttype tquery[KDTREE_MAX_DIM];
 
-    if (!kd || !query)
+    if (!kd || !ctx || !query)
         return NULL;
 
-    ttype* tquery = malloc(D * sizeof(tquery));
-
-
 #if defined(KD_DIM)
     assert(kd->ndim == KD_DIM);
     D = KD_DIM;
 #else
     D = kd->ndim;
 #endif
-	
+    assert(D <= KDTREE_MAX_DIM);
+
     if (options & KD_OPTIONS_SORT_DISTS)
         // gotta compute 'em if ya wanna sort 'em!
         options |= KD_OPTIONS_COMPUTE_DISTS;
@@ -1162,25 +1230,9 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
         }
     }
 
-
-    if (res) {
-        if (!res->capacity) {
-            resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points);
-        } else {
-            // call the resize routine just in case the old result struct was
-            // from a tree of different type or dimensionality.
-            resize_results(res, res->capacity, D, do_dists, do_points);
-        }
-        res->nres = 0;
-    } else {
-        res = CALLOC(1, sizeof(kdtree_qres_t));
-        if (!res) {
-            SYSERROR("Failed to allocate kdtree_qres_t struct");
-            free(tquery);
-            return NULL;
-        }
-        resize_results(res, KDTREE_MAX_RESULTS, D, do_dists, do_points);
-    }
+    if (!prepare_results(ctx, D, do_dists, do_points))
+        return NULL;
+    res = &(ctx->res);
 
     // queue root.
     nodestack[0] = 0;
@@ -1201,7 +1253,11 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
             L = kdtree_left(kd, nodeid);
             R = kdtree_right(kd, nodeid);
 
-            if (do_dists) {
+            if (kd->fun.leaf_scan) {
+                if (!add_leaf_results(kd, res, query, L, R, maxd2, D,
+                                      do_dists, do_points))
+                    return NULL;
+            } else if (do_dists) {
                 for (i=L; i<=R; i++) {
                     anbool bailedout = FALSE;
                     double dsqd;
@@ -1214,10 +1270,7 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                         continue;
                     if (!add_result(kd, res, dsqd, KD_PERM(kd, i), data,
                         D, do_dists, do_points))
-                    {
-                        free(tquery);
                         return NULL;
-                    }
                 }
             } else {
                 for (i=L; i<=R; i++) {
@@ -1227,10 +1280,7 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                         continue;
                     if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i), data,
                                     D, do_dists, do_points))
-                    {
-                        free(tquery);
                         return NULL;
-                    }
                 }
             }
             continue;
@@ -1297,26 +1347,18 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                 wholenode = do_wholenode_check &&
                     !bb_point_maxdist2_exceeds_bigttype(tlo, thi, tquery, D, bigtl2);
             } else {
-                etype* bblo = malloc(D * sizeof(etype));
-                etype* bbhi = malloc(D * sizeof(etype));
-
+                etype bblo[KDTREE_MAX_DIM];
+                etype bbhi[KDTREE_MAX_DIM];
                 int d;
                 for (d=0; d<D; d++) {
                     bblo[d] = POINT_TE(kd, d, tlo[d]);
                     bbhi[d] = POINT_TE(kd, d, thi[d]);
                 }
                 if (bb_point_mindist2_exceeds(bblo, bbhi, query, D, maxd2))
-                {
-                    free(bblo);
-                    free(bbhi);
                     continue;
-                }
 
                 wholenode = do_wholenode_check &&
                     !bb_point_maxdist2_exceeds(bblo, bbhi, query, D, maxd2);
-
-                free(bblo);
-                free(bbhi);
             }
 
             if (wholenode) {
@@ -1328,20 +1370,14 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
                         if (!add_result(kd, res, dsqd, KD_PERM(kd, i),
                                         KD_DATA(kd, D, i), D,
                                         do_dists, do_points))
-                        {
-                            free(tquery);
                             return NULL;
-                        }
                     }
                 } else {
                     for (i=L; i<=R; i++)
                         if (!add_result(kd, res, LARGE_VAL, KD_PERM(kd, i),
                                         KD_DATA(kd, D, i), D,
                                         do_dists, do_points))
-                        {
-                            free(tquery);
                             return NULL;
-                        }
                 }
                 continue;
             }
@@ -1417,9 +1453,9 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
         }
     }
 
-    /* Resize result arrays. */
-    if (!(options & KD_OPTIONS_NO_RESIZE_RESULTS))
-        resize_results(res, res->nres, D, do_dists, do_points);
+    // (the arrays may have grown)
+    if (do_dists)
+        ctx->distcap = res->capacity;
 
     /* Sort by ascending distance away from target point before returning */
     if (options & KD_OPTIONS_SORT_DISTS) {
@@ -1427,18 +1463,470 @@ kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
             printf("before sorting results:\n");
             print_results(res, D);
         }
-        kdtree_qsort_results(res, kd->ndim);
+        kdtree_qsort_results(res, D);
         if (FALSE) {
             printf("after sorting results:\n");
             print_results(res, D);
         }
     }
 
-    free(tquery);
+    return res;
+}
+
+kdtree_qres_t* MANGLE(kdtree_rangesearch_options)
+     (const kdtree_t* kd, kdtree_qres_t* res, const void* vquery,
+      double maxd2, int options)
+{
+    kdtree_query_ctx_t ctx;
+    anbool newres = (res == NULL);
+    anbool do_dists = (options & (KD_OPTIONS_COMPUTE_DISTS |
+                                  KD_OPTIONS_SORT_DISTS)) ? TRUE : FALSE;
+
+    if (!kd || !vquery)
+        return NULL;
+    if (newres) {
+        res = CALLOC(1, sizeof(kdtree_qres_t));
+        if (!res) {
+            SYSERROR("Failed to allocate kdtree_qres_t struct");
+            return NULL;
+        }
+    }
+    // A context around "res": it doesn't know what the arrays were sized
+    // for, so they get resized on the way in, as they always were.
+    memset(&ctx, 0, sizeof(kdtree_query_ctx_t));
+    ctx.res = *res;
+    if (!MANGLE(kdtree_rangesearch_ctx)(kd, &ctx, vquery, maxd2, options)) {
+        *res = ctx.res;
+        if (newres)
+            kdtree_free_query(res);
+        return NULL;
+    }
+    /* Resize result arrays. */
+    if (!(options & KD_OPTIONS_NO_RESIZE_RESULTS))
+        resize_results(&ctx.res, ctx.res.nres, kd->ndim, do_dists, TRUE);
+    *res = ctx.res;
+    return res;
+}
+
+
+/*
+ State of a kdtree_rangesearch_batch() traversal.
+ */
+struct batch_search {
+    const kdtree_t* kd;
+    const etype* queries;
+    double maxd2;
+    double maxdist;
+    anbool use_bboxes;
+    anbool do_dists;
+    anbool do_points;
+    // results go in ctx->res, and the query number of each in ctx->qids.
+    kdtree_query_ctx_t* ctx;
+    anbool failed;
+};
+
+/*
+ Makes sure "*buf", of "*cap" ints, has room for "n".
+ */
+static anbool reserve_ints(int** buf, size_t* cap, size_t n) {
+    int* newbuf;
+    if (n <= *cap)
+        return TRUE;
+    n = MAX(n, 2 * (*cap));
+    newbuf = REALLOC(*buf, n * sizeof(int));
+    if (!newbuf)
+        return FALSE;
+    *buf = newbuf;
+    *cap = n;
+    return TRUE;
+}
+
+static anbool batch_add_result(struct batch_search* bs, int q, double sdist,
+                               int i) {
+    kdtree_query_ctx_t* ctx = bs->ctx;
+    kdtree_qres_t* res = &(ctx->res);
+    int D = DIMENSION(bs->kd);
+    if (!add_result(bs->kd, res, sdist, KD_PERM(bs->kd, i),
+                    KD_DATA(bs->kd, D, i), D,
+                    bs->do_dists, bs->do_points)) {
+        bs->failed = TRUE;
+        return FALSE;
+    }
+    if (!reserve_ints(&(ctx->qids), &(ctx->qidcap), res->capacity)) {
+        SYSERROR("Failed to allocate batched search results");
+        bs->failed = TRUE;
+        return FALSE;
+    }
+    ctx->qids[res->nres - 1] = q;
+    return TRUE;
+}
+
+static void batch_scan_leaf(struct batch_search* bs, int nodeid, int q) {
+    const kdtree_t* kd = bs->kd;
+    int D = DIMENSION(bs->kd);
+    const etype* query = bs->queries + (size_t)q * D;
+    int L = kdtree_left(kd, nodeid);
+    int R = kdtree_right(kd, nodeid);
+    int i, j, n;
+
+    if (kd->fun.leaf_scan) {
+        int hits[KDTREE_LEAF_BLOCK];
+        double d2s[KDTREE_LEAF_BLOCK];
+        for (i=L; i<=R; i+=KDTREE_LEAF_BLOCK) {
+            n = kd->fun.leaf_scan(kd, i, MIN(KDTREE_LEAF_BLOCK, R+1-i),
+                                  (const double*)query, bs->maxd2, hits, d2s);
+            for (j=0; j<n; j++)
+                if (!batch_add_result(bs, q, d2s[j], hits[j]))
+                    return;
+        }
+        return;
+    }
+    for (i=L; i<=R; i++) {
+        dtype* data = KD_DATA(kd, D, i);
+        if (bs->do_dists) {
+            anbool bailedout = FALSE;
+            double dsqd;
+            dist2_bailout(kd, query, data, D, bs->maxd2, &bailedout, &dsqd);
+            if (bailedout)
+                continue;
+            if (!batch_add_result(bs, q, dsqd, i))
+                return;
+        } else {
+            if (dist2_exceeds(kd, query, data, D, bs->maxd2))
+                continue;
+            if (!batch_add_result(bs, q, LARGE_VAL, i))
+                return;
+        }
+    }
+}
+
+/*
+ Finds the splitting dimension and value of an interior node.
+ */
+static inline void batch_get_split(const kdtree_t* kd, int nodeid,
+                                   int* pdim, etype* psplit) {
+    ttype split = *KD_SPLIT(kd, nodeid);
+    int dim;
+    if (kd->splitdim)
+        dim = kd->splitdim[nodeid];
+    else {
+        bigint tmpsplit = split;
+        dim = tmpsplit & kd->dimmask;
+        split = tmpsplit & kd->splitmask;
+    }
+    *pdim = dim;
+    *psplit = POINT_TE(kd, dim, split);
+}
+
+/*
+ Searches the subtree rooted at "nodeid" for a single query, once the
+ other queries of the batch have gone their own way.
+ */
+static void batch_search_one(struct batch_search* bs, int root, int q) {
+    const kdtree_t* kd = bs->kd;
+    int D = DIMENSION(bs->kd);
+    const etype* query = bs->queries + (size_t)q * D;
+    int nodestack[100];
+    int stackpos = 0;
+
+    nodestack[0] = root;
+    while (stackpos >= 0) {
+        int nodeid = nodestack[stackpos--];
+
+        if (KD_IS_LEAF(kd, nodeid)) {
+            batch_scan_leaf(bs, nodeid, q);
+            if (bs->failed)
+                return;
+            continue;
+        }
+        if (bs->use_bboxes) {
+            ttype *tlo=NULL, *thi=NULL;
+            etype bblo[KDTREE_MAX_DIM];
+            etype bbhi[KDTREE_MAX_DIM];
+            int d;
+            bboxes(kd, nodeid, &tlo, &thi, D);
+            for (d=0; d<D; d++) {
+                bblo[d] = POINT_TE(kd, d, tlo[d]);
+                bbhi[d] = POINT_TE(kd, d, thi[d]);
+            }
+            if (bb_point_mindist2_exceeds(bblo, bbhi, query, D, bs->maxd2))
+                continue;
+            // (pushed in the order of kdtree_rangesearch_options(), so
+            // that the results come out in the same order)
+            nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+            nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+        } else {
+            int dim;
+            etype rsplit;
+            batch_get_split(kd, nodeid, &dim, &rsplit);
+            // (the child on the query's side is pushed first, so that
+            // the other one is searched first, as in
+            // kdtree_rangesearch_options())
+            if (query[dim] < rsplit) {
+                nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+                if (rsplit - query[dim] <= bs->maxdist)
+                    nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+            } else {
+                nodestack[++stackpos] = KD_CHILD_RIGHT(nodeid);
+                if (query[dim] - rsplit <= bs->maxdist)
+                    nodestack[++stackpos] = KD_CHILD_LEFT(nodeid);
+            }
+        }
+    }
+}
+
+/*
+ Searches the subtree rooted at "nodeid" for the "nactive" queries
+ listed in "active" (which can reach this node).  "scratch" has room
+ for 2 x nactive query lists for each level below.
+
+ Each query visits the children of a node in the same order as in
+ kdtree_rangesearch_options(), so that its results come out in the
+ same order: with bounding boxes, the right child first; with splits,
+ the child on the other side of the split from the query first.
+ */
+static void batch_search_rec(struct batch_search* bs, int nodeid,
+                             const int* active, int nactive, int* scratch) {
+    const kdtree_t* kd = bs->kd;
+    int D = DIMENSION(bs->kd);
+    int j;
+
+    if (nactive == 1) {
+        batch_search_one(bs, nodeid, active[0]);
+        return;
+    }
+
+    if (KD_IS_LEAF(kd, nodeid)) {
+        for (j=0; j<nactive; j++) {
+            batch_scan_leaf(bs, nodeid, active[j]);
+            if (bs->failed)
+                return;
+        }
+        return;
+    }
+
+    if (bs->use_bboxes) {
+        ttype *tlo=NULL, *thi=NULL;
+        etype bblo[KDTREE_MAX_DIM];
+        etype bbhi[KDTREE_MAX_DIM];
+        int d, n;
+
+        bboxes(kd, nodeid, &tlo, &thi, D);
+        assert(tlo && thi);
+        for (d=0; d<D; d++) {
+            bblo[d] = POINT_TE(kd, d, tlo[d]);
+            bbhi[d] = POINT_TE(kd, d, thi[d]);
+        }
+        n = 0;
+        for (j=0; j<nactive; j++) {
+            const etype* query = bs->queries + (size_t)active[j] * D;
+            if (!bb_point_mindist2_exceeds(bblo, bbhi, query, D, bs->maxd2))
+                scratch[n++] = active[j];
+        }
+        if (!n)
+            return;
+        batch_search_rec(bs, KD_CHILD_RIGHT(nodeid), scratch, n, scratch + 2*n);
+        if (bs->failed)
+            return;
+        batch_search_rec(bs, KD_CHILD_LEFT(nodeid), scratch, n, scratch + 2*n);
 
+    } else {
+        int dim;
+        etype rsplit;
+        // The queries left of the split search the right child (if they
+        // reach it) then the left one, and those right of it, the left
+        // child (if they reach it) then the right one.  So: the left
+        // child for the queries on the right, the right child for all
+        // that reach it, then the left child for the queries on the
+        // left.
+        int* lastleft = scratch;
+        int* right = scratch + nactive;
+        int* firstleft;
+        int nlastleft = 0, nright = 0, nfirstleft = 0;
+
+        batch_get_split(kd, nodeid, &dim, &rsplit);
+        for (j=0; j<nactive; j++) {
+            const etype* query = bs->queries + (size_t)active[j] * D;
+            if (query[dim] < rsplit) {
+                lastleft[nlastleft++] = active[j];
+                if (rsplit - query[dim] <= bs->maxdist)
+                    right[nright++] = active[j];
+            } else
+                right[nright++] = active[j];
+        }
+        // (after the queries on the left: together, at most nactive)
+        firstleft = lastleft + nlastleft;
+        for (j=0; j<nactive; j++) {
+            const etype* query = bs->queries + (size_t)active[j] * D;
+            if ((query[dim] >= rsplit) && (query[dim] - rsplit <= bs->maxdist))
+                firstleft[nfirstleft++] = active[j];
+        }
+        if (nfirstleft)
+            batch_search_rec(bs, KD_CHILD_LEFT(nodeid), firstleft, nfirstleft,
+                             scratch + 2*nactive);
+        if (bs->failed)
+            return;
+        if (nright)
+            batch_search_rec(bs, KD_CHILD_RIGHT(nodeid), right, nright,
+                             scratch + 2*nactive);
+        if (bs->failed)
+            return;
+        if (nlastleft)
+            batch_search_rec(bs, KD_CHILD_LEFT(nodeid), lastleft, nlastleft,
+                             scratch + 2*nactive);
+    }
+}
+
+/*
+ Moves result "i" to position "dest[i]", for all results, in place.
+ */
+static void permute_results(kdtree_qres_t* res, int* dest, int D,
+                            anbool do_dists) {
+    int i, d;
+    for (i=0; i<(int)res->nres; i++) {
+        while (dest[i] != i) {
+            int k = dest[i];
+            u32 tmpind;
+            double tmpdist;
+            etype tmppt;
+
+            tmpind = res->inds[i];
+            res->inds[i] = res->inds[k];
+            res->inds[k] = tmpind;
+            if (do_dists) {
+                tmpdist = res->sdists[i];
+                res->sdists[i] = res->sdists[k];
+                res->sdists[k] = tmpdist;
+            }
+            for (d=0; d<D; d++) {
+                tmppt = res->results.ETYPE[(size_t)i*D + d];
+                res->results.ETYPE[(size_t)i*D + d] = res->results.ETYPE[(size_t)k*D + d];
+                res->results.ETYPE[(size_t)k*D + d] = tmppt;
+            }
+            dest[i] = dest[k];
+            dest[k] = k;
+        }
+    }
+}
+
+kdtree_qres_t* MANGLE(kdtree_rangesearch_batch_ctx)
+     (const kdtree_t* kd, kdtree_query_ctx_t* ctx, const void* vqueries,
+      int N, double maxd2, int options, int* starts)
+{
+    struct batch_search bs;
+    kdtree_qres_t* res;
+    int D = (kd ? kd->ndim : 0);
+    int* active;
+    int* next;
+    int i, nres;
+
+    if (!kd || !ctx || !vqueries || !starts || N < 0)
+        return NULL;
+#if defined(KD_DIM)
+    assert(kd->ndim == KD_DIM);
+    D = KD_DIM;
+#endif
+    assert(D <= KDTREE_MAX_DIM);
+
+    memset(&bs, 0, sizeof(bs));
+    bs.kd = kd;
+    bs.queries = vqueries;
+    bs.maxd2 = maxd2;
+    bs.maxdist = sqrt(maxd2);
+    bs.do_dists = (options & KD_OPTIONS_COMPUTE_DISTS) ? TRUE : FALSE;
+    // (always kept, as in kdtree_rangesearch_options())
+    bs.do_points = TRUE;
+    bs.ctx = ctx;
+    if (!kd->split.any) {
+        assert(kd->bb.any);
+        bs.use_bboxes = TRUE;
+    } else if (kd->bb.any && !(options & KD_OPTIONS_USE_SPLIT)) {
+        bs.use_bboxes = TRUE;
+    }
+
+    if (!prepare_results(ctx, D, bs.do_dists, bs.do_points))
+        return NULL;
+    res = &(ctx->res);
+
+    for (i=0; i<=N; i++)
+        starts[i] = 0;
+    if (!N)
+        return res;
+
+    // the query lists: two per level of the tree.
+    if (!reserve_ints(&(ctx->lists), &(ctx->listcap),
+                      (size_t)N * (size_t)(2 * kd->nlevels + 1))) {
+        SYSERROR("Failed to allocate batched search query lists");
+        return NULL;
+    }
+    active = ctx->lists;
+    for (i=0; i<N; i++)
+        active[i] = i;
+
+    batch_search_rec(&bs, 0, active, N, active + N);
+    if (bs.failed)
+        return NULL;
+    // (the arrays may have grown)
+    if (bs.do_dists)
+        ctx->distcap = res->capacity;
+
+    // Bucket the results by query (stable, so each bucket stays in the
+    // order of the search).
+    nres = res->nres;
+    for (i=0; i<nres; i++)
+        starts[ctx->qids[i] + 1]++;
+    for (i=0; i<N; i++)
+        starts[i+1] += starts[i];
+
+    // (the query lists are done with: they hold the bucket cursors)
+    next = ctx->lists;
+    memcpy(next, starts, (size_t)N * sizeof(int));
+    // (turn the query numbers into destinations)
+    for (i=0; i<nres; i++)
+        ctx->qids[i] = next[ctx->qids[i]]++;
+
+    permute_results(res, ctx->qids, D, bs.do_dists);
+    return res;
+}
+
+kdtree_qres_t* MANGLE(kdtree_rangesearch_batch)
+     (const kdtree_t* kd, kdtree_qres_t* res, const void* vqueries, int N,
+      double maxd2, int options, int* starts)
+{
+    kdtree_query_ctx_t ctx;
+    kdtree_qres_t* rtn;
+    anbool newres = (res == NULL);
+
+    if (!kd || !vqueries || !starts || N < 0)
+        return NULL;
+    if (newres) {
+        res = CALLOC(1, sizeof(kdtree_qres_t));
+        if (!res) {
+            SYSERROR("Failed to allocate kdtree_qres_t struct");
+            return NULL;
+        }
+    }
+    // (a context around "res", as in kdtree_rangesearch_options())
+    memset(&ctx, 0, sizeof(kdtree_query_ctx_t));
+    ctx.res = *res;
+    rtn = MANGLE(kdtree_rangesearch_batch_ctx)(kd, &ctx, vqueries, N, maxd2,
+                                               options, starts);
+    *res = ctx.res;
+    FREE(ctx.qids);
+    FREE(ctx.lists);
+    if (!rtn) {
+        if (newres)
+            kdtree_free_query(res);
+        return NULL;
+    }
     return res;
 }
 
+/*
+ The rest is not dimension-specific: it's only compiled once per tree
+ type, not in the KD_DIM versions (which have just the queries).
+ */
+#if !defined(KD_DIM)
 
 static void* get_data(const kdtree_t* kd, int i) {
     return KD_DATA(kd, kd->ndim, i);
@@ -1585,7 +2073,10 @@ static void kdtree_quickselect_partition(dtype *arr, unsigned int *parr,
     /* sanity is good */
     assert(R >= L);
 
-    dtype* tmpdata = malloc(D * sizeof(dtype));
+    // (on the stack unless the points have many dimensions: this is
+    // called for every node of the tree)
+    dtype tmpbuf[KDTREE_MAX_DIM];
+    dtype* tmpdata = (D <= KDTREE_MAX_DIM) ? tmpbuf : malloc(D * sizeof(dtype));
 
     /* Find the "rank"th point and partition the data. */
     /* For us, "rank" is usually the median of L and R. */
@@ -1773,7 +2264,8 @@ static void kdtree_quickselect_partition(dtype *arr, unsigned int *parr,
     for (i=rank; i<=R; i++)
         assert(GET(i) >= GET(rank));
 
-    free(tmpdata);
+    if (tmpdata != tmpbuf)
+        free(tmpdata);
 }
 #undef ELEM_SWAP
 #undef ELEM_ROT
@@ -2157,13 +2649,421 @@ static int needs_data_conversion() {
     return DTYPE_INTEGER && !ETYPE_INTEGER;
 }
 
+// Do the points have to be sorted (by kdtree_qsort(), which isn't
+// reentrant) rather than just partitioned to split the nodes?
+static anbool needs_sort(unsigned int options) {
+    return (options & KD_BUILD_FORCE_SORT) ||
+        (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM));
+}
+
+// The bounding box of each block of points of compute_bb_parallel().
+struct bb_blocks {
+    const dtype* data;
+    int D;
+    int N;
+    int nblocks;
+    dtype* lo;
+    dtype* hi;
+};
+
+static void bb_block_task(void* arg, int task, int thread) {
+    struct bb_blocks* bb = arg;
+    int start = (int)((int64_t)bb->N * task / bb->nblocks);
+    int end   = (int)((int64_t)bb->N * (task + 1) / bb->nblocks);
+    compute_bb(bb->data + (size_t)start * bb->D, bb->D, end - start,
+               bb->lo + task * bb->D, bb->hi + task * bb->D);
+}
+
+/* Same as "compute_bb" but spread over the threads of "pool": the
+ min and max of blocks of the points, then of the blocks. */
+static void compute_bb_parallel(an_pool_t* pool, const dtype* data, int D, int N,
+                                dtype* lo, dtype* hi) {
+    struct bb_blocks bb;
+    int i, d;
+
+    bb.nblocks = MIN(N / KD_PARALLEL_CUTOFF, KD_PARALLEL_TASKS * an_pool_nthreads(pool));
+    if (bb.nblocks < 2) {
+        compute_bb(data, D, N, lo, hi);
+        return;
+    }
+    bb.data = data;
+    bb.D = D;
+    bb.N = N;
+    bb.lo = MALLOC((size_t)bb.nblocks * D * sizeof(dtype));
+    bb.hi = MALLOC((size_t)bb.nblocks * D * sizeof(dtype));
+    an_pool_run(pool, bb.nblocks, bb_block_task, &bb);
+
+    for (d=0; d<D; d++) {
+        hi[d] = DTYPE_MIN;
+        lo[d] = DTYPE_MAX;
+    }
+    for (i=0; i<bb.nblocks; i++)
+        for (d=0; d<D; d++) {
+            if (bb.hi[i*D + d] > hi[d]) hi[d] = bb.hi[i*D + d];
+            if (bb.lo[i*D + d] < lo[d]) lo[d] = bb.lo[i*D + d];
+        }
+    FREE(bb.lo);
+    FREE(bb.hi);
+}
+
+/* Builds interior node "i", whose points are [left, right]: finds its
+ bounding box and splitting plane, and partitions its points.  Returns
+ the first point of its right child (its left child gets [left, m-1]
+ and its right child [m, right]), or -1 on error.  If "pool" is given,
+ the bounding box is computed with its threads. */
+static int build_node(kdtree_t* kd, int i, int left, int right,
+                      unsigned int options, dtype* lo, dtype* hi,
+                      an_pool_t* pool) {
+    int D = kd->ndim;
+    dtype* data = kd->data.DTYPE;
+    unsigned int d;
+    dtype maxrange;
+    ttype s;
+    int dim = 0;
+    int m;
+    dtype qsplit = 0;
+    Unused int xx;
+
+    if (left >= right) {
+        //debug("Empty node %i: left=right=%i\n", i, left);
+        if (options & KD_BUILD_BBOX) {
+            for (d=0; d<D; d++)
+                lo[d] = hi[d] = 0;
+            save_bb(kd, i, lo, hi);
+        }
+        if (kd->splitdim)
+            kd->splitdim[i] = 0;
+        return right + 1;
+    }
+
+    /* More sanity */
+    assert(0 <= left);
+    assert(left <= right);
+    assert(right < kd->ndata);
+
+    /* Find the bounding-box for this node. */
+    if (pool)
+        compute_bb_parallel(pool, KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
+    else
+        compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
+
+    if (options & KD_BUILD_BBOX)
+        save_bb(kd, i, lo, hi);
+
+    /* Split along dimension with largest range */
+    maxrange = DTYPE_MIN;
+    for (d=0; d<D; d++)
+        if ((hi[d] - lo[d]) >= maxrange) {
+            maxrange = hi[d] - lo[d];
+            dim = d;
+        }
+    d = dim;
+    assert (d < D);
+
+    if (needs_sort(options)) {
+        
+        /* We're packing dimension and split location into an int. */
+
+        /* Sort the data. */
+
+        /* Because the nature of the inttree is to bin the split
+         * planes, we have to be careful. Here, we MUST sort instead
+         * of merely partitioning, because we may not be able to
+         * properly represent the median as a split plane. Imagine the
+         * following on the dtype line: 
+         *
+         *    |P P   | P M  | P    |P     |  PP |  ------> X
+         *           1      2
+         * The |'s are possible split positions. If M is selected to
+         * split on, we actually cannot select the split 1 or 2
+         * immediately, because if we selected 2, then M would be on
+         * the wrong side (the medians always go to the right) and we
+         * can't select 1 because then P would be on the wrong side.
+         * So, the solution is to try split 2, and if point M-1 is on
+         * the correct side, great. Otherwise, we have to move shift
+         * point M-1 into the right side and only then chose plane 1. */
+
+
+        /* FIXME but qsort allocates a 2nd perm array GAH */
+        if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
+            ERROR("kdtree_qsort failed");
+            return -1;
+        }
+        m = (1 + (size_t)left + (size_t)right)/2;
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        
+        /* Make sure sort works */
+        for(xx=left; xx<=right-1; xx++) {
+            assert(KD_ARRAY_VAL(data, D, xx,   d) <=
+                   KD_ARRAY_VAL(data, D, xx+1, d));
+        }
+
+        /* Encode split dimension and value. */
+        /* "s" is the location of the splitting plane in the "tree"
+         data type. */
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        if (kd->split.any) {
+            /* If we are using the "split" array to store both the
+             splitting plane and the splitting dimension, then we
+             truncate a few bits from "s" here. */
+            bigint tmps = s;
+            tmps &= kd->splitmask;
+            assert((tmps & kd->dimmask) == 0);
+            s = tmps;
+        }
+        /* "qsplit" is the location of the splitting plane in the "data"
+         type. */
+        qsplit = POINT_TD(kd, d, s);
+
+        /* Play games to make sure we properly partition the data */
+        while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
+        while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
+
+        /* Even more sanity */
+        assert(m >= -1);
+        assert(left <= m);
+        assert(m <= right);
+        for (xx=left; m && xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
+        for (xx=m; xx<=right; xx++)
+            assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
+
+    } else {
+        /* "m-1" becomes R of the left child;
+         "m" becomes L of the right child. */
+        if (kd->has_linear_lr) {
+            m = kdtree_left(kd, KD_CHILD_RIGHT(i));
+        } else {
+            /* Pivot the data at the median */
+            m = (1 + (size_t)left + (size_t)right) / 2;
+        }
+        assert(m >= 0);
+        assert(m >= left);
+        assert(m <= right);
+        kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
+
+        s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
+
+        assert(m != 0);
+        assert(left <= (m-1));
+        assert(m <= right);
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <=
+                   KD_ARRAY_VAL(data, D, m, d));
+        for (xx=left; xx<=m-1; xx++)
+            assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
+        for (xx=m; xx<=right; xx++)
+            assert(KD_ARRAY_VAL(data, D, m, d) <=
+                   KD_ARRAY_VAL(data, D, xx, d));
+        for (xx=m; xx<=right; xx++)
+            assert(s <= KD_ARRAY_VAL(data, D, xx, d));
+    }
+
+    if (kd->split.any) {
+        if (kd->splitdim)
+            *KD_SPLIT(kd, i) = s;
+        else {
+            bigint tmps = s;
+            *KD_SPLIT(kd, i) = tmps | dim;
+        }
+    }
+    if (kd->splitdim)
+        kd->splitdim[i] = dim;
+    return m;
+}
+
+/* Builds the subtree of interior node "i" (at "level"), whose points
+ are [left, right], and sets the "lr" of its leaves. */
+static void build_subtree(kdtree_t* kd, int i, int level, int maxlevel,
+                          int left, int right, unsigned int options,
+                          dtype* lo, dtype* hi) {
+    int m = build_node(kd, i, left, right, options, lo, hi, NULL);
+    assert(m >= 0);
+    if (level == maxlevel - 2) {
+        int c = 2*i - kd->ninterior;
+        kd->lr[c+1] = m-1;
+        kd->lr[c+2] = right;
+        return;
+    }
+    build_subtree(kd, KD_CHILD_LEFT(i),  level+1, maxlevel, left, m-1,
+                  options, lo, hi);
+    build_subtree(kd, KD_CHILD_RIGHT(i), level+1, maxlevel, m, right,
+                  options, lo, hi);
+}
+
+// A level of the tree, for build_parallel().
+struct build_level {
+    kdtree_t* kd;
+    unsigned int options;
+    int level;
+    int maxlevel;
+    // node (first + j) of the level has points [left[j], right[j]]...
+    int first;
+    int* left;
+    int* right;
+    // ... and, once built, its right child starts at mid[j].
+    int* mid;
+};
+
+static void build_node_task(void* arg, int task, int thread) {
+    struct build_level* bl = arg;
+    dtype lo[KDTREE_MAX_DIM], hi[KDTREE_MAX_DIM];
+    bl->mid[task] = build_node(bl->kd, bl->first + task, bl->left[task],
+                               bl->right[task], bl->options, lo, hi, NULL);
+}
+
+static void build_subtree_task(void* arg, int task, int thread) {
+    struct build_level* bl = arg;
+    dtype lo[KDTREE_MAX_DIM], hi[KDTREE_MAX_DIM];
+    build_subtree(bl->kd, bl->first + task, bl->level, bl->maxlevel,
+                  bl->left[task], bl->right[task], bl->options, lo, hi);
+}
+
+static void leaf_bb_task(void* arg, int task, int thread) {
+    kdtree_t* kd = arg;
+    dtype lo[KDTREE_MAX_DIM], hi[KDTREE_MAX_DIM];
+    int i, L, R;
+    int start = task * KD_PARALLEL_LEAVES;
+    int end = MIN(start + KD_PARALLEL_LEAVES, kd->nbottom);
+    for (i=start; i<end; i++) {
+        L = (i == 0) ? 0 : kd->lr[i-1] + 1;
+        R = kd->lr[i];
+        compute_bb(KD_DATA(kd, kd->ndim, L), kd->ndim, R - L + 1, lo, hi);
+        save_bb(kd, i + kd->ninterior, lo, hi);
+    }
+}
+
+/*
+ Builds the interior nodes of the tree, and sets the "lr" of the leaves,
+ with the threads of "pool" (the KD_BUILD_PARALLEL version of the loop
+ in kdtree_build_2).
+
+ A node only ever moves the points of its own range, so whatever the
+ order the nodes are built in, each one is built from the same points
+ in the same order as by the loop, and the tree comes out the same, bit
+ for bit.  The levels at the top, of fewer nodes than threads, are built
+ one node at a time, each with its bounding box computed in parallel;
+ the next ones, one node per task; and from the level that has
+ KD_PARALLEL_TASKS nodes per thread, each task builds a whole subtree.
+ */
+static void build_parallel(kdtree_t* kd, an_pool_t* pool, int maxlevel,
+                           unsigned int options, dtype* lo, dtype* hi) {
+    struct build_level bl;
+    int nthreads = an_pool_nthreads(pool);
+    int nmax, n, j;
+
+    // the most nodes on a level before the subtrees are split off.
+    nmax = 1;
+    while (nmax < KD_PARALLEL_TASKS * nthreads)
+        nmax *= 2;
+
+    bl.kd = kd;
+    bl.options = options;
+    bl.maxlevel = maxlevel;
+    bl.left  = MALLOC(nmax * sizeof(int));
+    bl.right = MALLOC(nmax * sizeof(int));
+    bl.mid   = MALLOC(nmax * sizeof(int));
+    bl.left[0] = 0;
+    bl.right[0] = kd->ndata - 1;
+
+    for (bl.level = 0, n = 1; bl.level <= maxlevel - 2; bl.level++, n *= 2) {
+        bl.first = n - 1;
+        if (n == nmax) {
+            an_pool_run(pool, n, build_subtree_task, &bl);
+            break;
+        }
+        if (n < nthreads) {
+            for (j=0; j<n; j++)
+                bl.mid[j] = build_node(kd, bl.first + j, bl.left[j], bl.right[j],
+                                       options, lo, hi, pool);
+        } else
+            an_pool_run(pool, n, build_node_task, &bl);
+
+        if (bl.level == maxlevel - 2) {
+            // the children are leaves.
+            for (j=0; j<n; j++) {
+                kd->lr[2*j]   = bl.mid[j] - 1;
+                kd->lr[2*j+1] = bl.right[j];
+            }
+            break;
+        }
+        // (backwards, so as to not overwrite the nodes of this level)
+        for (j=n-1; j>=0; j--) {
+            assert(bl.mid[j] >= 0);
+            bl.left [2*j+1] = bl.mid[j];
+            bl.right[2*j+1] = bl.right[j];
+            bl.right[2*j]   = bl.mid[j] - 1;
+            bl.left [2*j]   = bl.left[j];
+        }
+    }
+    FREE(bl.left);
+    FREE(bl.right);
+    FREE(bl.mid);
+}
+
+/* Builds the interior nodes of the tree, and sets the "lr" of the
+ leaves, one node at a time.  Returns 0 on success. */
+static int build_serial(kdtree_t* kd, int maxlevel, unsigned int options,
+                        dtype* lo, dtype* hi) {
+    int i;
+    int lnext, level;
+
+    /* Use the lr array as a stack while building. In place in your face! */
+    kd->lr[0] = kd->ndata - 1;
+    lnext = 1;
+    level = 0;
+
+    /* And in one shot, make the kdtree. Because the lr pointers
+     * are only stored for the bottom layer, we use the lr array as a
+     * stack. At finish, it contains the r pointers for the bottom nodes.
+     * The l pointer is simply +1 of the previous right pointer, or 0 if we
+     * are at the first element of the lr array. */
+    for (i = 0; i < kd->ninterior; i++) {
+        int left, right;
+        unsigned int c;
+        int m;
+
+        /* Have we reached the next level in the tree? */
+        if (i == lnext) {
+            level++;
+            lnext = lnext * 2 + 1;
+        }
+
+        /* Since we're not storing the L pointers, we have to infer L */
+        if (i == (1<<level)-1) {
+            left = 0;
+        } else {
+            left = kd->lr[i-1] + 1;
+        }
+        right = kd->lr[i];
+
+        assert(right != (unsigned int)-1);
+
+        m = build_node(kd, i, left, right, options, lo, hi, NULL);
+        if (m < 0)
+            return -1;
+
+        /* Store the R pointers for each child */
+        c = 2*i;
+        if (level == maxlevel - 2)
+            c -= kd->ninterior;
+
+        kd->lr[c+1] = m-1;
+        kd->lr[c+2] = right;
+
+        assert(c+2 < kd->nbottom);
+    }
+    return 0;
+}
+
 kdtree_t* MANGLE(kdtree_build_2)
      (kdtree_t* kd, etype* indata, int N, int D, int Nleaf, int treetype, unsigned int options, double* minval, double* maxval) {
     int i;
-    int xx;
-    int lnext, level;
     int maxlevel;
-    dtype* data = NULL;
+    an_pool_t* pool = NULL;
 
     maxlevel = kdtree_compute_levels(N, Nleaf);
 
@@ -2283,214 +3183,27 @@ kdtree_t* MANGLE(kdtree_build_2)
     if (options & KD_BUILD_LINEAR_LR)
         kd->has_linear_lr = TRUE;
 
-    /* Use the lr array as a stack while building. In place in your face! */
-    kd->lr[0] = N - 1;
-    lnext = 1;
-    level = 0;
-
-    // shorthand
-    data = kd->data.DTYPE;
-
     dtype* hi = malloc(D * sizeof(dtype));
     dtype* lo = malloc(D * sizeof(dtype));
 
-    dtype* nullbb = malloc(D * sizeof(dtype));
-    for (i = 0; i < D; i++)
-        nullbb[i] = 0;
-
-    /* And in one shot, make the kdtree. Because the lr pointers
-     * are only stored for the bottom layer, we use the lr array as a
-     * stack. At finish, it contains the r pointers for the bottom nodes.
-     * The l pointer is simply +1 of the previous right pointer, or 0 if we
-     * are at the first element of the lr array. */
-    for (i = 0; i < kd->ninterior; i++) {
-        unsigned int d;
-        int left, right;
-        dtype maxrange;
-        ttype s;
-        unsigned int c;
-        int dim = 0;
-        int m;
-        dtype qsplit = 0;
-
-        /* Have we reached the next level in the tree? */
-        if (i == lnext) {
-            level++;
-            lnext = lnext * 2 + 1;
-        }
-
-        /* Since we're not storing the L pointers, we have to infer L */
-        if (i == (1<<level)-1) {
-            left = 0;
-        } else {
-            left = kd->lr[i-1] + 1;
-        }
-        right = kd->lr[i];
-
-        assert(right != (unsigned int)-1);
-
-        if (left >= right) {
-            //debug("Empty node %i: left=right=%i\n", i, left);
-            if (options & KD_BUILD_BBOX)
-                save_bb(kd, i, nullbb, nullbb);
-            if (kd->splitdim)
-                kd->splitdim[i] = 0;
-            c = 2*i;
-            if (level == maxlevel - 2)
-                c -= kd->ninterior;
-            kd->lr[c+1] = right;
-            kd->lr[c+2] = right;
-            continue;
-        }
-
-        /* More sanity */
-        assert(0 <= left);
-        assert(left <= right);
-        assert(right < N);
-
-        /* Find the bounding-box for this node. */
-        compute_bb(KD_DATA(kd, D, left), D, right - left + 1, lo, hi);
-
-        if (options & KD_BUILD_BBOX)
-            save_bb(kd, i, lo, hi);
-
-        /* Split along dimension with largest range */
-        maxrange = DTYPE_MIN;
-        for (d=0; d<D; d++)
-            if ((hi[d] - lo[d]) >= maxrange) {
-                maxrange = hi[d] - lo[d];
-                dim = d;
-            }
-        d = dim;
-        assert (d < D);
-
-        if ((options & KD_BUILD_FORCE_SORT) ||
-            (TTYPE_INTEGER && !(options & KD_BUILD_SPLITDIM))) {
-            
-            /* We're packing dimension and split location into an int. */
-
-            /* Sort the data. */
-
-            /* Because the nature of the inttree is to bin the split
-             * planes, we have to be careful. Here, we MUST sort instead
-             * of merely partitioning, because we may not be able to
-             * properly represent the median as a split plane. Imagine the
-             * following on the dtype line: 
-             *
-             *    |P P   | P M  | P    |P     |  PP |  ------> X
-             *           1      2
-             * The |'s are possible split positions. If M is selected to
-             * split on, we actually cannot select the split 1 or 2
-             * immediately, because if we selected 2, then M would be on
-             * the wrong side (the medians always go to the right) and we
-             * can't select 1 because then P would be on the wrong side.
-             * So, the solution is to try split 2, and if point M-1 is on
-             * the correct side, great. Otherwise, we have to move shift
-             * point M-1 into the right side and only then chose plane 1. */
-
-
-            /* FIXME but qsort allocates a 2nd perm array GAH */
-            if (kdtree_qsort(data, kd->perm, left, right, D, dim)) {
-                ERROR("kdtree_qsort failed");
-                // FIXME: memleak mania!
-                free(hi);
-                free(lo);
-                free(nullbb);
-                return NULL;
-            }
-            m = (1 + (size_t)left + (size_t)right)/2;
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            
-            /* Make sure sort works */
-            for(xx=left; xx<=right-1; xx++) {
-                assert(KD_ARRAY_VAL(data, D, xx,   d) <=
-                       KD_ARRAY_VAL(data, D, xx+1, d));
-            }
-
-            /* Encode split dimension and value. */
-            /* "s" is the location of the splitting plane in the "tree"
-             data type. */
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            if (kd->split.any) {
-                /* If we are using the "split" array to store both the
-                 splitting plane and the splitting dimension, then we
-                 truncate a few bits from "s" here. */
-                bigint tmps = s;
-                tmps &= kd->splitmask;
-                assert((tmps & kd->dimmask) == 0);
-                s = tmps;
-            }
-            /* "qsplit" is the location of the splitting plane in the "data"
-             type. */
-            qsplit = POINT_TD(kd, d, s);
-
-            /* Play games to make sure we properly partition the data */
-            while (m < right && KD_ARRAY_VAL(data, D, m, d) < qsplit) m++;
-            while (left < m  && qsplit < KD_ARRAY_VAL(data, D, m-1, d)) m--;
-
-            /* Even more sanity */
-            assert(m >= -1);
-            assert(left <= m);
-            assert(m <= right);
-            for (xx=left; m && xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= qsplit);
-            for (xx=m; xx<=right; xx++)
-                assert(qsplit <= KD_ARRAY_VAL(data, D, xx, d));
-
-        } else {
-            /* "m-1" becomes R of the left child;
-             "m" becomes L of the right child. */
-            if (kd->has_linear_lr) {
-                m = kdtree_left(kd, KD_CHILD_RIGHT(i));
-            } else {
-                /* Pivot the data at the median */
-                m = (1 + (size_t)left + (size_t)right) / 2;
-            }
-            assert(m >= 0);
-            assert(m >= left);
-            assert(m <= right);
-            kdtree_quickselect_partition(data, kd->perm, left, right, D, dim, m);
-
-            s = POINT_DT(kd, d, KD_ARRAY_VAL(data, D, m, d), KD_ROUND);
-
-            assert(m != 0);
-            assert(left <= (m-1));
-            assert(m <= right);
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <=
-                       KD_ARRAY_VAL(data, D, m, d));
-            for (xx=left; xx<=m-1; xx++)
-                assert(KD_ARRAY_VAL(data, D, xx, d) <= s);
-            for (xx=m; xx<=right; xx++)
-                assert(KD_ARRAY_VAL(data, D, m, d) <=
-                       KD_ARRAY_VAL(data, D, xx, d));
-            for (xx=m; xx<=right; xx++)
-                assert(s <= KD_ARRAY_VAL(data, D, xx, d));
-        }
-
-        if (kd->split.any) {
-            if (kd->splitdim)
-                *KD_SPLIT(kd, i) = s;
-            else {
-                bigint tmps = s;
-                *KD_SPLIT(kd, i) = tmps | dim;
-            }
+    if ((options & KD_BUILD_PARALLEL) && !needs_sort(options) &&
+        (N >= 2 * KD_PARALLEL_CUTOFF) && (maxlevel > 1)) {
+        pool = an_pool_new(0);
+        if (an_pool_nthreads(pool) > 1)
+            debug("Building kdtree with %i threads\n", an_pool_nthreads(pool));
+        else {
+            an_pool_free(pool);
+            pool = NULL;
         }
-        if (kd->splitdim)
-            kd->splitdim[i] = dim;
-
-        /* Store the R pointers for each child */
-        c = 2*i;
-        if (level == maxlevel - 2)
-            c -= kd->ninterior;
-
-        kd->lr[c+1] = m-1;
-        kd->lr[c+2] = right;
+    }
 
-        assert(c+2 < kd->nbottom);
+    if (pool)
+        build_parallel(kd, pool, maxlevel, options, lo, hi);
+    else if (build_serial(kd, maxlevel, options, lo, hi)) {
+        // FIXME: memleak mania!
+        free(hi);
+        free(lo);
+        return NULL;
     }
 
     for (i=0; i<kd->nbottom-1; i++)
@@ -2498,14 +3211,19 @@ kdtree_t* MANGLE(kdtree_build_2)
 
     if (options & KD_BUILD_BBOX) {
         // Compute bounding boxes for leaf nodes.
-        int L, R = -1;
-        for (i=0; i<kd->nbottom; i++) {
-            L = R + 1;
-            R = kd->lr[i];
-            assert(L == kdtree_leaf_left(kd, i + kd->ninterior));
-            assert(R == kdtree_leaf_right(kd, i + kd->ninterior));
-            compute_bb(KD_DATA(kd, D, L), D, R - L + 1, lo, hi);
-            save_bb(kd, i + kd->ninterior, lo, hi);
+        if (pool)
+            an_pool_run(pool, (kd->nbottom + KD_PARALLEL_LEAVES - 1) / KD_PARALLEL_LEAVES,
+                        leaf_bb_task, kd);
+        else {
+            int L, R = -1;
+            for (i=0; i<kd->nbottom; i++) {
+                L = R + 1;
+                R = kd->lr[i];
+                assert(L == kdtree_leaf_left(kd, i + kd->ninterior));
+                assert(R == kdtree_leaf_right(kd, i + kd->ninterior));
+                compute_bb(KD_DATA(kd, D, L), D, R - L + 1, lo, hi);
+                save_bb(kd, i + kd->ninterior, lo, hi);
+            }
         }
 
         // check that it worked...
@@ -2537,11 +3255,11 @@ kdtree_t* MANGLE(kdtree_build_2)
     }
 
     // set function table pointers.
-    MANGLE(kdtree_update_funcs)(kd);
+    kdtree_update_funcs(kd);
 
+    an_pool_free(pool);
     free(hi);
     free(lo);
-    free(nullbb);
 
     return kd;
 }
@@ -2963,6 +3681,22 @@ int MANGLE(kdtree_get_bboxes)(const kdtree_t* kd, int node,
     return TRUE;
 }
 
+#endif // !KD_DIM
+
+#if defined(KD_DIM)
+/*
+ Installs the queries compiled for KD_DIM dimensions, over those set by
+ the generic version of this tree type.
+ */
+void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
+    assert(kd->ndim == KD_DIM);
+    kd->fun.nearest_neighbour_internal = MANGLE(kdtree_nn);
+    kd->fun.rangesearch = MANGLE(kdtree_rangesearch_options);
+    kd->fun.rangesearch_batch = MANGLE(kdtree_rangesearch_batch);
+    kd->fun.rangesearch_ctx = MANGLE(kdtree_rangesearch_ctx);
+    kd->fun.rangesearch_batch_ctx = MANGLE(kdtree_rangesearch_batch_ctx);
+}
+#else
 void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
     kd->fun.get_data = get_data;
     kd->fun.copy_data_double = copy_data_double;
@@ -2972,6 +3706,11 @@ void MANGLE(kdtree_update_funcs)(kdtree_t* kd) {
     kd->fun.fix_bounding_boxes = MANGLE(kdtree_fix_bounding_boxes);
     kd->fun.nearest_neighbour_internal = MANGLE(kdtree_nn);
     kd->fun.rangesearch = MANGLE(kdtree_rangesearch_options);
+    kd->fun.rangesearch_batch = MANGLE(kdtree_rangesearch_batch);
+    kd->fun.rangesearch_ctx = MANGLE(kdtree_rangesearch_ctx);
+    kd->fun.rangesearch_batch_ctx = MANGLE(kdtree_rangesearch_batch_ctx);
     kd->fun.nodes_contained = MANGLE(kdtree_nodes_contained);
+    kd->fun.leaf_scan = kdtree_get_leaf_scan(kd->treetype, kd->ndim);
 }
+#endif
 
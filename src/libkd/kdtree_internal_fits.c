@@ -3,7 +3,8 @@
  # Licensed under a 3-clause BSD style license - see LICENSE
  */
 
-#ifndef KDTREE_NO_FITS
+// (not in the KD_DIM versions, which only have the queries)
+#if !defined(KDTREE_NO_FITS) && !defined(KD_DIM)
 
 #include "kdtree_fits_io.h"
 #include "kdtree.h"
@@ -0,0 +1,173 @@
+/*
+ # This file is part of libkd.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ Leaf scans of range searches, 4 points at a time with AVX, for the
+ trees of index files: 3-dimensional star trees and 4-dimensional code
+ trees, with "double" external type and points stored as u16, u32 or
+ doubles.  The squared distances are computed with the operations of
+ dist2_bailout() in kdtree_internal.c, in the same order (and without
+ fused multiply-adds), so they are the same, bit for bit; a point is in
+ range unless its distance is greater than the maximum, as there.
+ Define AN_NO_SIMD to build without them.
+ */
+
+#include <stdint.h>
+
+#include "os-features.h"
+#include "an-bool.h"
+#include "kdtree.h"
+#include "kdtree_internal.h"
+
+#if !defined(AN_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define KD_LEAF_X86 1
+#include <immintrin.h>
+#endif
+
+#ifdef KD_LEAF_X86
+
+// Coordinate "d" of the 4 "D"-dimensional points at "p", as doubles.
+__attribute__((target("avx"), always_inline))
+static inline __m256d load4_u16(const uint16_t* p, int D, int d) {
+    return _mm256_cvtepi32_pd(_mm_setr_epi32(p[d], p[D + d], p[2*D + d],
+                                             p[3*D + d]));
+}
+
+__attribute__((target("avx"), always_inline))
+static inline __m256d load4_u32(const uint32_t* p, int D, int d) {
+    // (there's no unsigned conversion: the values are shifted by 2^31,
+    // converted as signed ints and shifted back, which is exact)
+    __m128i v = _mm_setr_epi32((int)p[d], (int)p[D + d], (int)p[2*D + d],
+                               (int)p[3*D + d]);
+    v = _mm_xor_si128(v, _mm_set1_epi32(INT32_MIN));
+    return _mm256_add_pd(_mm256_cvtepi32_pd(v), _mm256_set1_pd(2147483648.0));
+}
+
+__attribute__((target("avx"), always_inline))
+static inline __m256d load4_double(const double* p, int D, int d) {
+    return _mm256_setr_pd(p[d], p[D + d], p[2*D + d], p[3*D + d]);
+}
+
+// Coordinate "d" of the point at "p", as stored.
+static inline double load1(const void* p, int datatype, int d) {
+    switch (datatype) {
+    case KDT_DATA_U16:
+        return ((const uint16_t*)p)[d];
+    case KDT_DATA_U32:
+        return ((const uint32_t*)p)[d];
+    default:
+        return ((const double*)p)[d];
+    }
+}
+
+/*
+ The scan, for data type "datatype" in "D" dimensions: both are
+ constants in the callers below, so each gets its own version, with the
+ loops over the dimensions unrolled.
+ */
+__attribute__((target("avx"), always_inline))
+static inline int leaf_scan_avx(const kdtree_t* kd, int start, int n,
+                                const double* query, double maxd2,
+                                int* hits, double* d2s,
+                                int datatype, int D) {
+    const anbool scaled = (datatype != KDT_DATA_DOUBLE);
+    size_t psize = (datatype == KDT_DATA_U16 ? sizeof(uint16_t) :
+                    datatype == KDT_DATA_U32 ? sizeof(uint32_t) :
+                    sizeof(double));
+    const char* data = (const char*)kd->data.any + (size_t)start * D * psize;
+    __m256d q[4], lo[4];
+    __m256d invscale = _mm256_set1_pd(kd->invscale);
+    __m256d vmaxd2 = _mm256_set1_pd(maxd2);
+    double d2buf[4];
+    int i, j, d, nhits = 0;
+
+    for (d = 0; d < D; d++) {
+        q[d] = _mm256_set1_pd(query[d]);
+        lo[d] = _mm256_set1_pd(scaled ? kd->minval[d] : 0.0);
+    }
+    for (i = 0; i + 4 <= n; i += 4) {
+        const char* p = data + (size_t)i * D * psize;
+        __m256d d2 = _mm256_setzero_pd();
+        int mask;
+        for (d = 0; d < D; d++) {
+            __m256d pp, delta;
+            if (datatype == KDT_DATA_U16)
+                pp = load4_u16((const uint16_t*)p, D, d);
+            else if (datatype == KDT_DATA_U32)
+                pp = load4_u32((const uint32_t*)p, D, d);
+            else
+                pp = load4_double((const double*)p, D, d);
+            if (scaled)
+                pp = _mm256_add_pd(_mm256_mul_pd(pp, invscale), lo[d]);
+            delta = _mm256_sub_pd(q[d], pp);
+            d2 = _mm256_add_pd(d2, _mm256_mul_pd(delta, delta));
+        }
+        mask = _mm256_movemask_pd(_mm256_cmp_pd(d2, vmaxd2, _CMP_NGT_UQ));
+        if (!mask)
+            continue;
+        _mm256_storeu_pd(d2buf, d2);
+        for (j = 0; j < 4; j++)
+            if (mask & (1 << j)) {
+                hits[nhits] = start + i + j;
+                d2s[nhits] = d2buf[j];
+                nhits++;
+            }
+    }
+    for (; i < n; i++) {
+        const char* p = data + (size_t)i * D * psize;
+        double d2 = 0.0;
+        for (d = 0; d < D; d++) {
+            double pp = load1(p, datatype, d);
+            double delta;
+            if (scaled)
+                pp = pp * kd->invscale + kd->minval[d];
+            delta = query[d] - pp;
+            d2 += delta * delta;
+        }
+        if (d2 > maxd2)
+            continue;
+        hits[nhits] = start + i;
+        d2s[nhits] = d2;
+        nhits++;
+    }
+    return nhits;
+}
+
+#define LEAF_SCAN(name, datatype, D)                                    \
+    __attribute__((target("avx")))                                      \
+    static int name(const kdtree_t* kd, int start, int n,               \
+                    const double* query, double maxd2,                  \
+                    int* hits, double* d2s) {                           \
+        return leaf_scan_avx(kd, start, n, query, maxd2, hits, d2s,     \
+                             datatype, D);                              \
+    }
+
+LEAF_SCAN(leaf_scan_u16_3, KDT_DATA_U16, 3)
+LEAF_SCAN(leaf_scan_u16_4, KDT_DATA_U16, 4)
+LEAF_SCAN(leaf_scan_u32_3, KDT_DATA_U32, 3)
+LEAF_SCAN(leaf_scan_u32_4, KDT_DATA_U32, 4)
+LEAF_SCAN(leaf_scan_double_3, KDT_DATA_DOUBLE, 3)
+LEAF_SCAN(leaf_scan_double_4, KDT_DATA_DOUBLE, 4)
+
+#endif
+
+kdtree_leaf_scan_t kdtree_get_leaf_scan(int treetype, int D) {
+#ifdef KD_LEAF_X86
+    if (!__builtin_cpu_supports("avx"))
+        return NULL;
+    if ((treetype & KDT_EXT_MASK) != KDT_EXT_DOUBLE)
+        return NULL;
+    switch (treetype & KDT_DATA_MASK) {
+    case KDT_DATA_U16:
+        return (D == 3 ? leaf_scan_u16_3 : D == 4 ? leaf_scan_u16_4 : NULL);
+    case KDT_DATA_U32:
+        return (D == 3 ? leaf_scan_u32_3 : D == 4 ? leaf_scan_u32_4 : NULL);
+    case KDT_DATA_DOUBLE:
+        return (D == 3 ? leaf_scan_double_3 : D == 4 ? leaf_scan_double_4 : NULL);
+    }
+#endif
+    return NULL;
+}
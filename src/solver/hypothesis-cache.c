@@ -0,0 +1,127 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "hypothesis-cache.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "sip.h"
+#include "errors.h"
+
+#define MIN_CAP 256
+
+void hypothesis_key(int32_t* key, const MatchObj* mo, double tol,
+                    double field_radius) {
+    // size of the cells of the scale (relative) and rotation (radians):
+    // "tol" pixels at the edge of the field...
+    double rel = tol / field_radius;
+    // ... and of the center, in radians on the sky (the same for all the
+    // matches in a scale cell, or they'd be on different grids).
+    int32_t scalekey = (int32_t)floor(log(mo->scale) / rel);
+    double cell = arcsec2rad(tol * exp(scalekey * rel));
+    int i;
+    for (i = 0; i < 3; i++)
+        key[i] = (int32_t)floor(mo->center[i] / cell);
+    key[3] = scalekey;
+    key[4] = (int32_t)floor(deg2rad(tan_get_orientation(&(mo->wcstan))) / rel);
+    key[5] = mo->parity;
+}
+
+uint32_t hypothesis_key_hash(const int32_t* key) {
+    // FNV-1a over the key words.
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < HYPOTHESIS_KEY_SIZE; i++) {
+        h ^= (uint32_t)key[i];
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+const hypothesis_t* hypothesis_cache_find(const hypothesis_cache_t* cache,
+                                          const int32_t* key,
+                                          int indexid, int healpix,
+                                          double logodds_accept) {
+    uint32_t mask, i;
+    if (!cache->n)
+        return NULL;
+    mask = cache->cap - 1;
+    // (all the hypotheses with this key are in the run of used slots
+    // that starts at its hash)
+    for (i = hypothesis_key_hash(key) & mask; cache->used[i]; i = (i + 1) & mask) {
+        const hypothesis_t* h = cache->entries + i;
+        if (memcmp(h->key, key, sizeof(h->key)))
+            continue;
+        if (((h->indexid == indexid) && (h->healpix == healpix)) ||
+            (h->logodds >= logodds_accept))
+            return h;
+    }
+    return NULL;
+}
+
+static void insert(hypothesis_cache_t* cache, const hypothesis_t* h) {
+    uint32_t mask = cache->cap - 1;
+    uint32_t i;
+    for (i = hypothesis_key_hash(h->key) & mask; cache->used[i]; i = (i + 1) & mask);
+    cache->entries[i] = *h;
+    cache->used[i] = 1;
+    cache->n++;
+}
+
+static int grow(hypothesis_cache_t* cache) {
+    hypothesis_t* oldentries = cache->entries;
+    uint8_t* oldused = cache->used;
+    int oldcap = cache->cap;
+    int i, cap;
+
+    cap = MAX(MIN_CAP, 2 * oldcap);
+    cache->entries = malloc(cap * sizeof(hypothesis_t));
+    cache->used = calloc(cap, 1);
+    if (!cache->entries || !cache->used) {
+        SYSERROR("Failed to allocate a cache of %i hypotheses", cap);
+        free(cache->entries);
+        free(cache->used);
+        cache->entries = oldentries;
+        cache->used = oldused;
+        return -1;
+    }
+    cache->cap = cap;
+    cache->n = 0;
+    for (i = 0; i < oldcap; i++)
+        if (oldused[i])
+            insert(cache, oldentries + i);
+    free(oldentries);
+    free(oldused);
+    return 0;
+}
+
+int hypothesis_cache_add(hypothesis_cache_t* cache, const int32_t* key,
+                         int indexid, int healpix, double logodds) {
+    hypothesis_t h;
+    // (keep the table at most half full)
+    if ((2 * (cache->n + 1) > cache->cap) && grow(cache))
+        return -1;
+    memcpy(h.key, key, sizeof(h.key));
+    h.indexid = indexid;
+    h.healpix = healpix;
+    h.logodds = logodds;
+    insert(cache, &h);
+    return 0;
+}
+
+void hypothesis_cache_clear(hypothesis_cache_t* cache) {
+    if (cache->n)
+        memset(cache->used, 0, cache->cap);
+    cache->n = 0;
+}
+
+void hypothesis_cache_free(hypothesis_cache_t* cache) {
+    free(cache->entries);
+    free(cache->used);
+    memset(cache, 0, sizeof(hypothesis_cache_t));
+}
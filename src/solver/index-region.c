@@ -0,0 +1,120 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "index-region.h"
+#include "healpix.h"
+#include "starutil.h"
+#include "mathutil.h"
+#include "bl.h"
+#include "log.h"
+#include "errors.h"
+
+// Limits on the healpix resolution: 12 * 128^2 = 196608 healpixes.
+#define MIN_NSIDE 1
+#define MAX_NSIDE 128
+
+// "inrange" states
+#define HP_UNKNOWN 0
+#define HP_IN 1
+#define HP_OUT 2
+
+index_region_t* index_region_new(index_t* index) {
+    index_region_t* region;
+    unsigned int stars[DQMAX];
+    double A[3], B[3], mid[3];
+    int i, nquads, nside;
+
+    // healpixes about the size of the largest quads.
+    nside = (int)healpix_nside_for_side_length_arcmin(index->index_scale_upper / 60.0);
+    nside = MAX(MIN_NSIDE, MIN(MAX_NSIDE, nside));
+
+    region = calloc(1, sizeof(index_region_t));
+    if (!region) {
+        SYSERROR("Failed to allocate index region");
+        return NULL;
+    }
+    nquads = quadfile_nquads(index->quads);
+    region->index = index;
+    region->nside = nside;
+    region->quadhp = malloc((nquads ? nquads : 1) * sizeof(int));
+    region->inrange = malloc(12 * nside * nside);
+    if (!region->quadhp || !region->inrange) {
+        SYSERROR("Failed to allocate index region for %i quads", nquads);
+        index_region_free(region);
+        return NULL;
+    }
+    // no circle yet.
+    region->r2 = -1.0;
+
+    for (i = 0; i < nquads; i++) {
+        if (quadfile_get_stars(index->quads, i, stars) ||
+            startree_get(index->starkd, stars[0], A) ||
+            startree_get(index->starkd, stars[1], B)) {
+            ERROR("Failed to get the stars of quad %i of index %s", i, index->indexname);
+            index_region_free(region);
+            return NULL;
+        }
+        star_midpoint(mid, A, B);
+        region->quadhp[i] = xyzarrtohealpix(mid, nside);
+    }
+    logverb("Index %s: filed %i quads into healpixes with nside %i\n",
+            index->indexname, nquads, nside);
+    return region;
+}
+
+void index_region_free(index_region_t* region) {
+    if (!region)
+        return;
+    free(region->quadhp);
+    free(region->inrange);
+    free(region);
+}
+
+void index_region_set_circle(index_region_t* region, const double* centerxyz,
+                             double r2) {
+    il* queue;
+    double radius;
+    int neigh[8];
+    int i, j, n, hp, nside;
+
+    if ((region->r2 == r2) &&
+        (memcmp(region->centerxyz, centerxyz, 3 * sizeof(double)) == 0))
+        return;
+
+    nside = region->nside;
+    memset(region->inrange, HP_UNKNOWN, 12 * nside * nside);
+    memcpy(region->centerxyz, centerxyz, 3 * sizeof(double));
+    region->r2 = r2;
+
+    // (a bit of margin, since healpix_distance_to_xyz() is approximate.)
+    radius = distsq2deg(r2) + healpix_side_length_arcmin(nside) / 60.0 * 0.01;
+
+    // The healpixes that touch the circle are connected: flood-fill
+    // from the one containing its center.
+    queue = il_new(256);
+    hp = xyzarrtohealpix(centerxyz, nside);
+    region->inrange[hp] = HP_IN;
+    il_append(queue, hp);
+    for (i = 0; i < il_size(queue); i++) {
+        hp = il_get(queue, i);
+        n = healpix_get_neighbours(hp, neigh, nside);
+        for (j = 0; j < n; j++) {
+            if (region->inrange[neigh[j]] != HP_UNKNOWN)
+                continue;
+            if (healpix_within_range_of_xyz(neigh[j], nside, centerxyz, radius)) {
+                region->inrange[neigh[j]] = HP_IN;
+                il_append(queue, neigh[j]);
+            } else
+                region->inrange[neigh[j]] = HP_OUT;
+        }
+    }
+    debug("%zu of %i healpixes (nside %i) within %g deg of the center\n",
+          il_size(queue), 12 * nside * nside, nside, radius);
+    il_free(queue);
+}
@@ -0,0 +1,177 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "os-features.h"
+#include "match-queue.h"
+#include "mathutil.h"
+#include "errors.h"
+
+// Does the match in slot "a" come out before that in slot "b"?
+static anbool before(const match_queue_t* q, int a, int b) {
+    const match_queue_entry_t* ea = q->slots + a;
+    const match_queue_entry_t* eb = q->slots + b;
+    if (ea->mo.code_err != eb->mo.code_err)
+        return (ea->mo.code_err < eb->mo.code_err);
+    return (ea->seq < eb->seq);
+}
+
+static void sift_up(match_queue_t* q, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        int tmp;
+        if (!before(q, q->heap[i], q->heap[parent]))
+            break;
+        tmp = q->heap[i];
+        q->heap[i] = q->heap[parent];
+        q->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void sift_down(match_queue_t* q, int i) {
+    for (;;) {
+        int left = 2 * i + 1;
+        int best = i;
+        int tmp;
+        if ((left < q->n) && before(q, q->heap[left], q->heap[best]))
+            best = left;
+        if ((left + 1 < q->n) && before(q, q->heap[left + 1], q->heap[best]))
+            best = left + 1;
+        if (best == i)
+            break;
+        tmp = q->heap[i];
+        q->heap[i] = q->heap[best];
+        q->heap[best] = tmp;
+        i = best;
+    }
+}
+
+int match_queue_init(match_queue_t* q, int cap) {
+    int i;
+    cap = MAX(1, cap);
+    if (!q->mutex)
+        q->mutex = an_mutex_new();
+    if (!q->notempty)
+        q->notempty = an_cond_new();
+    if (!q->notfull)
+        q->notfull = an_cond_new();
+    if (cap != q->cap) {
+        free(q->slots);
+        free(q->heap);
+        free(q->freeslots);
+        q->slots = malloc(cap * sizeof(match_queue_entry_t));
+        q->heap = malloc(cap * sizeof(int));
+        q->freeslots = malloc(cap * sizeof(int));
+        q->cap = ((q->slots && q->heap && q->freeslots) ? cap : 0);
+    }
+    if (!q->cap) {
+        SYSERROR("Failed to allocate a queue of %i matches", cap);
+        return -1;
+    }
+    for (i = 0; i < q->cap; i++)
+        q->freeslots[i] = i;
+    q->n = 0;
+    q->npushed = 0;
+    q->closed = FALSE;
+    q->cancelled = FALSE;
+    q->firstdropped = INT_MAX;
+    q->nwaits = 0;
+    q->maxn = 0;
+    return 0;
+}
+
+anbool match_queue_push(match_queue_t* q, const MatchObj* mo, index_t* index,
+                        int fieldobj) {
+    match_queue_entry_t* e;
+    int slot;
+
+    an_mutex_lock(q->mutex);
+    if ((q->n == q->cap) && !q->cancelled && !q->closed)
+        q->nwaits++;
+    while ((q->n == q->cap) && !q->cancelled && !q->closed)
+        an_cond_wait(q->notfull, q->mutex);
+    if (q->cancelled || q->closed) {
+        q->firstdropped = MIN(q->firstdropped, fieldobj);
+        an_mutex_unlock(q->mutex);
+        return FALSE;
+    }
+    // (the free slots are used from the end of the list)
+    slot = q->freeslots[q->cap - q->n - 1];
+    e = q->slots + slot;
+    memcpy(&(e->mo), mo, sizeof(MatchObj));
+    e->index = index;
+    e->fieldobj = fieldobj;
+    e->seq = q->npushed++;
+    q->heap[q->n] = slot;
+    q->n++;
+    q->maxn = MAX(q->maxn, q->n);
+    sift_up(q, q->n - 1);
+    an_cond_signal(q->notempty);
+    an_mutex_unlock(q->mutex);
+    return TRUE;
+}
+
+anbool match_queue_pop(match_queue_t* q, MatchObj* mo, index_t** index,
+                       int* fieldobj) {
+    match_queue_entry_t* e;
+    int slot;
+
+    an_mutex_lock(q->mutex);
+    while (!q->n && !q->closed && !q->cancelled)
+        an_cond_wait(q->notempty, q->mutex);
+    if (!q->n || q->cancelled) {
+        an_mutex_unlock(q->mutex);
+        return FALSE;
+    }
+    slot = q->heap[0];
+    q->n--;
+    q->heap[0] = q->heap[q->n];
+    sift_down(q, 0);
+    q->freeslots[q->cap - q->n - 1] = slot;
+    e = q->slots + slot;
+    memcpy(mo, &(e->mo), sizeof(MatchObj));
+    *index = e->index;
+    *fieldobj = e->fieldobj;
+    an_cond_signal(q->notfull);
+    an_mutex_unlock(q->mutex);
+    return TRUE;
+}
+
+void match_queue_close(match_queue_t* q) {
+    an_mutex_lock(q->mutex);
+    q->closed = TRUE;
+    an_cond_broadcast(q->notempty);
+    an_cond_broadcast(q->notfull);
+    an_mutex_unlock(q->mutex);
+}
+
+void match_queue_cancel(match_queue_t* q, int fieldobj) {
+    int i;
+    an_mutex_lock(q->mutex);
+    if (fieldobj >= 0)
+        q->firstdropped = MIN(q->firstdropped, fieldobj);
+    for (i = 0; i < q->n; i++)
+        q->firstdropped = MIN(q->firstdropped, q->slots[q->heap[i]].fieldobj);
+    for (i = 0; i < q->cap; i++)
+        q->freeslots[i] = i;
+    q->n = 0;
+    q->cancelled = TRUE;
+    an_cond_broadcast(q->notempty);
+    an_cond_broadcast(q->notfull);
+    an_mutex_unlock(q->mutex);
+}
+
+void match_queue_free(match_queue_t* q) {
+    an_cond_free(q->notempty);
+    an_cond_free(q->notfull);
+    an_mutex_free(q->mutex);
+    free(q->slots);
+    free(q->heap);
+    free(q->freeslots);
+    memset(q, 0, sizeof(match_queue_t));
+}
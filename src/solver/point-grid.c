@@ -0,0 +1,184 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "point-grid.h"
+#include "an-bool.h"
+#include "mathutil.h"
+#include "errors.h"
+
+// Points per cell, on average.
+#define POINTS_PER_CELL 2
+
+static int cell_of(double v, double lo, double invsize, int n) {
+    double c = (v - lo) * invsize;
+    // (the comparisons also catch NaN, and values out of int range)
+    if (!(c >= 0))
+        return 0;
+    if (!(c < n))
+        return n - 1;
+    return (int)c;
+}
+
+int point_grid_build(point_grid_t* grid, const double* xy, const int* perm,
+                     int N) {
+    double xhi, yhi, w, h, eps;
+    int i, ncells;
+
+    grid->npoints = N;
+    grid->nx = grid->ny = 0;
+    if (!N)
+        return 0;
+
+    grid->xlo = xhi = xy[2 * (perm ? perm[0] : 0) + 0];
+    grid->ylo = yhi = xy[2 * (perm ? perm[0] : 0) + 1];
+    for (i = 1; i < N; i++) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        grid->xlo = MIN(grid->xlo, p[0]);
+        xhi = MAX(xhi, p[0]);
+        grid->ylo = MIN(grid->ylo, p[1]);
+        yhi = MAX(yhi, p[1]);
+    }
+    // (points all on a line, or all in the same place, still make a
+    // grid)
+    w = xhi - grid->xlo;
+    h = yhi - grid->ylo;
+    eps = 1e-6 * MAX(1.0, MAX(w, h));
+    w = MAX(w, eps);
+    h = MAX(h, eps);
+
+    ncells = MAX(1, N / POINTS_PER_CELL);
+    grid->nx = (int)MAX(1, MIN(ncells, ceil(sqrt(ncells * w / h))));
+    grid->ny = MAX(1, (ncells + grid->nx - 1) / grid->nx);
+    ncells = grid->nx * grid->ny;
+    grid->invcellw = grid->nx / w;
+    grid->invcellh = grid->ny / h;
+
+    if (ncells + 1 > grid->cellcap) {
+        free(grid->cellstart);
+        grid->cellstart = malloc((ncells + 1) * sizeof(int));
+        grid->cellcap = (grid->cellstart ? ncells + 1 : 0);
+    }
+    if (N > grid->pointcap) {
+        free(grid->xy);
+        free(grid->index);
+        grid->xy = malloc(2 * N * sizeof(double));
+        grid->index = malloc(N * sizeof(int));
+        grid->pointcap = ((grid->xy && grid->index) ? N : 0);
+    }
+    if (!grid->cellcap || !grid->pointcap) {
+        SYSERROR("Failed to allocate a grid of %i points", N);
+        grid->npoints = 0;
+        grid->nx = grid->ny = 0;
+        return -1;
+    }
+
+    // counting sort of the points by cell: count...
+    memset(grid->cellstart, 0, (ncells + 1) * sizeof(int));
+    for (i = 0; i < N; i++) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        int c = cell_of(p[1], grid->ylo, grid->invcellh, grid->ny) * grid->nx +
+            cell_of(p[0], grid->xlo, grid->invcellw, grid->nx);
+        grid->cellstart[c + 1]++;
+    }
+    for (i = 0; i < ncells; i++)
+        grid->cellstart[i + 1] += grid->cellstart[i];
+    // ...and fill, using cellstart[c] as the cursor of cell c...
+    for (i = 0; i < N; i++) {
+        const double* p = xy + 2 * (perm ? perm[i] : i);
+        int c = cell_of(p[1], grid->ylo, grid->invcellh, grid->ny) * grid->nx +
+            cell_of(p[0], grid->xlo, grid->invcellw, grid->nx);
+        int k = grid->cellstart[c]++;
+        grid->xy[2 * k + 0] = p[0];
+        grid->xy[2 * k + 1] = p[1];
+        grid->index[k] = i;
+    }
+    // ...which leaves it at the start of cell c+1.
+    for (i = ncells; i > 0; i--)
+        grid->cellstart[i] = grid->cellstart[i - 1];
+    grid->cellstart[0] = 0;
+    return 0;
+}
+
+// The cells that overlap the bounding box of the disc of squared radius
+// "maxd2" around "pt": [x0,x1] x [y0,y1].  FALSE if there are none.
+static anbool cells_around(const point_grid_t* grid, const double* pt,
+                           double maxd2, int* x0, int* x1, int* y0, int* y1) {
+    double r;
+    if (!grid->npoints || !(maxd2 >= 0))
+        return FALSE;
+    r = sqrt(maxd2);
+    if ((pt[0] + r - grid->xlo) * grid->invcellw < 0 ||
+        (pt[1] + r - grid->ylo) * grid->invcellh < 0 ||
+        (pt[0] - r - grid->xlo) * grid->invcellw >= grid->nx ||
+        (pt[1] - r - grid->ylo) * grid->invcellh >= grid->ny)
+        return FALSE;
+    *x0 = cell_of(pt[0] - r, grid->xlo, grid->invcellw, grid->nx);
+    *x1 = cell_of(pt[0] + r, grid->xlo, grid->invcellw, grid->nx);
+    *y0 = cell_of(pt[1] - r, grid->ylo, grid->invcellh, grid->ny);
+    *y1 = cell_of(pt[1] + r, grid->ylo, grid->invcellh, grid->ny);
+    return TRUE;
+}
+
+int point_grid_nearest_within(const point_grid_t* grid, const double* pt,
+                              double maxd2, double* p_d2) {
+    double bestd2;
+    int x0, x1, y0, y1, cy;
+    int ibest = -1;
+
+    if (!cells_around(grid, pt, maxd2, &x0, &x1, &y0, &y1))
+        return -1;
+
+    bestd2 = maxd2;
+    for (cy = y0; cy <= y1; cy++) {
+        const int* start = grid->cellstart + cy * grid->nx;
+        int k;
+        for (k = start[x0]; k < start[x1 + 1]; k++) {
+            double dx = pt[0] - grid->xy[2 * k + 0];
+            double dy = pt[1] - grid->xy[2 * k + 1];
+            double d2 = dx*dx + dy*dy;
+            if (d2 > bestd2)
+                continue;
+            // (on a tie, the first point in the input wins)
+            if ((d2 == bestd2) && (ibest != -1) && (grid->index[k] > ibest))
+                continue;
+            bestd2 = d2;
+            ibest = grid->index[k];
+        }
+    }
+    if (p_d2 && (ibest != -1))
+        *p_d2 = bestd2;
+    return ibest;
+}
+
+int point_grid_within(const point_grid_t* grid, const double* pt,
+                      double maxd2, int* inds) {
+    int x0, x1, y0, y1, cy;
+    int n = 0;
+
+    if (!cells_around(grid, pt, maxd2, &x0, &x1, &y0, &y1))
+        return 0;
+    for (cy = y0; cy <= y1; cy++) {
+        const int* start = grid->cellstart + cy * grid->nx;
+        int k;
+        for (k = start[x0]; k < start[x1 + 1]; k++) {
+            double dx = pt[0] - grid->xy[2 * k + 0];
+            double dy = pt[1] - grid->xy[2 * k + 1];
+            if (dx*dx + dy*dy <= maxd2)
+                inds[n++] = grid->index[k];
+        }
+    }
+    return n;
+}
+
+void point_grid_free(point_grid_t* grid) {
+    free(grid->cellstart);
+    free(grid->xy);
+    free(grid->index);
+    memset(grid, 0, sizeof(point_grid_t));
+}
@@ -0,0 +1,82 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "pquad.h"
+#include "errors.h"
+
+int pquad_store_init(pquad_store_t* store, int numxy) {
+    size_t npairs;
+    int words;
+
+    npairs = (numxy > 1) ? pquad_index(0, numxy) : 0;
+    words = (numxy + 63) / 64;
+
+    if (!store->pquads || (store->pquads_cap < npairs) ||
+        (store->inbox_cap < npairs * words)) {
+        pquad_store_free(store);
+        store->pquads_cap = npairs ? npairs : 1;
+        store->inbox_cap = npairs ? npairs * words : 1;
+        store->pquads = malloc(store->pquads_cap * sizeof(pquad));
+        store->inbox = malloc(store->inbox_cap * sizeof(uint64_t));
+        if (!store->pquads || !store->inbox) {
+            SYSERROR("Failed to allocate potential quads for %i stars", numxy);
+            pquad_store_free(store);
+            return -1;
+        }
+    }
+    store->numxy = numxy;
+    store->inbox_words = words;
+    return 0;
+}
+
+int pquad_store_grow(pquad_store_t* store, int numxy) {
+    size_t oldpairs, npairs, i;
+    int oldwords, words;
+
+    if (numxy <= store->numxy)
+        return 0;
+    oldpairs = (store->numxy > 1) ? pquad_index(0, store->numxy) : 0;
+    npairs = (numxy > 1) ? pquad_index(0, numxy) : 0;
+    oldwords = store->inbox_words;
+    words = (numxy + 63) / 64;
+
+    if (store->pquads_cap < npairs) {
+        pquad* pquads = realloc(store->pquads, npairs * sizeof(pquad));
+        if (!pquads) {
+            SYSERROR("Failed to allocate potential quads for %i stars", numxy);
+            return -1;
+        }
+        store->pquads = pquads;
+        store->pquads_cap = npairs;
+    }
+    if (store->inbox_cap < npairs * words) {
+        uint64_t* inbox = realloc(store->inbox, npairs * words * sizeof(uint64_t));
+        if (!inbox) {
+            SYSERROR("Failed to allocate potential quads for %i stars", numxy);
+            return -1;
+        }
+        store->inbox = inbox;
+        store->inbox_cap = npairs * words;
+    }
+    // Spread the bitsets out if they need more words, starting from the
+    // last one so as not to overwrite those not moved yet.
+    if (words != oldwords)
+        for (i = oldpairs; i-- > 0;)
+            memmove(store->inbox + i * words, store->inbox + i * oldwords,
+                    oldwords * sizeof(uint64_t));
+    for (i = 0; i < oldpairs; i++)
+        store->pquads[i].inbox = store->inbox + i * words;
+    store->numxy = numxy;
+    store->inbox_words = words;
+    return 0;
+}
+
+void pquad_store_free(pquad_store_t* store) {
+    free(store->pquads);
+    free(store->inbox);
+    memset(store, 0, sizeof(pquad_store_t));
+}
@@ -0,0 +1,107 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "scale-intervals.h"
+#include "permutedsort.h"
+#include "errors.h"
+
+int scale_intervals_build(scale_intervals_t* iv, const double* mins,
+                          const double* maxs, int N) {
+    int i, j, k, m, nintervals;
+    size_t n;
+
+    if (2 * N > iv->breakscap) {
+        free(iv->breaks);
+        iv->breaks = malloc(2 * (size_t)N * sizeof(double));
+        iv->breakscap = (iv->breaks ? 2 * N : 0);
+        if (!iv->breaks) {
+            SYSERROR("Failed to allocate quad size intervals");
+            return -1;
+        }
+    }
+    // The end points of the non-empty ranges.
+    m = 0;
+    for (i = 0; i < N; i++) {
+        if (mins[i] > maxs[i])
+            continue;
+        iv->breaks[m++] = mins[i];
+        iv->breaks[m++] = maxs[i];
+    }
+    qsort(iv->breaks, m, sizeof(double), compare_doubles_asc);
+    for (i = 0, k = 0; i < m; i++)
+        if ((k == 0) || (iv->breaks[i] != iv->breaks[k-1]))
+            iv->breaks[k++] = iv->breaks[i];
+    m = k;
+    iv->nbreaks = m;
+    nintervals = 2 * m + 1;
+
+    if (nintervals + 1 > iv->startcap) {
+        free(iv->start);
+        iv->start = malloc((nintervals + 1) * sizeof(int));
+        iv->startcap = (iv->start ? nintervals + 1 : 0);
+        if (!iv->start) {
+            SYSERROR("Failed to allocate quad size intervals");
+            return -1;
+        }
+    }
+    // Two passes: count, then fill.
+    for (k = 0; k < 2; k++) {
+        n = 0;
+        for (j = 0; j < nintervals; j++) {
+            // the interval is (lo, hi), or [lo, hi] if it's a point.
+            double lo = ((j & 1) ? iv->breaks[j/2] : ((j > 0) ? iv->breaks[j/2 - 1] : -HUGE_VAL));
+            double hi = ((j & 1) ? iv->breaks[j/2] : ((j/2 < m) ? iv->breaks[j/2] : HUGE_VAL));
+            iv->start[j] = (int)n;
+            for (i = 0; i < N; i++) {
+                if ((mins[i] > lo) || (maxs[i] < hi))
+                    continue;
+                if (k)
+                    iv->indexes[n] = i;
+                n++;
+            }
+        }
+        iv->start[nintervals] = (int)n;
+        if ((k == 0) && (n > iv->indexescap)) {
+            free(iv->indexes);
+            iv->indexes = malloc(n * sizeof(int));
+            iv->indexescap = (iv->indexes ? n : 0);
+            if (!iv->indexes) {
+                SYSERROR("Failed to allocate quad size intervals");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int scale_intervals_find(const scale_intervals_t* iv, double scale) {
+    // binary search for the first end point >= scale.
+    int lo = 0, hi = iv->nbreaks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (iv->breaks[mid] < scale)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if ((lo < iv->nbreaks) && (iv->breaks[lo] == scale))
+        return 2 * lo + 1;
+    return 2 * lo;
+}
+
+void scale_intervals_free(scale_intervals_t* iv) {
+    free(iv->breaks);
+    free(iv->start);
+    free(iv->indexes);
+    iv->breaks = NULL;
+    iv->start = NULL;
+    iv->indexes = NULL;
+    iv->nbreaks = 0;
+    iv->breakscap = iv->startcap = 0;
+    iv->indexescap = 0;
+}
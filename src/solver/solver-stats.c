@@ -0,0 +1,279 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "os-features.h"
+#include "solver-stats.h"
+#include "tic.h"
+#include "log.h"
+#include "errors.h"
+
+static const char* timer_names[SOLVER_NTIMERS] = {
+    "run", "setup", "code_search", "resolve", "fit_tan", "verify", "tweak"
+};
+
+solver_stats_t* solver_stats_new(void) {
+    solver_stats_t* stats = calloc(1, sizeof(solver_stats_t));
+    if (!stats)
+        SYSERROR("Failed to allocate solver stats");
+    return stats;
+}
+
+static void free_index_names(solver_stats_t* stats) {
+    int i;
+    for (i = 0; i < stats->nindexes; i++)
+        free(stats->indexes[i].indexname);
+}
+
+void solver_stats_free(solver_stats_t* stats) {
+    if (!stats)
+        return;
+    free_index_names(stats);
+    free(stats->indexes);
+    free(stats);
+}
+
+void solver_stats_clear(solver_stats_t* stats) {
+    solver_index_stats_t* indexes = stats->indexes;
+    int indexcap = stats->indexcap;
+    free_index_names(stats);
+    memset(stats, 0, sizeof(solver_stats_t));
+    // (keep the memory)
+    stats->indexes = indexes;
+    stats->indexcap = indexcap;
+}
+
+static solver_index_stats_t* find_index(const solver_stats_t* stats,
+                                        const index_t* index,
+                                        int indexid, int healpix) {
+    int i;
+    for (i = 0; i < stats->nindexes; i++) {
+        solver_index_stats_t* is = stats->indexes + i;
+        if ((is->index == index) && (is->indexid == indexid) &&
+            (is->healpix == healpix))
+            return is;
+    }
+    return NULL;
+}
+
+static solver_index_stats_t* add_index(solver_stats_t* stats,
+                                       const index_t* index, const char* name,
+                                       int indexid, int healpix) {
+    solver_index_stats_t* is;
+    if (stats->nindexes == stats->indexcap) {
+        int cap = MAX(8, 2 * stats->indexcap);
+        solver_index_stats_t* indexes = realloc(stats->indexes,
+                                                cap * sizeof(solver_index_stats_t));
+        if (!indexes) {
+            SYSERROR("Failed to allocate stats for %i indexes", cap);
+            return NULL;
+        }
+        stats->indexes = indexes;
+        stats->indexcap = cap;
+    }
+    is = stats->indexes + stats->nindexes;
+    memset(is, 0, sizeof(solver_index_stats_t));
+    is->index = index;
+    is->indexname = (name ? strdup(name) : NULL);
+    is->indexid = indexid;
+    is->healpix = healpix;
+    stats->nindexes++;
+    return is;
+}
+
+solver_index_stats_t* solver_stats_get_index(solver_stats_t* stats,
+                                             const index_t* index) {
+    solver_index_stats_t* is = find_index(stats, index, index->indexid,
+                                          index->healpix);
+    if (is)
+        return is;
+    return add_index(stats, index, index->indexname, index->indexid,
+                     index->healpix);
+}
+
+static void add_timer(solver_timer_t* dest, const solver_timer_t* src) {
+    dest->count += src->count;
+    dest->wall_ns += src->wall_ns;
+    dest->cpu_ns += src->cpu_ns;
+}
+
+int solver_stats_add(solver_stats_t* dest, const solver_stats_t* src) {
+    int i, j;
+    dest->nruns += src->nruns;
+    dest->nsolved += src->nsolved;
+    dest->ntimedout += src->ntimedout;
+    dest->numtries += src->numtries;
+    dest->nummatches += src->nummatches;
+    dest->numscaleok += src->numscaleok;
+    dest->num_cxdx_skipped += src->num_cxdx_skipped;
+    dest->num_meanx_skipped += src->num_meanx_skipped;
+    dest->num_radec_skipped += src->num_radec_skipped;
+    dest->num_abscale_skipped += src->num_abscale_skipped;
+    dest->num_verified += src->num_verified;
+    dest->num_hypothesis_hits += src->num_hypothesis_hits;
+    dest->num_ref_cache_hits += src->num_ref_cache_hits;
+    dest->num_ref_cache_misses += src->num_ref_cache_misses;
+    dest->num_precheck_rejected += src->num_precheck_rejected;
+    for (i = 0; i < SOLVER_NTIMERS; i++)
+        add_timer(dest->timers + i, src->timers + i);
+    for (i = 0; i < SOLVER_STATS_HIT_BINS; i++)
+        dest->hits_hist[i] += src->hits_hist[i];
+    for (i = 0; i < SOLVER_STATS_LOGODDS_BINS; i++)
+        dest->logodds_hist[i] += src->logodds_hist[i];
+
+    for (i = 0; i < src->nindexes; i++) {
+        const solver_index_stats_t* s = src->indexes + i;
+        solver_index_stats_t* d = find_index(dest, s->index, s->indexid,
+                                             s->healpix);
+        if (!d)
+            d = add_index(dest, s->index, s->indexname, s->indexid, s->healpix);
+        if (!d)
+            return -1;
+        d->ncodes += s->ncodes;
+        d->nhits += s->nhits;
+        d->nverified += s->nverified;
+        d->nkept += s->nkept;
+        for (j = 0; j < SOLVER_NTIMERS; j++)
+            add_timer(d->timers + j, s->timers + j);
+    }
+    return 0;
+}
+
+const char* solver_stats_timer_name(int timer) {
+    if ((timer < 0) || (timer >= SOLVER_NTIMERS))
+        return NULL;
+    return timer_names[timer];
+}
+
+void solver_clock_start(solver_clock_t* clock) {
+    clock->wall_ns = timenow_ns();
+    clock->cpu_ns = timenow_thread_cpu_ns();
+}
+
+void solver_timer_add_since(solver_timer_t* timer, solver_timer_t* timer2,
+                            const solver_clock_t* clock) {
+    int64_t wall = timenow_ns() - clock->wall_ns;
+    int64_t cpu = timenow_thread_cpu_ns() - clock->cpu_ns;
+    timer->count++;
+    timer->wall_ns += wall;
+    timer->cpu_ns += cpu;
+    if (timer2) {
+        timer2->count++;
+        timer2->wall_ns += wall;
+        timer2->cpu_ns += cpu;
+    }
+}
+
+void solver_stats_add_logodds(solver_stats_t* stats, double logodds) {
+    double bin = floor((logodds - SOLVER_STATS_LOGODDS_LOW) /
+                       SOLVER_STATS_LOGODDS_STEP);
+    // (NaN goes to the first bin)
+    if (!(bin >= 0))
+        bin = 0;
+    if (bin > SOLVER_STATS_LOGODDS_BINS - 1)
+        bin = SOLVER_STATS_LOGODDS_BINS - 1;
+    stats->logodds_hist[(int)bin]++;
+}
+
+static void write_json_string(FILE* fid, const char* str) {
+    const unsigned char* c;
+    if (!str) {
+        fprintf(fid, "null");
+        return;
+    }
+    fputc('"', fid);
+    for (c = (const unsigned char*)str; *c; c++) {
+        if ((*c == '"') || (*c == '\\'))
+            fprintf(fid, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(fid, "\\u%04x", *c);
+        else
+            fputc(*c, fid);
+    }
+    fputc('"', fid);
+}
+
+static void write_json_timer(FILE* fid, const solver_timer_t* timer) {
+    fprintf(fid, "{\"count\": %lld, \"wall_ms\": %.3f, \"cpu_ms\": %.3f}",
+            (long long)timer->count, 1e-6 * timer->wall_ns, 1e-6 * timer->cpu_ns);
+}
+
+static void write_json_hist(FILE* fid, const int64_t* hist, int nbins) {
+    int i;
+    fputc('[', fid);
+    for (i = 0; i < nbins; i++)
+        fprintf(fid, "%s%lld", (i ? ", " : ""), (long long)hist[i]);
+    fputc(']', fid);
+}
+
+int solver_stats_write_json(const solver_stats_t* stats, FILE* fid) {
+    int i, j;
+
+    fprintf(fid, "{\n");
+    fprintf(fid, "  \"runs\": %i,\n", stats->nruns);
+    fprintf(fid, "  \"solved\": %i,\n", stats->nsolved);
+    fprintf(fid, "  \"timed_out\": %i,\n", stats->ntimedout);
+    fprintf(fid, "  \"counters\": {\"numtries\": %lld, \"nummatches\": %lld, "
+            "\"numscaleok\": %lld, \"num_cxdx_skipped\": %lld, "
+            "\"num_meanx_skipped\": %lld, \"num_radec_skipped\": %lld, "
+            "\"num_abscale_skipped\": %lld, \"num_verified\": %lld, "
+            "\"num_hypothesis_hits\": %lld, \"num_ref_cache_hits\": %lld, "
+            "\"num_ref_cache_misses\": %lld, \"num_precheck_rejected\": %lld},\n",
+            (long long)stats->numtries, (long long)stats->nummatches,
+            (long long)stats->numscaleok, (long long)stats->num_cxdx_skipped,
+            (long long)stats->num_meanx_skipped,
+            (long long)stats->num_radec_skipped,
+            (long long)stats->num_abscale_skipped,
+            (long long)stats->num_verified,
+            (long long)stats->num_hypothesis_hits,
+            (long long)stats->num_ref_cache_hits,
+            (long long)stats->num_ref_cache_misses,
+            (long long)stats->num_precheck_rejected);
+
+    fprintf(fid, "  \"timers\": {\n");
+    for (i = 0; i < SOLVER_NTIMERS; i++) {
+        fprintf(fid, "    \"%s\": ", timer_names[i]);
+        write_json_timer(fid, stats->timers + i);
+        fprintf(fid, "%s\n", (i < SOLVER_NTIMERS - 1) ? "," : "");
+    }
+    fprintf(fid, "  },\n");
+
+    fprintf(fid, "  \"code_hits\": ");
+    write_json_hist(fid, stats->hits_hist, SOLVER_STATS_HIT_BINS);
+    fprintf(fid, ",\n");
+    fprintf(fid, "  \"logodds\": {\"low\": %g, \"step\": %g, \"counts\": ",
+            SOLVER_STATS_LOGODDS_LOW, SOLVER_STATS_LOGODDS_STEP);
+    write_json_hist(fid, stats->logodds_hist, SOLVER_STATS_LOGODDS_BINS);
+    fprintf(fid, "},\n");
+
+    fprintf(fid, "  \"indexes\": [");
+    for (i = 0; i < stats->nindexes; i++) {
+        const solver_index_stats_t* is = stats->indexes + i;
+        fprintf(fid, "%s\n    {\"name\": ", (i ? "," : ""));
+        write_json_string(fid, is->indexname);
+        fprintf(fid, ", \"indexid\": %i, \"healpix\": %i, \"codes\": %lld, "
+                "\"hits\": %lld, \"verified\": %lld, \"kept\": %lld,\n"
+                "     \"timers\": {",
+                is->indexid, is->healpix, (long long)is->ncodes,
+                (long long)is->nhits, (long long)is->nverified,
+                (long long)is->nkept);
+        for (j = SOLVER_FIRST_INDEX_TIMER; j < SOLVER_NTIMERS; j++) {
+            fprintf(fid, "%s\"%s\": ", (j > SOLVER_FIRST_INDEX_TIMER ? ", " : ""),
+                    timer_names[j]);
+            write_json_timer(fid, is->timers + j);
+        }
+        fprintf(fid, "}}");
+    }
+    fprintf(fid, "%s]\n", (stats->nindexes ? "\n  " : ""));
+    fprintf(fid, "}\n");
+
+    if (ferror(fid)) {
+        SYSERROR("Failed to write solver stats");
+        return -1;
+    }
+    return 0;
+}
@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #ifndef _WIN32
 #  include <unistd.h>
@@ -19,6 +20,7 @@
 #include "mathutil.h"
 #include "matchobj.h"
 #include "solver.h"
+#include "solver-stats.h"
 #include "verify.h"
 #include "tic.h"
 #include "fit-wcs.h"
@@ -26,6 +28,11 @@
 #include "keywords.h"
 #include "log.h"
 #include "pquad.h"
+#include "index-region.h"
+#include "hypothesis-cache.h"
+#include "vote-grid.h"
+#include "scale-intervals.h"
+#include "match-queue.h"
 #include "kdtree.h"
 #include "quad-utils.h"
 #include "errors.h"
@@ -382,6 +389,33 @@ void solver_reset_counters(solver_t* s) {
     s->num_radec_skipped = 0;
     s->num_abscale_skipped = 0;
     s->num_verified = 0;
+    s->num_hypothesis_hits = 0;
+    s->num_ref_cache_hits = 0;
+    s->num_ref_cache_misses = 0;
+    s->num_precheck_rejected = 0;
+    memset(s->stage_ns, 0, sizeof(s->stage_ns));
+    s->timed_out = FALSE;
+}
+
+void solver_set_deadline_ns(solver_t* s, int64_t deadline_ns) {
+    s->deadline_ns = deadline_ns;
+}
+
+void solver_set_stage_budget_ns(solver_t* s, int stage, int64_t budget_ns) {
+    if ((stage < 0) || (stage >= SOLVER_NSTAGES)) {
+        ERROR("Invalid solver stage %i", stage);
+        return;
+    }
+    s->stage_budget_ns[stage] = budget_ns;
+}
+
+void solver_set_stats(solver_t* s, solver_stats_t* stats) {
+    s->stats = stats;
+    s->index_stats = NULL;
+}
+
+solver_stats_t* solver_get_stats(const solver_t* s) {
+    return s->stats;
 }
 
 double solver_field_width(const solver_t* s) {
@@ -421,6 +455,7 @@ static void set_center_and_radius(solver_t* solver, MatchObj* mo,
 static void set_index(solver_t* s, index_t* index) {
     s->index = index;
     s->rel_index_noise2 = square(index->index_jitter / index->index_scale_lower);
+    s->index_stats = (s->stats ? solver_stats_get_index(s->stats, index) : NULL);
 }
 
 static void set_diag(solver_t* s) {
@@ -448,6 +483,13 @@ void solver_cleanup_field(solver_t* solver) {
     solver_reset_counters(solver);
 }
 
+void solver_reset(solver_t* solver, starxy_t* field) {
+    if (solver->have_best_match)
+        verify_free_matchobj(&solver->best_match);
+    solver_cleanup_field(solver);
+    solver_set_field(solver, field);
+}
+
 void solver_verify_sip_wcs(solver_t* solver, sip_t* sip) { //, MatchObj* pmo) {
     int i, nindexes;
     MatchObj mo;
@@ -458,6 +500,8 @@ void solver_verify_sip_wcs(solver_t* solver, sip_t* sip) { //, MatchObj* pmo) {
 
     if (!solver->vf)
         solver_preprocess_field(solver);
+    if (!solver->vf)
+        return;
 
     // fabricate a match and inject it into the solver.
     set_matchobj_template(solver, pmo);
@@ -548,14 +592,156 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult);
+                             int slot, anbool* placed);
+
+static void add_code(solver_t* solver, const double* code, const int* stars,
+                     int dimquad, anbool current_parity, double tol2);
+static void flush_codes(solver_t* solver);
 
 static void resolve_matches(kdtree_qres_t* krez, const double *field,
                             const int* fstars, int dimquads,
                             solver_t* solver, anbool current_parity);
 
 static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* sip, anbool fake_match);
+static anbool voting(const solver_t* sp);
+static void add_vote(solver_t* sp, const MatchObj* mo);
+static void verify_vote(solver_t* sp, const vote_cell_t* cell);
+static void verify_votes(solver_t* solver);
+static int handle_hit(solver_t* sp, MatchObj* mo, sip_t* sip, anbool fake_match);
+static anbool record_match(solver_t* sp, MatchObj* mo, index_t* index);
+static anbool record_match_in_parent(solver_t* sp, MatchObj* mo);
+static anbool defer_match(solver_t* sp, MatchObj* mo);
+static anbool record_pending_matches(solver_t* solver, int endtask);
+static anbool task_cancelled(const solver_t* w);
+
+// How many calls to quitting() between looks at the clock.
+#define CLOCK_CHECK_INTERVAL 64
+
+/*
+ Starts timing the given stage, and works out when to stop: at the
+ deadline, or when the budget of the stage runs out, whichever comes
+ first.
+ */
+static void start_timing(solver_t* solver, int stage) {
+    int64_t now = timenow_ns();
+    int64_t budget = solver->stage_budget_ns[stage];
+    solver->stage = stage;
+    solver->stage_start_ns = now;
+    solver->stop_ns = solver->deadline_ns;
+    if (budget) {
+        int64_t end = now + MAX(0, budget - solver->stage_ns[stage]);
+        if (!solver->stop_ns || (end < solver->stop_ns))
+            solver->stop_ns = end;
+    }
+    // (look at the clock at the next check)
+    solver->clock_countdown = 0;
+}
+
+static void stop_timing(solver_t* solver) {
+    if (!solver->stage_start_ns)
+        return;
+    solver->stage_ns[solver->stage] += timenow_ns() - solver->stage_start_ns;
+    solver->stage_start_ns = 0;
+    solver->stop_ns = 0;
+}
+
+/*
+ Moves on to timing another stage, if we're timing.  Returns FALSE if
+ there's no time left for it.
+ */
+static anbool enter_stage(solver_t* solver, int stage) {
+    if (!solver->stage_start_ns)
+        return TRUE;
+    stop_timing(solver);
+    start_timing(solver, stage);
+    return (!solver->stop_ns || (solver->stage_start_ns < solver->stop_ns));
+}
+
+/*
+ "quit_now" of a solver that other threads may stop, during
+ solver_run_parallel(): the parent, which the workers look at while
+ they search (and which the verification threads may set while it
+ looks at it).
+ */
+static anbool get_quit_now(const solver_t* solver) {
+    return an_atomic_load_flag(&(solver->quit_now));
+}
+
+static void set_quit_now(solver_t* solver) {
+    an_atomic_store_flag(&(solver->quit_now), TRUE);
+}
+
+/*
+ Stops the search (all the threads of it) for lack of time.
+ */
+static void time_is_up(solver_t* solver) {
+    solver_t* sp = (solver->parent ? solver->parent : solver);
+    if (sp->mutex)
+        an_mutex_lock(sp->mutex);
+    if (!sp->timed_out)
+        logverb("Out of time: stopping the search\n");
+    sp->timed_out = TRUE;
+    set_quit_now(sp);
+    if (sp->mutex)
+        an_mutex_unlock(sp->mutex);
+    solver->quit_now = TRUE;
+}
+
+/*
+ Adds the time since "t0" (see solver_clock_start()) to the given timer
+ of the stats, and to that of the current index.  Only call this if
+ there are stats.
+ */
+static void stats_add_time(solver_t* solver, int timer, const solver_clock_t* t0) {
+    solver_timer_t* itimer = NULL;
+    if (solver->index_stats && (timer >= SOLVER_FIRST_INDEX_TIMER))
+        itimer = solver->index_stats->timers + timer;
+    solver_timer_add_since(solver->stats->timers + timer, itimer, t0);
+}
+
+/*
+ Adds the counters of the solver, times "sign", to the stats: -1 at the
+ start of a run and +1 at the end adds what the run did.
+ */
+static void stats_add_counters(solver_stats_t* stats, const solver_t* s, int sign) {
+    stats->numtries += sign * s->numtries;
+    stats->nummatches += sign * s->nummatches;
+    stats->numscaleok += sign * s->numscaleok;
+    stats->num_cxdx_skipped += sign * s->num_cxdx_skipped;
+    stats->num_meanx_skipped += sign * s->num_meanx_skipped;
+    stats->num_radec_skipped += sign * s->num_radec_skipped;
+    stats->num_abscale_skipped += sign * s->num_abscale_skipped;
+    stats->num_verified += sign * s->num_verified;
+    stats->num_hypothesis_hits += sign * s->num_hypothesis_hits;
+    stats->num_ref_cache_hits += sign * s->num_ref_cache_hits;
+    stats->num_ref_cache_misses += sign * s->num_ref_cache_misses;
+    stats->num_precheck_rejected += sign * s->num_precheck_rejected;
+    stats->nsolved += sign * (s->best_match_solves ? 1 : 0);
+    stats->ntimedout += sign * (s->timed_out ? 1 : 0);
+}
+
+/*
+ Returns TRUE if the search must stop.
+ */
+static anbool quitting(solver_t* solver) {
+    if (solver->quit_now)
+        return TRUE;
+    // The parent may be told to quit by another thread.
+    if (solver->parent && get_quit_now(solver->parent))
+        return TRUE;
+    if (solver->parent && task_cancelled(solver))
+        return TRUE;
+    // Out of time?
+    if (unlikely(solver->stop_ns) && (--solver->clock_countdown <= 0)) {
+        solver->clock_countdown = CLOCK_CHECK_INTERVAL;
+        if (timenow_ns() >= solver->stop_ns) {
+            time_is_up(solver);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 
 static void check_scale(pquad* pq, solver_t* s) {
     double dx, dy;
@@ -573,23 +759,33 @@ static void check_scale(pquad* pq, solver_t* s) {
     pq->scale_ok = TRUE;
 }
 
+/*
+ Computes the position of field star "i" in the code frame of the AB
+ pair (A at (0,0), B at (1,1)).  These aren't stored in the pquads, it's
+ cheaper to recompute them than to keep N of them per AB pair.
+ */
+static inline void get_code_xy(const pquad* pq, int i, solver_t* solver,
+                               double* px, double* py) {
+    double Ax, Ay, Cx, Cy, xxtmp;
+    field_getxy(solver, pq->fieldA, &Ax, &Ay);
+    field_getxy(solver, i, &Cx, &Cy);
+    Cx -= Ax;
+    Cy -= Ay;
+    xxtmp = Cx;
+    *px = Cx * pq->costheta + Cy * pq->sintheta;
+    *py = -xxtmp * pq->sintheta + Cy * pq->costheta;
+}
+
 static void check_inbox(pquad* pq, int start, solver_t* solver) {
     int i;
-    double Ax, Ay;
-    field_getxy(solver, pq->fieldA, &Ax, &Ay);
     // check which C, D points are inside the circle.
     for (i = start; i < pq->ninbox; i++) {
         double r;
-        double Cx, Cy, xxtmp;
+        double Cx, Cy;
         double tol = solver->codetol;
-        if (!pq->inbox[i])
+        if (!pquad_inbox_get(pq, i))
             continue;
-        field_getxy(solver, i, &Cx, &Cy);
-        Cx -= Ax;
-        Cy -= Ay;
-        xxtmp = Cx;
-        Cx = Cx * pq->costheta + Cy * pq->sintheta;
-        Cy = -xxtmp * pq->sintheta + Cy * pq->costheta;
+        get_code_xy(pq, i, solver, &Cx, &Cy);
 
         // make sure it's in the circle centered at (0.5, 0.5)
         // with radius 1/sqrt(2) (plus codetol for fudge):
@@ -598,12 +794,8 @@ static void check_inbox(pquad* pq, int start, solver_t* solver) {
         // x^2-x + y^2-y + 1/2     <=   1/2 + sqrt(2)*codetol + codetol^2
         // x^2-x + y^2-y           <=   sqrt(2)*codetol + codetol^2
         r = (Cx * Cx - Cx) + (Cy * Cy - Cy);
-        if (r > (tol * (M_SQRT2 + tol))) {
-            pq->inbox[i] = FALSE;
-            continue;
-        }
-        setx(pq->xy, i, Cx);
-        sety(pq->xy, i, Cy);
+        if (r > (tol * (M_SQRT2 + tol)))
+            pquad_inbox_clear(pq, i);
     }
 }
 
@@ -612,7 +804,7 @@ static void print_inbox(pquad* pq) {
     int i;
     debug("[ ");
     for (i = 0; i < pq->ninbox; i++) {
-        if (pq->inbox[i])
+        if (pquad_inbox_get(pq, i))
             debug("%i ", i);
     }
     debug("] (n %i)\n", pq->ninbox);
@@ -622,6 +814,313 @@ static void print_inbox(pquad* pq) {}
 #endif
 
 
+/*
+ A match accepted by a task of solver_run_parallel(), waiting for the
+ others to be done; see defer_match().
+ */
+struct pending_match {
+    int task;
+    // (the matches of a task are in the order of "order")
+    int order;
+    MatchObj mo;
+    index_t* index;
+};
+
+/*
+ Memory that a solver keeps from one solver_run() to the next, so that
+ solving a sequence of fields with the same indexes (see solver_reset())
+ doesn't set it up again for each of them.  Freed by solver_cleanup().
+ */
+struct solver_scratch {
+    // The "potential quads"; see setup_quad_search().
+    pquad_store_t store;
+    // Whether the potential quads are set up for the current field, and
+    // how far its search went: the quads made of field objects
+    // [0, nextobj) have all been tried.  See solver_resume().
+    anbool resumable;
+    int nextobj;
+
+    // Limits on the size of quads, for each index, in pixels^2 (empty
+    // for the indexes that are out of the RA,Dec region), and what they
+    // were computed from.
+    double* minAB2s;
+    double* maxAB2s;
+    index_t** rangeindexes;
+    int nrange;
+    int rangecap;
+    double range_funits_lower;
+    double range_funits_upper;
+    double range_codetol;
+    anbool range_use_radec;
+    double range_centerxyz[3];
+    double range_r2;
+
+    // Which indexes can hold quads of which size.
+    scale_intervals_t intervals;
+    // Scratch for solver_run(): the AB pairs with the new field object
+    // as star B, bucketed by index.
+    int* bstart;
+    int* bpairs;
+    size_t bpairscap;
+
+    // With an RA,Dec region: where the quads of the indexes are (see
+    // index-region.h), for all the indexes searched so far, and for each
+    // of the current ones (NULL if not needed).
+    pl* regions;
+    index_region_t** indexregions;
+
+    // The verification data of the previous field, recycled by
+    // solver_preprocess_field().
+    verify_field_t* spare_vf;
+
+    // The matches verified for the current field; see
+    // hypothesis-cache.h.
+    hypothesis_cache_t hypotheses;
+    // With "vote_min": the votes of its matches; see vote-grid.h.
+    vote_grid_t votes;
+
+    // solver_run_parallel(): the thread pool, the worker copies of the
+    // solver (with their own scratch space: one per thread of the pool,
+    // then one per verification thread), and room for the list of AB
+    // pairs.
+    an_pool_t* pool;
+    solver_t* workers;
+    int nworkers;
+    // With "verify_threads": the matches waiting for verification, and
+    // the threads verifying them.
+    anbool verifying;
+    match_queue_t matchq;
+    an_thread_t** verifiers;
+    int nverifiers;
+    // (and their stats, if the parent has some)
+    solver_stats_t** workerstats;
+    pquad** pairs;
+    size_t pairscap;
+    // The tasks of the current round (see run_tasks()), and which of
+    // them were skipped; the matches accepted by the tasks, and the
+    // first task that has one.
+    int* tasks;
+    anbool* skipped;
+    int taskscap;
+    struct pending_match* pending;
+    int npending;
+    int pendingcap;
+    int norder;
+    int cutoff;
+};
+
+static struct solver_scratch* get_scratch(solver_t* solver) {
+    if (!solver->scratch) {
+        solver->scratch = calloc(1, sizeof(struct solver_scratch));
+        if (!solver->scratch)
+            SYSERROR("Failed to allocate solver scratch space");
+    }
+    return solver->scratch;
+}
+
+static void free_workers(struct solver_scratch* sc) {
+    int i;
+    for (i = 0; i < sc->nworkers; i++) {
+        kdtree_query_ctx_free(sc->workers[i].codectx);
+        free(sc->workers[i].codebatch);
+        verify_scratch_free(sc->workers[i].vscratch);
+        solver_stats_free(sc->workerstats[i]);
+    }
+    free(sc->workers);
+    sc->workers = NULL;
+    free(sc->workerstats);
+    sc->workerstats = NULL;
+    sc->nworkers = 0;
+}
+
+/*
+ Forgets the reference stars cached by the verifications (of the solver
+ and its workers).
+ */
+static void clear_ref_caches(solver_t* solver) {
+    int i;
+    verify_scratch_clear(solver->vscratch);
+    if (!solver->scratch)
+        return;
+    for (i = 0; i < solver->scratch->nworkers; i++)
+        verify_scratch_clear(solver->scratch->workers[i].vscratch);
+}
+
+static void free_index_regions(struct solver_scratch* sc) {
+    size_t i;
+    if (!sc->regions)
+        return;
+    for (i = 0; i < pl_size(sc->regions); i++)
+        index_region_free(pl_get(sc->regions, i));
+    pl_remove_all(sc->regions);
+}
+
+static void free_scratch(struct solver_scratch* sc) {
+    if (!sc)
+        return;
+    pquad_store_free(&(sc->store));
+    free(sc->minAB2s);
+    free(sc->maxAB2s);
+    free(sc->rangeindexes);
+    free(sc->indexregions);
+    scale_intervals_free(&(sc->intervals));
+    free(sc->bstart);
+    free(sc->bpairs);
+    free_index_regions(sc);
+    pl_free(sc->regions);
+    verify_field_free(sc->spare_vf);
+    hypothesis_cache_free(&(sc->hypotheses));
+    vote_grid_free(&(sc->votes));
+    an_pool_free(sc->pool);
+    free_workers(sc);
+    free(sc->pairs);
+    free(sc->tasks);
+    free(sc->skipped);
+    free(sc->pending);
+    match_queue_free(&(sc->matchq));
+    free(sc->verifiers);
+    free(sc);
+}
+
+/*
+ Returns the region of the given index (computing it if we don't have
+ it yet), set up for the given RA,Dec circle; NULL on error, in which
+ case the search just doesn't use it.
+ */
+static index_region_t* get_index_region(struct solver_scratch* sc, index_t* index,
+                                        const double* centerxyz, double r2) {
+    index_region_t* region = NULL;
+    size_t i;
+    if (!sc->regions)
+        sc->regions = pl_new(16);
+    for (i = 0; i < pl_size(sc->regions); i++) {
+        index_region_t* r = pl_get(sc->regions, i);
+        if (r->index == index) {
+            region = r;
+            break;
+        }
+    }
+    if (!region) {
+        region = index_region_new(index);
+        if (!region)
+            return NULL;
+        pl_append(sc->regions, region);
+    }
+    index_region_set_circle(region, centerxyz, r2);
+    return region;
+}
+
+/*
+ Returns TRUE if the limits on the size of quads were computed for the
+ current indexes and parameters.
+ */
+static anbool quad_ranges_current(const solver_t* solver,
+                                  const struct solver_scratch* sc) {
+    int i, num_indexes;
+
+    num_indexes = pl_size(solver->indexes);
+    if ((sc->nrange != num_indexes) ||
+        (sc->range_funits_lower != solver->funits_lower) ||
+        (sc->range_funits_upper != solver->funits_upper) ||
+        (sc->range_codetol != solver->codetol) ||
+        (sc->range_use_radec != solver->use_radec))
+        return FALSE;
+    if (solver->use_radec &&
+        ((sc->range_r2 != solver->r2) ||
+         (memcmp(sc->range_centerxyz, solver->centerxyz, 3 * sizeof(double)) != 0)))
+        return FALSE;
+    for (i = 0; i < num_indexes; i++)
+        if (sc->rangeindexes[i] != pl_get(solver->indexes, i))
+            return FALSE;
+    return TRUE;
+}
+
+/*
+ Computes the limits on the size of quads for each index, unless the
+ indexes and the parameters they depend on haven't changed since last
+ time.
+ */
+static int update_quad_ranges(solver_t* solver, struct solver_scratch* sc) {
+    int i, num_indexes;
+    double ra = 0, dec = 0, radius = 0;
+
+    if (quad_ranges_current(solver, sc))
+        return 0;
+    num_indexes = pl_size(solver->indexes);
+
+    if (num_indexes > sc->rangecap) {
+        free(sc->minAB2s);
+        free(sc->maxAB2s);
+        free(sc->rangeindexes);
+        free(sc->indexregions);
+        free(sc->bstart);
+        sc->minAB2s = malloc(num_indexes * sizeof(double));
+        sc->maxAB2s = malloc(num_indexes * sizeof(double));
+        sc->rangeindexes = malloc(num_indexes * sizeof(index_t*));
+        sc->indexregions = malloc(num_indexes * sizeof(index_region_t*));
+        sc->bstart = malloc((num_indexes + 1) * sizeof(int));
+        if (!sc->minAB2s || !sc->maxAB2s || !sc->rangeindexes ||
+            !sc->indexregions || !sc->bstart) {
+            SYSERROR("Failed to allocate quad ranges for %i indexes", num_indexes);
+            free(sc->minAB2s);
+            free(sc->maxAB2s);
+            free(sc->rangeindexes);
+            free(sc->indexregions);
+            free(sc->bstart);
+            sc->minAB2s = sc->maxAB2s = NULL;
+            sc->rangeindexes = NULL;
+            sc->indexregions = NULL;
+            sc->bstart = NULL;
+            sc->rangecap = sc->nrange = 0;
+            return -1;
+        }
+        sc->rangecap = num_indexes;
+    }
+
+    if (solver->use_radec) {
+        xyzarr2radecdeg(solver->centerxyz, &ra, &dec);
+        radius = distsq2deg(solver->r2);
+    }
+    for (i = 0; i < num_indexes; i++) {
+        double minAB=0, maxAB=0;
+        index_t* index = pl_get(solver->indexes, i);
+        sc->rangeindexes[i] = index;
+        sc->indexregions[i] = NULL;
+        // Skip the indexes that don't cover the RA,Dec region.
+        if (solver->use_radec &&
+            !index_is_within_range(index, ra, dec, radius)) {
+            logverb("Index \"%s\" is not within %g deg of RA,Dec (%g, %g); skipping it\n",
+                    index->indexname, radius, ra, dec);
+            sc->minAB2s[i] = LARGE_VAL;
+            sc->maxAB2s[i] = -LARGE_VAL;
+            continue;
+        }
+        // The limits on the size of quads that we try to match, in pixels.
+        // Derived from index_scale_* and funits_*.
+        solver_compute_quad_range(solver, index, &minAB, &maxAB);
+        //logverb("Index \"%s\" quad range %f to %f\n", index->indexname,
+        //minAB, maxAB);
+        sc->minAB2s[i] = square(minAB);
+        sc->maxAB2s[i] = square(maxAB);
+        if (solver->use_radec)
+            sc->indexregions[i] = get_index_region(sc, index, solver->centerxyz,
+                                                   solver->r2);
+    }
+    if (scale_intervals_build(&(sc->intervals), sc->minAB2s, sc->maxAB2s,
+                              num_indexes)) {
+        sc->nrange = 0;
+        return -1;
+    }
+    sc->nrange = num_indexes;
+    sc->range_funits_lower = solver->funits_lower;
+    sc->range_funits_upper = solver->funits_upper;
+    sc->range_codetol = solver->codetol;
+    sc->range_use_radec = solver->use_radec;
+    memcpy(sc->range_centerxyz, solver->centerxyz, 3 * sizeof(double));
+    sc->range_r2 = solver->r2;
+    return 0;
+}
+
 void solver_reset_field_size(solver_t* s) {
     s->field_minx = s->field_maxx = s->field_miny = s->field_maxy = 0;
     s->field_diag = 0.0;
@@ -644,24 +1143,18 @@ static void find_field_boundaries(solver_t* solver) {
     set_diag(solver);
 }
 
-void solver_preprocess_field(solver_t* solver) {
+/*
+ Applies the x-factor or the undistortion to the field objects from
+ "start" on.
+ */
+static void correct_field_stars(solver_t* solver, int start) {
     int i;
-
-    // Make a copy of the original x,y list.
-    solver->fieldxy = starxy_copy(solver->fieldxy_orig);
-
-    if ((solver->pixel_xscale > 0) && solver->predistort) {
-        logerr("Error, can't do both pixel_xscale and predistortion at the same time!");
-    }
     if (solver->pixel_xscale > 0) {
-        logverb("Applying x-factor of %f to %i stars\n",
-                solver->pixel_xscale, starxy_n(solver->fieldxy_orig));
-        for (i=0; i<starxy_n(solver->fieldxy); i++)
+        for (i=start; i<starxy_n(solver->fieldxy); i++)
             solver->fieldxy->x[i] *= solver->pixel_xscale;
     } else if (solver->predistort) {
-        logverb("Applying undistortion to %i stars\n", starxy_n(solver->fieldxy_orig));
         // Apply the *un*distortion
-        for (i=0; i<starxy_n(solver->fieldxy); i++) {
+        for (i=start; i<starxy_n(solver->fieldxy); i++) {
             double dx, dy;
             sip_pixel_undistortion(solver->predistort,
                                    solver->fieldxy->x[i], solver->fieldxy->y[i],
@@ -670,32 +1163,140 @@ void solver_preprocess_field(solver_t* solver) {
             solver->fieldxy->y[i] = dy;
         }
     }
+}
+
+/*
+ With "set_crpix_center", puts CRPIX at the center of the field bounds.
+ */
+static void center_crpix(solver_t* solver) {
+    if (!(solver->set_crpix && solver->set_crpix_center))
+        return;
+    solver->crpix[0] = wcs_pixel_center_for_size(solver_field_width(solver));
+    solver->crpix[1] = wcs_pixel_center_for_size(solver_field_height(solver));
+    logverb("Setting CRPIX to center (%.1f, %.1f) based on image size %i x %i\n",
+            solver->crpix[0], solver->crpix[1],
+            (int)solver_field_width(solver), (int)solver_field_height(solver));
+}
+
+void solver_preprocess_field(solver_t* solver) {
+    // Make a copy of the original x,y list.
+    solver->fieldxy = starxy_copy(solver->fieldxy_orig);
+
+    if ((solver->pixel_xscale > 0) && solver->predistort) {
+        logerr("Error, can't do both pixel_xscale and predistortion at the same time!");
+    }
+    if (solver->pixel_xscale > 0)
+        logverb("Applying x-factor of %f to %i stars\n",
+                solver->pixel_xscale, starxy_n(solver->fieldxy_orig));
+    else if (solver->predistort)
+        logverb("Applying undistortion to %i stars\n", starxy_n(solver->fieldxy_orig));
+    correct_field_stars(solver, 0);
 
     find_field_boundaries(solver);
-    // precompute a kdtree over the field
-    solver->vf = verify_field_preprocess(solver->fieldxy);
+    if (solver->scratch) {
+        hypothesis_cache_clear(&(solver->scratch->hypotheses));
+        vote_grid_clear(&(solver->scratch->votes));
+    }
+    // precompute a kdtree over the field (recycling the previous field's)
+    if (solver->scratch) {
+        solver->vf = verify_field_preprocess_reuse(solver->scratch->spare_vf,
+                                                   solver->fieldxy);
+        solver->scratch->spare_vf = NULL;
+    } else
+        solver->vf = verify_field_preprocess(solver->fieldxy);
+    if (!solver->vf) {
+        ERROR("Failed to preprocess the field for verification");
+        return;
+    }
 
     solver->vf->do_uniformize = solver->verify_uniformize;
     solver->vf->do_dedup = solver->verify_dedup;
 
-    if (solver->set_crpix && solver->set_crpix_center) {
-        solver->crpix[0] = wcs_pixel_center_for_size(solver_field_width(solver));
-        solver->crpix[1] = wcs_pixel_center_for_size(solver_field_height(solver));
-        logverb("Setting CRPIX to center (%.1f, %.1f) based on image size %i x %i\n",
-                solver->crpix[0], solver->crpix[1],
-                (int)solver_field_width(solver), (int)solver_field_height(solver));
+    center_crpix(solver);
+}
+
+int solver_append_stars(solver_t* solver, const starxy_t* stars) {
+    int i, N;
+
+    if (!solver->fieldxy_orig) {
+        solver->fieldxy_orig = starxy_new(0, stars->flux ? TRUE : FALSE,
+                                          stars->background ? TRUE : FALSE);
+        if (!solver->fieldxy_orig) {
+            SYSERROR("Failed to allocate the field");
+            return -1;
+        }
+    }
+    if (starxy_append(solver->fieldxy_orig, stars)) {
+        SYSERROR("Failed to add %i stars to the field", starxy_n(stars));
+        return -1;
+    }
+    // Not preprocessed yet?  Then the new stars will be along with the
+    // others.
+    if (!solver->fieldxy)
+        return 0;
+
+    N = starxy_n(solver->fieldxy);
+    if (starxy_append(solver->fieldxy, stars)) {
+        SYSERROR("Failed to add %i stars to the field", starxy_n(stars));
+        return -1;
+    }
+    correct_field_stars(solver, N);
+    logverb("Added %i stars to the field (now %i)\n", starxy_n(stars),
+            starxy_n(solver->fieldxy));
+
+    // If the field bounds were computed from the stars, they must grow
+    // to include the new ones.  (Bounds set by the caller normally
+    // include them already.)
+    for (i = N; i < starxy_n(solver->fieldxy); i++) {
+        solver->field_minx = MIN(solver->field_minx, field_getx(solver, i));
+        solver->field_maxx = MAX(solver->field_maxx, field_getx(solver, i));
+        solver->field_miny = MIN(solver->field_miny, field_gety(solver, i));
+        solver->field_maxy = MAX(solver->field_maxy, field_gety(solver, i));
+    }
+    set_diag(solver);
+    // ... and so must a CRPIX placed at their center.
+    center_crpix(solver);
+
+    if (solver->vf) {
+        anbool uniformize = solver->vf->do_uniformize;
+        anbool dedup = solver->vf->do_dedup;
+        // (with more stars, the verifications could come out otherwise)
+        if (solver->scratch) {
+            hypothesis_cache_clear(&(solver->scratch->hypotheses));
+            vote_grid_unverify(&(solver->scratch->votes), solver->vote_min);
+        }
+        solver->vf = verify_field_preprocess_reuse(solver->vf, solver->fieldxy);
+        if (!solver->vf) {
+            ERROR("Failed to preprocess the field for verification");
+            return -1;
+        }
+        solver->vf->do_uniformize = uniformize;
+        solver->vf->do_dedup = dedup;
     }
+    return 0;
 }
 
 void solver_free_field(solver_t* solver) {
+    // (the search of the field can't be resumed any more)
+    if (solver->scratch) {
+        solver->scratch->resumable = FALSE;
+        hypothesis_cache_clear(&(solver->scratch->hypotheses));
+        vote_grid_clear(&(solver->scratch->votes));
+    }
+    clear_ref_caches(solver);
     if (solver->fieldxy)
         starxy_free(solver->fieldxy);
     solver->fieldxy = NULL;
     if (solver->fieldxy_orig)
         starxy_free(solver->fieldxy_orig);
     solver->fieldxy_orig = NULL;
-    if (solver->vf)
-        verify_field_free(solver->vf);
+    if (solver->vf) {
+        // keep it for the next field.
+        if (solver->scratch && !solver->scratch->spare_vf)
+            solver->scratch->spare_vf = solver->vf;
+        else
+            verify_field_free(solver->vf);
+    }
     solver->vf = NULL;
 }
 
@@ -746,9 +1347,9 @@ static void add_stars(const pquad* pq, int* field, int fieldoffset,
     // it's required because try_all_codes needs to know which field stars
     // were used to create the quad (which are stored in the "f" array)
     for (f[adding]=bottom; f[adding]<fieldtop; f[adding]++) {
-        if (!pq->inbox[f[adding]])
+        if (!pquad_inbox_get(pq, f[adding]))
             continue;
-        if (unlikely(solver->quit_now))
+        if (unlikely(quitting(solver)))
             return;
 
         // If we've hit the end of the recursion (we're adding the last star),
@@ -765,287 +1366,1024 @@ static void add_stars(const pquad* pq, int* field, int fieldoffset,
 }
 
 
-// The real deal
-void solver_run(solver_t* solver) {
+/*
+ State of a quad search, shared by all the threads taking part in it.
+ The memory belongs to the solver's scratch.
+ */
+struct quad_search {
+    // Number of field objects we look at.
+    int numxy;
+    // The first field object to add.
+    int startobj;
+    // The indexes, resolved from solver->indexes: the threads must not
+    // read that list at the same time (bl_access() updates its cache).
+    index_t** indexes;
+    // Limits on the size of quads, for each index, in pixels^2.
+    const double* minAB2s;
+    const double* maxAB2s;
+    // Which indexes can hold quads of which size.
+    const scale_intervals_t* intervals;
+    // For each index, where its quads are, if there's an RA,Dec region.
+    index_region_t** regions;
+    // The "potential quads"; see setup_quad_search().
+    pquad_store_t* store;
+    // The field object currently being added.
+    int newpoint;
+    // During solver_run_parallel(): worker copies of the solver, one per thread.
+    solver_t* workers;
+    // During solver_run_parallel(): the AB pairs to search for "newpoint".
+    pquad** pairs;
+};
+typedef struct quad_search quad_search_t;
+
+/*
+ Computes the range of quad sizes to look at and sets up the array of
+ "potential quads".  Returns FALSE if there's nothing to search.
+
+ If "resume" is set, and the search of the current field can be resumed
+ (see solver_resume()), keeps the potential quads of the field objects
+ already searched, and makes room for those added since.
+ */
+static anbool setup_quad_search(solver_t* solver, quad_search_t* qs,
+                                anbool resume) {
+    struct solver_scratch* sc;
+    int numxy;
+    size_t i, num_indexes;
+    int field[DQMAX];
+
+    memset(qs, 0, sizeof(quad_search_t));
+
+    numxy = starxy_n(solver->fieldxy);
+    if (solver->endobj && (numxy > solver->endobj))
+        numxy = solver->endobj;
+    if (solver->startobj >= numxy)
+        return FALSE;
+    if (numxy >= 1000) {
+        logverb("Limiting search to first 1000 objects\n");
+        numxy = 1000;
+    }
+    qs->numxy = numxy;
+
+    sc = get_scratch(solver);
+    if (!sc)
+        return FALSE;
+    if (resume && sc->resumable && !quad_ranges_current(solver, sc)) {
+        logverb("The indexes or the scale range have changed: starting the search over\n");
+        sc->resumable = FALSE;
+    }
+    resume = resume && sc->resumable;
+    sc->resumable = FALSE;
+    if (update_quad_ranges(solver, sc))
+        return FALSE;
+    qs->indexes = sc->rangeindexes;
+    qs->minAB2s = sc->minAB2s;
+    qs->maxAB2s = sc->maxAB2s;
+    qs->intervals = &(sc->intervals);
+    qs->regions = sc->indexregions;
+
+    num_indexes = pl_size(solver->indexes);
+    solver->minminAB2 = LARGE_VAL;
+    solver->maxmaxAB2 = -LARGE_VAL;
+    for (i = 0; i < num_indexes; i++) {
+        index_t* index = pl_get(solver->indexes, i);
+        solver->minminAB2 = MIN(solver->minminAB2, qs->minAB2s[i]);
+        solver->maxmaxAB2 = MAX(solver->maxmaxAB2, qs->maxAB2s[i]);
+
+        if (index->cx_less_than_dx) {
+            solver->cxdx_margin = 1.5 * solver->codetol;
+            // FIXME die horribly if the indexes have differing cx_less_than_dx
+        }
+    }
+    solver->minminAB2 = MAX(solver->minminAB2, square(solver->quadsize_min));
+    if (solver->quadsize_max != 0.0)
+        solver->maxmaxAB2 = MIN(solver->maxmaxAB2, square(solver->quadsize_max));
+    logverb("Quad scale range: [%g, %g] pixels\n", sqrt(solver->minminAB2), sqrt(solver->maxmaxAB2));
+
+    // quick-n-dirty scale estimate using stars A,B.
+    solver->abscale_high = square(arcsec2rad(solver->funits_upper) * (1.0 + solver->codetol));
+    solver->abscale_low  = square(arcsec2rad(solver->funits_lower) * (1.0 - solver->codetol));
+
+    /** Ugh, I want to avoid doing distsq2rad when checking scale,
+     but that means correcting for the difference between the
+     distance along the curve of the sphere vs the chord distance.
+     This affects the lower bound for the largest quads in a messy way...
+     This below isn't right.
+     solver->abscale_high = square(arcsec2rad(solver->funits_upper) * (1.0 + solver->codetol));
+     solver->abscale_low = arcsec2rad(solver->funits_lower) * (1.0 - solver->codetol) *
+     MIN(M_PI, arcsec2rad(field_diag * solver->funits_upper)) ...
+     */
+
+    /* We maintain an array of "potential quads" (pquad) structs, where
+     * each struct corresponds to one choice of stars A and B; the struct
+     * at index (B * (B-1) / 2 + A) holds information about quads that could
+     * be created using stars A,B.
+     *
+     * (We only store the above-diagonal elements of the AB matrix because
+     * A<B.)
+     *
+     * For each AB pair, we cache the scale and the rotation parameters,
+     * and we keep a bitset "inbox" of length "numxy", one bit for each
+     * star, which say whether that star is eligible to be star C or D of
+     * a quad with AB at the corners.  (Obviously A and B aren't
+     * eligible).
+     *
+     * The "ninbox" parameter is somewhat misnamed - it says that "inbox"
+     * elements in the range [0, ninbox) have been initialized.
+     */
+    qs->store = &(sc->store);
+    if (resume) {
+        if (pquad_store_grow(qs->store, numxy)) {
+            ERROR("Failed to allocate the potential quads");
+            return FALSE;
+        }
+        qs->startobj = sc->nextobj;
+        sc->resumable = TRUE;
+        logverb("Resuming the search at field object %i of %i\n",
+                qs->startobj, numxy);
+        return TRUE;
+    }
+    if (pquad_store_init(qs->store, numxy)) {
+        ERROR("Failed to allocate the potential quads");
+        return FALSE;
+    }
+
+    /* (See explanatory paragraph in solver_run()) If "solver->startobj"
+     * isn't zero, then we need to initialize the triangle of "pquads" up
+     * to A=startobj-2, B=startobj-1. */
+    if (solver->startobj) {
+        debug("startobj > 0; priming pquad arrays.\n");
+        for (field[B] = 0; field[B] < solver->startobj; field[B]++) {
+            for (field[A] = 0; field[A] < field[B]; field[A]++) {
+                pquad* pq = pquad_store_init_pair(qs->store, field[A], field[B]);
+                debug("trying A=%i, B=%i\n", field[A], field[B]);
+                check_scale(pq, solver);
+                if (!pq->scale_ok) {
+                    debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
+                    continue;
+                }
+                pq->interval = scale_intervals_find(qs->intervals, pq->scale);
+                pquad_inbox_fill(pq, solver->startobj);
+                pquad_inbox_clear(pq, field[A]);
+                pquad_inbox_clear(pq, field[B]);
+                check_inbox(pq, 0, solver);
+                debug("  inbox(A=%i, B=%i): ", field[A], field[B]);
+                print_inbox(pq);
+            }
+        }
+    }
+    qs->startobj = solver->startobj;
+    sc->nextobj = solver->startobj;
+    sc->resumable = TRUE;
+    return TRUE;
+}
+
+/*
+ Updates the "potential quads" for a new field object: initializes the
+ AB pairs that have "newpoint" as star B, and checks whether "newpoint"
+ is in the box of the existing AB pairs.
+
+ This must be done before any quad containing "newpoint" is searched.
+ */
+static void add_newpoint(solver_t* solver, quad_search_t* qs, int newpoint) {
+    int field[DQMAX];
+
+    // quads with the new star on the diagonal:
+    field[B] = newpoint;
+    debug("Trying quads with B=%i\n", newpoint);
+
+    // first do an index-independent scale check...
+    for (field[A] = 0; field[A] < newpoint; field[A]++) {
+        // initialize the "pquad" struct for this AB combo.
+        pquad* pq = pquad_store_init_pair(qs->store, field[A], field[B]);
+        debug("  trying A=%i, B=%i\n", field[A], field[B]);
+        check_scale(pq, solver);
+        if (!pq->scale_ok) {
+            debug("    bad scale for A=%i, B=%i\n", field[A], field[B]);
+            continue;
+        }
+        pq->interval = scale_intervals_find(qs->intervals, pq->scale);
+        // initialize the "inbox" bitset:
+        // -try all stars up to "newpoint"...
+        pquad_inbox_fill(pq, newpoint + 1);
+        // -except A and B.
+        pquad_inbox_clear(pq, field[A]);
+        pquad_inbox_clear(pq, field[B]);
+        check_inbox(pq, 0, solver);
+        debug("    inbox(A=%i, B=%i): ", field[A], field[B]);
+        print_inbox(pq);
+    }
+
+    // the new star not on the diagonal:
+    field[C] = newpoint;
+    for (field[A] = 0; field[A] < newpoint; field[A]++) {
+        for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
+            pquad* pq = pquad_store_get(qs->store, field[A], field[B]);
+            if (!pq->scale_ok)
+                continue;
+            // test if this C is in the box:
+            pquad_inbox_set(pq, field[C]);
+            pq->ninbox = field[C] + 1;
+            check_inbox(pq, field[C], solver);
+        }
+    }
+}
+
+/*
+ Tries all the quads, in the given index, that have the stars of the
+ given "pquad" as stars A and B, and "newpoint" (= pq->fieldB) as star B.
+ The index must be one of those listed for the scale of the pair.
+ */
+static void search_pair_b(solver_t* solver, quad_search_t* qs, const pquad* pq,
+                          int newpoint, size_t indexnum) {
+    int field[DQMAX];
+    index_t* index;
+    int dimquads;
+    double tol2;
+
+    memset(field, 0, sizeof(field));
+    field[A] = pq->fieldA;
+    field[B] = newpoint;
+
+    index = qs->indexes[indexnum];
+    set_index(solver, index);
+    solver->index_region = qs->regions[indexnum];
+    dimquads = index_dimquads(index);
+
+    // set code tolerance for this index and AB pair...
+    solver->rel_field_noise2 = pq->rel_field_noise2;
+    tol2 = get_tolerance(solver);
+    // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
+    // ("dimquads - 2" because we've set stars A and B at this point)
+    add_stars(pq, field, C, dimquads-2, 0, newpoint, dimquads, solver, tol2);
+}
+
+/*
+ Lists the AB pairs that have "newpoint" as star B, by index: the stars
+ A of the pairs whose quads index i can hold are
+ bpairs[bstart[i] .. bstart[i+1]), in increasing order.
+ */
+static int bucket_newpoint_pairs(quad_search_t* qs, struct solver_scratch* sc,
+                                 int num_indexes, int newpoint) {
+    int a, i, k;
+    size_t n = 0;
+    int* bstart = sc->bstart;
+    const scale_intervals_t* iv = qs->intervals;
+
+    // count...
+    memset(bstart, 0, (num_indexes + 1) * sizeof(int));
+    for (a = 0; a < newpoint; a++) {
+        pquad* pq = pquad_store_get(qs->store, a, newpoint);
+        if (!pq->scale_ok)
+            continue;
+        for (k = iv->start[pq->interval]; k < iv->start[pq->interval + 1]; k++)
+            bstart[iv->indexes[k] + 1]++;
+        n += iv->start[pq->interval + 1] - iv->start[pq->interval];
+    }
+    if (n > sc->bpairscap) {
+        free(sc->bpairs);
+        sc->bpairs = malloc(n * sizeof(int));
+        if (!sc->bpairs) {
+            SYSERROR("Failed to allocate the list of AB pairs");
+            sc->bpairscap = 0;
+            return -1;
+        }
+        sc->bpairscap = n;
+    }
+    for (i = 0; i < num_indexes; i++)
+        bstart[i + 1] += bstart[i];
+    // ...fill, using bstart[i] as the cursor of index i...
+    for (a = 0; a < newpoint; a++) {
+        pquad* pq = pquad_store_get(qs->store, a, newpoint);
+        if (!pq->scale_ok)
+            continue;
+        for (k = iv->start[pq->interval]; k < iv->start[pq->interval + 1]; k++)
+            sc->bpairs[bstart[iv->indexes[k]]++] = a;
+    }
+    // ...which leaves it at the start of index i+1.
+    for (i = num_indexes; i > 0; i--)
+        bstart[i] = bstart[i - 1];
+    bstart[0] = 0;
+    return 0;
+}
+
+/*
+ Tries all the quads, in the given index, that have "newpoint" as star
+ B; the pairs must have been listed by bucket_newpoint_pairs().
+ */
+static void search_newpoint_b(solver_t* solver, quad_search_t* qs,
+                              const struct solver_scratch* sc, int newpoint,
+                              size_t indexnum) {
+    int k;
+    for (k = sc->bstart[indexnum]; k < sc->bstart[indexnum + 1]; k++) {
+        // grab the "pquad" struct for this AB combo.
+        const pquad* pq = pquad_store_get(qs->store, sc->bpairs[k], newpoint);
+        search_pair_b(solver, qs, pq, newpoint, indexnum);
+        if (quitting(solver))
+            break;
+    }
+    flush_codes(solver);
+}
+
+/*
+ Tries all the quads, in the given index, that have "newpoint" as star C
+ and the stars of the given "pquad" as stars A and B.  "newpoint" must
+ be in the box of this pquad, and the index must be one of those listed
+ for the scale of the pair.
+ */
+static void search_newpoint_c(solver_t* solver, quad_search_t* qs, const pquad* pq,
+                              int newpoint, size_t indexnum) {
+    int field[DQMAX];
+    index_t* index;
+    int dimquads;
+    double tol2;
+
+    memset(field, 0, sizeof(field));
+    field[A] = pq->fieldA;
+    field[B] = pq->fieldB;
+    // (in this case field[C] > field[D])
+    field[C] = newpoint;
+
+    index = qs->indexes[indexnum];
+    set_index(solver, index);
+    solver->index_region = qs->regions[indexnum];
+    dimquads = index_dimquads(index);
+
+    solver->rel_field_noise2 = pq->rel_field_noise2;
+    tol2 = get_tolerance(solver);
+
+    if (dimquads > 3) {
+        // ("dimquads - 3" because we've set stars A, B, and C at this point)
+        add_stars(pq, field, D, dimquads-3, 0, newpoint, dimquads, solver, tol2);
+    } else {
+        TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
+    }
+    flush_codes(solver);
+}
+
+/*
+ Calls the timer callback, if it's time to.  Returns FALSE if the
+ caller wants us to stop.
+ */
+static anbool check_timer(solver_t* solver, time_t* next_timer_callback_time) {
+    // Give our caller a chance to cancel us midway. The callback
+    // returns how long to wait before calling again.
+    if (solver->timer_callback) {
+        time_t delay;
+        time_t now = time(NULL);
+        if (now > *next_timer_callback_time) {
+            update_timeused(solver);
+            delay = solver->timer_callback(solver->userdata);
+            if (delay == 0) // Canceled
+                return FALSE;
+            *next_timer_callback_time = now + delay;
+        }
+    }
+    return TRUE;
+}
+
+static anbool search_limits_reached(const solver_t* solver) {
+    return ((solver->maxquads && (solver->numtries >= solver->maxquads))
+            || (solver->maxmatches && (solver->nummatches >= solver->maxmatches))
+            || get_quit_now(solver));
+}
+
+// The real deal
+static void search_serial(solver_t* solver, anbool resume) {
+    int numxy, newpoint;
+    double usertime, systime;
+    // first timer callback is called after 1 second
+    time_t next_timer_callback_time = time(NULL) + 1;
+    quad_search_t qs;
+    const scale_intervals_t* iv;
+    size_t i, num_indexes;
+    int k;
+    int field[DQMAX];
+    solver_clock_t t0;
+
+    get_resource_stats(&usertime, &systime, NULL);
+
+    if (!solver->vf)
+        solver_preprocess_field(solver);
+    if (!solver->vf)
+        return;
+    solver->vf->deadline_ns = solver->deadline_ns;
+
+    solver->starttime = usertime + systime;
+
+    if (solver->stats)
+        solver_clock_start(&t0);
+    if (!setup_quad_search(solver, &qs, resume))
+        return;
+    if (solver->stats)
+        stats_add_time(solver, SOLVER_TIMER_SETUP, &t0);
+    numxy = qs.numxy;
+    iv = qs.intervals;
+    num_indexes = pl_size(solver->indexes);
+
+    /* Each time through the "for" loop below, we consider a new star
+     * ("newpoint").  First, we try building all quads that have the new
+     * star on the diagonal (star B).  Then, we try building all quads that
+     * have the star not on the diagonal (star D).
+     * 
+     * For each AB pair, we have a "potential_quad" or "pquad" struct.
+     * This caches the computation we need to do: deciding whether the
+     * scale is acceptable, computing the transformation to code
+     * coordinates, and deciding which C,D stars are in the circle.
+     */
+    for (newpoint = qs.startobj; newpoint < numxy; newpoint++) {
+
+        debug("Trying newpoint=%i (%.1f,%.1f)\n", newpoint,
+              field_getx(solver,newpoint), field_gety(solver,newpoint));
+
+        if (!check_timer(solver, &next_timer_callback_time))
+            break;
+
+        solver->last_examined_object = newpoint;
+        qs.newpoint = newpoint;
+
+        if (solver->stats)
+            solver_clock_start(&t0);
+        add_newpoint(solver, &qs, newpoint);
+        if (bucket_newpoint_pairs(&qs, solver->scratch, num_indexes, newpoint))
+            return;
+        if (solver->stats)
+            stats_add_time(solver, SOLVER_TIMER_SETUP, &t0);
+
+        // quads with the new star on the diagonal:
+        // iterate through the different indices
+        for (i = 0; i < num_indexes; i++) {
+            search_newpoint_b(solver, &qs, solver->scratch, newpoint, i);
+            if (solver->quit_now)
+                return;
+        }
+
+        // Now try building quads with the new star not on the diagonal:
+        field[C] = newpoint;
+        debug("Trying quads with C=%i\n", newpoint);
+        for (field[A] = 0; field[A] < newpoint; field[A]++) {
+            for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
+                // grab the "pquad" for this AB combo
+                pquad* pq = pquad_store_get(qs.store, field[A], field[B]);
+                if (!pq->scale_ok) {
+                    debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
+                    continue;
+                }
+                if (!pquad_inbox_get(pq, field[C])) {
+                    debug("  C is not in the box for A=%i, B=%i\n", field[A], field[B]);
+                    continue;
+                }
+                debug("  C is in the box for A=%i, B=%i\n", field[A], field[B]);
+                debug("    box now:");
+                print_inbox(pq);
+                debug("\n");
+
+                // (only the indexes that can hold quads of this scale)
+                for (k = iv->start[pq->interval]; k < iv->start[pq->interval + 1]; k++) {
+                    search_newpoint_c(solver, &qs, pq, newpoint, iv->indexes[k]);
+                    if (solver->quit_now)
+                        return;
+                }
+            }
+        }
+
+        if (voting(solver)) {
+            verify_votes(solver);
+            if (solver->quit_now)
+                return;
+        }
+        solver->scratch->nextobj = newpoint + 1;
+        logverb("object %u of %u: %i quads tried, %i matched.\n",
+                newpoint + 1, numxy, solver->numtries, solver->nummatches);
+
+        if (search_limits_reached(solver))
+            break;
+    }
+}
+
+
+/*
+ During solver_run_parallel(), the counters of the worker copies only
+ count what was done during the current "newpoint"; they are added to
+ the parent's once all the workers are done with it.
+ */
+static void reset_worker_counters(solver_t* w) {
+    w->numtries = 0;
+    w->nummatches = 0;
+    w->numscaleok = 0;
+    w->num_cxdx_skipped = 0;
+    w->num_meanx_skipped = 0;
+    w->num_radec_skipped = 0;
+    w->num_abscale_skipped = 0;
+    w->num_verified = 0;
+    w->num_hypothesis_hits = 0;
+    w->num_ref_cache_hits = 0;
+    w->num_ref_cache_misses = 0;
+    w->num_precheck_rejected = 0;
+    memset(w->stage_ns, 0, sizeof(w->stage_ns));
+    if (w->stats)
+        solver_stats_clear(w->stats);
+}
+
+/*
+ Gives each of the "nthreads" workers an equal share of what's left of
+ the time budgets, for the current "newpoint".
+ */
+static void share_worker_budgets(const solver_t* sp, solver_t* w, int nthreads) {
+    int i;
+    for (i = 0; i < SOLVER_NSTAGES; i++) {
+        int64_t left;
+        if (!sp->stage_budget_ns[i])
+            continue;
+        left = (sp->stage_budget_ns[i] - sp->stage_ns[i]) / nthreads;
+        // (zero would mean no budget)
+        w->stage_budget_ns[i] = MAX(1, left);
+    }
+}
+
+static void merge_worker_counters(solver_t* sp, const solver_t* w) {
+    int i;
+    sp->numtries += w->numtries;
+    sp->nummatches += w->nummatches;
+    sp->numscaleok += w->numscaleok;
+    sp->num_cxdx_skipped += w->num_cxdx_skipped;
+    sp->num_meanx_skipped += w->num_meanx_skipped;
+    sp->num_radec_skipped += w->num_radec_skipped;
+    sp->num_abscale_skipped += w->num_abscale_skipped;
+    sp->num_verified += w->num_verified;
+    sp->num_hypothesis_hits += w->num_hypothesis_hits;
+    sp->num_ref_cache_hits += w->num_ref_cache_hits;
+    sp->num_ref_cache_misses += w->num_ref_cache_misses;
+    sp->num_precheck_rejected += w->num_precheck_rejected;
+    for (i = 0; i < SOLVER_NSTAGES; i++)
+        sp->stage_ns[i] += w->stage_ns[i];
+    if (w->stats)
+        solver_stats_add(sp->stats, w->stats);
+}
+
+/*
+ Lists the AB pairs that form quads with the current "newpoint": those
+ with "newpoint" as star B, then those that have "newpoint" in their box
+ (as star C or D).
+ */
+static int list_newpoint_pairs(quad_search_t* qs, int newpoint) {
+    int a, b;
+    int n = 0;
+    for (a = 0; a < newpoint; a++) {
+        pquad* pq = pquad_store_get(qs->store, a, newpoint);
+        if (pq->scale_ok)
+            qs->pairs[n++] = pq;
+    }
+    for (a = 0; a < newpoint; a++) {
+        for (b = a + 1; b < newpoint; b++) {
+            pquad* pq = pquad_store_get(qs->store, a, b);
+            if (pq->scale_ok && pquad_inbox_get(pq, newpoint))
+                qs->pairs[n++] = pq;
+        }
+    }
+    return n;
+}
+
+/*
+ Starts the k-th task of the current round of run_tasks() in the given
+ worker.  Returns its number, or -1 if it must be skipped: a task after
+ one that has accepted a match isn't started (which would be a waste if
+ the match solves the field), but it is run in another round if it
+ turns out that the match doesn't.
+ */
+static int start_task(solver_t* w, int k) {
+    struct solver_scratch* sc = w->parent->scratch;
+    int task = sc->tasks[k];
+    if (task > an_atomic_load_int(&(sc->cutoff))) {
+        sc->skipped[k] = TRUE;
+        return -1;
+    }
+    w->task = task;
+    // (if set, it was by the previous task of this worker)
+    w->quit_now = FALSE;
+    return task;
+}
+
+/*
+ Is the task of the given worker after one whose match is sure to solve
+ the field?  It is then of no use.
+ */
+static anbool task_cancelled(const solver_t* w) {
+    return (!w->record_match_callback &&
+            (w->task > an_atomic_load_int(&(w->parent->scratch->cutoff))));
+}
+
+/*
+ Runs the tasks [0, ntasks) of solver_run_parallel() with the thread
+ pool, and records the matches they accept in the order of the tasks,
+ as if they had been run one after the other (see defer_match()): the
+ tasks skipped because of a match of an earlier task are run in
+ another round if that match doesn't solve the field, and so on.
+ */
+static void run_tasks(solver_t* solver, quad_search_t* qs, int ntasks,
+                      an_pool_func_t func) {
+    struct solver_scratch* sc = solver->scratch;
+    int i, n;
+
+    if (ntasks > sc->taskscap) {
+        free(sc->tasks);
+        free(sc->skipped);
+        sc->tasks = malloc(ntasks * sizeof(int));
+        sc->skipped = malloc(ntasks * sizeof(anbool));
+        sc->taskscap = ((sc->tasks && sc->skipped) ? ntasks : 0);
+        if (!sc->taskscap) {
+            SYSERROR("Failed to allocate the tasks of the parallel search");
+            return;
+        }
+    }
+    for (i = 0; i < ntasks; i++)
+        sc->tasks[i] = i;
+    sc->npending = 0;
+    sc->norder = 0;
+
+    for (n = ntasks; n > 0; ) {
+        int nskipped = 0;
+        // (the matches of the earlier rounds that haven't been recorded
+        // are all after the first task of this one)
+        an_atomic_store_int(&(sc->cutoff), sc->npending ? sc->pending[0].task : INT_MAX);
+        memset(sc->skipped, 0, n * sizeof(anbool));
+
+        an_pool_run(sc->pool, n, func, qs);
+
+        for (i = 0; i < n; i++)
+            if (sc->skipped[i])
+                sc->tasks[nskipped++] = sc->tasks[i];
+        // (the matches after a skipped task have to wait for it)
+        if (record_pending_matches(solver, nskipped ? sc->tasks[0] : INT_MAX) ||
+            get_quit_now(solver))
+            break;
+        n = nskipped;
+    }
+    // (if the search was stopped, the matches accepted until then are
+    // recorded all the same)
+    record_pending_matches(solver, INT_MAX);
+    an_atomic_store_int(&(sc->cutoff), INT_MAX);
+}
+
+/*
+ Task of solver_run_parallel(): searches all the quads, in all the
+ indexes, that contain the current "newpoint" and the given AB pair.
+ */
+static void search_pair_task(void* arg, int k, int thread) {
+    quad_search_t* qs = arg;
+    solver_t* solver = qs->workers + thread;
+    int task = start_task(solver, k);
+    const pquad* pq;
+    int newpoint = qs->newpoint;
+    const scale_intervals_t* iv = qs->intervals;
+    int j;
+
+    if (task < 0)
+        return;
+    pq = qs->pairs[task];
+    start_timing(solver, SOLVER_STAGE_SEARCH);
+    // (only the indexes that can hold quads of this scale)
+    for (j = iv->start[pq->interval]; j < iv->start[pq->interval + 1]; j++) {
+        int i = iv->indexes[j];
+        if (quitting(solver))
+            break;
+        if (pq->fieldB == newpoint) {
+            search_pair_b(solver, qs, pq, newpoint, i);
+            flush_codes(solver);
+        } else
+            search_newpoint_c(solver, qs, pq, newpoint, i);
+    }
+    stop_timing(solver);
+}
+
+/*
+ Task of solver_run_parallel(): verifies one of the vote cells picked by
+ vote_grid_select().
+ */
+static void verify_vote_task(void* arg, int k, int thread) {
+    quad_search_t* qs = arg;
+    solver_t* solver = qs->workers + thread;
+    const vote_grid_t* grid = &(solver->parent->scratch->votes);
+    int task = start_task(solver, k);
+
+    if (task < 0)
+        return;
+    start_timing(solver, SOLVER_STAGE_VERIFY);
+    if (!quitting(solver))
+        verify_vote(solver, grid->cells + grid->selected[task]);
+    stop_timing(solver);
+}
+
+/*
+ Verification thread of solver_run_parallel() with "verify_threads":
+ verifies the queued matches until the queue is closed and empty, or
+ the search is over.
+ */
+static void verifier_thread(void* arg) {
+    solver_t* solver = arg;
+    match_queue_t* q = &(solver->parent->scratch->matchq);
+    MatchObj mo;
+    index_t* index;
+    int fieldobj;
+
+    start_timing(solver, SOLVER_STAGE_VERIFY);
+    while (match_queue_pop(q, &mo, &index, &fieldobj)) {
+        if (quitting(solver)) {
+            match_queue_cancel(q, fieldobj);
+            break;
+        }
+        set_index(solver, index);
+        if (solver_handle_hit(solver, &mo, NULL, FALSE))
+            solver->quit_now = TRUE;
+        if (mo.sip != solver->best_match.sip) {
+            sip_free(mo.sip);
+            mo.sip = NULL;
+        }
+        // (solved, or out of time: the others can stop too)
+        if (quitting(solver)) {
+            match_queue_cancel(q, fieldobj);
+            break;
+        }
+    }
+    stop_timing(solver);
+}
+
+/*
+ Starts the verification threads of "verify_threads", with the workers
+ after the "nthreads" of the pool.  Returns FALSE if they can't be
+ started, in which case the search threads verify their own matches.
+ */
+static anbool start_verifiers(solver_t* solver, int nthreads) {
+    struct solver_scratch* sc = solver->scratch;
+    int i, n = solver->verify_threads;
+
+    if (n > sc->nverifiers) {
+        free(sc->verifiers);
+        sc->verifiers = calloc(n, sizeof(an_thread_t*));
+        sc->nverifiers = (sc->verifiers ? n : 0);
+    }
+    if (!sc->verifiers ||
+        match_queue_init(&(sc->matchq), solver->verify_queue_size)) {
+        SYSERROR("Failed to set up the verification threads");
+        return FALSE;
+    }
+    logverb("Verifying with %i threads\n", n);
+    sc->verifying = TRUE;
+    for (i = 0; i < n; i++) {
+        solver_t* w = sc->workers + nthreads + i;
+        reset_worker_counters(w);
+        share_worker_budgets(solver, w, n);
+        sc->verifiers[i] = an_thread_start(verifier_thread, w);
+    }
+    return TRUE;
+}
+
+/*
+ Lets the verification threads finish the queue (unless the search is
+ over), and adds up what they did.  The search has to be resumed from
+ the first field object that has matches that weren't verified.
+ */
+static void stop_verifiers(solver_t* solver, int nthreads) {
+    struct solver_scratch* sc = solver->scratch;
+    match_queue_t* q = &(sc->matchq);
+    int i;
+
+    if (!sc->verifying)
+        return;
+    match_queue_close(q);
+    for (i = 0; i < solver->verify_threads; i++) {
+        an_thread_join(sc->verifiers[i]);
+        sc->verifiers[i] = NULL;
+    }
+    sc->verifying = FALSE;
+    for (i = 0; i < solver->verify_threads; i++)
+        merge_worker_counters(solver, sc->workers + nthreads + i);
+    if (q->firstdropped < sc->nextobj)
+        sc->nextobj = q->firstdropped;
+    logverb("Verification queue: %lld matches, at most %i queued, "
+            "%i waits for room\n", (long long)q->npushed, q->maxn, q->nwaits);
+}
+
+static void search_parallel(solver_t* solver, int nthreads, anbool resume) {
     int numxy, newpoint;
     double usertime, systime;
     // first timer callback is called after 1 second
     time_t next_timer_callback_time = time(NULL) + 1;
-    pquad* pquads;
-    size_t i, num_indexes;
-    double tol2;
-    int field[DQMAX];
+    quad_search_t qs;
+    struct solver_scratch* sc;
+    an_pool_t* pool;
+    size_t maxpairs;
+    int i, num_indexes, npairs, nworkers;
+    solver_clock_t t0;
+
+    if (nthreads <= 0)
+        nthreads = an_thread_hardware_concurrency();
+    num_indexes = pl_size(solver->indexes);
+    // (with verification threads, even a single search thread is a
+    // parallel search)
+    if ((nthreads <= 1) && (solver->verify_threads <= 0)) {
+        search_serial(solver, resume);
+        return;
+    }
 
     get_resource_stats(&usertime, &systime, NULL);
 
     if (!solver->vf)
         solver_preprocess_field(solver);
-
-    memset(field, 0, sizeof(field));
+    if (!solver->vf)
+        return;
+    solver->vf->deadline_ns = solver->deadline_ns;
 
     solver->starttime = usertime + systime;
 
-    numxy = starxy_n(solver->fieldxy);
-    if (solver->endobj && (numxy > solver->endobj))
-        numxy = solver->endobj;
-    if (solver->startobj >= numxy)
+    if (solver->stats)
+        solver_clock_start(&t0);
+    if (!setup_quad_search(solver, &qs, resume))
         return;
-    if (numxy >= 1000) {
-        logverb("Limiting search to first 1000 objects\n");
-        numxy = 1000;
+    if (solver->stats)
+        stats_add_time(solver, SOLVER_TIMER_SETUP, &t0);
+    numxy = qs.numxy;
+
+    // startree_get() computes this lazily; do it before the threads
+    // start sharing the indexes.
+    for (i = 0; i < num_indexes; i++) {
+        index_t* index = pl_get(solver->indexes, i);
+        if (index->starkd->tree->perm)
+            startree_compute_inverse_perm(index->starkd);
     }
 
-    num_indexes = pl_size(solver->indexes);
-    {
-        double* minAB2s = malloc(num_indexes * sizeof(double));
-        double* maxAB2s = malloc(num_indexes * sizeof(double));
-        solver->minminAB2 = LARGE_VAL;
-        solver->maxmaxAB2 = -LARGE_VAL;
-        for (i = 0; i < num_indexes; i++) {
-            double minAB=0, maxAB=0;
-            index_t* index = pl_get(solver->indexes, i);
-            // The limits on the size of quads that we try to match, in pixels.
-            // Derived from index_scale_* and funits_*.
-            solver_compute_quad_range(solver, index, &minAB, &maxAB);
-            //logverb("Index \"%s\" quad range %f to %f\n", index->indexname,
-            //minAB, maxAB);
-            minAB2s[i] = square(minAB);
-            maxAB2s[i] = square(maxAB);
-            solver->minminAB2 = MIN(solver->minminAB2, minAB2s[i]);
-            solver->maxmaxAB2 = MAX(solver->maxmaxAB2, maxAB2s[i]);
-
-            if (index->cx_less_than_dx) {
-                solver->cxdx_margin = 1.5 * solver->codetol;
-                // FIXME die horribly if the indexes have differing cx_less_than_dx
-            }
+    // The thread pool and the workers are kept for the next run.
+    sc = solver->scratch;
+    if (sc->pool && (an_pool_nthreads(sc->pool) != nthreads)) {
+        an_pool_free(sc->pool);
+        sc->pool = NULL;
+    }
+    if (!sc->pool)
+        sc->pool = an_pool_new(nthreads);
+    pool = sc->pool;
+    nthreads = an_pool_nthreads(pool);
+    logverb("Searching with %i threads\n", nthreads);
+
+    // (at most numxy pairs with newpoint as B, plus numxy^2/2 others)
+    maxpairs = (size_t)numxy + (size_t)numxy * (size_t)numxy / 2;
+    if (maxpairs > sc->pairscap) {
+        free(sc->pairs);
+        sc->pairs = malloc(maxpairs * sizeof(pquad*));
+        sc->pairscap = (sc->pairs ? maxpairs : 0);
+    }
+    nworkers = nthreads + MAX(0, solver->verify_threads);
+    if (nworkers != sc->nworkers) {
+        free_workers(sc);
+        sc->workers = calloc(nworkers, sizeof(solver_t));
+        sc->workerstats = calloc(nworkers, sizeof(solver_stats_t*));
+        sc->nworkers = ((sc->workers && sc->workerstats) ? nworkers : 0);
+    }
+    if (!sc->pairs || !sc->nworkers) {
+        SYSERROR("Failed to allocate the parallel search");
+        return;
+    }
+    // From here on, the workers time themselves.
+    stop_timing(solver);
+    solver->mutex = an_mutex_new();
+    qs.pairs = sc->pairs;
+    qs.workers = sc->workers;
+    for (i = 0; i < nworkers; i++) {
+        solver_t* w = qs.workers + i;
+        // (the workers keep their own scratch space)
+        kdtree_query_ctx_t* codectx = w->codectx;
+        struct solver_code_batch* codebatch = w->codebatch;
+        verify_scratch_t* vscratch = w->vscratch;
+        memcpy(w, solver, sizeof(solver_t));
+        // matches are recorded into the parent.
+        w->parent = solver;
+        w->mutex = NULL;
+        w->scratch = NULL;
+        w->have_best_match = FALSE;
+        w->best_match_solves = FALSE;
+        memset(&(w->best_match), 0, sizeof(MatchObj));
+        w->best_index = NULL;
+        w->codectx = codectx;
+        w->codebatch = codebatch;
+        w->vscratch = vscratch;
+        // (the workers count into their own stats)
+        w->stats = NULL;
+        if (solver->stats) {
+            if (!sc->workerstats[i])
+                sc->workerstats[i] = solver_stats_new();
+            w->stats = sc->workerstats[i];
         }
-        solver->minminAB2 = MAX(solver->minminAB2, square(solver->quadsize_min));
-        if (solver->quadsize_max != 0.0)
-            solver->maxmaxAB2 = MIN(solver->maxmaxAB2, square(solver->quadsize_max));
-        logverb("Quad scale range: [%g, %g] pixels\n", sqrt(solver->minminAB2), sqrt(solver->maxmaxAB2));
-
-        // quick-n-dirty scale estimate using stars A,B.
-        solver->abscale_high = square(arcsec2rad(solver->funits_upper) * (1.0 + solver->codetol));
-        solver->abscale_low  = square(arcsec2rad(solver->funits_lower) * (1.0 - solver->codetol));
-
-        /** Ugh, I want to avoid doing distsq2rad when checking scale,
-         but that means correcting for the difference between the
-         distance along the curve of the sphere vs the chord distance.
-         This affects the lower bound for the largest quads in a messy way...
-         This below isn't right.
-         solver->abscale_high = square(arcsec2rad(solver->funits_upper) * (1.0 + solver->codetol));
-         solver->abscale_low = arcsec2rad(solver->funits_lower) * (1.0 - solver->codetol) *
-         MIN(M_PI, arcsec2rad(field_diag * solver->funits_upper)) ...
-         */
-
-        pquads = calloc((size_t)numxy * (size_t)numxy, sizeof(pquad));
-
-        /* We maintain an array of "potential quads" (pquad) structs, where
-         * each struct corresponds to one choice of stars A and B; the struct
-         * at index (B * numxy + A) holds information about quads that could be
-         * created using stars A,B.
-         *
-         * (We only use the above-diagonal elements of this 2D array because
-         * A<B.)
-         *
-         * For each AB pair, we cache the scale and the rotation parameters,
-         * and we keep an array "inbox" of length "numxy" of booleans, one for
-         * each star, which say whether that star is eligible to be star C or D
-         * of a quad with AB at the corners.  (Obviously A and B aren't
-         * eligible).
-         *
-         * The "ninbox" parameter is somewhat misnamed - it says that "inbox"
-         * elements in the range [0, ninbox) have been initialized.
-         */
+        w->index_stats = NULL;
+        // (see start_task())
+        w->task = -1;
+    }
+    // (the verification is done by the search threads if voting, since
+    // the votes are verified after each field object anyway)
+    if ((solver->verify_threads > 0) && !voting(solver))
+        start_verifiers(solver, nthreads);
 
-        /* (See explanatory paragraph below) If "solver->startobj" isn't zero,
-         * then we need to initialize the triangle of "pquads" up to
-         * A=startobj-2, B=startobj-1. */
-        if (solver->startobj) {
-            debug("startobj > 0; priming pquad arrays.\n");
-            for (field[B] = 0; field[B] < solver->startobj; field[B]++) {
-                for (field[A] = 0; field[A] < field[B]; field[A]++) {
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    pq->fieldA = field[A];
-                    pq->fieldB = field[B];
-                    debug("trying A=%i, B=%i\n", field[A], field[B]);
-                    check_scale(pq, solver);
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    pq->xy = malloc(numxy * 2 * sizeof(double));
-                    pq->inbox = malloc(numxy * sizeof(anbool));
-                    memset(pq->inbox, TRUE, solver->startobj);
-                    pq->ninbox = solver->startobj;
-                    pq->inbox[field[A]] = FALSE;
-                    pq->inbox[field[B]] = FALSE;
-                    check_inbox(pq, 0, solver);
-                    debug("  inbox(A=%i, B=%i): ", field[A], field[B]);
-                    print_inbox(pq);
-                }
-            }
-        }
+    // See solver_run() for the logic.
+    for (newpoint = qs.startobj; newpoint < numxy; newpoint++) {
 
-        /* Each time through the "for" loop below, we consider a new star
-         * ("newpoint").  First, we try building all quads that have the new
-         * star on the diagonal (star B).  Then, we try building all quads that
-         * have the star not on the diagonal (star D).
-         * 
-         * For each AB pair, we have a "potential_quad" or "pquad" struct.
-         * This caches the computation we need to do: deciding whether the
-         * scale is acceptable, computing the transformation to code
-         * coordinates, and deciding which C,D stars are in the circle.
-         */
-        for (newpoint = solver->startobj; newpoint < numxy; newpoint++) {
-
-            debug("Trying newpoint=%i (%.1f,%.1f)\n", newpoint,
-                  field_getx(solver,newpoint), field_gety(solver,newpoint));
-
-            // Give our caller a chance to cancel us midway. The callback
-            // returns how long to wait before calling again.
-
-            if (solver->timer_callback) {
-                time_t delay;
-                time_t now = time(NULL);
-                if (now > next_timer_callback_time) {
-                    update_timeused(solver);
-                    delay = solver->timer_callback(solver->userdata);
-                    if (delay == 0) // Canceled
-                        break;
-                    next_timer_callback_time = now + delay;
-                }
-            }
+        debug("Trying newpoint=%i (%.1f,%.1f)\n", newpoint,
+              field_getx(solver,newpoint), field_gety(solver,newpoint));
 
-            solver->last_examined_object = newpoint;
-            // quads with the new star on the diagonal:
-            field[B] = newpoint;
-            debug("Trying quads with B=%i\n", newpoint);
-	
-            // first do an index-independent scale check...
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                // initialize the "pquad" struct for this AB combo.
-                pquad* pq = pquads + field[B] * numxy + field[A];
-                pq->fieldA = field[A];
-                pq->fieldB = field[B];
-                debug("  trying A=%i, B=%i\n", field[A], field[B]);
-                check_scale(pq, solver);
-                if (!pq->scale_ok) {
-                    debug("    bad scale for A=%i, B=%i\n", field[A], field[B]);
-                    continue;
-                }
-                // initialize the "inbox" array:
-                pq->inbox = malloc(numxy * sizeof(anbool));
-                pq->xy = malloc(numxy * 2 * sizeof(double));
-                // -try all stars up to "newpoint"...
-                assert(sizeof(anbool) == 1);
-                memset(pq->inbox, TRUE, newpoint + 1);
-                pq->ninbox = newpoint + 1;
-                // -except A and B.
-                pq->inbox[field[A]] = FALSE;
-                pq->inbox[field[B]] = FALSE;
-                check_inbox(pq, 0, solver);
-                debug("    inbox(A=%i, B=%i): ", field[A], field[B]);
-                print_inbox(pq);
-            }
+        if (!check_timer(solver, &next_timer_callback_time))
+            break;
 
-            // Now iterate through the different indices
-            for (i = 0; i < num_indexes; i++) {
-                index_t* index = pl_get(solver->indexes, i);
-                int dimquads;
-                set_index(solver, index);
-                dimquads = index_dimquads(index);
-                for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                    // initialize the "pquad" struct for this AB combo.
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok)
-                        continue;
-                    if ((pq->scale < minAB2s[i]) ||
-                        (pq->scale > maxAB2s[i]))
-                        continue;
-                    // set code tolerance for this index and AB pair...
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-                    tol2 = get_tolerance(solver);
-                    // Now look at all sets of (C, D, ...) stars (subject to field[C] < field[D] < ...)
-                    // ("dimquads - 2" because we've set stars A and B at this point)
-                    add_stars(pq, field, C, dimquads-2, 0, newpoint, dimquads, solver, tol2);
-                    if (solver->quit_now)
-                        goto quitnow;
-                }
-            }
+        solver->last_examined_object = newpoint;
+        qs.newpoint = newpoint;
 
-            if (solver->quit_now)
-                goto quitnow;
-
-            // Now try building quads with the new star not on the diagonal:
-            field[C] = newpoint;
-            // (in this loop field[C] > field[D])
-            debug("Trying quads with C=%i\n", newpoint);
-            for (field[A] = 0; field[A] < newpoint; field[A]++) {
-                for (field[B] = field[A] + 1; field[B] < newpoint; field[B]++) {
-                    // grab the "pquad" for this AB combo
-                    pquad* pq = pquads + field[B] * numxy + field[A];
-                    if (!pq->scale_ok) {
-                        debug("  bad scale for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    // test if this C is in the box:
-                    pq->inbox[field[C]] = TRUE;
-                    pq->ninbox = field[C] + 1;
-                    check_inbox(pq, field[C], solver);
-                    if (!pq->inbox[field[C]]) {
-                        debug("  C is not in the box for A=%i, B=%i\n", field[A], field[B]);
-                        continue;
-                    }
-                    debug("  C is in the box for A=%i, B=%i\n", field[A], field[B]);
-                    debug("    box now:");
-                    print_inbox(pq);
-                    debug("\n");
-
-                    solver->rel_field_noise2 = pq->rel_field_noise2;
-
-                    for (i = 0; i < pl_size(solver->indexes); i++) {
-                        int dimquads;
-                        index_t* index = pl_get(solver->indexes, i);
-                        if ((pq->scale < minAB2s[i]) ||
-                            (pq->scale > maxAB2s[i]))
-                            continue;
-                        set_index(solver, index);
-                        dimquads = index_dimquads(index);
-
-                        tol2 = get_tolerance(solver);
-
-                        if (dimquads > 3) {
-                            // ("dimquads - 3" because we've set stars A, B, and C at this point)
-                            add_stars(pq, field, D, dimquads-3, 0, newpoint, dimquads, solver, tol2);
-                        } else {
-                            TRY_ALL_CODES(pq, field, dimquads, solver, tol2);
-                        }
-                        if (solver->quit_now)
-                            goto quitnow;
-                    }
-                }
-            }
-            logverb("object %u of %u: %i quads tried, %i matched.\n",
-                    newpoint + 1, numxy, solver->numtries, solver->nummatches);
+        if (solver->stats)
+            solver_clock_start(&t0);
+        add_newpoint(solver, &qs, newpoint);
+        npairs = list_newpoint_pairs(&qs, newpoint);
+        if (solver->stats)
+            stats_add_time(solver, SOLVER_TIMER_SETUP, &t0);
 
-            if ((solver->maxquads && (solver->numtries >= solver->maxquads))
-                || (solver->maxmatches && (solver->nummatches >= solver->maxmatches))
-                || solver->quit_now)
-                break;
+        for (i = 0; i < nthreads; i++) {
+            reset_worker_counters(qs.workers + i);
+            share_worker_budgets(solver, qs.workers + i, nthreads);
         }
 
-    quitnow:
-        for (i = 0; i < (numxy*numxy); i++) {
-            pquad* pq = pquads + i;
-            free(pq->inbox);
-            free(pq->xy);
+        run_tasks(solver, &qs, npairs, search_pair_task);
+
+        if (voting(solver) && !get_quit_now(solver)) {
+            int ncells = vote_grid_select(&(sc->votes), solver->vote_max_cells);
+            run_tasks(solver, &qs, ncells, verify_vote_task);
         }
-        free(pquads);
 
-    free(minAB2s);
-    free(maxAB2s);
+        // (the verification threads may be reading the counters)
+        an_mutex_lock(solver->mutex);
+        for (i = 0; i < nthreads; i++)
+            merge_worker_counters(solver, qs.workers + i);
+        an_mutex_unlock(solver->mutex);
+        // (if the search stopped midway, this field object isn't done)
+        if (!get_quit_now(solver))
+            sc->nextobj = newpoint + 1;
+
+        logverb("object %u of %u: %i quads tried, %i matched.\n",
+                newpoint + 1, numxy, solver->numtries, solver->nummatches);
+
+        if (search_limits_reached(solver))
+            break;
+    }
+    stop_verifiers(solver, nthreads);
+
+    an_mutex_free(solver->mutex);
+    solver->mutex = NULL;
+    start_timing(solver, SOLVER_STAGE_SEARCH);
+}
+
+/*
+ Runs the search, with search_parallel() (which only searches in
+ parallel with several threads or "verify_threads") or serially, and
+ times it.
+ */
+static void run_search(solver_t* solver, anbool parallel, int nthreads,
+                       anbool resume) {
+    solver_stats_t* stats = solver->stats;
+    double usertime, systime, cputime = 0;
+    int64_t wall = 0;
+
+    if (stats) {
+        get_resource_stats(&usertime, &systime, NULL);
+        cputime = usertime + systime;
+        wall = timenow_ns();
+        stats_add_counters(stats, solver, -1);
     }
+    start_timing(solver, SOLVER_STAGE_SEARCH);
+    if (parallel)
+        search_parallel(solver, nthreads, resume);
+    else
+        search_serial(solver, resume);
+    stop_timing(solver);
+    // (the deadline was for this search only)
+    if (solver->vf)
+        solver->vf->deadline_ns = 0;
+    if (stats) {
+        solver_timer_t* timer = stats->timers + SOLVER_TIMER_RUN;
+        get_resource_stats(&usertime, &systime, NULL);
+        timer->count++;
+        timer->wall_ns += timenow_ns() - wall;
+        timer->cpu_ns += (int64_t)(1e9 * (usertime + systime - cputime));
+        stats->nruns++;
+        stats_add_counters(stats, solver, +1);
+    }
+}
+
+void solver_run(solver_t* solver) {
+    run_search(solver, FALSE, 1, FALSE);
+}
+
+void solver_resume(solver_t* solver) {
+    run_search(solver, FALSE, 1, TRUE);
+}
+
+void solver_run_parallel(solver_t* solver, int nthreads) {
+    run_search(solver, TRUE, nthreads, FALSE);
+}
+
+void solver_resume_parallel(solver_t* solver, int nthreads) {
+    run_search(solver, TRUE, nthreads, TRUE);
 }
 
 /**
@@ -1068,10 +2406,8 @@ static void try_all_codes(const pquad* pq,
     }
     debug("]\n");
 
-    for (i=0; i<dimquad-NBACK; i++) {
-        code[2*i  ] = getx(pq->xy, fieldstars[NBACK+i]);
-        code[2*i+1] = gety(pq->xy, fieldstars[NBACK+i]);
-    }
+    for (i=0; i<dimquad-NBACK; i++)
+        get_code_xy(pq, fieldstars[NBACK+i], solver, code + 2*i, code + 2*i + 1);
 
     if (solver->parity == PARITY_NORMAL ||
         solver->parity == PARITY_BOTH) {
@@ -1105,7 +2441,6 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
                             const double* code, solver_t* solver,
                             anbool current_parity, double tol2) {
     int i;
-    kdtree_qres_t* result = NULL;
     int dimcode = (dimquad - 2) * 2;
     int stars[DQMAX];
     double flipcode[DCMAX];
@@ -1121,9 +2456,9 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, code, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
-    if (unlikely(solver->quit_now))
-        goto bailout;
+                     tol2, stars, NULL, 0, placed);
+    if (unlikely(quitting(solver)))
+        return;
 
     // Flipped:
     stars[0] = fieldstars[1];
@@ -1136,10 +2471,7 @@ static void try_all_codes_2(const int* fieldstars, int dimquad,
         placed[i] = FALSE;
 
     try_permutations(fieldstars, dimquad, flipcode, solver, current_parity,
-                     tol2, stars, NULL, 0, placed, &result);
-
- bailout:
-    kdtree_free_query(result);
+                     tol2, stars, NULL, 0, placed);
 }
 
 /**
@@ -1151,11 +2483,8 @@ static void try_permutations(const int* origstars, int dimquad,
                              solver_t* solver, anbool current_parity,
                              double tol2,
                              int* stars, double* code,
-                             int slot, anbool* placed,
-                             kdtree_qres_t** presult) {
+                             int slot, anbool* placed) {
     int i;
-    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
-        KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_USE_SPLIT;
     double mycode[DCMAX];
     int Nstars = dimquad - NBACK;
     int lastslot = dimquad - NBACK - 1;
@@ -1236,7 +2565,7 @@ static void try_permutations(const int* origstars, int dimquad,
             placed[i] = TRUE;
             try_permutations(origstars, dimquad, origcode, solver,
                              current_parity, tol2, stars, code, 
-                             slot+1, placed, presult);
+                             slot+1, placed);
             placed[i] = FALSE;
 
         } else {
@@ -1245,26 +2574,144 @@ static void try_permutations(const int* origstars, int dimquad,
             continue;
 #endif
 				
-            // Search with the code we've built.
-            *presult = kdtree_rangesearch_options_reuse
-                (solver->index->codekd->tree, *presult, code, tol2, options);
-            //debug("      trying ABCD = [%i %i %i %i]: %i results.\n",
-            //fstars[A], fstars[B], fstars[C], fstars[D], result->nres);
-
-            if ((*presult)->nres) {
-                double pixvals[DQMAX*2];
-                int j;
-                for (j=0; j<dimquad; j++) {
-                    setx(pixvals, j, field_getx(solver, stars[j]));
-                    sety(pixvals, j, field_gety(solver, stars[j]));
-                }
-                resolve_matches(*presult, pixvals, stars, dimquad, solver,
-                                current_parity);
-            }
-            if (unlikely(solver->quit_now))
-                return;
+            // Queue the code we've built for searching.
+            add_code(solver, code, stars, dimquad, current_parity, tol2);
+        }
+    }
+}
+
+/*
+ The codes of the quads tried are not searched for in the code tree one
+ at a time: they are queued, with the stars that form them, and searched
+ for in batches of up to CODE_BATCH_SIZE, in one traversal of the tree.
+ The queue must be flushed before moving to another index.
+ */
+#define CODE_BATCH_SIZE 256
+
+struct solver_code_batch {
+    int n;
+    int dimquad;
+    double tol2;
+    // n x dimcode
+    double codes[CODE_BATCH_SIZE * DCMAX];
+    int stars[CODE_BATCH_SIZE][DQMAX];
+    anbool parity[CODE_BATCH_SIZE];
+    // value of "numtries" when the quad was tried
+    int numtries[CODE_BATCH_SIZE];
+    int starts[CODE_BATCH_SIZE + 1];
+};
+
+static void add_code(solver_t* solver, const double* code, const int* stars,
+                     int dimquad, anbool current_parity, double tol2) {
+    struct solver_code_batch* batch = solver->codebatch;
+    int dimcode = (dimquad - NBACK) * 2;
+    int n;
+
+    if (!batch) {
+        batch = solver->codebatch = calloc(1, sizeof(struct solver_code_batch));
+        if (!batch) {
+            SYSERROR("Failed to allocate code batch");
+            return;
+        }
+    }
+    if (batch->n && ((batch->dimquad != dimquad) || (batch->tol2 != tol2)))
+        flush_codes(solver);
+
+    n = batch->n;
+    batch->dimquad = dimquad;
+    batch->tol2 = tol2;
+    memcpy(batch->codes + n * dimcode, code, dimcode * sizeof(double));
+    memcpy(batch->stars[n], stars, dimquad * sizeof(int));
+    batch->parity[n] = current_parity;
+    batch->numtries[n] = solver->numtries;
+    batch->n++;
+
+    if (batch->n == CODE_BATCH_SIZE)
+        flush_codes(solver);
+}
+
+/*
+ Searches for the queued codes in the code tree of the current index,
+ and resolves the matches, in the order the quads were tried.
+ */
+static void flush_codes(solver_t* solver) {
+    struct solver_code_batch* batch = solver->codebatch;
+    int options = KD_OPTIONS_SMALL_RADIUS | KD_OPTIONS_COMPUTE_DISTS |
+        KD_OPTIONS_USE_SPLIT;
+    kdtree_qres_t* qres;
+    int i, numtries;
+    solver_clock_t t0;
+
+    if (!batch || !batch->n)
+        return;
+    if (quitting(solver)) {
+        batch->n = 0;
+        return;
+    }
+
+    if (!solver->codectx) {
+        solver->codectx = kdtree_query_ctx_new();
+        if (!solver->codectx) {
+            batch->n = 0;
+            return;
+        }
+    }
+
+    if (solver->stats)
+        solver_clock_start(&t0);
+    qres = kdtree_rangesearch_batch_ctx(solver->index->codekd->tree,
+                                        solver->codectx, batch->codes, batch->n,
+                                        batch->tol2, options, batch->starts);
+    if (!qres) {
+        ERROR("Code tree search failed");
+        batch->n = 0;
+        return;
+    }
+    if (solver->stats) {
+        stats_add_time(solver, SOLVER_TIMER_CODE_SEARCH, &t0);
+        for (i = 0; i < batch->n; i++)
+            solver_stats_add_hits(solver->stats, batch->starts[i+1] - batch->starts[i]);
+        if (solver->index_stats) {
+            solver->index_stats->ncodes += batch->n;
+            solver->index_stats->nhits += batch->starts[batch->n];
         }
     }
+
+    numtries = solver->numtries;
+    for (i = 0; i < batch->n; i++) {
+        kdtree_qres_t krez;
+        double pixvals[DQMAX*2];
+        const int* stars = batch->stars[i];
+        int j;
+
+        if (batch->starts[i+1] == batch->starts[i])
+            continue;
+
+        // the matches of this code.
+        memset(&krez, 0, sizeof(kdtree_qres_t));
+        krez.nres = batch->starts[i+1] - batch->starts[i];
+        krez.inds = qres->inds + batch->starts[i];
+        krez.sdists = qres->sdists + batch->starts[i];
+
+        for (j=0; j<batch->dimquad; j++) {
+            setx(pixvals, j, field_getx(solver, stars[j]));
+            sety(pixvals, j, field_gety(solver, stars[j]));
+        }
+        // as if the quad had just been tried.
+        solver->numtries = batch->numtries[i];
+        if (solver->stats)
+            solver_clock_start(&t0);
+        resolve_matches(&krez, pixvals, stars, batch->dimquad, solver,
+                        batch->parity[i]);
+        if (solver->stats)
+            stats_add_time(solver, SOLVER_TIMER_RESOLVE, &t0);
+        if (unlikely(quitting(solver)))
+            break;
+    }
+    // If we found a solution, the quads tried after it don't count.
+    if (!solver->quit_now)
+        solver->numtries = numtries;
+    batch->n = 0;
 }
 
 static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
@@ -1274,8 +2721,9 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
     //    [x_A,y_A, x_B,y_B, x_C,y_C, ...]
     int jj, thisquadno;
     MatchObj mo;
-    unsigned int* star = malloc(dimquads * sizeof(unsigned int));
-    double* starxyz = malloc(dimquads * 3 * sizeof(starxyz));
+    unsigned int star[DQMAX];
+    double starxyz[DQMAX * 3];
+    solver_clock_t t0;
 
     assert(krez);
 
@@ -1289,6 +2737,12 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
 
         solver->nummatches++;
         thisquadno = krez->inds[jj];
+        if (solver->use_radec && solver->index_region &&
+            !index_region_may_contain(solver->index_region, thisquadno)) {
+            debug("Quad match is out of bounds.\n");
+            solver->num_radec_skipped++;
+            continue;
+        }
         quadfile_get_stars(solver->index->quads, thisquadno, star);
         for (i=0; i<dimquads; i++) {
             startree_get(solver->index->starkd, star[i], starxyz + 3*i);
@@ -1320,11 +2774,17 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         }
 
         // compute TAN projection from the matching quad alone.
+        if (solver->stats)
+            solver_clock_start(&t0);
         if (fit_tan_wcs(starxyz, field_xy, dimquads, &wcs, &scale)) {
             // bad quad.
             logverb("bad quad at %s:%i\n", __FILE__, __LINE__);
+            if (solver->stats)
+                stats_add_time(solver, SOLVER_TIMER_FIT_TAN, &t0);
             continue;
         }
+        if (solver->stats)
+            stats_add_time(solver, SOLVER_TIMER_FIT_TAN, &t0);
         arcsecperpix = scale * 3600.0;
 
         // FIXME - should there be scale fudge here?
@@ -1345,6 +2805,12 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
         mo.quads_tried = solver->numtries;
         mo.quads_matched = solver->nummatches;
         mo.quads_scaleok = solver->numscaleok;
+        if (solver->parent) {
+            // (the parent holds the counts up to the current field object)
+            mo.quads_tried += solver->parent->numtries;
+            mo.quads_matched += solver->parent->nummatches;
+            mo.quads_scaleok += solver->parent->numscaleok;
+        }
         mo.quad_npeers = krez->nres;
         mo.timeused = solver->timeused;
         mo.quadno = thisquadno;
@@ -1360,6 +2826,23 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
 
         set_center_and_radius(solver, &mo, &(mo.wcstan), NULL);
 
+        if (voting(solver)) {
+            // (verified later, if its WCS gets enough votes)
+            add_vote(solver, &mo);
+            continue;
+        }
+
+        if (solver->parent && solver->parent->scratch->verifying) {
+            // (verified by one of the verification threads; the parent
+            // knows which field object is being searched)
+            match_queue_push(&(solver->parent->scratch->matchq), &mo,
+                             solver->index,
+                             solver->parent->last_examined_object);
+            if (unlikely(quitting(solver)))
+                break;
+            continue;
+        }
+
         if (solver_handle_hit(solver, &mo, NULL, FALSE))
             solver->quit_now = TRUE;
 
@@ -1369,23 +2852,168 @@ static void resolve_matches(kdtree_qres_t* krez, const double *field_xy,
             mo.sip = NULL;
         }
 
-        if (unlikely(solver->quit_now))
+        if (unlikely(quitting(solver)))
             break;
     }
+}
+
+/*
+ Has a match with the same hypothesis (see hypothesis-cache.h) as the
+ current one been verified, in a way that makes verifying the current
+ one useless?  With solver_run_parallel(), the workers share the cache
+ of the parent.
+ */
+static anbool hypothesis_known(solver_t* sp, const int32_t* key) {
+    solver_t* owner = (sp->parent ? sp->parent : sp);
+    anbool known;
+    if (!owner->scratch)
+        return FALSE;
+    if (owner->mutex)
+        an_mutex_lock(owner->mutex);
+    known = (hypothesis_cache_find(&(owner->scratch->hypotheses), key,
+                                   sp->index->indexid, sp->index->healpix,
+                                   sp->logratio_tokeep) != NULL);
+    if (owner->mutex)
+        an_mutex_unlock(owner->mutex);
+    return known;
+}
+
+static void add_hypothesis(solver_t* sp, const int32_t* key, double logodds) {
+    solver_t* owner = (sp->parent ? sp->parent : sp);
+    if (!owner->scratch)
+        return;
+    if (owner->mutex)
+        an_mutex_lock(owner->mutex);
+    hypothesis_cache_add(&(owner->scratch->hypotheses), key,
+                         sp->index->indexid, sp->index->healpix, logodds);
+    if (owner->mutex)
+        an_mutex_unlock(owner->mutex);
+}
 
-    free(star);
-    free(starxyz);
+/*
+ Are the matches voted for, rather than verified right away?
+ */
+static anbool voting(const solver_t* sp) {
+    return ((sp->vote_min > 0) && (sp->vote_tol > 0) && (sp->field_diag > 0));
 }
 
-void solver_inject_match(solver_t* solver, MatchObj* mo, sip_t* sip) {
-    solver_handle_hit(solver, mo, sip, TRUE);
+/*
+ Adds the vote of a match to the grid (that of the parent, with
+ solver_run_parallel()).
+ */
+static void add_vote(solver_t* sp, const MatchObj* mo) {
+    solver_t* owner = (sp->parent ? sp->parent : sp);
+    int32_t key[HYPOTHESIS_KEY_SIZE];
+    if (!owner->scratch)
+        return;
+    hypothesis_key(key, mo, sp->vote_tol, 0.5 * sp->field_diag);
+    if (owner->mutex)
+        an_mutex_lock(owner->mutex);
+    vote_grid_add(&(owner->scratch->votes), key, mo, sp->index, sp->vote_min);
+    if (owner->mutex)
+        an_mutex_unlock(owner->mutex);
+}
+
+/*
+ Verifies (and so on) the match of a vote cell.
+ */
+static void verify_vote(solver_t* sp, const vote_cell_t* cell) {
+    MatchObj mo;
+    memcpy(&mo, &(cell->mo), sizeof(MatchObj));
+    set_index(sp, cell->index);
+    debug("Verifying a match with %i votes\n", cell->nvotes);
+    if (solver_handle_hit(sp, &mo, NULL, FALSE))
+        sp->quit_now = TRUE;
+    if (mo.sip != sp->best_match.sip) {
+        sip_free(mo.sip);
+        mo.sip = NULL;
+    }
 }
 
+/*
+ Verifies the vote cells that have enough votes; see "vote_min".
+ */
+static void verify_votes(solver_t* solver) {
+    vote_grid_t* grid = &(solver->scratch->votes);
+    int i, n;
+    n = vote_grid_select(grid, solver->vote_max_cells);
+    for (i = 0; i < n; i++) {
+        verify_vote(solver, grid->cells + grid->selected[i]);
+        if (quitting(solver))
+            break;
+    }
+}
+
+/*
+ Verifies (and so on) a match, timing each stage, and goes back to
+ timing the search.
+ */
 static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
                              anbool fake_match) {
+    int stage = sp->stage;
+    int rtn = handle_hit(sp, mo, verifysip, fake_match);
+    enter_stage(sp, stage);
+    return rtn;
+}
+
+void solver_inject_match(solver_t* solver, MatchObj* mo, sip_t* sip) {
+    solver_handle_hit(solver, mo, sip, TRUE);
+}
+
+/*
+ verify_hit() with the solver's settings, counting the reference star
+ cache hits.
+ */
+static void verify_match(solver_t* sp, MatchObj* mo, sip_t* sip, double pix2,
+                   double logaccept, anbool fake_match) {
+    int64_t hits0, misses0, hits, misses;
+
+    verify_scratch_get_ref_cache_stats(sp->vscratch, &hits0, &misses0);
+
+    verify_hit(sp->index->starkd, sp->index->cutnside,
+               mo, sip, sp->vf, sp->vscratch, pix2,
+               sp->distractor_ratio, sp->field_maxx, sp->field_maxy,
+               sp->logratio_bail_threshold, logaccept,
+               sp->logratio_stoplooking,
+               sp->distance_from_quad_bonus, fake_match);
+
+    verify_scratch_get_ref_cache_stats(sp->vscratch, &hits, &misses);
+    sp->num_ref_cache_hits += (int)(hits - hits0);
+    sp->num_ref_cache_misses += (int)(misses - misses0);
+}
+
+/*
+ Did verify_hit() run out of time (see verify_field_t.deadline_ns)?  Its
+ log-odds are then those of the stars it got to, not a verdict.
+ */
+static anbool verify_out_of_time(const solver_t* sp) {
+    return (sp->vf->deadline_ns && (timenow_ns() >= sp->vf->deadline_ns));
+}
+
+static int handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
+                      anbool fake_match) {
     double match_distance_in_pixels2;
     anbool solved;
     double logaccept;
+    solver_clock_t t0;
+    int32_t hkey[HYPOTHESIS_KEY_SIZE];
+    anbool cache;
+    // was the match verified (and tuned up) to the end?  Only then are its
+    // log-odds cached: one cut short by the deadline or the budgets must
+    // be verified again by solver_resume().
+    anbool complete;
+    anbool tune;
+
+    if (!enter_stage(sp, SOLVER_STAGE_VERIFY)) {
+        // No time left to verify it (or anything else).
+        time_is_up(sp);
+        return FALSE;
+    }
+    if (sp->stats) {
+        // (the index may have been set without set_index())
+        sp->index_stats = solver_stats_get_index(sp->stats, sp->index);
+        solver_clock_start(&t0);
+    }
 
     mo->indexid = sp->index->indexid;
     mo->healpix = sp->index->healpix;
@@ -1394,49 +3022,114 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
     mo->wcstan.imageh = sp->field_maxy;
     mo->dimquads = quadfile_dimquads(sp->index->quads);
 
+    // Has the same WCS been verified already?
+    cache = ((sp->hypothesis_tol > 0) && (sp->field_diag > 0) &&
+             !fake_match && !verifysip);
+    if (cache) {
+        hypothesis_key(hkey, mo, sp->hypothesis_tol, 0.5 * sp->field_diag);
+        if (hypothesis_known(sp, hkey)) {
+            debug("Skipping the verification of a known hypothesis\n");
+            sp->num_hypothesis_hits++;
+            return FALSE;
+        }
+    }
+
     match_distance_in_pixels2 = square(sp->verify_pix) +
         square(sp->index->index_jitter / mo->scale);
 
     logaccept = MIN(sp->logratio_tokeep, sp->logratio_totune);
 
-    verify_hit(sp->index->starkd, sp->index->cutnside,
-               mo, verifysip, sp->vf, match_distance_in_pixels2,
-               sp->distractor_ratio, sp->field_maxx, sp->field_maxy,
-               sp->logratio_bail_threshold, logaccept,
-               sp->logratio_stoplooking,
-               sp->distance_from_quad_bonus, fake_match);
+    // (without it, verify_hit() allocates its own)
+    if (!sp->vscratch)
+        sp->vscratch = verify_scratch_new();
+
+    // A cheap look at its brightest stars first?
+    if ((sp->precheck_nref > 0) && !verifysip && !fake_match) {
+        double logodds = verify_precheck(sp->index->starkd, mo, sp->vf,
+                                         sp->vscratch, sp->precheck_nref,
+                                         sp->precheck_nfield,
+                                         match_distance_in_pixels2,
+                                         sp->distractor_ratio,
+                                         sp->field_maxx, sp->field_maxy);
+        if (logodds < sp->logratio_precheck) {
+            debug("Pre-check: log-odds %g, not verifying\n", logodds);
+            sp->num_precheck_rejected++;
+            if (sp->stats)
+                stats_add_time(sp, SOLVER_TIMER_VERIFY, &t0);
+            if (cache)
+                add_hypothesis(sp, hkey, logodds);
+            return FALSE;
+        }
+    }
+
+    verify_match(sp, mo, verifysip, match_distance_in_pixels2, logaccept,
+                 fake_match);
+    complete = !verify_out_of_time(sp);
+    if (sp->stats)
+        stats_add_time(sp, SOLVER_TIMER_VERIFY, &t0);
     mo->nverified = sp->num_verified++;
+    if (sp->parent) {
+        // (with "verify_threads", the parent's counters are updated
+        // while we verify)
+        an_mutex_lock(sp->parent->mutex);
+        mo->nverified += sp->parent->num_verified;
+        an_mutex_unlock(sp->parent->mutex);
+    }
 
     if (mo->logodds >= sp->best_logodds) {
         sp->best_logodds = mo->logodds;
         logverb("Got a new best match: logodds %g.\n", mo->logodds);
     }
 
-    if (mo->logodds >= sp->logratio_totune &&
-        mo->logodds < sp->logratio_tokeep) {
+    tune = (mo->logodds >= sp->logratio_totune &&
+            mo->logodds < sp->logratio_tokeep);
+    if (tune && !enter_stage(sp, SOLVER_STAGE_TWEAK)) {
+        // (no time left to tune it up)
+        tune = FALSE;
+        complete = FALSE;
+    }
+    if (tune) {
         logverb("Trying to tune up this solution (logodds = %g; %g)...\n",
                 mo->logodds, exp(mo->logodds));
+        if (sp->stats)
+            solver_clock_start(&t0);
         solver_tweak2(sp, mo, 1, NULL);
+        if (sp->stats)
+            stats_add_time(sp, SOLVER_TIMER_TWEAK, &t0);
         logverb("After tuning, logodds = %g (%g)\n",
                 mo->logodds, exp(mo->logodds));
 
         // Since we tuned up this solution, we can't just accept the
         // resulting log-odds at face value.
         if (!fake_match) {
-            verify_hit(sp->index->starkd, sp->index->cutnside,
-                       mo, mo->sip, sp->vf, match_distance_in_pixels2,
-                       sp->distractor_ratio,
-                       sp->field_maxx, sp->field_maxy,
-                       sp->logratio_bail_threshold,
-                       sp->logratio_tokeep,
-                       sp->logratio_stoplooking,
-                       sp->distance_from_quad_bonus,
-                       fake_match);
+            if (!enter_stage(sp, SOLVER_STAGE_VERIFY)) {
+                time_is_up(sp);
+                return FALSE;
+            }
+            if (sp->stats)
+                solver_clock_start(&t0);
+            verify_match(sp, mo, mo->sip, match_distance_in_pixels2,
+                         sp->logratio_tokeep, fake_match);
+            complete = complete && !verify_out_of_time(sp);
+            if (sp->stats)
+                stats_add_time(sp, SOLVER_TIMER_VERIFY, &t0);
             logverb("Checking tuned result: logodds = %g (%g)\n",
                     mo->logodds, exp(mo->logodds));
         }
     }
 
+    if (cache && complete && !quitting(sp))
+        add_hypothesis(sp, hkey, mo->logodds);
+
+    if (sp->stats) {
+        solver_stats_add_logodds(sp->stats, mo->logodds);
+        if (sp->index_stats) {
+            sp->index_stats->nverified++;
+            if (mo->logodds >= sp->logratio_tokeep)
+                sp->index_stats->nkept++;
+        }
+    }
+
     if (mo->logodds < sp->logratio_toprint)
         return FALSE;
 
@@ -1616,7 +3309,14 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
         free(weights);
 
     } else if (sp->do_tweak) {
-        solver_tweak2(sp, mo, sp->tweak_aborder, verifysip);
+        if (enter_stage(sp, SOLVER_STAGE_TWEAK)) {
+            if (sp->stats)
+                solver_clock_start(&t0);
+            solver_tweak2(sp, mo, sp->tweak_aborder, verifysip);
+            if (sp->stats)
+                stats_add_time(sp, SOLVER_TIMER_TWEAK, &t0);
+        } else
+            logverb("No time left to tweak the solution\n");
 
     } else if (!verifysip && sp->set_crpix) {
         tan_t wcs2;
@@ -1645,6 +3345,20 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
          */
     }
 
+    if (sp->parent && (sp->task >= 0))
+        return defer_match(sp, mo);
+    if (sp->parent)
+        return record_match_in_parent(sp, mo);
+    return record_match(sp, mo, sp->index);
+}
+
+/*
+ Hands an accepted match to the user and keeps it if it's the best one
+ so far.  Returns TRUE if the field is solved.
+ */
+static anbool record_match(solver_t* sp, MatchObj* mo, index_t* index) {
+    anbool solved;
+
     // If the user didn't supply a callback, or if the callback
     // returns TRUE, consider it solved.
     solved = (!sp->record_match_callback ||
@@ -1656,7 +3370,7 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
             verify_free_matchobj(&sp->best_match);
         memcpy(&sp->best_match, mo, sizeof(MatchObj));
         sp->have_best_match = TRUE;
-        sp->best_index = sp->index;
+        sp->best_index = index;
     } else {
         verify_free_matchobj(mo);
     }
@@ -1668,6 +3382,126 @@ static int solver_handle_hit(solver_t* sp, MatchObj* mo, sip_t* verifysip,
     return FALSE;
 }
 
+/*
+ Same as record_match(), for the verification threads of
+ solver_run_parallel() (see "verify_threads"): the match is recorded
+ into the parent solver right away.  If the match becomes the best one
+ of the parent, its SIP solution (if any) belongs to the parent
+ afterwards; otherwise it is left to the caller to free.
+ */
+static anbool record_match_in_parent(solver_t* sp, MatchObj* mo) {
+    solver_t* parent = sp->parent;
+    anbool solved;
+
+    an_mutex_lock(parent->mutex);
+    if (parent->best_match_solves) {
+        // Another thread got there first.
+        verify_free_matchobj(mo);
+        an_mutex_unlock(parent->mutex);
+        return TRUE;
+    }
+    solved = record_match(parent, mo, sp->index);
+    if (solved)
+        set_quit_now(parent);
+    if (parent->best_match.sip == mo->sip)
+        mo->sip = NULL;
+    an_mutex_unlock(parent->mutex);
+    return solved;
+}
+
+/*
+ Same as record_match(), for the tasks of solver_run_parallel(): the
+ match is kept by the parent, with the number of the task, until the
+ tasks before it are done; run_tasks() then records the matches in the
+ order of the tasks, as solver_run() would, until one solves the field.
+ The tasks after the first one that has a match are skipped, or stopped
+ if that match is sure to solve the field (without
+ "record_match_callback").
+
+ Returns TRUE if the match solves the field, as far as the rest of the
+ task is concerned: without "record_match_callback", it does.  The
+ match (and its SIP solution) belongs to the parent afterwards.
+ */
+static anbool defer_match(solver_t* sp, MatchObj* mo) {
+    solver_t* parent = sp->parent;
+    struct solver_scratch* sc = parent->scratch;
+    struct pending_match* p;
+
+    an_mutex_lock(parent->mutex);
+    if (sc->npending == sc->pendingcap) {
+        int cap = MAX(16, 2 * sc->pendingcap);
+        p = realloc(sc->pending, cap * sizeof(struct pending_match));
+        if (!p) {
+            SYSERROR("Failed to keep a match of the parallel search");
+            an_mutex_unlock(parent->mutex);
+            verify_free_matchobj(mo);
+            return FALSE;
+        }
+        sc->pending = p;
+        sc->pendingcap = cap;
+    }
+    p = sc->pending + sc->npending++;
+    p->task = sp->task;
+    p->order = sc->norder++;
+    memcpy(&(p->mo), mo, sizeof(MatchObj));
+    p->index = sp->index;
+    if (sp->task < sc->cutoff)
+        an_atomic_store_int(&(sc->cutoff), sp->task);
+    an_mutex_unlock(parent->mutex);
+    mo->sip = NULL;
+    return !sp->record_match_callback;
+}
+
+static int compare_pending_matches(const void* v1, const void* v2) {
+    const struct pending_match* p1 = v1;
+    const struct pending_match* p2 = v2;
+    if (p1->task != p2->task)
+        return (p1->task < p2->task ? -1 : 1);
+    return (p1->order < p2->order ? -1 : (p1->order > p2->order ? 1 : 0));
+}
+
+static void drop_pending_match(struct pending_match* p) {
+    sip_free(p->mo.sip);
+    p->mo.sip = NULL;
+    verify_free_matchobj(&(p->mo));
+}
+
+/*
+ Records the matches kept by defer_match() for the tasks before
+ "endtask", in the order of the tasks, until one solves the field; the
+ others are dropped (all of them, if it does).  Returns TRUE if the
+ field is solved.
+ */
+static anbool record_pending_matches(solver_t* solver, int endtask) {
+    struct solver_scratch* sc = solver->scratch;
+    anbool solved = FALSE;
+    int i, n;
+
+    qsort(sc->pending, sc->npending, sizeof(struct pending_match),
+          compare_pending_matches);
+    for (n = 0; (n < sc->npending) && (sc->pending[n].task < endtask); n++) {
+        struct pending_match* p = sc->pending + n;
+        if (solved) {
+            drop_pending_match(p);
+            continue;
+        }
+        solved = record_match(solver, &(p->mo), p->index);
+        if (solver->best_match.sip != p->mo.sip)
+            sip_free(p->mo.sip);
+    }
+    if (solved) {
+        for (i = n; i < sc->npending; i++)
+            drop_pending_match(sc->pending + i);
+        sc->npending = 0;
+        set_quit_now(solver);
+        return TRUE;
+    }
+    memmove(sc->pending, sc->pending + n,
+            (sc->npending - n) * sizeof(struct pending_match));
+    sc->npending -= n;
+    return FALSE;
+}
+
 solver_t* solver_new() {
     solver_t* solver = calloc(1, sizeof(solver_t));
     solver_set_default_values(solver);
@@ -1687,6 +3521,10 @@ void solver_set_default_values(solver_t* solver) {
     solver->verify_pix = DEFAULT_VERIFY_PIX;
     solver->verify_uniformize = TRUE;
     solver->verify_dedup = TRUE;
+    solver->vote_tol = DEFAULT_VOTE_TOL;
+    solver->precheck_nfield = DEFAULT_PRECHECK_NFIELD;
+    solver->logratio_precheck = DEFAULT_PRECHECK_LOGODDS;
+    solver->verify_queue_size = DEFAULT_VERIFY_QUEUE_SIZE;
     solver->distance_from_quad_bonus = TRUE;
     solver->tweak_aborder = DEFAULT_TWEAK_ABORDER;
     solver->tweak_abporder = DEFAULT_TWEAK_ABPORDER;
@@ -1695,10 +3533,28 @@ void solver_set_default_values(solver_t* solver) {
 void solver_clear_indexes(solver_t* solver) {
     pl_remove_all(solver->indexes);
     solver->index = NULL;
+    solver->index_region = NULL;
+    // Forget what we know about the indexes.
+    if (solver->scratch) {
+        free_index_regions(solver->scratch);
+        solver->scratch->nrange = 0;
+        // (the votes point to the indexes)
+        vote_grid_clear(&(solver->scratch->votes));
+    }
+    // (and so do the cached reference stars)
+    clear_ref_caches(solver);
 }
 
 void solver_cleanup(solver_t* solver) {
     solver_free_field(solver);
+    kdtree_query_ctx_free(solver->codectx);
+    solver->codectx = NULL;
+    free(solver->codebatch);
+    solver->codebatch = NULL;
+    verify_scratch_free(solver->vscratch);
+    solver->vscratch = NULL;
+    free_scratch(solver->scratch);
+    solver->scratch = NULL;
     pl_free(solver->indexes);
     solver->indexes = NULL;
     if (solver->have_best_match) {
@@ -186,6 +186,29 @@ static char* tdebugfn(const char* name) {
 
 
 
+/*
+ Projects the reference sources into pixel space (all at once; "projxy"
+ and "inside" are scratch space for that) and keeps the ones inside the
+ image bounds: their pixel positions go into "indexpix", and their
+ numbers into "indexin".  Returns how many there are.
+ */
+static int project_index_stars(const sip_t* sip, const double* indexxyz,
+                               int Nindex, double* projxy, anbool* inside,
+                               double* indexpix, int* indexin) {
+    int i, Nin = 0;
+    sip_xyzarr2pixelxy_batch(sip, indexxyz, Nindex, projxy, projxy + Nindex,
+                             inside);
+    for (i=0; i<Nindex; i++) {
+        if (!inside[i])
+            continue;
+        indexpix[Nin*2+0] = projxy[i];
+        indexpix[Nin*2+1] = projxy[Nindex + i];
+        indexin[Nin] = i;
+        Nin++;
+    }
+    return Nin;
+}
+
 sip_t* tweak2(const double* fieldxy, int Nfield,
               double fieldjitter,
               int W, int H,
@@ -208,6 +231,9 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
     sip_t* sipout;
     int* indexin;
     double* indexpix;
+    double* indexxyz;
+    double* projxy;
+    anbool* inside;
     double* fieldsigma2s;
     double* weights;
     double* matchxyz;
@@ -233,6 +259,13 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
     weights = malloc(Nfield * sizeof(double));
     matchxyz = malloc(Nfield * 3 * sizeof(double));
     matchxy = malloc(Nfield * 2 * sizeof(double));
+    // the reference sources as unit vectors (which don't change from
+    // step to step), and room for their projections.
+    indexxyz = malloc(3 * Nindex * sizeof(double));
+    for (i=0; i<Nindex; i++)
+        radecdeg2xyzarr(indexradec[2*i + 0], indexradec[2*i + 1], indexxyz + 3*i);
+    projxy = malloc(2 * Nindex * sizeof(double));
+    inside = malloc(Nindex * sizeof(anbool));
 
     // FIXME --- hmmm, how do the annealing steps and iterating up to
     // higher orders interact?
@@ -261,7 +294,6 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         for (step=0; step<STEPS; step++) {
             double iscale;
             double ijitter;
-            double ra, dec;
             double R2;
             int Nmatch;
             int nmatch, nconf, ndist;
@@ -285,22 +317,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 sip_print_to(sipout, stdout);
 
             // Project reference sources into pixel space; keep the ones inside image bounds.
-            Nin = 0;
-            for (i=0; i<Nindex; i++) {
-                anbool ok;
-                double x,y;
-                ra  = indexradec[2*i + 0];
-                dec = indexradec[2*i + 1];
-                ok = sip_radec2pixelxy(sipout, ra, dec, &x, &y);
-                if (!ok)
-                    continue;
-                if (!sip_pixel_is_inside_image(sipout, x, y))
-                    continue;
-                indexpix[Nin*2+0] = x;
-                indexpix[Nin*2+1] = y;
-                indexin[Nin] = i;
-                Nin++;
-            }
+            Nin = project_index_stars(sipout, indexxyz, Nindex, projxy, inside,
+                                      indexpix, indexin);
             logverb("%i reference sources within the image.\n", Nin);
             //logverb("CRPIX is (%g,%g)\n", sip.wcstan.crpix[0], sip.wcstan.crpix[1]);
 
@@ -312,6 +330,9 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 free(fieldsigma2s);
                 free(indexpix);
                 free(indexin);
+                free(indexxyz);
+                free(projxy);
+                free(inside);
 //                free(refperm);
                 return NULL;
             }
@@ -429,6 +450,9 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
                 free(fieldsigma2s);
                 free(indexpix);
                 free(indexin);
+                free(indexxyz);
+                free(projxy);
+                free(inside);
                 free(refperm);
                 return NULL;
             }
@@ -480,7 +504,6 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         double gamma = 1.0;
         double iscale;
         double ijitter;
-        double ra, dec;
         double R2;
         int nmatch, nconf, ndist;
         double pix2;
@@ -490,22 +513,8 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
         free(refperm);
         gamma = 1.0;
         // Project reference sources into pixel space; keep the ones inside image bounds.
-        Nin = 0;
-        for (i=0; i<Nindex; i++) {
-            anbool ok;
-            double x,y;
-            ra  = indexradec[2*i + 0];
-            dec = indexradec[2*i + 1];
-            ok = sip_radec2pixelxy(sipout, ra, dec, &x, &y);
-            if (!ok)
-                continue;
-            if (!sip_pixel_is_inside_image(sipout, x, y))
-                continue;
-            indexpix[Nin*2+0] = x;
-            indexpix[Nin*2+1] = y;
-            indexin[Nin] = i;
-            Nin++;
-        }
+        Nin = project_index_stars(sipout, indexxyz, Nindex, projxy, inside,
+                                  indexpix, indexin);
         logverb("%i reference sources within the image.\n", Nin);
 
         iscale = sip_pixel_scale(sipout);
@@ -572,6 +581,9 @@ sip_t* tweak2(const double* fieldxy, int Nfield,
 
     free(indexin);
     free(indexpix);
+    free(indexxyz);
+    free(projxy);
+    free(inside);
     free(fieldsigma2s);
     free(weights);
     free(matchxyz);
@@ -17,6 +17,9 @@
 #include "sip-utils.h"
 #include "healpix.h"
 #include "datalog.h"
+#include "tic.h"
+#include "point-grid.h"
+#include "errors.h"
 
 #define DEBUGVERIFY 0
 
@@ -58,34 +61,422 @@ struct verify_s {
     // temp storage
     int* tbadguys;
 
+    // when to give up (0: never); see verify_field_t.
+    int64_t deadline_ns;
+
+    // VERIFY_NN_*.
+    int nn_method;
 };
 typedef struct verify_s verify_t;
 
-static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas);
+// Number of patches of sky in the reference star cache.
+#define REF_CACHE_SIZE 8
+// Number of field radius buckets per factor of two.
+#define REF_CACHE_BUCKETS 4
+// Largest healpix nside of the cache keys (so that the healpix numbers
+// fit in an int).
+#define REF_CACHE_MAX_NSIDE 8192
+// Number of the last patches of sky not found in the cache that are
+// remembered (see get_cached_ref_stars()).
+#define REF_CACHE_NRECENT 16
+
+// The key of a patch of sky of the reference star cache.
+struct ref_cache_key {
+    const startree_t* skdt;
+    int hp;
+    int bucket;
+};
+
+// The reference stars of a patch of sky, for the verifications of the
+// fields whose bounding circle it contains.
+struct ref_cache_entry {
+    // the star tree, the healpix (at a resolution that depends on the
+    // radius) of the field center, and the field radius bucket; a NULL
+    // "skdt" marks an empty entry.
+    const startree_t* skdt;
+    int hp;
+    int bucket;
+    // the patch: all the stars within "radius" (in radians) of
+    // "center", sorted by sweep number (see sort_by_sweep()); there's
+    // room for "cap" of them.
+    double center[3];
+    double radius;
+    int N;
+    double* xyz;
+    int* starid;
+    int cap;
+    // when it was last used (for the replacement of the least recently
+    // used one).
+    int64_t used;
+};
+
+// The buffers of the scratch space; see scratch_get().
+enum {
+    // verify_hit(): the reference stars...
+    VS_REFXYZ,
+    VS_REFSTARID,
+    VS_REFXY,
+    VS_REFPERM,
+    VS_REFX,
+    VS_INSIDE,
+    VS_BADGUYS,
+    // ...the test stars...
+    VS_TESTPERM,
+    VS_TESTSIGMA,
+    VS_TBADGUYS,
+    VS_KEEPERS,
+    VS_NEIGHBOURS,
+    // ...their uniformization...
+    VS_BINSTART,
+    VS_BINORDER,
+    VS_BINIDS,
+    VS_BINCENTERS,
+    VS_GOODBINS,
+    // ...and real_verify_star_lists().
+    VS_REFCOPY,
+    VS_RMATCHES,
+    VS_RPROBS,
+    VS_THETA,
+    VS_ALLODDS,
+    VS_LOGDS,
+    // sort_by_sweep(), the reference star cache and verify_precheck().
+    VS_SWEEPKEYS,
+    VS_CACHEPERM,
+    VS_MATCHED,
+    VS_NBUFS
+};
+
+struct verify_scratch_t {
+    point_grid_t grid;
+
+    // the buffers, and their sizes in bytes.
+    void* bufs[VS_NBUFS];
+    size_t bufsizes[VS_NBUFS];
+    // the memory of the searches in the star trees, and the results of
+    // the last one.
+    kdtree_query_ctx_t* starctx;
+    kdtree_qres_t* starres;
+
+    struct ref_cache_entry refs[REF_CACHE_SIZE];
+    struct ref_cache_key recent[REF_CACHE_NRECENT];
+    int nextrecent;
+    int64_t clock;
+    int64_t nrefhits;
+    int64_t nrefmisses;
+};
+
+verify_scratch_t* verify_scratch_new(void) {
+    verify_scratch_t* vs = calloc(1, sizeof(verify_scratch_t));
+    if (!vs)
+        SYSERROR("Failed to allocate verification scratch space");
+    return vs;
+}
+
+/*
+ Returns buffer "which" of the scratch space, with room for at least
+ "size" bytes: it only grows, so after the first few verifications it
+ doesn't need to.  Its contents are lost when it does.  NULL on error.
+ */
+static void* scratch_get(verify_scratch_t* vs, int which, size_t size) {
+    size = MAX(size, 1);
+    if (size > vs->bufsizes[which]) {
+        size_t newsize = MAX(size, 2 * vs->bufsizes[which]);
+        free(vs->bufs[which]);
+        vs->bufs[which] = malloc(newsize);
+        vs->bufsizes[which] = (vs->bufs[which] ? newsize : 0);
+        if (!vs->bufs[which])
+            SYSERROR("Failed to allocate %zu bytes of verification scratch space",
+                     newsize);
+    }
+    return vs->bufs[which];
+}
+
+/*
+ Hands buffer "which" over to the caller, who then owns it (for the
+ matches that are accepted: see verify_hit()); the scratch space
+ allocates a new one the next time it's needed.
+ */
+static void* scratch_take(verify_scratch_t* vs, int which) {
+    void* p = vs->bufs[which];
+    vs->bufs[which] = NULL;
+    vs->bufsizes[which] = 0;
+    return p;
+}
+
+static void free_ref_cache_entry(struct ref_cache_entry* e) {
+    free(e->xyz);
+    free(e->starid);
+    memset(e, 0, sizeof(struct ref_cache_entry));
+}
+
+void verify_scratch_clear(verify_scratch_t* vs) {
+    int i;
+    if (!vs)
+        return;
+    for (i = 0; i < REF_CACHE_SIZE; i++)
+        free_ref_cache_entry(vs->refs + i);
+    memset(vs->recent, 0, sizeof(vs->recent));
+    vs->nextrecent = 0;
+}
+
+void verify_scratch_get_ref_cache_stats(const verify_scratch_t* vs,
+                                        int64_t* p_hits, int64_t* p_misses) {
+    if (p_hits)
+        *p_hits = (vs ? vs->nrefhits : 0);
+    if (p_misses)
+        *p_misses = (vs ? vs->nrefmisses : 0);
+}
+
+// Frees the memory of the scratch space (but not the struct).
+static void free_scratch_contents(verify_scratch_t* vs) {
+    int i;
+    point_grid_free(&(vs->grid));
+    verify_scratch_clear(vs);
+    for (i = 0; i < VS_NBUFS; i++)
+        free(vs->bufs[i]);
+    kdtree_query_ctx_free(vs->starctx);
+    memset(vs, 0, sizeof(verify_scratch_t));
+}
+
+void verify_scratch_free(verify_scratch_t* vs) {
+    if (!vs)
+        return;
+    free_scratch_contents(vs);
+    free(vs);
+}
+
+struct sweep_key {
+    int sweep;
+    int starid;
+};
+
+static int compare_sweep_keys(const void* v1, const void* v2) {
+    const struct sweep_key* k1 = v1;
+    const struct sweep_key* k2 = v2;
+    if (k1->sweep != k2->sweep)
+        return (k1->sweep < k2->sweep) ? -1 : 1;
+    return (k1->starid < k2->starid) ? -1 : (k1->starid > k2->starid);
+}
+
+/*
+ Sorts the "N" elements of "perm" (indices into "starid") by the sweep
+ number of the stars.  Each index star has a "sweep number" assigned
+ during index building; it roughly represents a local brightness
+ ordering.  (The star ids break the ties, so that the order doesn't
+ depend on the order the stars came in.)
+ */
+static void sort_by_sweep(verify_scratch_t* vs, const startree_t* skdt,
+                          const int* starid, int Nall, int* perm, int N) {
+    struct sweep_key* keys;
+    int i;
+    assert(skdt->sweep);
+    keys = scratch_get(vs, VS_SWEEPKEYS, Nall * sizeof(struct sweep_key));
+    for (i=0; i<N; i++) {
+        keys[perm[i]].sweep = skdt->sweep[starid[perm[i]]];
+        keys[perm[i]].starid = starid[perm[i]];
+    }
+    permuted_sort(keys, sizeof(struct sweep_key), compare_sweep_keys, perm, N);
+}
+
+/*
+ Finds the reference stars within squared distance "r2" of "center":
+ returns how many there are, with their positions and ids in
+ vs->starres (until the next search).
+ */
+static int search_ref_stars(verify_scratch_t* vs, const startree_t* skdt,
+                            const double* center, double r2) {
+    if (!vs->starctx) {
+        vs->starctx = kdtree_query_ctx_new();
+        if (!vs->starctx)
+            return 0;
+    }
+    vs->starres = kdtree_rangesearch_ctx(skdt->tree, vs->starctx, center, r2,
+                                         KD_OPTIONS_SMALL_RADIUS |
+                                         KD_OPTIONS_RETURN_POINTS);
+    return (vs->starres ? (int)vs->starres->nres : 0);
+}
+
+/*
+ Returns the cache entry whose patch of sky contains the circle of
+ squared radius "r2" around "center".  If it isn't there yet and "fill"
+ is set, looks the stars of the patch up in "skdt", but only if the
+ patch was asked for recently: in a blind search, few false matches
+ land on the same patch, and looking up all of its stars costs more
+ than looking up those of the field.  NULL if the caller must look
+ them up itself (or on error).
+ */
+static const struct ref_cache_entry*
+get_cached_ref_stars(verify_scratch_t* vs, const startree_t* skdt,
+                     const double* center, double r2, anbool fill) {
+    struct ref_cache_entry* e = NULL;
+    struct ref_cache_key* k;
+    double r, rbucket, cellr, corner[3];
+    int bucket, nside, hp, i, j, N;
+    int* perm;
+
+    r = distsq2rad(r2);
+    if (!(r > 0) || !(r < M_PI))
+        return NULL;
+    // the buckets are a factor of 2^(1/REF_CACHE_BUCKETS) in radius
+    // apart, and the healpixes about half the bucket's radius on a side.
+    bucket = (int)ceil(REF_CACHE_BUCKETS * log2(r));
+    rbucket = exp2((double)bucket / REF_CACHE_BUCKETS);
+    nside = (int)ceil(healpix_nside_for_side_length_arcmin(rad2arcmin(0.5 * rbucket)));
+    nside = MAX(1, MIN(REF_CACHE_MAX_NSIDE, nside));
+    hp = xyzarrtohealpix(center, nside);
+
+    vs->clock++;
+    for (i = 0; i < REF_CACHE_SIZE; i++) {
+        struct ref_cache_entry* ei = vs->refs + i;
+        if (ei->skdt != skdt || ei->hp != hp || ei->bucket != bucket)
+            continue;
+        if (distsq2rad(distsq(center, ei->center, 3)) + r <= ei->radius) {
+            vs->nrefhits++;
+            ei->used = vs->clock;
+            return ei;
+        }
+        // (the circle sticks out of the patch: look it up again)
+        e = ei;
+        break;
+    }
+    vs->nrefmisses++;
+    if (!fill)
+        return NULL;
+    if (!e) {
+        for (i = 0; i < REF_CACHE_NRECENT; i++) {
+            k = vs->recent + i;
+            if (k->skdt == skdt && k->hp == hp && k->bucket == bucket)
+                break;
+        }
+        if (i == REF_CACHE_NRECENT) {
+            // (not asked for recently: only remember it)
+            k = vs->recent + vs->nextrecent;
+            k->skdt = skdt;
+            k->hp = hp;
+            k->bucket = bucket;
+            vs->nextrecent = (vs->nextrecent + 1) % REF_CACHE_NRECENT;
+            return NULL;
+        }
+        // an empty entry, or else the least recently used one.
+        e = vs->refs;
+        for (i = 1; i < REF_CACHE_SIZE && e->skdt; i++)
+            if (!vs->refs[i].skdt || vs->refs[i].used < e->used)
+                e = vs->refs + i;
+    }
+    // (keeping its memory)
+    e->skdt = NULL;
+    e->N = 0;
+
+    // the patch is the circle around the center of the healpix that
+    // contains all the circles of radius "rbucket" around the points of
+    // the healpix (with some margin, since its sides are curved).
+    healpix_to_xyzarr(hp, nside, 0.5, 0.5, e->center);
+    cellr = 0;
+    for (i = 0; i < 2; i++)
+        for (j = 0; j < 2; j++) {
+            healpix_to_xyzarr(hp, nside, i, j, corner);
+            cellr = MAX(cellr, distsq2rad(distsq(e->center, corner, 3)));
+        }
+    e->radius = MIN(M_PI, rbucket + 1.1 * cellr);
+    N = search_ref_stars(vs, skdt, e->center, rad2distsq(e->radius));
+    if (N > e->cap) {
+        free(e->xyz);
+        free(e->starid);
+        e->cap = MAX(N, 2 * e->cap);
+        e->xyz = malloc(e->cap * 3 * sizeof(double));
+        e->starid = malloc(e->cap * sizeof(int));
+        if (!e->xyz || !e->starid) {
+            SYSERROR("Failed to allocate the reference star cache");
+            free_ref_cache_entry(e);
+            return NULL;
+        }
+    }
+    // (the star ids first, to sort them)
+    for (i = 0; i < N; i++)
+        e->starid[i] = vs->starres->inds[i];
+    perm = permutation_init(scratch_get(vs, VS_CACHEPERM, N * sizeof(int)), N);
+    sort_by_sweep(vs, skdt, e->starid, N, perm, N);
+    for (i = 0; i < N; i++) {
+        memcpy(e->xyz + 3*i, vs->starres->results.d + 3*perm[i],
+               3 * sizeof(double));
+        e->starid[i] = vs->starres->inds[perm[i]];
+    }
+    e->N = N;
+    e->skdt = skdt;
+    e->hp = hp;
+    e->bucket = bucket;
+    e->used = vs->clock;
+    return e;
+}
+
+static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf,
+                                              double nsigmas, verify_scratch_t* vs);
+static void uniformize(const double* xy, int* perm, int N,
+                       double fieldW, double fieldH, int nw, int nh,
+                       int* binstart, int* order, int* binids);
+static void fill_bin_centers(double fieldW, double fieldH, int nw, int nh,
+                             double* bxy);
 
 verify_field_t* verify_field_preprocess(const starxy_t* fieldxy) {
     verify_field_t* vf;
-    int Nleaf = 5;
 
-    vf = malloc(sizeof(verify_field_t));
+    vf = calloc(1, sizeof(verify_field_t));
     if (!vf) {
         fprintf(stderr, "Failed to allocate space for a verify_field_t().\n");
         return NULL;
     }
+    return verify_field_preprocess_reuse(vf, fieldxy);
+}
+
+verify_field_t* verify_field_preprocess_reuse(verify_field_t* vf,
+                                              const starxy_t* fieldxy) {
+    int Nleaf = 5;
+    int i, N;
+
+    if (!vf)
+        return verify_field_preprocess(fieldxy);
+
+    N = starxy_n(fieldxy);
     vf->field = fieldxy;
     // Note on kdtree type: I tried U32 (duu) but it was marginally slower.
     // I didn't try U16 (dss) because we need a fair bit of accuracy here.
     // Make a copy of the field objects, because we're going to build a
     // kdtree out of them and that shuffles their order.
-    vf->fieldcopy = starxy_copy_xy(fieldxy);
-    vf->xy = starxy_copy_xy(fieldxy);
-    if (!vf->fieldcopy || !vf->xy) {
-        fprintf(stderr, "Failed to copy the field.\n");
-        return NULL;
+    // (room for at least one star, so that an empty field, to which
+    // stars are added later, is a field too)
+    if (N > vf->capacity || !vf->fieldcopy || !vf->xy) {
+        int capacity = MAX(N, 1);
+        free(vf->fieldcopy);
+        free(vf->xy);
+        vf->fieldcopy = malloc(sizeof(double) * 2 * capacity);
+        vf->xy = malloc(sizeof(double) * 2 * capacity);
+        vf->capacity = 0;
+        if (!vf->fieldcopy || !vf->xy) {
+            fprintf(stderr, "Failed to copy the field.\n");
+            verify_field_free(vf);
+            return NULL;
+        }
+        vf->capacity = capacity;
+    }
+    for (i=0; i<N; i++) {
+        vf->xy[2*i + 0] = starxy_getx(fieldxy, i);
+        vf->xy[2*i + 1] = starxy_gety(fieldxy, i);
     }
+    memcpy(vf->fieldcopy, vf->xy, sizeof(double) * 2 * N);
+
     // Build a tree out of the field objects (in pixel space)
-    vf->ftree = kdtree_build(NULL, vf->fieldcopy, starxy_n(vf->field),
-                             2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    kdtree_free(vf->ftree);
+    vf->ftree = NULL;
+    if (N)
+        vf->ftree = kdtree_build(NULL, vf->fieldcopy, N,
+                                 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    // ... and a grid, which is cheaper to search for all the stars
+    // within a radius.
+    if (point_grid_build(&(vf->grid), vf->xy, NULL, N)) {
+        fprintf(stderr, "Failed to build the grid of the field.\n");
+        verify_field_free(vf);
+        return NULL;
+    }
 
     vf->do_uniformize = TRUE;
     vf->do_dedup = TRUE;
@@ -98,6 +489,7 @@ void verify_field_free(verify_field_t* vf) {
     if (!vf)
         return;
     kdtree_free(vf->ftree);
+    point_grid_free(&(vf->grid));
     free(vf->xy);
     free(vf->fieldcopy);
     free(vf);
@@ -107,15 +499,14 @@ static double get_sigma2_at_radius(double verify_pix2, double r2, double quadr2)
     return verify_pix2 * (1.0 + r2/quadr2);
 }
 
-static double* compute_sigma2s(const verify_field_t* vf,
-                               const double* xy, int NF,
-                               const double* qc, double Q2,
-                               double verify_pix2, anbool do_gamma) {
-    double* sigma2s;
+static void compute_sigma2s(const verify_field_t* vf,
+                            const double* xy, int NF,
+                            const double* qc, double Q2,
+                            double verify_pix2, anbool do_gamma,
+                            double* sigma2s) {
     int i;
     double R2;
 
-    sigma2s = malloc(NF * sizeof(double));
     if (!do_gamma) {
         for (i=0; i<NF; i++)
             sigma2s[i] = verify_pix2;
@@ -135,32 +526,65 @@ static double* compute_sigma2s(const verify_field_t* vf,
             sigma2s[i] = get_sigma2_at_radius(verify_pix2, R2, Q2);
         }
     }
-    return sigma2s;
 }
 
-double* verify_compute_sigma2s(const verify_field_t* vf, const MatchObj* mo,
-                               double verify_pix2, anbool do_gamma) {
-    int NF;
+// verify_compute_sigma2s(), into "sigma2s".
+static void fill_sigma2s(const verify_field_t* vf, const MatchObj* mo,
+                         double verify_pix2, anbool do_gamma,
+                         double* sigma2s) {
     double qc[2];
     double Q2=0;
-    NF = starxy_n(vf->field);
     if (do_gamma) {
         verify_get_quad_center(vf, mo, qc, &Q2);
         debug2("Quad radius = %g pixels\n", sqrt(Q2));
     }
-    return compute_sigma2s(vf, NULL, NF, qc, Q2, verify_pix2, do_gamma);
+    compute_sigma2s(vf, NULL, starxy_n(vf->field), qc, Q2, verify_pix2,
+                    do_gamma, sigma2s);
+}
+
+double* verify_compute_sigma2s(const verify_field_t* vf, const MatchObj* mo,
+                               double verify_pix2, anbool do_gamma) {
+    double* sigma2s = malloc(starxy_n(vf->field) * sizeof(double));
+    fill_sigma2s(vf, mo, verify_pix2, do_gamma, sigma2s);
+    return sigma2s;
 }
 
 double* verify_compute_sigma2s_arr(const double* xy, int NF,
                                    const double* qc, double Q2,
                                    double verify_pix2, anbool do_gamma) {
-    return compute_sigma2s(NULL, xy, NF, qc, Q2, verify_pix2, do_gamma);
+    double* sigma2s = malloc(NF * sizeof(double));
+    compute_sigma2s(NULL, xy, NF, qc, Q2, verify_pix2, do_gamma, sigma2s);
+    return sigma2s;
 }
 
 static double logd_at(double distractor, int mu, int NR, double logbg) {
     return log(distractor + (1.0-distractor)*mu / (double)NR) + logbg;
 }
 
+// Number of values of the log-likelihoods that real_verify_star_lists()
+// computes at once, with log_batch().
+#define LOGODDS_BLOCK 32
+
+/*
+ logd_at(distractor, mu, NR, logbg), from the table "logds" of its values
+ for mu = 0, 1, ..., NR+1: the first "*nlogds" of them are there, and
+ the others are computed when they're needed, LOGODDS_BLOCK at a time.
+ */
+static double logd_lookup(double* logds, int* nlogds, double distractor,
+                          int mu, int NR, double logbg) {
+    int k, n;
+    if (mu < *nlogds)
+        return logds[mu];
+    n = MIN(NR + 2, MAX(mu + 1, *nlogds + LOGODDS_BLOCK));
+    for (k = *nlogds; k < n; k++)
+        logds[k] = distractor + (1.0-distractor)*k / (double)NR;
+    log_batch(logds + *nlogds, n - *nlogds, logds + *nlogds);
+    for (k = *nlogds; k < n; k++)
+        logds[k] += logbg;
+    *nlogds = n;
+    return logds[mu];
+}
+
 static int get_xy_bin(const double* xy,
                       double fieldW, double fieldH,
                       int nw, int nh) {
@@ -182,7 +606,8 @@ static void print_test_perm(verify_t* v) {
 }
 
 static void verify_get_test_stars(verify_t* v, const verify_field_t* vf, MatchObj* mo,
-                                  double pix2, anbool do_gamma, anbool fake_match) {
+                                  double pix2, anbool do_gamma, anbool fake_match,
+                                  verify_scratch_t* vs) {
     anbool* keepers = NULL;
     int i;
     int ibad=0, igood=0;
@@ -190,9 +615,11 @@ static void verify_get_test_stars(verify_t* v, const verify_field_t* vf, MatchOb
     v->NTall = starxy_n(vf->field);
     v->testxy = vf->xy;
     v->NT = v->NTall;
-    v->testsigma = verify_compute_sigma2s(vf, mo, pix2, do_gamma);
-    v->testperm = permutation_init(NULL, v->NTall);
-    v->tbadguys = malloc(v->NTall * sizeof(int));
+    v->testsigma = scratch_get(vs, VS_TESTSIGMA, v->NTall * sizeof(double));
+    fill_sigma2s(vf, mo, pix2, do_gamma, v->testsigma);
+    v->testperm = permutation_init(scratch_get(vs, VS_TESTPERM, v->NTall * sizeof(int)),
+                                   v->NTall);
+    v->tbadguys = scratch_get(vs, VS_TBADGUYS, v->NTall * sizeof(int));
 
     if (DEBUGVERIFY) {
         debug2("start:\n");
@@ -206,7 +633,7 @@ static void verify_get_test_stars(verify_t* v, const verify_field_t* vf, MatchOb
         // -- this requires the match scale
         // -- can perhaps discretize dedup to nearest power-of-sqrt(2) pixel radius and cache it.
         // -- we can compute sigma much later
-        keepers = verify_deduplicate_field_stars(v, vf, 1.0);
+        keepers = verify_deduplicate_field_stars(v, vf, 1.0, vs);
 
         // Remove test quad stars.  Do this after deduplication so we
         // don't end up with (duplicate) test stars near the quad stars.
@@ -263,7 +690,6 @@ static void verify_get_test_stars(verify_t* v, const verify_field_t* vf, MatchOb
     v->NT = igood;
     // remember the bad guys
     memcpy(v->testperm + igood, v->tbadguys, ibad * sizeof(int));
-    free(keepers);
 
     if (DEBUGVERIFY) {
         debug2("after dedup and removing quad:\n");
@@ -288,7 +714,8 @@ static void verify_apply_ror(verify_t* v,
                              double fieldH,
                              anbool do_gamma, anbool fake_match,
                              double* p_effA,
-                             int* p_uninw, int* p_uninh) {
+                             int* p_uninw, int* p_uninh,
+                             verify_scratch_t* vs) {
     int i;
     int uni_nw = 0, uni_nh = 0;
     double effA = fieldW * fieldH;
@@ -302,7 +729,7 @@ static void verify_apply_ror(verify_t* v,
     if (fake_match)
         do_gamma = FALSE;
 
-    verify_get_test_stars(v, vf, mo, pix2, do_gamma, fake_match);
+    verify_get_test_stars(v, vf, mo, pix2, do_gamma, fake_match, vs);
     debug2("Number of test stars: %i\n", v->NT);
     debug2("Number of reference stars: %i\n", v->NR);
 
@@ -318,8 +745,14 @@ static void verify_apply_ror(verify_t* v,
 
         // uniformize!
         if (uni_nw > 1 || uni_nh > 1) {
-            verify_uniformize_field(vf->xy, v->testperm, v->NT, fieldW, fieldH, uni_nw, uni_nh, NULL, &binids);
-            bincenters = verify_uniformize_bin_centers(fieldW, fieldH, uni_nw, uni_nh);
+            size_t nbins = (size_t)uni_nw * (size_t)uni_nh;
+            binids = scratch_get(vs, VS_BINIDS, v->NT * sizeof(int));
+            uniformize(vf->xy, v->testperm, v->NT, fieldW, fieldH, uni_nw, uni_nh,
+                       scratch_get(vs, VS_BINSTART, (nbins + 1) * sizeof(int)),
+                       scratch_get(vs, VS_BINORDER, v->NT * sizeof(int)),
+                       binids);
+            bincenters = scratch_get(vs, VS_BINCENTERS, nbins * 2 * sizeof(double));
+            fill_bin_centers(fieldW, fieldH, uni_nw, uni_nh, bincenters);
 
             if (DEBUGVERIFY) {
                 debug2("after uniformizing:\n");
@@ -339,7 +772,8 @@ static void verify_apply_ror(verify_t* v,
 
         if (binids) {
             assert(uni_nw);
-            goodbins = malloc((size_t)uni_nw * (size_t)uni_nh * sizeof(anbool));
+            goodbins = scratch_get(vs, VS_GOODBINS,
+                                   (size_t)uni_nw * (size_t)uni_nh * sizeof(anbool));
             Ngoodbins = 0;
             for (i=0; i<(uni_nw * uni_nh); i++) {
                 double binr2 = distsq(bincenters + 2*i, qc, 2);
@@ -377,7 +811,9 @@ static void verify_apply_ror(verify_t* v,
             assert(!bincenters);
             if (!uni_nw)
                 verify_get_uniformize_scale(index_cutnside, mo->scale, fieldW, fieldH, &uni_nw, &uni_nh);
-            bincenters = verify_uniformize_bin_centers(fieldW, fieldH, uni_nw, uni_nh);
+            bincenters = scratch_get(vs, VS_BINCENTERS,
+                                     (size_t)uni_nw * (size_t)uni_nh * 2 * sizeof(double));
+            fill_bin_centers(fieldW, fieldH, uni_nw, uni_nh, bincenters);
             Ngoodbins = 0;
             for (i=0; i<(uni_nw * uni_nh); i++) {
                 double binr2 = distsq(bincenters + 2*i, qc, 2);
@@ -434,11 +870,7 @@ static void verify_apply_ror(verify_t* v,
         // New ROR is...
         debug2("ROR changed from %g to %g\n", sqrt(ror2),
                sqrt(verify_get_ror2(Q2, effA, distractors, v->NR, pix2)));
-
-        free(goodbins);
     }
-    free(bincenters);
-    free(binids);
 
     *p_effA = effA;
     if (p_uninw)
@@ -447,6 +879,10 @@ static void verify_apply_ror(verify_t* v,
         *p_uninh = uni_nh;
 }
 
+/*
+ The "theta" and "logodds" arrays it returns belong to the scratch space
+ "vs", like the grid of the reference stars.
+ */
 static double real_verify_star_lists(verify_t* v,
                                      double effective_area,
                                      double distractors,
@@ -455,7 +891,8 @@ static double real_verify_star_lists(verify_t* v,
                                      int* p_besti,
                                      double** p_logodds, int** p_theta,
                                      double* p_worstlogodds,
-                                     int* p_ibailed, int* p_istopped) {
+                                     int* p_ibailed, int* p_istopped,
+                                     verify_scratch_t* vs) {
     int i, j;
     double worstlogodds;
     double bestworstlogodds;
@@ -465,47 +902,63 @@ static double real_verify_star_lists(verify_t* v,
     double logbg;
     double logd;
     //double matchnsigma = 5.0;
-    double* refcopy;
-    kdtree_t* rtree;
+    double* refcopy = NULL;
+    kdtree_t* rtree = NULL;
     int Nleaf = 10;
+    point_grid_t* grid = &(vs->grid);
     int* rmatches;
     double* rprobs;
     double* all_logodds = NULL;
     int* theta = NULL;
     int mu;
     int* rperm;
+    // the log-likelihood tables: logd_at() for each number of matches
+    // (see logd_lookup()), and the peak values of the foreground
+    // Gaussians of the current block of test stars.
+    double* logds;
+    int nlogds = 0;
+    double loggmaxes[LOGODDS_BLOCK];
 
     if (!v->NR || !v->NT) {
         logerr("real_verify_star_lists: NR=%i, NT=%i\n", v->NR, v->NT);
         return -LARGE_VAL;
     }
 
-    // Build a tree out of the index stars in pixel space...
-    // kdtree scrambles the data array so make a copy first.
-    refcopy = malloc(2 * v->NR * sizeof(double));
     // we must pack/unpermute the refxys; remember this packing order in "rperm".
     // we borrow storage for "rperm"...
     if (!v->badguys)
-        v->badguys = malloc(v->NR * sizeof(int));
+        v->badguys = scratch_get(vs, VS_BADGUYS, v->NR * sizeof(int));
     rperm = v->badguys;
-    for (i=0; i<v->NR; i++) {
-        int ri = v->refperm[i];
-        rperm[i] = ri;
-        refcopy[2*i+0] = v->refxy[2*ri+0];
-        refcopy[2*i+1] = v->refxy[2*ri+1];
+    memcpy(rperm, v->refperm, v->NR * sizeof(int));
+
+    if (v->nn_method == VERIFY_NN_KDTREE) {
+        // Build a tree out of the index stars in pixel space...
+        // kdtree scrambles the data array so make a copy first.
+        refcopy = scratch_get(vs, VS_REFCOPY, 2 * v->NR * sizeof(double));
+        for (i=0; i<v->NR; i++) {
+            int ri = rperm[i];
+            refcopy[2*i+0] = v->refxy[2*ri+0];
+            refcopy[2*i+1] = v->refxy[2*ri+1];
+        }
+        rtree = kdtree_build(NULL, refcopy, v->NR, 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
+    } else {
+        // ... or a grid (which doesn't move them).
+        if (point_grid_build(grid, v->refxy, rperm, v->NR))
+            return -LARGE_VAL;
     }
-    rtree = kdtree_build(NULL, refcopy, v->NR, 2, Nleaf, KDTT_DOUBLE, KD_BUILD_SPLIT);
 
-    rmatches = malloc(v->NR * sizeof(int));
+    rmatches = scratch_get(vs, VS_RMATCHES, v->NR * sizeof(int));
     for (i=0; i<v->NR; i++)
         rmatches[i] = -1;
 
-    rprobs = malloc(v->NR * sizeof(double));
+    rprobs = scratch_get(vs, VS_RPROBS, v->NR * sizeof(double));
     for (i=0; i<v->NR; i++)
         rprobs[i] = -LARGE_VAL;
 
-    if (p_logodds || data_log_passes(DATALOG_MASK_VERIFY, DLOG_ODDS))
-        all_logodds = calloc(v->NT, sizeof(double));
+    if (p_logodds || data_log_passes(DATALOG_MASK_VERIFY, DLOG_ODDS)) {
+        all_logodds = scratch_get(vs, VS_ALLODDS, v->NT * sizeof(double));
+        memset(all_logodds, 0, v->NT * sizeof(double));
+    }
     if (p_logodds)
         *p_logodds = all_logodds;
 	
@@ -514,9 +967,10 @@ static double real_verify_star_lists(verify_t* v,
     if (p_istopped)
         *p_istopped = -1;
 
-    theta = malloc(v->NT * sizeof(int));
+    theta = scratch_get(vs, VS_THETA, v->NT * sizeof(int));
 
     logbg = log(1.0 / effective_area);
+    logds = scratch_get(vs, VS_LOGDS, (v->NR + 2) * sizeof(double));
 
     worstlogodds = 0;
     bestlogodds = -LARGE_VAL;
@@ -534,17 +988,28 @@ static double real_verify_star_lists(verify_t* v,
         double logfg;
         int ti;
 
+        if ((i % LOGODDS_BLOCK) == 0) {
+            int k, n = MIN(LOGODDS_BLOCK, v->NT - i);
+            for (k=0; k<n; k++)
+                loggmaxes[k] = (1.0 - distractors) /
+                    (2.0 * M_PI * v->testsigma[v->testperm[i + k]] * v->NR);
+            log_batch(loggmaxes, n, loggmaxes);
+        }
+
         ti = v->testperm[i];
         testxy = v->testxy + 2*ti;
         sig2 = v->testsigma[ti];
 
-        logd = logd_at(distractors, mu, v->NR, logbg);
+        logd = logd_lookup(logds, &nlogds, distractors, mu, v->NR, logbg);
 
         debug2("\n");
         debug2("test star %i: (%.1f,%.1f), sigma: %.1f\n", i, testxy[0], testxy[1], sqrt(sig2));
 
         // find nearest ref star (within 5 sigma)
-        tmpi = kdtree_nearest_neighbour_within(rtree, testxy, sig2 * 25.0, &d2);
+        if (rtree)
+            tmpi = kdtree_nearest_neighbour_within(rtree, testxy, sig2 * 25.0, &d2);
+        else
+            tmpi = point_grid_nearest_within(grid, testxy, sig2 * 25.0, &d2);
         if (tmpi == -1) {
             // no nearest neighbour within range.
             debug2("  No nearest neighbour.\n");
@@ -552,10 +1017,10 @@ static double real_verify_star_lists(verify_t* v,
             logfg = -LARGE_VAL;
         } else {
             double loggmax;
-            // Note that "refi" is w.r.t. the "refcopy" array (not the original data).
-            refi = kdtree_permute(rtree, tmpi);
+            // Note that "refi" is w.r.t. the "rperm" packing order (not the original data).
+            refi = (rtree ? kdtree_permute(rtree, tmpi) : tmpi);
             // peak value of the Gaussian
-            loggmax = log((1.0 - distractors) / (2.0 * M_PI * sig2 * v->NR));
+            loggmax = loggmaxes[i % LOGODDS_BLOCK];
             // FIXME - do something with uninformative hits?
             // these should be eliminated by RoR filtering...
             if (loggmax < logbg)
@@ -591,7 +1056,8 @@ static double real_verify_star_lists(verify_t* v,
                 for (j=0; j<oldj; j++)
                     if (theta[j] >= 0)
                         muj++;
-                switchfg += (logd_at(distractors, muj, v->NR, logbg) - oldfg);
+                switchfg += (logd_lookup(logds, &nlogds, distractors, muj, v->NR, logbg) -
+                             oldfg);
                 // FIXME - could estimate/bound the distractor change and avoid computing it...
 
                 // ... and the intervening distractors become worse.
@@ -600,8 +1066,8 @@ static double real_verify_star_lists(verify_t* v,
                        (logd_at(distractors, muj, v->NR, logbg) - oldfg));
                 for (; j<i; j++)
                     if (theta[j] < 0) {
-                        switchfg += (logd_at(distractors, muj, v->NR, logbg) -
-                                     logd_at(distractors, muj+1, v->NR, logbg));
+                        switchfg += (logd_lookup(logds, &nlogds, distractors, muj, v->NR, logbg) -
+                                     logd_lookup(logds, &nlogds, distractors, muj+1, v->NR, logbg));
                         debug2("  adjusting distractor %i: %g change in logodds\n",
                                j, (logd_at(distractors, muj, v->NR, logbg) -
                                    logd_at(distractors, muj+1, v->NR, logbg)));
@@ -694,6 +1160,15 @@ static double real_verify_star_lists(verify_t* v,
                 *p_istopped = i;
             break;
         }
+
+        // (looking at the clock every 32 stars)
+        if (v->deadline_ns && ((i & 31) == 31) &&
+            (timenow_ns() >= v->deadline_ns)) {
+            debug2("  out of time\n");
+            if (p_ibailed)
+                *p_ibailed = i;
+            break;
+        }
     }
 
     if (bestlogodds > DLOG_ODDS_MIN) {
@@ -750,12 +1225,8 @@ static double real_verify_star_lists(verify_t* v,
          */
     }
 
-    free(rmatches);
-
     if (p_theta)
         *p_theta = theta;
-    else
-        free(theta);
 
     if (p_besti)
         *p_besti = besti;
@@ -763,13 +1234,7 @@ static double real_verify_star_lists(verify_t* v,
     if (p_worstlogodds)
         *p_worstlogodds = bestworstlogodds;
 
-    if (all_logodds && !*p_logodds)
-        free(all_logodds);
-
-    free(rprobs);
-
     kdtree_free(rtree);
-    free(refcopy);
 
     return bestlogodds;
 }
@@ -852,31 +1317,35 @@ void verify_get_index_stars(const double* fieldcenter, double fieldr2,
  If field objects are within "sigma" of each other (where sigma depends on the
  distance from the matched quad), then they are not very useful for verification.
  We filter out field stars within sigma of each other, taking only the brightest.
+ (The neighbours of each star come from the grid of the field stars
+ built by verify_field_preprocess().)
 
  Returns an array indicating which field stars should be kept.
  */
-static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf, double nsigmas) {
+static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t* vf,
+                                              double nsigmas, verify_scratch_t* vs) {
     anbool* keepers = NULL;
-    int i, j, ti;
-    kdtree_qres_t* res = NULL;
+    int i, j, ti, nnear;
+    int* near;
     double nsig2 = nsigmas*nsigmas;
-    int options = KD_OPTIONS_NO_RESIZE_RESULTS | KD_OPTIONS_SMALL_RADIUS;
 
+    near = scratch_get(vs, VS_NEIGHBOURS, v->NTall * sizeof(int));
     // default to FALSE
-    keepers = calloc(v->NTall, sizeof(anbool));
+    keepers = scratch_get(vs, VS_KEEPERS, v->NTall * sizeof(anbool));
+    memset(keepers, 0, v->NTall * sizeof(anbool));
     for (i=0; i<v->NT; i++) {
         ti = v->testperm[i];
         keepers[ti] = TRUE;
     }
     for (i=0; i<v->NT; i++) {
-        double sxy[2];
+        const double* sxy;
         ti = v->testperm[i];
         if (!keepers[ti])
             continue;
-        starxy_get(vf->field, ti, sxy);
-        res = kdtree_rangesearch_options_reuse(vf->ftree, res, sxy, nsig2 * v->testsigma[ti], options);
-        for (j=0; j<res->nres; j++) {
-            int ind = res->inds[j];
+        sxy = vf->xy + 2*ti;
+        nnear = point_grid_within(&(vf->grid), sxy, nsig2 * v->testsigma[ti], near);
+        for (j=0; j<nnear; j++) {
+            int ind = near[j];
             if (ind > i) {
                 keepers[ind] = FALSE;
                 if (DEBUGVERIFY) {
@@ -889,7 +1358,6 @@ static anbool* verify_deduplicate_field_stars(verify_t* v, const verify_field_t*
             }
         }
     }
-    kdtree_free_query(res);
     return keepers;
 }
 
@@ -919,48 +1387,39 @@ void verify_get_uniformize_scale(int cutnside, double scale, int W, int H, int*
         *cutnh = MAX(1, (int)round(H / cutpix));
 }
 
-void verify_uniformize_field(const double* xy,
-                             int* perm,
-                             int N,
-                             double fieldW, double fieldH,
-                             int nw, int nh,
-                             int** p_bincounts,
-                             int** p_binids) {
-    il** lists;
+/*
+ verify_uniformize_field(), with the memory supplied by the caller:
+ "binstart" has room for nw*nh+1 ints, "order" and "binids" (which may
+ be NULL) for N.  The stars are sorted into their bins with a counting
+ sort: the stars of bin b are order[binstart[b]], ...,
+ order[binstart[b+1]-1], in the order of "perm".
+ */
+static void uniformize(const double* xy, int* perm, int N,
+                       double fieldW, double fieldH, int nw, int nh,
+                       int* binstart, int* order, int* binids) {
     int i,j,k,p;
-    int* bincounts = NULL;
-    int* binids = NULL;
-
-    if (p_binids) {
-        binids = malloc((size_t)N * sizeof(int));
-        *p_binids = binids;
-    }
-
-    lists = malloc((size_t)nw * (size_t)nh * sizeof(il*));
-    for (i=0; i<(nw*nh); i++)
-        lists[i] = il_new(16);
+    int nbins = nw * nh;
 
-    // put the stars in the appropriate bins.
+    // count the stars in each bin...
+    memset(binstart, 0, (nbins + 1) * sizeof(int));
     debug2("Test star bins:\n");
     for (i=0; i<N; i++) {
-        int ind;
-        int bin;
-        ind = perm[i];
-        bin = get_xy_bin(xy + 2*ind, fieldW, fieldH, nw, nh);
+        int bin = get_xy_bin(xy + 2*perm[i], fieldW, fieldH, nw, nh);
         debug2("%i ", bin);
-        il_append(lists[bin], ind);
+        binstart[bin + 1]++;
     }
     debug2("\n");
-
-    if (p_bincounts) {
-        // note the bin occupancies.
-        bincounts = malloc((size_t)nw * (size_t)nh * sizeof(int));
-        for (i=0; i<(nw*nh); i++) {
-            bincounts[i] = il_size(lists[i]);
-            //logverb("bin %i has %i stars\n", i, bincounts[i]);
-        }
-        *p_bincounts = bincounts;
+    for (i=0; i<nbins; i++)
+        binstart[i + 1] += binstart[i];
+    // ...and put them in, using binstart[b] as the cursor of bin b,
+    // which leaves it at the start of bin b+1.
+    for (i=0; i<N; i++) {
+        int bin = get_xy_bin(xy + 2*perm[i], fieldW, fieldH, nw, nh);
+        order[binstart[bin]++] = perm[i];
     }
+    for (i=nbins; i>0; i--)
+        binstart[i] = binstart[i - 1];
+    binstart[0] = 0;
 
     // make sweeps through the bins, grabbing one star from each.
     p=0;
@@ -968,10 +1427,9 @@ void verify_uniformize_field(const double* xy,
         for (j=0; j<nh; j++) {
             for (i=0; i<nw; i++) {
                 int binid = j*nw + i;
-                il* lst = lists[binid];
-                if (k >= il_size(lst))
+                if (k >= binstart[binid + 1] - binstart[binid])
                     continue;
-                perm[p] = il_get(lst, k);
+                perm[p] = order[binstart[binid] + k];
                 if (binids)
                     binids[p] = binid;
                 p++;
@@ -981,21 +1439,55 @@ void verify_uniformize_field(const double* xy,
             break;
     }
     assert(p == N);
+}
 
-    for (i=0; i<(nw*nh); i++)
-        il_free(lists[i]);
-    free(lists);
+void verify_uniformize_field(const double* xy,
+                             int* perm,
+                             int N,
+                             double fieldW, double fieldH,
+                             int nw, int nh,
+                             int** p_bincounts,
+                             int** p_binids) {
+    int i;
+    int* binstart;
+    int* order;
+    int* binids = NULL;
+
+    if (p_binids) {
+        binids = malloc((size_t)N * sizeof(int));
+        *p_binids = binids;
+    }
+    binstart = malloc(((size_t)nw * (size_t)nh + 1) * sizeof(int));
+    order = malloc(MAX(1, (size_t)N) * sizeof(int));
+
+    uniformize(xy, perm, N, fieldW, fieldH, nw, nh, binstart, order, binids);
+
+    if (p_bincounts) {
+        // note the bin occupancies.
+        int* bincounts = malloc((size_t)nw * (size_t)nh * sizeof(int));
+        for (i=0; i<(nw*nh); i++)
+            bincounts[i] = binstart[i + 1] - binstart[i];
+        *p_bincounts = bincounts;
+    }
+    free(binstart);
+    free(order);
 }
 
-double* verify_uniformize_bin_centers(double fieldW, double fieldH,
-                                      int nw, int nh) {
+// verify_uniformize_bin_centers(), into "bxy".
+static void fill_bin_centers(double fieldW, double fieldH, int nw, int nh,
+                             double* bxy) {
     int i,j;
-    double* bxy = malloc((size_t)nw * (size_t)nh * (size_t)2 * sizeof(double));
     for (j=0; j<nh; j++)
         for (i=0; i<nw; i++) {
             bxy[(j * nw + i)*2 +0] = (i + 0.5) * fieldW / (double)nw;
             bxy[(j * nw + i)*2 +1] = (j + 0.5) * fieldH / (double)nh;
         }
+}
+
+double* verify_uniformize_bin_centers(double fieldW, double fieldH,
+                                      int nw, int nh) {
+    double* bxy = malloc((size_t)nw * (size_t)nh * (size_t)2 * sizeof(double));
+    fill_bin_centers(fieldW, fieldH, nw, nh, bxy);
     return bxy;
 }
 
@@ -1025,7 +1517,7 @@ void verify_wcs(const startree_t* skdt,
     memcpy(&(mo.wcstan), &(sip->wcstan), sizeof(tan_t));
     mo.wcs_valid = TRUE;
 
-    verify_hit(skdt, index_cutnside, &mo, sip, vf, verify_pix2,
+    verify_hit(skdt, index_cutnside, &mo, sip, vf, NULL, verify_pix2,
                distractors, fieldW, fieldH, logbail, logaccept,
                logstoplooking, FALSE, TRUE);
 
@@ -1216,8 +1708,116 @@ void verify_count_hits(int* theta, int besti, int* p_nmatch, int* p_nconflict, i
 }
 
 
+double verify_precheck(const startree_t* skdt, const MatchObj* mo,
+                       const verify_field_t* vf, verify_scratch_t* vs,
+                       int nref, int nfield, double pix2, double distractors,
+                       double fieldW, double fieldH) {
+    verify_scratch_t tmpvs;
+    anbool owns_vs = FALSE;
+    const struct ref_cache_entry* refs = NULL;
+    double* xyz = NULL;
+    int* starid = NULL;
+    int* perm = NULL;
+    int* matched;
+    double fieldr2, qc[2], quadr2, logbg, logodds;
+    int i, j, N, NF, k, mu;
+
+    NF = MIN(nfield, starxy_n(vf->field));
+    if (nref <= 0 || NF <= 0 || !vf->ftree)
+        return LARGE_VAL;
+    if (!vs) {
+        memset(&tmpvs, 0, sizeof(verify_scratch_t));
+        vs = &tmpvs;
+        owns_vs = TRUE;
+    }
+
+    // the reference stars in the bounding circle of the field, brightest
+    // (lowest sweep number) first.
+    fieldr2 = square(mo->radius);
+    if (!owns_vs && !vf->no_ref_cache)
+        refs = get_cached_ref_stars(vs, skdt, mo->center, fieldr2, FALSE);
+    if (refs) {
+        xyz = refs->xyz;
+        starid = refs->starid;
+        N = refs->N;
+    } else {
+        N = search_ref_stars(vs, skdt, mo->center, fieldr2);
+        if (N) {
+            xyz = vs->starres->results.d;
+            starid = scratch_get(vs, VS_REFSTARID, N * sizeof(int));
+            for (i=0; i<N; i++)
+                starid[i] = vs->starres->inds[i];
+            perm = permutation_init(scratch_get(vs, VS_REFPERM, N * sizeof(int)), N);
+            sort_by_sweep(vs, skdt, starid, N, perm, N);
+        }
+    }
+
+    verify_get_quad_center(vf, mo, qc, &quadr2);
+    logbg = log(1.0 / (fieldW * fieldH));
+    matched = scratch_get(vs, VS_MATCHED, nref * sizeof(int));
+    logodds = 0.0;
+    mu = 0;
+    k = 0;
+    for (i=0; i<N && k<nref; i++) {
+        int ri = (perm ? perm[i] : i);
+        double xy[2], sig2, d2, logfg, logd;
+        int fi;
+        if (refs && distsq(xyz + 3*ri, mo->center, 3) > fieldr2)
+            continue;
+        // (skip the stars of the quad, which match by construction)
+        for (j=0; j<mo->dimquads; j++)
+            if (starid[ri] == mo->star[j])
+                break;
+        if (j < mo->dimquads)
+            continue;
+        if (!tan_xyzarr2pixelxy(&(mo->wcstan), xyz + 3*ri, xy, xy+1) ||
+            !tan_pixel_is_inside_image(&(mo->wcstan), xy[0], xy[1]))
+            continue;
+
+        // the nearest field star (within 5 sigma) must be one of the
+        // "nfield" brightest, not in the quad, and not already matched.
+        sig2 = get_sigma2_at_radius(pix2, distsq(xy, qc, 2), quadr2);
+        fi = kdtree_nearest_neighbour_within(vf->ftree, xy, sig2 * 25.0, &d2);
+        if (fi != -1) {
+            fi = kdtree_permute(vf->ftree, fi);
+            if (fi >= NF)
+                fi = -1;
+            for (j=0; fi != -1 && j<mo->dimquads; j++)
+                if (fi == mo->field[j])
+                    fi = -1;
+            for (j=0; fi != -1 && j<k; j++)
+                if (fi == matched[j])
+                    fi = -1;
+        }
+        // the same foreground / distractor model as the full
+        // verification, with the roles of the field and reference
+        // stars swapped.
+        logd = logd_at(distractors, mu, NF, logbg);
+        logfg = -LARGE_VAL;
+        if (fi != -1)
+            logfg = log((1.0 - distractors) / (2.0 * M_PI * sig2 * NF)) -
+                d2 / (2.0 * sig2);
+        if (logfg >= logd) {
+            logodds += logfg - logbg;
+            mu++;
+        } else {
+            logodds += logd - logbg;
+            fi = -1;
+        }
+        matched[k] = fi;
+        k++;
+    }
+    debug("Pre-check: %i of %i bright reference stars matched; log-odds %g\n",
+          mu, k, logodds);
+
+    if (owns_vs)
+        free_scratch_contents(vs);
+    return logodds;
+}
+
 void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
                 const sip_t* sip, const verify_field_t* vf,
+                verify_scratch_t* vs,
                 double pix2, double distractors,
                 double fieldW, double fieldH,
                 double logbail, double logaccept, double logstoplooking,
@@ -1231,8 +1831,12 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     double* allodds = NULL;
     sip_t thewcs;
     int ibad, igood;
+    verify_scratch_t tmpvs;
+    anbool owns_vs = FALSE;
     double* refxyz = NULL;
-    int* sweep = NULL;
+    const struct ref_cache_entry* refs = NULL;
+    double* refx;
+    anbool* inside;
     verify_t the_v;
     verify_t* v = &the_v;
     int NRimage;
@@ -1244,6 +1848,19 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
 
     memset(v, 0, sizeof(verify_t));
 
+    v->deadline_ns = vf->deadline_ns;
+    v->nn_method = vf->nn_method;
+    if (!vs) {
+        // (a temporary one, without the reference star cache)
+        memset(&tmpvs, 0, sizeof(verify_scratch_t));
+        vs = &tmpvs;
+        owns_vs = TRUE;
+    }
+    if (v->deadline_ns && (timenow_ns() >= v->deadline_ns)) {
+        logverb("Out of time: not verifying\n");
+        goto bailout;
+    }
+
     if (sip)
         v->wcs = sip;
     else {
@@ -1289,23 +1906,51 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
      */
     assert(skdt->sweep);
     // Find all index stars within the bounding circle of the field.
-    startree_search_for(skdt, fieldcenter, fieldr2, &refxyz, NULL, &v->refstarid, &v->NRall);
+    if (!owns_vs && !vf->no_ref_cache)
+        refs = get_cached_ref_stars(vs, skdt, fieldcenter, fieldr2, TRUE);
+    if (refs) {
+        // (they come sorted by sweep number)
+        refxyz = scratch_get(vs, VS_REFXYZ, refs->N * 3 * sizeof(double));
+        v->refstarid = scratch_get(vs, VS_REFSTARID, refs->N * sizeof(int));
+        v->NRall = 0;
+        for (i=0; i<refs->N; i++) {
+            if (distsq(refs->xyz + 3*i, fieldcenter, 3) > fieldr2)
+                continue;
+            memcpy(refxyz + 3*v->NRall, refs->xyz + 3*i, 3 * sizeof(double));
+            v->refstarid[v->NRall] = refs->starid[i];
+            v->NRall++;
+        }
+    } else {
+        v->NRall = search_ref_stars(vs, skdt, fieldcenter, fieldr2);
+        refxyz = scratch_get(vs, VS_REFXYZ, v->NRall * 3 * sizeof(double));
+        v->refstarid = scratch_get(vs, VS_REFSTARID, v->NRall * sizeof(int));
+        if (v->NRall)
+            memcpy(refxyz, vs->starres->results.d,
+                   v->NRall * 3 * sizeof(double));
+        for (i=0; i<v->NRall; i++)
+            v->refstarid[i] = vs->starres->inds[i];
+    }
     debug2("%i reference stars in the bounding circle\n", v->NRall);
-    if (!refxyz) {
+    if (!v->NRall) {
         // no stars in range.
         logverb("No reference stars in the bounding circle\n");
         goto bailout;
     }
     //logverb("Found %i reference stars in the bounding circle\n", v->NRall);
     // Find index stars within the rectangular field.
-    v->refxy = malloc(v->NRall * 2 * sizeof(double));
-    v->refperm = malloc(v->NRall * sizeof(int));
+    v->refxy = scratch_get(vs, VS_REFXY, v->NRall * 2 * sizeof(double));
+    v->refperm = scratch_get(vs, VS_REFPERM, v->NRall * sizeof(int));
+    // (project them all at once, then interleave x and y)
+    refx = scratch_get(vs, VS_REFX, v->NRall * 2 * sizeof(double));
+    inside = scratch_get(vs, VS_INSIDE, v->NRall * sizeof(anbool));
+    sip_xyzarr2pixelxy_batch(v->wcs, refxyz, v->NRall, refx, refx + v->NRall,
+                             inside);
     igood = 0;
     for (i=0; i<v->NRall; i++) {
-        if (!sip_xyzarr2pixelxy(v->wcs, refxyz+i*3, v->refxy+i*2, v->refxy+i*2 +1) ||
-            !sip_pixel_is_inside_image(v->wcs, v->refxy[i*2], v->refxy[i*2+1])) {
+        v->refxy[i*2 + 0] = refx[i];
+        v->refxy[i*2 + 1] = refx[v->NRall + i];
+        if (!inside[i])
             continue;
-        }
         v->refperm[igood] = i;
         igood++;
     }
@@ -1317,27 +1962,16 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     // (ie, may contain repeats)
 
     // Sort by sweep #.
-    // Each index star has a "sweep number" assigned during index building;
-    // it roughly represents a local brightness ordering.  Use this to sort the
-    // index stars.
-    // (NOTE that here we do want "sweep" to be size "NRall"; only the
-    // bottom "NRimage" of the "refperm" array will be accessed in the
-    // permuted_sort below, so none of
-    // the elements between NRimage and NRall will be touched.)
-    sweep = malloc(v->NRall * sizeof(int));
-    for (i=0; i<v->NRall; i++)
-        sweep[i] = skdt->sweep[v->refstarid[i]];
-    // Note here that we're passing in an existing permutation array; it
-    // gets re-permuted during this call.
-    permuted_sort(sweep, sizeof(int), compare_ints_asc, v->refperm, v->NR);
-    free(sweep);
-    sweep = NULL;
+    // (Only the bottom "NRimage" of the "refperm" array is sorted, so
+    // none of the elements between NRimage and NRall will be touched.)
+    if (!refs)
+        sort_by_sweep(vs, skdt, v->refstarid, v->NRall, v->refperm, v->NR);
     debug2("Found %i reference stars.\n", v->NR);
 
     // "refstarids" are indices into the star kdtree and could be used to
     // retrieve "tag-along" data with, eg, startree_get_data_column().
 
-    v->badguys = malloc(v->NR * sizeof(int));
+    v->badguys = scratch_get(vs, VS_BADGUYS, v->NR * sizeof(int));
 
     // remove reference stars that are part of the quad.
     if (!fake_match) {
@@ -1379,13 +2013,13 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
         verify_apply_ror(v, index_cutnside, mo,
                          vf, pix2, distractors, fieldW, fieldH,
                          do_gamma, fake_match,
-                         &effA, NULL, NULL);
+                         &effA, NULL, NULL, vs);
         if (!v->NR) {
             logerr("After applying ROR, NR = 0!\n");
             goto bailout;
         }
     } else {
-        verify_get_test_stars(v, vf, mo, pix2, do_gamma, fake_match);
+        verify_get_test_stars(v, vf, mo, pix2, do_gamma, fake_match, vs);
         effA = fieldW * fieldH;
         debug2("Number of test stars: %i\n", v->NT);
     }
@@ -1397,7 +2031,7 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
     worst = -LARGE_VAL;
     K = real_verify_star_lists(v, effA, distractors,
                                logbail, logstoplooking, &besti, &allodds, &theta, &worst,
-                               &ibailed, &istopped);
+                               &ibailed, &istopped, vs);
     mo->logodds = K;
     mo->worstlogodds = worst;
     // NTall so that caller knows how big 'etheta' is.
@@ -1464,29 +2098,17 @@ void verify_hit(const startree_t* skdt, int index_cutnside, MatchObj* mo,
 
         mo->theta = etheta;
         mo->matchodds = eodds;
-        mo->refxyz = refxyz;
-        refxyz = NULL;
-        mo->refxy = v->refxy;
-        v->refxy = NULL;
-        mo->refstarid = v->refstarid;
-        v->refstarid = NULL;
-        mo->testperm = v->testperm;
-        v->testperm = NULL;
+        mo->refxyz = scratch_take(vs, VS_REFXYZ);
+        mo->refxy = scratch_take(vs, VS_REFXY);
+        mo->refstarid = scratch_take(vs, VS_REFSTARID);
+        mo->testperm = scratch_take(vs, VS_TESTPERM);
 
         matchobj_compute_derived(mo);
     }
 
  cleanup:
-    free(refxyz);
-    free(theta);
-    free(allodds);
-    free(v->testperm);
-    free(v->testsigma);
-    free(v->tbadguys);
-    free(v->refperm);
-    free(v->refxy);
-    free(v->refstarid);
-    free(v->badguys);
+    if (owns_vs)
+        free_scratch_contents(vs);
     return;
 
  bailout:
@@ -1561,8 +2183,10 @@ double verify_star_lists(double* refxys, int NR,
     int besti;
     int* theta;
     double* allodds;
+    verify_scratch_t vs;
 
     memset(&v, 0, sizeof(verify_t));
+    memset(&vs, 0, sizeof(verify_scratch_t));
     v.NRall = v.NR = NR;
     v.NTall = v.NT = NT;
     // discard const here...
@@ -1576,11 +2200,9 @@ double verify_star_lists(double* refxys, int NR,
     X = real_verify_star_lists(&v, effective_area, distractors,
                                logodds_bail, logodds_stoplooking, &besti,
                                &allodds, &theta,
-                               p_worstlogodds, &ibailed, &istopped);
+                               p_worstlogodds, &ibailed, &istopped, &vs);
     fixup_theta(theta, allodds, ibailed, istopped, &v, besti, NR, NULL,
                 &etheta, &eodds);
-    free(theta);
-    free(allodds);
 
     if (p_all_logodds)
         *p_all_logodds = eodds;
@@ -1600,7 +2222,7 @@ double verify_star_lists(double* refxys, int NR,
         free(v.testperm);
 
     free(v.refperm);
-    free(v.badguys);
+    free_scratch_contents(&vs);
     return X;
 }
 
@@ -1632,6 +2254,7 @@ double verify_star_lists_ror(double* refxys, int NR,
     int besti = -1;
     int* theta = NULL;
     double* allodds = NULL;
+    verify_scratch_t vs;
     // RoR
     double ror2;
     int igood, ibad;
@@ -1644,6 +2267,7 @@ double verify_star_lists_ror(double* refxys, int NR,
     double effective_area;
 
     memset(&v, 0, sizeof(verify_t));
+    memset(&vs, 0, sizeof(verify_scratch_t));
     v.NRall = v.NR = NR;
     v.NTall = v.NT = NT;
     v.refxy = refxys;
@@ -1727,11 +2351,9 @@ double verify_star_lists_ror(double* refxys, int NR,
         X = real_verify_star_lists(&v, effective_area, distractors,
                                    logodds_bail, logodds_stoplooking, &besti,
                                    &allodds, &theta,
-                                   p_worstlogodds, &ibailed, &istopped);
+                                   p_worstlogodds, &ibailed, &istopped, &vs);
         fixup_theta(theta, allodds, ibailed, istopped, &v, besti, NR, NULL,
                     &etheta, &eodds);
-        free(theta);
-        free(allodds);
 
         if (p_all_logodds)
             *p_all_logodds = eodds;
@@ -1763,6 +2385,7 @@ double verify_star_lists_ror(double* refxys, int NR,
 
     free(v.badguys);
     free(v.tbadguys);
+    free_scratch_contents(&vs);
 	
     return X;
 }
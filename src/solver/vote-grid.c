@@ -0,0 +1,180 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "os-features.h"
+#include "vote-grid.h"
+#include "mathutil.h"
+#include "errors.h"
+
+#define MIN_CAP 64
+
+// Makes room for "n" elements of "size" bytes in "*array", of capacity
+// "*cap".  Returns 0 on success.
+static int ensure_cap(void** array, int* cap, int n, size_t size) {
+    void* newarray;
+    int newcap;
+    if (n <= *cap)
+        return 0;
+    newcap = MAX(MIN_CAP, MAX(n, 2 * (*cap)));
+    newarray = realloc(*array, (size_t)newcap * size);
+    if (!newarray) {
+        SYSERROR("Failed to allocate %i vote grid entries", newcap);
+        return -1;
+    }
+    *array = newarray;
+    *cap = newcap;
+    return 0;
+}
+
+static void insert(vote_grid_t* grid, int cell) {
+    uint32_t mask = grid->tablecap - 1;
+    uint32_t i;
+    for (i = hypothesis_key_hash(grid->cells[cell].key) & mask;
+         grid->table[i] != -1; i = (i + 1) & mask);
+    grid->table[i] = cell;
+}
+
+static int grow_table(vote_grid_t* grid) {
+    int cap = MAX(4 * MIN_CAP, 2 * grid->tablecap);
+    int* table = malloc(cap * sizeof(int));
+    int i;
+    if (!table) {
+        SYSERROR("Failed to allocate a vote grid of %i cells", cap);
+        return -1;
+    }
+    free(grid->table);
+    grid->table = table;
+    grid->tablecap = cap;
+    memset(grid->table, -1, cap * sizeof(int));
+    for (i = 0; i < grid->ncells; i++)
+        insert(grid, i);
+    return 0;
+}
+
+static int find(const vote_grid_t* grid, const int32_t* key) {
+    uint32_t mask, i;
+    if (!grid->ncells)
+        return -1;
+    mask = grid->tablecap - 1;
+    for (i = hypothesis_key_hash(key) & mask; grid->table[i] != -1;
+         i = (i + 1) & mask) {
+        int cell = grid->table[i];
+        if (!memcmp(grid->cells[cell].key, key, sizeof(grid->cells[cell].key)))
+            return cell;
+    }
+    return -1;
+}
+
+static int add_pending(vote_grid_t* grid, int cell) {
+    if (ensure_cap((void**)&(grid->pending), &(grid->pendingcap),
+                   grid->npending + 1, sizeof(vote_ref_t)))
+        return -1;
+    grid->pending[grid->npending].cell = cell;
+    grid->npending++;
+    return 0;
+}
+
+int vote_grid_add(vote_grid_t* grid, const int32_t* key, const MatchObj* mo,
+                  index_t* index, int minvotes) {
+    vote_cell_t* c;
+    int cell = find(grid, key);
+
+    if (cell == -1) {
+        // (keep the table at most half full)
+        if ((2 * (grid->ncells + 1) > grid->tablecap) && grow_table(grid))
+            return -1;
+        if (ensure_cap((void**)&(grid->cells), &(grid->cellcap),
+                       grid->ncells + 1, sizeof(vote_cell_t)))
+            return -1;
+        cell = grid->ncells;
+        c = grid->cells + cell;
+        memcpy(c->key, key, sizeof(c->key));
+        c->nvotes = 0;
+        c->verified = FALSE;
+        c->index = index;
+        memcpy(&(c->mo), mo, sizeof(MatchObj));
+        grid->ncells++;
+        insert(grid, cell);
+    } else {
+        c = grid->cells + cell;
+        if (mo->code_err < c->mo.code_err) {
+            c->index = index;
+            memcpy(&(c->mo), mo, sizeof(MatchObj));
+        }
+    }
+    c->nvotes++;
+    if ((c->nvotes == minvotes) && !c->verified)
+        return add_pending(grid, cell);
+    return 0;
+}
+
+static int compare_refs(const void* v1, const void* v2) {
+    const vote_ref_t* r1 = v1;
+    const vote_ref_t* r2 = v2;
+    // most votes first, then in the order of the first votes.
+    if (r1->nvotes != r2->nvotes)
+        return (r1->nvotes > r2->nvotes) ? -1 : 1;
+    return (r1->cell < r2->cell) ? -1 : (r1->cell > r2->cell);
+}
+
+int vote_grid_select(vote_grid_t* grid, int maxcells) {
+    int i, n;
+
+    grid->nselected = 0;
+    if (!grid->npending)
+        return 0;
+    for (i = 0; i < grid->npending; i++)
+        grid->pending[i].nvotes = grid->cells[grid->pending[i].cell].nvotes;
+    qsort(grid->pending, grid->npending, sizeof(vote_ref_t), compare_refs);
+
+    n = grid->npending;
+    if (maxcells > 0)
+        n = MIN(n, maxcells);
+    if (ensure_cap((void**)&(grid->selected), &(grid->selectedcap), n,
+                   sizeof(int)))
+        return 0;
+    for (i = 0; i < n; i++) {
+        int cell = grid->pending[i].cell;
+        grid->cells[cell].verified = TRUE;
+        grid->selected[i] = cell;
+    }
+    grid->nselected = n;
+    // (the others stay pending)
+    memmove(grid->pending, grid->pending + n,
+            (grid->npending - n) * sizeof(vote_ref_t));
+    grid->npending -= n;
+    return n;
+}
+
+int vote_grid_unverify(vote_grid_t* grid, int minvotes) {
+    int i;
+    grid->npending = 0;
+    grid->nselected = 0;
+    for (i = 0; i < grid->ncells; i++) {
+        vote_cell_t* c = grid->cells + i;
+        c->verified = FALSE;
+        if ((c->nvotes >= minvotes) && add_pending(grid, i))
+            return -1;
+    }
+    return 0;
+}
+
+void vote_grid_clear(vote_grid_t* grid) {
+    if (grid->ncells)
+        memset(grid->table, -1, grid->tablecap * sizeof(int));
+    grid->ncells = 0;
+    grid->npending = 0;
+    grid->nselected = 0;
+}
+
+void vote_grid_free(vote_grid_t* grid) {
+    free(grid->cells);
+    free(grid->table);
+    free(grid->pending);
+    free(grid->selected);
+    memset(grid, 0, sizeof(vote_grid_t));
+}
@@ -0,0 +1,326 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "an-thread.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+
+struct an_mutex_t {
+    std::mutex m;
+};
+
+an_mutex_t* an_mutex_new(void) {
+    return new an_mutex_t;
+}
+
+void an_mutex_free(an_mutex_t* m) {
+    delete m;
+}
+
+void an_mutex_lock(an_mutex_t* m) {
+    m->m.lock();
+}
+
+void an_mutex_unlock(an_mutex_t* m) {
+    m->m.unlock();
+}
+
+struct an_cond_t {
+    std::condition_variable cv;
+};
+
+an_cond_t* an_cond_new(void) {
+    return new an_cond_t;
+}
+
+void an_cond_free(an_cond_t* c) {
+    delete c;
+}
+
+void an_cond_wait(an_cond_t* c, an_mutex_t* m) {
+    // (the caller holds the lock, and keeps it)
+    std::unique_lock<std::mutex> lock(m->m, std::adopt_lock);
+    c->cv.wait(lock);
+    lock.release();
+}
+
+void an_cond_signal(an_cond_t* c) {
+    c->cv.notify_one();
+}
+
+void an_cond_broadcast(an_cond_t* c) {
+    c->cv.notify_all();
+}
+
+struct an_thread_t {
+    std::thread t;
+};
+
+an_thread_t* an_thread_start(void (*func)(void* arg), void* arg) {
+    an_thread_t* t = new an_thread_t;
+    t->t = std::thread(func, arg);
+    return t;
+}
+
+void an_thread_join(an_thread_t* t) {
+    if (!t)
+        return;
+    t->t.join();
+    delete t;
+}
+
+int an_thread_hardware_concurrency(void) {
+    unsigned int n = std::thread::hardware_concurrency();
+    return (n > 0 ? (int)n : 1);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+
+unsigned char an_atomic_load_flag(const unsigned char* flag) {
+    return __atomic_load_n(flag, __ATOMIC_RELAXED);
+}
+
+void an_atomic_store_flag(unsigned char* flag, unsigned char value) {
+    __atomic_store_n(flag, value, __ATOMIC_RELAXED);
+}
+
+int an_atomic_load_int(const int* value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+void an_atomic_store_int(int* dest, int value) {
+    __atomic_store_n(dest, value, __ATOMIC_RELAXED);
+}
+
+#else
+
+// (std::atomic_ref needs C++20)
+unsigned char an_atomic_load_flag(const unsigned char* flag) {
+    return std::atomic_ref<unsigned char>(*const_cast<unsigned char*>(flag))
+        .load(std::memory_order_relaxed);
+}
+
+void an_atomic_store_flag(unsigned char* flag, unsigned char value) {
+    std::atomic_ref<unsigned char>(*flag).store(value, std::memory_order_relaxed);
+}
+
+int an_atomic_load_int(const int* value) {
+    return std::atomic_ref<int>(*const_cast<int*>(value))
+        .load(std::memory_order_relaxed);
+}
+
+void an_atomic_store_int(int* dest, int value) {
+    std::atomic_ref<int>(*dest).store(value, std::memory_order_relaxed);
+}
+
+#endif
+
+
+/*
+ The block of tasks [begin, end) a thread still has to run, packed into
+ a single word so that the owner and the thieves can update it with a
+ compare-and-swap.
+ */
+struct alignas(64) pool_queue {
+    std::atomic<uint64_t> range;
+};
+
+static inline uint64_t pack_range(uint32_t begin, uint32_t end) {
+    return ((uint64_t)end << 32) | begin;
+}
+
+static inline uint32_t range_begin(uint64_t r) {
+    return (uint32_t)r;
+}
+
+static inline uint32_t range_end(uint64_t r) {
+    return (uint32_t)(r >> 32);
+}
+
+struct an_pool_t {
+    std::vector<std::thread> threads;
+    // One per thread, including the caller.
+    std::vector<pool_queue> queues;
+
+    std::mutex mutex;
+    // signalled when a new batch is available (or we're shutting down)
+    std::condition_variable wakeup;
+    // signalled when the last worker leaves a batch
+    std::condition_variable done;
+
+    // The current batch
+    an_pool_func_t func;
+    void* arg;
+    int ntasks;
+
+    // Incremented for each batch, so the workers can tell new batches apart.
+    unsigned int generation;
+    // Number of workers still inside the current batch.
+    int nactive;
+    bool stop;
+};
+
+// Takes the first task of the block of thread "thread".
+static bool pool_pop(an_pool_t* pool, int thread, int* task) {
+    std::atomic<uint64_t>& range = pool->queues[thread].range;
+    uint64_t r = range.load();
+    for (;;) {
+        uint32_t begin = range_begin(r);
+        uint32_t end = range_end(r);
+        if (begin >= end)
+            return false;
+        if (range.compare_exchange_weak(r, pack_range(begin + 1, end))) {
+            *task = (int)begin;
+            return true;
+        }
+    }
+}
+
+// Steals the second half of the block of another thread; the first
+// stolen task is returned, and the rest becomes the block of "thread".
+static bool pool_steal(an_pool_t* pool, int thread, int* task) {
+    int nthreads = (int)pool->queues.size();
+    int i;
+    for (i=1; i<nthreads; i++) {
+        std::atomic<uint64_t>& victim = pool->queues[(thread + i) % nthreads].range;
+        uint64_t r = victim.load();
+        for (;;) {
+            uint32_t begin = range_begin(r);
+            uint32_t end = range_end(r);
+            uint32_t mid;
+            if (begin >= end)
+                break;
+            mid = end - (end - begin + 1) / 2;
+            if (victim.compare_exchange_weak(r, pack_range(begin, mid))) {
+                pool->queues[thread].range.store(pack_range(mid + 1, end));
+                *task = (int)mid;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void pool_work(an_pool_t* pool, int thread) {
+    int task;
+    for (;;) {
+        if (!pool_pop(pool, thread, &task) &&
+            !pool_steal(pool, thread, &task))
+            break;
+        pool->func(pool->arg, task, thread);
+    }
+}
+
+static void pool_worker(an_pool_t* pool, int thread) {
+    unsigned int seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->wakeup.wait(lock, [&]{ return pool->stop || (pool->generation != seen); });
+            if (pool->stop)
+                return;
+            seen = pool->generation;
+        }
+
+        pool_work(pool, thread);
+
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->nactive--;
+            if (pool->nactive == 0)
+                pool->done.notify_one();
+        }
+    }
+}
+
+an_pool_t* an_pool_new(int nthreads) {
+    an_pool_t* pool = new an_pool_t;
+    int i;
+
+    if (nthreads <= 0)
+        nthreads = an_thread_hardware_concurrency();
+
+    pool->func = NULL;
+    pool->arg = NULL;
+    pool->ntasks = 0;
+    pool->generation = 0;
+    pool->nactive = 0;
+    pool->stop = false;
+
+    pool->queues = std::vector<pool_queue>(nthreads);
+    for (i=0; i<nthreads; i++)
+        pool->queues[i].range = 0;
+
+    // Thread 0 is the caller of an_pool_run()
+    for (i=1; i<nthreads; i++)
+        pool->threads.emplace_back(pool_worker, pool, i);
+    return pool;
+}
+
+void an_pool_free(an_pool_t* pool) {
+    if (!pool)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+    }
+    pool->wakeup.notify_all();
+    for (std::thread& t : pool->threads)
+        t.join();
+    delete pool;
+}
+
+int an_pool_nthreads(const an_pool_t* pool) {
+    return (int)pool->threads.size() + 1;
+}
+
+void an_pool_run(an_pool_t* pool, int ntasks, an_pool_func_t func, void* arg) {
+    if (ntasks <= 0)
+        return;
+
+    // Not worth waking anyone up.
+    if ((ntasks == 1) || pool->threads.empty()) {
+        int i;
+        for (i=0; i<ntasks; i++)
+            func(arg, i, 0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->func = func;
+        pool->arg = arg;
+        int nthreads = (int)pool->queues.size();
+        int i;
+        pool->ntasks = ntasks;
+        // Each thread starts with its share of the tasks.
+        for (i=0; i<nthreads; i++)
+            pool->queues[i].range = pack_range((uint32_t)((int64_t)ntasks * i / nthreads),
+                                               (uint32_t)((int64_t)ntasks * (i+1) / nthreads));
+        pool->nactive = (int)pool->threads.size();
+        pool->generation++;
+    }
+    pool->wakeup.notify_all();
+
+    pool_work(pool, 0);
+
+    // Wait for the workers to leave this batch before returning, so
+    // that "func" and "arg" remain valid for as long as they use them.
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done.wait(lock, [&]{ return pool->nactive == 0; });
+}
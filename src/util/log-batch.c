@@ -0,0 +1,227 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ The natural logarithm of many numbers at once, 2 (SSE2) or 4 (AVX) at
+ a time if the CPU can.  This is the algorithm of fdlibm's log(): with
+ x = 2^k m, m in [sqrt(2)/2, sqrt(2)) and f = m - 1,
+
+   log(x) = k ln2 + log(1+f),  log(1+f) = f - s(f - R(z)),
+
+ where s = f / (2 + f), z = s^2 and R is a polynomial of degree 7 in z;
+ its error is below 1 ulp.  (The one difference with fdlibm is that it
+ uses the same formula over the whole range of f, where fdlibm has a
+ few special cases that make it a little faster.)  The scalar and SIMD
+ versions do the same operations, in the same order, so they give the
+ same results.  Only positive normal numbers go through it: the others
+ (zero, negative, subnormal, infinite or NaN) are passed to log().
+ "logx" may be "x".
+ Define AN_NO_SIMD to build without the SIMD versions.
+ */
+
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "os-features.h"
+#include "mathutil.h"
+
+#if !defined(AN_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define LOG_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+static const double ln2_hi = 6.93147180369123816490e-01; // 3fe62e42 fee00000
+static const double ln2_lo = 1.90821492927058770002e-10; // 3dea39ef 35793c76
+static const double Lg1 = 6.666666666666735130e-01;      // 3FE55555 55555593
+static const double Lg2 = 3.999999999940941908e-01;      // 3FD99999 9997FA04
+static const double Lg3 = 2.857142874366239149e-01;      // 3FD24924 94229359
+static const double Lg4 = 2.222219843214978396e-01;      // 3FCC71C5 1D8E78AF
+static const double Lg5 = 1.818357216161805012e-01;      // 3FC74664 96CB03DE
+static const double Lg6 = 1.531383769920937332e-01;      // 3FC39A09 D078C69F
+static const double Lg7 = 1.479819860511658591e-01;      // 3FC2F112 DF3E5244
+
+#define MANTISSA_BITS 0x000fffffffffffffULL
+#define ONE_BITS      0x3ff0000000000000ULL
+
+static double log_scalar(double x) {
+    uint64_t bits;
+    double k, m, f, s, z, w, t1, t2, R, hfsq;
+
+    if (!(x >= DBL_MIN && x <= DBL_MAX))
+        return log(x);
+    memcpy(&bits, &x, sizeof(double));
+    k = (double)(int)(bits >> 52) - 1023.0;
+    bits = (bits & MANTISSA_BITS) | ONE_BITS;
+    memcpy(&m, &bits, sizeof(double));
+    if (m > M_SQRT2) {
+        m = m * 0.5;
+        k = k + 1.0;
+    }
+    f = m - 1.0;
+    s = f / (2.0 + f);
+    z = s * s;
+    w = z * z;
+    t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+    t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+    R = t2 + t1;
+    hfsq = 0.5 * f * f;
+    return k * ln2_hi - ((hfsq - (s * (hfsq + R) + k * ln2_lo)) - f);
+}
+
+#ifdef LOG_BATCH_X86
+
+#if defined(__x86_64__) || defined(__SSE2__)
+// (SSE2 is part of x86-64; 32-bit builds need -msse2)
+#define LOG_BATCH_SSE2 1
+
+// The exponents of the (positive) numbers whose bits are "bits", as the
+// two low ints.
+static inline __m128i exponents_sse2(__m128i bits) {
+    return _mm_shuffle_epi32(_mm_srli_epi64(bits, 52), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+static void log_sse2(const double* x, int N, double* logx) {
+    const __m128d mantissa = _mm_castsi128_pd(_mm_set1_epi64x(MANTISSA_BITS));
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d two = _mm_set1_pd(2.0);
+    const __m128d half = _mm_set1_pd(0.5);
+    const __m128d bias = _mm_set1_pd(1023.0);
+    const __m128d sqrt2 = _mm_set1_pd(M_SQRT2);
+    const __m128d lo = _mm_set1_pd(DBL_MIN);
+    const __m128d hi = _mm_set1_pd(DBL_MAX);
+    int i, j;
+
+    for (i = 0; i + 2 <= N; i += 2) {
+        __m128d v = _mm_loadu_pd(x + i);
+        __m128d k, m, big, f, s, z, w, t1, t2, R, hfsq, r;
+        int ok;
+
+        k = _mm_sub_pd(_mm_cvtepi32_pd(exponents_sse2(_mm_castpd_si128(v))),
+                       bias);
+        m = _mm_or_pd(_mm_and_pd(v, mantissa), one);
+        big = _mm_cmpgt_pd(m, sqrt2);
+        m = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(m, half)),
+                      _mm_andnot_pd(big, m));
+        k = _mm_add_pd(k, _mm_and_pd(big, one));
+        f = _mm_sub_pd(m, one);
+        s = _mm_div_pd(f, _mm_add_pd(two, f));
+        z = _mm_mul_pd(s, s);
+        w = _mm_mul_pd(z, z);
+        t1 = _mm_mul_pd(w, _mm_add_pd(_mm_set1_pd(Lg2), _mm_mul_pd(w,
+                        _mm_add_pd(_mm_set1_pd(Lg4), _mm_mul_pd(w,
+                        _mm_set1_pd(Lg6))))));
+        t2 = _mm_mul_pd(z, _mm_add_pd(_mm_set1_pd(Lg1), _mm_mul_pd(w,
+                        _mm_add_pd(_mm_set1_pd(Lg3), _mm_mul_pd(w,
+                        _mm_add_pd(_mm_set1_pd(Lg5), _mm_mul_pd(w,
+                        _mm_set1_pd(Lg7))))))));
+        R = _mm_add_pd(t2, t1);
+        hfsq = _mm_mul_pd(_mm_mul_pd(half, f), f);
+        r = _mm_sub_pd(_mm_mul_pd(k, _mm_set1_pd(ln2_hi)),
+                       _mm_sub_pd(_mm_sub_pd(hfsq,
+                                             _mm_add_pd(_mm_mul_pd(s, _mm_add_pd(hfsq, R)),
+                                                        _mm_mul_pd(k, _mm_set1_pd(ln2_lo)))),
+                                  f));
+        ok = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(v, lo), _mm_cmple_pd(v, hi)));
+        if (ok != 3) {
+            // (keeping the numbers, in case "logx" is "x")
+            double xs[2];
+            _mm_storeu_pd(xs, v);
+            _mm_storeu_pd(logx + i, r);
+            for (j = 0; j < 2; j++)
+                if (!(ok & (1 << j)))
+                    logx[i + j] = log(xs[j]);
+        } else
+            _mm_storeu_pd(logx + i, r);
+    }
+    for (; i < N; i++)
+        logx[i] = log_scalar(x[i]);
+}
+#endif
+
+__attribute__((target("avx")))
+static void log_avx(const double* x, int N, double* logx) {
+    const __m256d mantissa = _mm256_castsi256_pd(_mm256_set1_epi64x(MANTISSA_BITS));
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d bias = _mm256_set1_pd(1023.0);
+    const __m256d sqrt2 = _mm256_set1_pd(M_SQRT2);
+    const __m256d lo = _mm256_set1_pd(DBL_MIN);
+    const __m256d hi = _mm256_set1_pd(DBL_MAX);
+    int i, j;
+
+    for (i = 0; i + 4 <= N; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d k, m, big, f, s, z, w, t1, t2, R, hfsq, r;
+        __m128i e01, e23;
+        int ok;
+
+        // (AVX has no 256-bit integer shifts: the exponents are taken
+        // out 2 at a time)
+        e01 = _mm_srli_epi64(_mm_castpd_si128(_mm256_castpd256_pd128(v)), 52);
+        e23 = _mm_srli_epi64(_mm_castpd_si128(_mm256_extractf128_pd(v, 1)), 52);
+        k = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_castps_si128(
+                              _mm_shuffle_ps(_mm_castsi128_ps(e01), _mm_castsi128_ps(e23),
+                                             _MM_SHUFFLE(2, 0, 2, 0)))),
+                          bias);
+        m = _mm256_or_pd(_mm256_and_pd(v, mantissa), one);
+        big = _mm256_cmp_pd(m, sqrt2, _CMP_GT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_mul_pd(m, half), big);
+        k = _mm256_add_pd(k, _mm256_and_pd(big, one));
+        f = _mm256_sub_pd(m, one);
+        s = _mm256_div_pd(f, _mm256_add_pd(two, f));
+        z = _mm256_mul_pd(s, s);
+        w = _mm256_mul_pd(z, z);
+        t1 = _mm256_mul_pd(w, _mm256_add_pd(_mm256_set1_pd(Lg2), _mm256_mul_pd(w,
+                           _mm256_add_pd(_mm256_set1_pd(Lg4), _mm256_mul_pd(w,
+                           _mm256_set1_pd(Lg6))))));
+        t2 = _mm256_mul_pd(z, _mm256_add_pd(_mm256_set1_pd(Lg1), _mm256_mul_pd(w,
+                           _mm256_add_pd(_mm256_set1_pd(Lg3), _mm256_mul_pd(w,
+                           _mm256_add_pd(_mm256_set1_pd(Lg5), _mm256_mul_pd(w,
+                           _mm256_set1_pd(Lg7))))))));
+        R = _mm256_add_pd(t2, t1);
+        hfsq = _mm256_mul_pd(_mm256_mul_pd(half, f), f);
+        r = _mm256_sub_pd(_mm256_mul_pd(k, _mm256_set1_pd(ln2_hi)),
+                          _mm256_sub_pd(_mm256_sub_pd(hfsq,
+                                                      _mm256_add_pd(_mm256_mul_pd(s, _mm256_add_pd(hfsq, R)),
+                                                                    _mm256_mul_pd(k, _mm256_set1_pd(ln2_lo)))),
+                                        f));
+        ok = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(v, lo, _CMP_GE_OQ),
+                                              _mm256_cmp_pd(v, hi, _CMP_LE_OQ)));
+        if (ok != 15) {
+            // (keeping the numbers, in case "logx" is "x")
+            double xs[4];
+            _mm256_storeu_pd(xs, v);
+            _mm256_storeu_pd(logx + i, r);
+            for (j = 0; j < 4; j++)
+                if (!(ok & (1 << j)))
+                    logx[i + j] = log(xs[j]);
+        } else
+            _mm256_storeu_pd(logx + i, r);
+    }
+    for (; i < N; i++)
+        logx[i] = log_scalar(x[i]);
+}
+
+#endif
+
+void log_batch(const double* x, int N, double* logx) {
+    int i;
+#ifdef LOG_BATCH_X86
+    if (__builtin_cpu_supports("avx")) {
+        log_avx(x, N, logx);
+        return;
+    }
+#ifdef LOG_BATCH_SSE2
+    log_sse2(x, N, logx);
+    return;
+#endif
+#endif
+    for (i = 0; i < N; i++)
+        logx[i] = log_scalar(x[i]);
+}
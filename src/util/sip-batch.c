@@ -0,0 +1,298 @@
+/*
+ # This file is part of the Astrometry.net suite.
+ # Licensed under a 3-clause BSD style license - see LICENSE
+ */
+
+/*
+ The projection of many points at once into pixel space.  This gives
+ the same results as the one-point functions of sip.c (the operations
+ are the same, in the same order: no fused multiply-adds), but
+ everything that doesn't depend on the point is computed once, and the
+ TAN projection is done 2 (SSE2) or 4 (AVX) points at a time, if the
+ CPU can.  Define AN_NO_SIMD to build without the SIMD versions.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "os-features.h"
+#include "sip.h"
+#include "starutil.h"
+#include "mathutil.h"
+
+#if !defined(AN_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SIP_BATCH_X86 1
+#include <immintrin.h>
+#endif
+
+// What the TAN projection of tan_xyzarr2pixelxy() needs, apart from
+// the point.
+struct tan_proj {
+    // the tangent point (CRVAL), and the unit vectors pointing
+    // towards increasing RA (eta, whose z is zero) and Dec (xi); see
+    // star_coords().
+    double r[3];
+    double eta[2];
+    double xi[3];
+    anbool tangent;
+    double cdi[4];
+    double crpix[2];
+};
+typedef struct tan_proj tan_proj_t;
+
+// Returns FALSE if the points must go through tan_xyzarr2pixelxy() one
+// by one.
+static anbool tan_proj_init(const tan_t* tan, tan_proj_t* p) {
+    double eta_norm, inv_en;
+
+    radecdeg2xyzarr(tan->crval[0], tan->crval[1], p->r);
+    // (star_coords() has special cases for the poles)
+    if (p->r[2] == 1.0 || p->r[2] == -1.0)
+        return FALSE;
+    if (invert_2by2_arr((const double*)tan->cd, p->cdi))
+        return FALSE;
+
+    p->eta[0] = -p->r[1];
+    p->eta[1] =  p->r[0];
+    eta_norm = hypot(p->eta[0], p->eta[1]);
+    inv_en = 1.0 / eta_norm;
+    p->eta[0] *= inv_en;
+    p->eta[1] *= inv_en;
+    p->xi[0] = -p->r[2] * p->eta[1];
+    p->xi[1] =  p->r[2] * p->eta[0];
+    p->xi[2] =  p->r[0] * p->eta[1] - p->r[1] * p->eta[0];
+    p->tangent = !tan->sin;
+    p->crpix[0] = tan->crpix[0];
+    p->crpix[1] = tan->crpix[1];
+    return TRUE;
+}
+
+static void tan_proj_scalar(const tan_proj_t* p, const double* xyz,
+                            int i0, int N, double* px, double* py) {
+    int i;
+    for (i = i0; i < N; i++) {
+        const double* s = xyz + 3 * i;
+        double sdotr, x, y;
+        sdotr = s[0] * p->r[0] + s[1] * p->r[1] + s[2] * p->r[2];
+        if (sdotr <= 0.0) {
+            // on the opposite side of the sky
+            px[i] = py[i] = NAN;
+            continue;
+        }
+        x = (s[0] * p->eta[0] + s[1] * p->eta[1]);
+        y = (s[0] * p->xi[0] + s[1] * p->xi[1] + s[2] * p->xi[2]);
+        if (p->tangent) {
+            double inv_sdotr = 1.0 / sdotr;
+            x *= inv_sdotr;
+            y *= inv_sdotr;
+        }
+        x = rad2deg(x);
+        y = rad2deg(y);
+        px[i] = (p->cdi[0] * x + p->cdi[1] * y) + p->crpix[0];
+        py[i] = (p->cdi[2] * x + p->cdi[3] * y) + p->crpix[1];
+    }
+}
+
+#ifdef SIP_BATCH_X86
+
+#if defined(__x86_64__) || defined(__SSE2__)
+// (SSE2 is part of x86-64; 32-bit builds need -msse2)
+#define SIP_BATCH_SSE2 1
+
+static void tan_proj_sse2(const tan_proj_t* p, const double* xyz, int N,
+                          double* px, double* py) {
+    const __m128d r0 = _mm_set1_pd(p->r[0]);
+    const __m128d r1 = _mm_set1_pd(p->r[1]);
+    const __m128d r2 = _mm_set1_pd(p->r[2]);
+    const __m128d eta0 = _mm_set1_pd(p->eta[0]);
+    const __m128d eta1 = _mm_set1_pd(p->eta[1]);
+    const __m128d xi0 = _mm_set1_pd(p->xi[0]);
+    const __m128d xi1 = _mm_set1_pd(p->xi[1]);
+    const __m128d xi2 = _mm_set1_pd(p->xi[2]);
+    const __m128d cdi0 = _mm_set1_pd(p->cdi[0]);
+    const __m128d cdi1 = _mm_set1_pd(p->cdi[1]);
+    const __m128d cdi2 = _mm_set1_pd(p->cdi[2]);
+    const __m128d cdi3 = _mm_set1_pd(p->cdi[3]);
+    const __m128d crpix0 = _mm_set1_pd(p->crpix[0]);
+    const __m128d crpix1 = _mm_set1_pd(p->crpix[1]);
+    const __m128d degs = _mm_set1_pd(DEG_PER_RAD);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d nan = _mm_set1_pd(NAN);
+    int i;
+
+    for (i = 0; i + 2 <= N; i += 2) {
+        const double* s = xyz + 3 * i;
+        __m128d s0 = _mm_loadh_pd(_mm_load_sd(s + 0), s + 3);
+        __m128d s1 = _mm_loadh_pd(_mm_load_sd(s + 1), s + 4);
+        __m128d s2 = _mm_loadh_pd(_mm_load_sd(s + 2), s + 5);
+        __m128d sdotr, x, y, u, v, behind;
+
+        sdotr = _mm_add_pd(_mm_add_pd(_mm_mul_pd(s0, r0), _mm_mul_pd(s1, r1)),
+                           _mm_mul_pd(s2, r2));
+        behind = _mm_cmple_pd(sdotr, zero);
+        x = _mm_add_pd(_mm_mul_pd(s0, eta0), _mm_mul_pd(s1, eta1));
+        y = _mm_add_pd(_mm_add_pd(_mm_mul_pd(s0, xi0), _mm_mul_pd(s1, xi1)),
+                       _mm_mul_pd(s2, xi2));
+        if (p->tangent) {
+            __m128d inv_sdotr = _mm_div_pd(one, sdotr);
+            x = _mm_mul_pd(x, inv_sdotr);
+            y = _mm_mul_pd(y, inv_sdotr);
+        }
+        x = _mm_mul_pd(x, degs);
+        y = _mm_mul_pd(y, degs);
+        u = _mm_add_pd(_mm_add_pd(_mm_mul_pd(cdi0, x), _mm_mul_pd(cdi1, y)),
+                       crpix0);
+        v = _mm_add_pd(_mm_add_pd(_mm_mul_pd(cdi2, x), _mm_mul_pd(cdi3, y)),
+                       crpix1);
+        // (NaN for the points behind)
+        u = _mm_or_pd(_mm_and_pd(behind, nan), _mm_andnot_pd(behind, u));
+        v = _mm_or_pd(_mm_and_pd(behind, nan), _mm_andnot_pd(behind, v));
+        _mm_storeu_pd(px + i, u);
+        _mm_storeu_pd(py + i, v);
+    }
+    tan_proj_scalar(p, xyz, i, N, px, py);
+}
+#endif
+
+__attribute__((target("avx")))
+static void tan_proj_avx(const tan_proj_t* p, const double* xyz, int N,
+                          double* px, double* py) {
+    const __m256d r0 = _mm256_set1_pd(p->r[0]);
+    const __m256d r1 = _mm256_set1_pd(p->r[1]);
+    const __m256d r2 = _mm256_set1_pd(p->r[2]);
+    const __m256d eta0 = _mm256_set1_pd(p->eta[0]);
+    const __m256d eta1 = _mm256_set1_pd(p->eta[1]);
+    const __m256d xi0 = _mm256_set1_pd(p->xi[0]);
+    const __m256d xi1 = _mm256_set1_pd(p->xi[1]);
+    const __m256d xi2 = _mm256_set1_pd(p->xi[2]);
+    const __m256d cdi0 = _mm256_set1_pd(p->cdi[0]);
+    const __m256d cdi1 = _mm256_set1_pd(p->cdi[1]);
+    const __m256d cdi2 = _mm256_set1_pd(p->cdi[2]);
+    const __m256d cdi3 = _mm256_set1_pd(p->cdi[3]);
+    const __m256d crpix0 = _mm256_set1_pd(p->crpix[0]);
+    const __m256d crpix1 = _mm256_set1_pd(p->crpix[1]);
+    const __m256d degs = _mm256_set1_pd(DEG_PER_RAD);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d nan = _mm256_set1_pd(NAN);
+    int i;
+
+    for (i = 0; i + 4 <= N; i += 4) {
+        const double* s = xyz + 3 * i;
+        // the 4 points, x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3, to
+        // x0 y0 x2 y2 | z0 x1 z2 x3 | y1 z1 y3 z3, to x, y and z.
+        __m256d a = _mm256_loadu_pd(s + 0);
+        __m256d b = _mm256_loadu_pd(s + 4);
+        __m256d c = _mm256_loadu_pd(s + 8);
+        __m256d m1 = _mm256_blend_pd(a, b, 0xc);
+        __m256d m2 = _mm256_permute2f128_pd(a, c, 0x21);
+        __m256d m3 = _mm256_blend_pd(b, c, 0xc);
+        __m256d s0 = _mm256_shuffle_pd(m1, m2, 0xa);
+        __m256d s1 = _mm256_shuffle_pd(m1, m3, 0x5);
+        __m256d s2 = _mm256_shuffle_pd(m2, m3, 0xa);
+        __m256d sdotr, x, y, u, v, behind;
+
+        sdotr = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(s0, r0),
+                                            _mm256_mul_pd(s1, r1)),
+                              _mm256_mul_pd(s2, r2));
+        behind = _mm256_cmp_pd(sdotr, zero, _CMP_LE_OQ);
+        x = _mm256_add_pd(_mm256_mul_pd(s0, eta0), _mm256_mul_pd(s1, eta1));
+        y = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(s0, xi0),
+                                        _mm256_mul_pd(s1, xi1)),
+                          _mm256_mul_pd(s2, xi2));
+        if (p->tangent) {
+            __m256d inv_sdotr = _mm256_div_pd(one, sdotr);
+            x = _mm256_mul_pd(x, inv_sdotr);
+            y = _mm256_mul_pd(y, inv_sdotr);
+        }
+        x = _mm256_mul_pd(x, degs);
+        y = _mm256_mul_pd(y, degs);
+        u = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cdi0, x),
+                                        _mm256_mul_pd(cdi1, y)), crpix0);
+        v = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cdi2, x),
+                                        _mm256_mul_pd(cdi3, y)), crpix1);
+        // (NaN for the points behind)
+        u = _mm256_blendv_pd(u, nan, behind);
+        v = _mm256_blendv_pd(v, nan, behind);
+        _mm256_storeu_pd(px + i, u);
+        _mm256_storeu_pd(py + i, v);
+    }
+    tan_proj_scalar(p, xyz, i, N, px, py);
+}
+
+#endif
+
+static void tan_proj(const tan_proj_t* p, const double* xyz, int N,
+                     double* px, double* py) {
+#ifdef SIP_BATCH_X86
+    if (__builtin_cpu_supports("avx")) {
+        tan_proj_avx(p, xyz, N, px, py);
+        return;
+    }
+#ifdef SIP_BATCH_SSE2
+    tan_proj_sse2(p, xyz, N, px, py);
+    return;
+#endif
+#endif
+    tan_proj_scalar(p, xyz, 0, N, px, py);
+}
+
+// Fills "inside" (if non-NULL) as tan_pixel_is_inside_image() would, and
+// returns the number of points inside.
+static int inside_image(const tan_t* tan, const double* px, const double* py,
+                        int N, anbool* inside) {
+    int i, n = 0;
+    for (i = 0; i < N; i++) {
+        anbool in = (px[i] >= 1 && px[i] <= tan->imagew &&
+                     py[i] >= 1 && py[i] <= tan->imageh);
+        if (inside)
+            inside[i] = in;
+        n += in;
+    }
+    return n;
+}
+
+// Projects the points, without the inside-image test.
+static void tan_batch(const tan_t* tan, const double* xyz, int N,
+                      double* px, double* py) {
+    tan_proj_t p;
+    int i;
+    if (tan_proj_init(tan, &p)) {
+        tan_proj(&p, xyz, N, px, py);
+        return;
+    }
+    for (i = 0; i < N; i++)
+        if (!tan_xyzarr2pixelxy(tan, xyz + 3 * i, px + i, py + i))
+            px[i] = py[i] = NAN;
+}
+
+int tan_xyzarr2pixelxy_batch(const tan_t* tan, const double* xyz, int N,
+                             double* px, double* py, anbool* inside) {
+    tan_batch(tan, xyz, N, px, py);
+    return inside_image(tan, px, py, N, inside);
+}
+
+int sip_xyzarr2pixelxy_batch(const sip_t* sip, const double* xyz, int N,
+                             double* px, double* py, anbool* inside) {
+    const double* crpix = sip->wcstan.crpix;
+    int i;
+    tan_batch(&(sip->wcstan), xyz, N, px, py);
+    if (sip->a_order == 0 && sip->ap_order == 0 && sip->bp_order == 0) {
+        // (a TAN WCS wrapped by sip_wrap_tan(): sip_pixel_undistortion()
+        // with only the constant terms, in the same order)
+        double f = 0. + sip->ap[0][0];
+        double g = 0. + sip->bp[0][0];
+        for (i = 0; i < N; i++) {
+            px[i] = ((px[i] - crpix[0]) + f) + crpix[0];
+            py[i] = ((py[i] - crpix[1]) + g) + crpix[1];
+        }
+    } else if (sip->a_order >= 0) {
+        // (the SIP polynomials are done one point at a time)
+        for (i = 0; i < N; i++)
+            if (!isnan(px[i]))
+                sip_pixel_undistortion(sip, px[i], py[i], px + i, py + i);
+    }
+    return inside_image(&(sip->wcstan), px, py, N, inside);
+}
@@ -165,8 +165,8 @@ int sip_compute_inverse_polynomials(sip_t* sip, int NX, int NY,
                     j++;
                 }
             assert(j == N);
-            b1(i, -fuv);
-            b2(i, -guv);
+            b1(i) = -fuv;
+            b2(i) = -guv;
             i++;
         }
     }
@@ -178,6 +178,30 @@ void starxy_sort_by_flux(starxy_t* s) {
     free(perm);
 }
 
+static int append_array(double** parr, int N, const double* more, int M) {
+    double* arr = realloc(*parr, (size_t)(N + M) * sizeof(double));
+    if (!arr)
+        return -1;
+    if (more)
+        memcpy(arr + N, more, (size_t)M * sizeof(double));
+    else
+        memset(arr + N, 0, (size_t)M * sizeof(double));
+    *parr = arr;
+    return 0;
+}
+
+int starxy_append(starxy_t* xy, const starxy_t* more) {
+    int N = starxy_n(xy);
+    int M = starxy_n(more);
+    if (append_array(&xy->x, N, more->x, M) ||
+        append_array(&xy->y, N, more->y, M) ||
+        (xy->flux && append_array(&xy->flux, N, more->flux, M)) ||
+        (xy->background && append_array(&xy->background, N, more->background, M)))
+        return -1;
+    xy->N = N + M;
+    return 0;
+}
+
 void starxy_set_x_array(starxy_t* s, const double* x) {
     memcpy(s->x, x, s->N * sizeof(double));
 }
@@ -40,6 +40,47 @@ double timenow() {
 #endif
 }
 
+int64_t timenow_ns(void) {
+#ifndef _WIN32
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        SYSERROR("Failed to read the monotonic clock");
+        return -1;
+    }
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)(now.QuadPart / freq.QuadPart) * 1000000000 +
+        (int64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#endif
+}
+
+int64_t timenow_thread_cpu_ns(void) {
+#ifndef _WIN32
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+        SYSERROR("Failed to read the thread CPU clock");
+        return -1;
+    }
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    FILETIME creation, exit, kernel, user;
+    ULARGE_INTEGER k, u;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return -1;
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    // (in units of 100 ns)
+    return (int64_t)(k.QuadPart + u.QuadPart) * 100;
+#endif
+}
+
 int get_resource_stats(double* p_usertime, double* p_systime, long* p_maxrss) {
 #ifndef _WIN32
     struct rusage usage;